@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+/** Name of the executable, to tell the benches apart. */
+static const char *bench_name = "bench";
+/** Print the reports as JSON lines instead of the text. */
+static bool bench_is_json = false;
+
+/**
+ * Parse the options common for all the benches, and remove them
+ * from the arguments. Returns the new number of the arguments.
+ *
+ * --json - print each report as a JSON object on a separate
+ *     line, for the regression scripts. The text is not printed
+ *     at all. For example:
+ *     {"bench": "bench_libcoro", "scenario": "...", "unit": "ns",
+ *      "min": 10.50, "med": 11.00, "max": 12.25}
+ */
+static inline int
+bench_init(int argc, char **argv)
+{
+	const char *slash = strrchr(argv[0], '/');
+	bench_name = slash != NULL ? slash + 1 : argv[0];
+	int count = 1;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--json") == 0)
+			bench_is_json = true;
+		else
+			argv[count++] = argv[i];
+	}
+	argv[count] = NULL;
+	return count;
+}
+
+static inline void
+bench_print_json_str(const char *str)
+{
+	putchar('"');
+	for (; *str != 0; ++str) {
+		if (*str == '"' || *str == '\\')
+			putchar('\\');
+		putchar(*str);
+	}
+	putchar('"');
+}
+
+/** Print one report as a JSON line. */
+static inline void
+bench_print_json(const char *scenario, const char *unit,
+	const char *const *keys, const double *values, int count)
+{
+	printf("{\"bench\": ");
+	bench_print_json_str(bench_name);
+	printf(", \"scenario\": ");
+	bench_print_json_str(scenario);
+	printf(", \"unit\": ");
+	bench_print_json_str(unit);
+	for (int i = 0; i < count; ++i)
+		printf(", \"%s\": %.2f", keys[i], values[i]);
+	printf("}\n");
+	fflush(stdout);
+}
+
+/** Monotonic time in nanoseconds. */
+static inline uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Print min, median and max of the collected samples of one
+ * scenario.
+ */
+static inline void
+bench_report(const char *scenario, std::vector<double> &samples,
+	const char *unit)
+{
+	std::sort(samples.begin(), samples.end());
+	double min = samples.front();
+	double med = samples[samples.size() / 2];
+	double max = samples.back();
+	if (bench_is_json) {
+		const char *keys[] = {"min", "med", "max"};
+		double values[] = {min, med, max};
+		bench_print_json(scenario, unit, keys, values, 3);
+		return;
+	}
+	printf("%s\n", scenario);
+	printf("    min: %.2f %s\n", min, unit);
+	printf("    med: %.2f %s\n", med, unit);
+	printf("    max: %.2f %s\n", max, unit);
+}
+
+/** Print the latency percentiles of one scenario. */
+static inline void
+bench_report_latency(const char *scenario, std::vector<double> &samples,
+	const char *unit)
+{
+	std::sort(samples.begin(), samples.end());
+	double p50 = samples[samples.size() / 2];
+	double p99 = samples[samples.size() * 99 / 100];
+	double max = samples.back();
+	if (bench_is_json) {
+		const char *keys[] = {"p50", "p99", "max"};
+		double values[] = {p50, p99, max};
+		bench_print_json(scenario, unit, keys, values, 3);
+		return;
+	}
+	printf("%s\n", scenario);
+	printf("    p50: %.2f %s\n", p50, unit);
+	printf("    p99: %.2f %s\n", p99, unit);
+	printf("    max: %.2f %s\n", max, unit);
+}
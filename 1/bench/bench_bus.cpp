@@ -0,0 +1,647 @@
+/**
+ * Throughput of the bus channels. First the queue alone, the
+ * ring buffer of the channels versus std::deque which they used
+ * before. Then the whole bus with a producer and a consumer
+ * coroutines, one message per call and in batches. Then the
+ * multi-threaded bus with a pair of them per channel, spread over
+ * the workers. Then the big payloads, passed as the messages
+ * versus copied into the allocated buffers with their indexes in
+ * a side table sent as the values. Then the durable channels,
+ * with a sync per a group of messages versus only on close. Then
+ * a burst of sends into a channel spilling to a file versus one
+ * only in memory, the time the producer takes for it. Then a
+ * fan-out to many consumers, a broadcast into a channel per
+ * consumer versus one topic which they all subscribe to. The
+ * channels hold a copy of each message per consumer, the topic
+ * one copy and a position per subscriber. At last the cost of
+ * opening and broadcasting over the many channels, which must
+ * stay the same per channel however many there are.
+ */
+#include "bench.h"
+#include "coro_ring.h"
+#include "corobus.h"
+#include "libcoro.h"
+
+#include <deque>
+#include <unistd.h>
+
+static const int run_count = 5;
+static const uint64_t message_count = 10000000;
+static const unsigned batch_size = 64;
+static const uint64_t payload_count = 1000000;
+static const size_t payload_size = 4096;
+static const size_t payload_limit = 1024;
+static const int broadcast_round_count = 4;
+static const uint64_t durable_count = 1000000;
+static const char *durable_path = "bench_bus_durable.seg";
+static const uint64_t burst_count = 1000000;
+static const uint64_t fanout_delivery_count = 2000000;
+static const size_t fanout_limit = 64;
+
+/** Keep the compiler from dropping the popped values. */
+static volatile unsigned sink;
+
+/**
+ * Fill the queue up to the limit and drain it, one by one or in
+ * batches, like a channel between a fast producer and consumer.
+ */
+static double
+bench_queue(bool is_ring, bool is_batch, size_t limit)
+{
+	struct coro_ring ring;
+	coro_ring_create(&ring, limit);
+	std::deque<struct coro_bus_msg> deque;
+	struct coro_bus_msg batch[batch_size];
+	for (unsigned i = 0; i < batch_size; ++i)
+		batch[i].len = i;
+	size_t step = is_batch ? batch_size : 1;
+	uint64_t start_ts = bench_now_ns();
+	for (uint64_t done = 0; done < message_count;) {
+		size_t size = 0;
+		for (; size + step <= limit; size += step) {
+			if (is_ring && is_batch) {
+				coro_ring_push_n(&ring, batch, step);
+			} else if (is_ring) {
+				coro_ring_push(&ring)->len = size;
+			} else {
+				for (size_t i = 0; i < step; ++i)
+					deque.push_back(batch[i]);
+			}
+		}
+		for (size_t popped = 0; popped < size; popped += step) {
+			if (is_ring && is_batch) {
+				coro_ring_pop_n(&ring, batch, step);
+				sink = batch[0].len;
+			} else if (is_ring) {
+				sink = coro_ring_pop(&ring)->len;
+			} else {
+				for (size_t i = 0; i < step; ++i) {
+					batch[i] = deque.front();
+					deque.pop_front();
+				}
+				sink = batch[0].len;
+			}
+		}
+		done += size;
+	}
+	uint64_t duration = bench_now_ns() - start_ts;
+	coro_ring_destroy(&ring);
+	return (double)message_count * 1000000000 / duration;
+}
+
+struct bus_ctx {
+	struct coro_bus *bus;
+	int channel;
+	uint64_t message_count;
+	bool is_batch;
+};
+
+static void *
+producer_f(void *arg)
+{
+	struct bus_ctx *ctx = (struct bus_ctx *)arg;
+	unsigned batch[batch_size];
+	for (unsigned i = 0; i < batch_size; ++i)
+		batch[i] = i;
+	for (uint64_t sent = 0; sent < ctx->message_count;) {
+		if (!ctx->is_batch) {
+			if (coro_bus_send(ctx->bus, ctx->channel, (unsigned)sent) != 0)
+				abort();
+			++sent;
+			continue;
+		}
+		unsigned count = batch_size;
+		if (ctx->message_count - sent < count)
+			count = ctx->message_count - sent;
+		int rc = coro_bus_send_v(ctx->bus, ctx->channel, batch, count);
+		if (rc <= 0)
+			abort();
+		sent += rc;
+	}
+	return NULL;
+}
+
+static void *
+consumer_f(void *arg)
+{
+	struct bus_ctx *ctx = (struct bus_ctx *)arg;
+	unsigned batch[batch_size];
+	for (uint64_t received = 0; received < ctx->message_count;) {
+		if (!ctx->is_batch) {
+			if (coro_bus_recv(ctx->bus, ctx->channel, &batch[0]) != 0)
+				abort();
+			++received;
+			continue;
+		}
+		int rc = coro_bus_recv_v(ctx->bus, ctx->channel, batch,
+			batch_size);
+		if (rc <= 0)
+			abort();
+		received += rc;
+	}
+	sink = batch[0];
+	return NULL;
+}
+
+/**
+ * A producer and a consumer per channel. The whole message count
+ * is split between the channels.
+ */
+static double
+bench_bus(bool is_mt, int worker_count, int channel_count, bool is_batch,
+	size_t limit)
+{
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = worker_count;
+	coro_sched_init_opts(&opts);
+	struct coro_bus *bus = is_mt ? coro_bus_new_mt() : coro_bus_new();
+	std::vector<struct bus_ctx> ctxs(channel_count);
+	std::vector<struct coro *> coros;
+	uint64_t start_ts = bench_now_ns();
+	for (struct bus_ctx &ctx : ctxs) {
+		ctx.bus = bus;
+		ctx.channel = coro_bus_channel_open(bus, limit);
+		ctx.message_count = message_count / channel_count;
+		ctx.is_batch = is_batch;
+		coros.push_back(coro_new(producer_f, &ctx));
+		coros.push_back(coro_new(consumer_f, &ctx));
+	}
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start_ts;
+	for (struct coro *c : coros)
+		coro_join(c);
+	for (struct bus_ctx &ctx : ctxs)
+		coro_bus_channel_close(bus, ctx.channel);
+	coro_bus_delete(bus);
+	coro_sched_destroy();
+	uint64_t total = message_count / channel_count * channel_count;
+	return (double)total * 1000000000 / duration;
+}
+
+static void
+bench_bus_scenario(bool is_mt, int worker_count, int channel_count,
+	bool is_batch, size_t limit)
+{
+	std::vector<double> samples;
+	for (int r = 0; r < run_count; ++r) {
+		samples.push_back(bench_bus(is_mt, worker_count, channel_count,
+			is_batch, limit));
+	}
+	char scenario[128];
+	if (!is_mt) {
+		snprintf(scenario, sizeof(scenario), "coro_bus %s, limit %zu",
+			is_batch ? "send_v/recv_v of 64" : "send/recv", limit);
+	} else {
+		snprintf(scenario, sizeof(scenario), "coro_bus_new_mt() %s, "
+			"limit %zu, %d channels, %d worker(s)", is_batch ?
+			"send_v/recv_v of 64" : "send/recv", limit,
+			channel_count, worker_count);
+	}
+	bench_report(scenario, samples, "messages/sec");
+}
+
+/**
+ * A producer and a consumer on a durable channel, in a new file.
+ * The messages go through the memory mapping of the file, and are
+ * synced to the disk each commit_batch of them.
+ */
+static double
+bench_durable(bool is_batch, unsigned commit_batch)
+{
+	coro_sched_init();
+	unlink(durable_path);
+	struct coro_bus_durable_opts opts;
+	coro_bus_durable_opts_create(&opts);
+	opts.commit_batch = commit_batch;
+	struct bus_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.channel = coro_bus_channel_open_durable(ctx.bus, 1024, durable_path,
+		&opts);
+	if (ctx.channel < 0)
+		abort();
+	ctx.message_count = durable_count;
+	ctx.is_batch = is_batch;
+	uint64_t start_ts = bench_now_ns();
+	struct coro *producer = coro_new(producer_f, &ctx);
+	struct coro *consumer = coro_new(consumer_f, &ctx);
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start_ts;
+	coro_join(producer);
+	coro_join(consumer);
+	coro_bus_channel_close(ctx.bus, ctx.channel);
+	coro_bus_delete(ctx.bus);
+	coro_sched_destroy();
+	unlink(durable_path);
+	return (double)durable_count * 1000000000 / duration;
+}
+
+struct burst_ctx {
+	struct coro_bus *bus;
+	int channel;
+	uint64_t start_ts;
+	uint64_t producer_ns;
+};
+
+static void *
+burst_producer_f(void *arg)
+{
+	struct burst_ctx *ctx = (struct burst_ctx *)arg;
+	for (uint64_t i = 0; i < burst_count; ++i) {
+		if (coro_bus_send(ctx->bus, ctx->channel, (unsigned)i) != 0)
+			abort();
+	}
+	ctx->producer_ns = bench_now_ns() - ctx->start_ts;
+	return NULL;
+}
+
+static void *
+burst_consumer_f(void *arg)
+{
+	struct burst_ctx *ctx = (struct burst_ctx *)arg;
+	unsigned data = 0;
+	for (uint64_t i = 0; i < burst_count; ++i) {
+		if (coro_bus_recv(ctx->bus, ctx->channel, &data) != 0)
+			abort();
+	}
+	sink = data;
+	return NULL;
+}
+
+/**
+ * The whole burst is sent at once, and the consumer takes it one
+ * by one. Returns the time of the producer per message.
+ */
+static double
+bench_burst(bool is_spill)
+{
+	coro_sched_init();
+	struct burst_ctx ctx;
+	ctx.bus = coro_bus_new();
+	if (is_spill) {
+		struct coro_bus_spill_opts opts;
+		coro_bus_spill_opts_create(&opts);
+		opts.spill_limit = burst_count;
+		ctx.channel = coro_bus_channel_open_spill(ctx.bus, 1024, &opts);
+	} else {
+		ctx.channel = coro_bus_channel_open(ctx.bus, 1024);
+	}
+	if (ctx.channel < 0)
+		abort();
+	ctx.start_ts = bench_now_ns();
+	struct coro *producer = coro_new(burst_producer_f, &ctx);
+	struct coro *consumer = coro_new(burst_consumer_f, &ctx);
+	coro_sched_run();
+	coro_join(producer);
+	coro_join(consumer);
+	coro_bus_channel_close(ctx.bus, ctx.channel);
+	coro_bus_delete(ctx.bus);
+	coro_sched_destroy();
+	return (double)ctx.producer_ns / burst_count;
+}
+
+struct fanout_ctx {
+	struct coro_bus *bus;
+	bool is_topic;
+	/** The topic, or the first of the consecutive channels. */
+	int desc;
+	uint64_t message_count;
+};
+
+struct fanout_consumer {
+	struct fanout_ctx *ctx;
+	/** The subscription, or the channel of the consumer. */
+	int desc;
+};
+
+static void *
+fanout_producer_f(void *arg)
+{
+	struct fanout_ctx *ctx = (struct fanout_ctx *)arg;
+	for (uint64_t i = 0; i < ctx->message_count; ++i) {
+		int rc = ctx->is_topic ?
+			coro_bus_publish(ctx->bus, ctx->desc, (unsigned)i) :
+			coro_bus_broadcast(ctx->bus, (unsigned)i);
+		if (rc != 0)
+			abort();
+	}
+	return NULL;
+}
+
+static void *
+fanout_consumer_f(void *arg)
+{
+	struct fanout_consumer *consumer = (struct fanout_consumer *)arg;
+	struct fanout_ctx *ctx = consumer->ctx;
+	unsigned data = 0;
+	for (uint64_t i = 0; i < ctx->message_count; ++i) {
+		int rc = ctx->is_topic ?
+			coro_bus_topic_recv(ctx->bus, ctx->desc, consumer->desc,
+				&data) :
+			coro_bus_recv(ctx->bus, consumer->desc, &data);
+		if (rc != 0)
+			abort();
+	}
+	sink = data;
+	return NULL;
+}
+
+/**
+ * One producer sends the messages to all the consumers, either
+ * broadcasting into their channels or publishing into the topic.
+ * Returns the time per delivered message.
+ */
+static double
+bench_fanout(bool is_topic, int consumer_count)
+{
+	coro_sched_init();
+	struct fanout_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.is_topic = is_topic;
+	ctx.message_count = fanout_delivery_count / consumer_count;
+	std::vector<struct fanout_consumer> consumers(consumer_count);
+	if (is_topic)
+		ctx.desc = coro_bus_topic_open(ctx.bus, fanout_limit);
+	for (struct fanout_consumer &consumer : consumers) {
+		consumer.ctx = &ctx;
+		consumer.desc = is_topic ? coro_bus_subscribe(ctx.bus, ctx.desc) :
+			coro_bus_channel_open(ctx.bus, fanout_limit);
+		if (consumer.desc < 0)
+			abort();
+	}
+	uint64_t start_ts = bench_now_ns();
+	std::vector<struct coro *> coros;
+	coros.push_back(coro_new(fanout_producer_f, &ctx));
+	for (struct fanout_consumer &consumer : consumers)
+		coros.push_back(coro_new(fanout_consumer_f, &consumer));
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start_ts;
+	for (struct coro *c : coros)
+		coro_join(c);
+	coro_bus_delete(ctx.bus);
+	coro_sched_destroy();
+	return (double)duration / (ctx.message_count * consumer_count);
+}
+
+enum payload_kind {
+	/** Copied into a new buffer, its index is sent as a value. */
+	PAYLOAD_SIDE_TABLE,
+	/** Sent as a message, the pointer changes the owner. */
+	PAYLOAD_MSG,
+	/** Same, in batches. */
+	PAYLOAD_MSG_BATCH,
+};
+
+struct payload_ctx {
+	struct coro_bus *bus;
+	int channel;
+	enum payload_kind kind;
+	/** The prepared payloads, more than the channel fits. */
+	char *payloads[payload_limit * 2];
+	/** The copied ones, by the sent index. */
+	char *table[payload_limit * 2];
+};
+
+static void *
+payload_producer_f(void *arg)
+{
+	struct payload_ctx *ctx = (struct payload_ctx *)arg;
+	const size_t table_size = payload_limit * 2;
+	struct coro_bus_msg batch[batch_size];
+	for (uint64_t sent = 0; sent < payload_count;) {
+		unsigned index = sent % table_size;
+		if (ctx->kind == PAYLOAD_SIDE_TABLE) {
+			char *copy = (char *)malloc(payload_size);
+			memcpy(copy, ctx->payloads[index], payload_size);
+			ctx->table[index] = copy;
+			if (coro_bus_send(ctx->bus, ctx->channel, index) != 0)
+				abort();
+			++sent;
+		} else if (ctx->kind == PAYLOAD_MSG) {
+			if (coro_bus_send_msg(ctx->bus, ctx->channel,
+					      ctx->payloads[index], payload_size) != 0)
+				abort();
+			++sent;
+		} else {
+			unsigned count = batch_size;
+			if (payload_count - sent < count)
+				count = payload_count - sent;
+			for (unsigned i = 0; i < count; ++i) {
+				coro_bus_msg_create(&batch[i], ctx->payloads[
+					(sent + i) % table_size], payload_size);
+			}
+			int rc = coro_bus_send_msg_v(ctx->bus, ctx->channel, batch,
+				count);
+			if (rc <= 0)
+				abort();
+			sent += rc;
+		}
+	}
+	return NULL;
+}
+
+static void *
+payload_consumer_f(void *arg)
+{
+	struct payload_ctx *ctx = (struct payload_ctx *)arg;
+	struct coro_bus_msg batch[batch_size];
+	char *buf = (char *)malloc(payload_size);
+	for (uint64_t received = 0; received < payload_count;) {
+		if (ctx->kind == PAYLOAD_SIDE_TABLE) {
+			unsigned index;
+			if (coro_bus_recv(ctx->bus, ctx->channel, &index) != 0)
+				abort();
+			memcpy(buf, ctx->table[index], payload_size);
+			free(ctx->table[index]);
+			sink = buf[0];
+			++received;
+			continue;
+		}
+		unsigned capacity = ctx->kind == PAYLOAD_MSG ? 1 : batch_size;
+		int rc = coro_bus_recv_msg_v(ctx->bus, ctx->channel, batch,
+			capacity);
+		if (rc <= 0)
+			abort();
+		/* The payload is used right where it is. */
+		for (int i = 0; i < rc; ++i)
+			sink = ((char *)coro_bus_msg_data(&batch[i]))[0];
+		received += rc;
+	}
+	free(buf);
+	return NULL;
+}
+
+static double
+bench_payload(enum payload_kind kind)
+{
+	coro_sched_init();
+	struct payload_ctx *ctx = new struct payload_ctx;
+	ctx->bus = coro_bus_new();
+	ctx->channel = coro_bus_channel_open(ctx->bus, payload_limit);
+	ctx->kind = kind;
+	for (char *&payload : ctx->payloads) {
+		payload = (char *)malloc(payload_size);
+		memset(payload, 'x', payload_size);
+	}
+	uint64_t start_ts = bench_now_ns();
+	struct coro *producer = coro_new(payload_producer_f, ctx);
+	struct coro *consumer = coro_new(payload_consumer_f, ctx);
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start_ts;
+	coro_join(producer);
+	coro_join(consumer);
+	for (char *payload : ctx->payloads)
+		free(payload);
+	coro_bus_channel_close(ctx->bus, ctx->channel);
+	coro_bus_delete(ctx->bus);
+	delete ctx;
+	coro_sched_destroy();
+	return (double)payload_count * 1000000000 / duration;
+}
+
+/**
+ * Open the channels, broadcast to them, and close them. In the
+ * sparse mode twice more are opened, and every other one is
+ * closed before the broadcasts. Saves the time per open, and per
+ * delivered broadcast message.
+ */
+static void
+bench_channels(int channel_count, bool is_sparse, double *open_ns,
+	double *broadcast_ns)
+{
+	struct coro_bus *bus = coro_bus_new();
+	int open_count = is_sparse ? channel_count * 2 : channel_count;
+	std::vector<int> channels(open_count);
+	uint64_t start_ts = bench_now_ns();
+	for (int &channel : channels)
+		channel = coro_bus_channel_open(bus, broadcast_round_count);
+	*open_ns = (double)(bench_now_ns() - start_ts) / open_count;
+	if (is_sparse) {
+		for (int i = 0; i < open_count; i += 2)
+			coro_bus_channel_close(bus, channels[i]);
+	}
+	start_ts = bench_now_ns();
+	for (int i = 0; i < broadcast_round_count; ++i) {
+		if (coro_bus_try_broadcast(bus, i) != 0)
+			abort();
+	}
+	*broadcast_ns = (double)(bench_now_ns() - start_ts) /
+		broadcast_round_count / channel_count;
+	coro_bus_delete(bus);
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_init(argc, argv);
+	size_t limits[] = {16, 1024};
+	for (size_t limit : limits) {
+		for (int i = 0; i < 4; ++i) {
+			bool is_ring = i % 2 == 1;
+			bool is_batch = i >= 2;
+			if (is_batch && limit < batch_size)
+				continue;
+			std::vector<double> samples;
+			for (int r = 0; r < run_count; ++r)
+				samples.push_back(bench_queue(is_ring, is_batch, limit));
+			char scenario[128];
+			snprintf(scenario, sizeof(scenario), "%s, %s, limit %zu",
+				is_ring ? "coro_ring" : "std::deque",
+				is_batch ? "batches of 64" : "one by one", limit);
+			bench_report(scenario, samples, "messages/sec");
+		}
+	}
+	for (size_t limit : limits) {
+		bench_bus_scenario(false, 1, 1, false, limit);
+		bench_bus_scenario(false, 1, 1, true, limit);
+	}
+	bench_bus_scenario(true, 1, 1, false, 1024);
+	bench_bus_scenario(true, 1, 4, false, 1024);
+	bench_bus_scenario(true, 4, 4, false, 1024);
+	bench_bus_scenario(true, 4, 4, true, 1024);
+
+	const char *payload_names[] = {
+		"copy + side table index",
+		"coro_bus_send_msg()",
+		"coro_bus_send_msg_v() of 64",
+	};
+	for (int kind = 0; kind < 3; ++kind) {
+		std::vector<double> samples;
+		for (int r = 0; r < run_count; ++r)
+			samples.push_back(bench_payload((enum payload_kind)kind));
+		char scenario[128];
+		snprintf(scenario, sizeof(scenario), "%zu byte payloads, %s",
+			payload_size, payload_names[kind]);
+		bench_report(scenario, samples, "messages/sec");
+	}
+
+	unsigned commit_batches[] = {0, 4096, 65536};
+	for (unsigned commit_batch : commit_batches) {
+		for (int i = 0; i < 2; ++i) {
+			std::vector<double> samples;
+			for (int r = 0; r < run_count; ++r)
+				samples.push_back(bench_durable(i == 1, commit_batch));
+			char commit[32];
+			if (commit_batch == 0)
+				snprintf(commit, sizeof(commit), "commit on close");
+			else
+				snprintf(commit, sizeof(commit), "commit each %u", commit_batch);
+			char scenario[128];
+			snprintf(scenario, sizeof(scenario), "durable coro_bus %s, %s",
+				i == 1 ? "send_v/recv_v of 64" : "send/recv", commit);
+			bench_report(scenario, samples, "messages/sec");
+		}
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		std::vector<double> samples;
+		for (int r = 0; r < run_count; ++r)
+			samples.push_back(bench_burst(i == 1));
+		char scenario[128];
+		snprintf(scenario, sizeof(scenario), "burst of %llu sends, limit 1024, "
+			"%s, producer time per message", (unsigned long long)burst_count,
+			i == 1 ? "spill to a file" : "memory only");
+		bench_report(scenario, samples, "ns");
+	}
+
+	int consumer_counts[] = {10, 1000};
+	for (int count : consumer_counts) {
+		for (int i = 0; i < 2; ++i) {
+			std::vector<double> samples;
+			for (int r = 0; r < run_count; ++r)
+				samples.push_back(bench_fanout(i == 1, count));
+			char scenario[128];
+			snprintf(scenario, sizeof(scenario), "fan-out to %d consumers, "
+				"limit %zu, %s, per delivered message", count, fanout_limit,
+				i == 1 ? "one topic" : "broadcast to channels");
+			bench_report(scenario, samples, "ns");
+		}
+	}
+
+	int channel_counts[] = {10, 1000, 100000};
+	for (int count : channel_counts) {
+		std::vector<double> open_samples;
+		std::vector<double> broadcast_samples;
+		std::vector<double> sparse_samples;
+		for (int r = 0; r < run_count; ++r) {
+			double open_ns;
+			double broadcast_ns;
+			bench_channels(count, false, &open_ns, &broadcast_ns);
+			open_samples.push_back(open_ns);
+			broadcast_samples.push_back(broadcast_ns);
+			bench_channels(count, true, &open_ns, &broadcast_ns);
+			sparse_samples.push_back(broadcast_ns);
+		}
+		char scenario[128];
+		snprintf(scenario, sizeof(scenario), "coro_bus_channel_open(), "
+			"%d channels, per channel", count);
+		bench_report(scenario, open_samples, "ns");
+		snprintf(scenario, sizeof(scenario), "coro_bus_try_broadcast(), "
+			"%d channels, per channel", count);
+		bench_report(scenario, broadcast_samples, "ns");
+		snprintf(scenario, sizeof(scenario), "coro_bus_try_broadcast(), "
+			"%d channels and as many closed, per channel", count);
+		bench_report(scenario, sparse_samples, "ns");
+	}
+	return 0;
+}
@@ -0,0 +1,152 @@
+/**
+ * Useless wakeups of the coro_bus waiters: the ones after which a
+ * waiter finds nothing for itself and suspends again. A call which
+ * had to wait is woken up usefully once, the rest of its
+ * suspensions are counted. The batches of the senders and the
+ * receivers differ, so a wakeup per message is way more than
+ * needed. Built with CORO_STATS for the suspension counters.
+ */
+#include "bench.h"
+#include "corobus.h"
+#include "libcoro.h"
+
+static const int run_count = 5;
+static const int message_count = 1000000;
+static const int peer_max = 8;
+
+struct bench_ctx {
+	struct coro_bus *bus;
+	int channel;
+	/** Messages per call of each side. */
+	unsigned send_batch;
+	unsigned recv_batch;
+	/** Messages per coroutine of each side. */
+	int send_quota;
+	int recv_quota;
+	uint64_t useless_count;
+};
+
+static uint64_t
+bench_suspend_count(void)
+{
+	struct coro_stats stats;
+	coro_stats_get(coro_this(), &stats);
+	return stats.suspend_count;
+}
+
+/** Account the suspensions of a call beyond the first one. */
+static void
+bench_account(struct bench_ctx *ctx, uint64_t start_count)
+{
+	uint64_t count = bench_suspend_count() - start_count;
+	if (count > 1)
+		ctx->useless_count += count - 1;
+}
+
+static void *
+sender_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	unsigned data[64] = {0};
+	for (int sent = 0; sent < ctx->send_quota;) {
+		unsigned count = ctx->send_batch;
+		if ((int)count > ctx->send_quota - sent)
+			count = ctx->send_quota - sent;
+		uint64_t start_count = bench_suspend_count();
+		int rc = coro_bus_send_v(ctx->bus, ctx->channel, data, count);
+		bench_account(ctx, start_count);
+		if (rc < 0)
+			abort();
+		sent += rc;
+		/* Let the others run, like a producer of the real data. */
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+receiver_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	unsigned data[64];
+	for (int received = 0; received < ctx->recv_quota;) {
+		unsigned capacity = ctx->recv_batch;
+		if ((int)capacity > ctx->recv_quota - received)
+			capacity = ctx->recv_quota - received;
+		uint64_t start_count = bench_suspend_count();
+		int rc = coro_bus_recv_v(ctx->bus, ctx->channel, data, capacity);
+		bench_account(ctx, start_count);
+		if (rc < 0)
+			abort();
+		received += rc;
+		coro_yield();
+	}
+	return NULL;
+}
+
+/**
+ * Returns the useless wakeups per million messages, and saves the
+ * throughput into @a rate.
+ */
+static double
+bench_run(int sender_count, unsigned send_batch, int receiver_count,
+	unsigned recv_batch, size_t limit, double *rate)
+{
+	coro_sched_init();
+	struct bench_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.channel = coro_bus_channel_open(ctx.bus, limit);
+	ctx.send_batch = send_batch;
+	ctx.recv_batch = recv_batch;
+	ctx.send_quota = message_count / sender_count;
+	ctx.recv_quota = message_count / receiver_count;
+	ctx.useless_count = 0;
+	struct coro *coros[peer_max * 2];
+	int coro_count = 0;
+	/* The receivers first, so they are waiting when data comes. */
+	for (int i = 0; i < receiver_count; ++i)
+		coros[coro_count++] = coro_new(receiver_f, &ctx);
+	for (int i = 0; i < sender_count; ++i)
+		coros[coro_count++] = coro_new(sender_f, &ctx);
+	uint64_t start_ts = bench_now_ns();
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start_ts;
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	coro_bus_channel_close(ctx.bus, ctx.channel);
+	coro_bus_delete(ctx.bus);
+	coro_sched_destroy();
+	*rate = (double)message_count * 1000000000 / duration;
+	return (double)ctx.useless_count * 1000000 / message_count;
+}
+
+static void
+bench_scenario(const char *name, int sender_count, unsigned send_batch,
+	int receiver_count, unsigned recv_batch, size_t limit)
+{
+	std::vector<double> useless;
+	std::vector<double> rates;
+	for (int i = 0; i < run_count; ++i) {
+		double rate;
+		useless.push_back(bench_run(sender_count, send_batch,
+			receiver_count, recv_batch, limit, &rate));
+		rates.push_back(rate);
+	}
+	char scenario[128];
+	snprintf(scenario, sizeof(scenario), "%s, useless wakeups per 1M "
+		"messages", name);
+	bench_report(scenario, useless, "wakeups");
+	snprintf(scenario, sizeof(scenario), "%s, throughput", name);
+	bench_report(scenario, rates, "messages/sec");
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_init(argc, argv);
+	bench_scenario("1 send_v(16), 8 recv_v(64)", 1, 16, 8, 64, 256);
+	bench_scenario("8 send_v(16), 1 recv_v(64)", 8, 16, 1, 64, 64);
+	bench_scenario("4 send_v(8), 4 recv_v(32)", 4, 8, 4, 32, 64);
+	bench_scenario("4 send(), 4 recv()", 4, 1, 4, 1, 64);
+	return 0;
+}
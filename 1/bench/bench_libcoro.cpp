@@ -0,0 +1,212 @@
+/**
+ * The basic costs of libcoro with a single worker, to keep an eye
+ * on the regressions: creation and join of the coroutines, the
+ * switches with a growing number of the runnable ones, and the
+ * latency of a wakeup passed along a chain of the suspended ones.
+ *
+ * Run with --json to get a line per scenario for the scripts.
+ */
+#include "bench.h"
+#include "libcoro.h"
+
+static const int run_count = 5;
+static const int fresh_spawn_count = 100000;
+static const int pooled_spawn_count = 1000000;
+static const uint64_t switch_count = 2000000;
+static const int chain_length = 100;
+static const int chain_round_count = 10000;
+
+static void
+bench_sched_init(size_t coro_cache_size, size_t stack_cache_size)
+{
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.stack_size = 16 * 1024;
+	/* Many stacks at once must fit into the memory mappings limit. */
+	opts.stack_guard = false;
+	opts.coro_cache_size = coro_cache_size;
+	opts.stack_cache_size = stack_cache_size;
+	coro_sched_init_opts(&opts);
+}
+
+static void *
+empty_f(void *arg)
+{
+	return arg;
+}
+
+struct spawn_ctx {
+	int count;
+	uint64_t duration;
+};
+
+static void *
+spawn_main_f(void *arg)
+{
+	struct spawn_ctx *ctx = (struct spawn_ctx *)arg;
+	uint64_t start_ts = bench_now_ns();
+	for (int i = 0; i < ctx->count; ++i)
+		coro_join(coro_new(empty_f, NULL));
+	ctx->duration = bench_now_ns() - start_ts;
+	return NULL;
+}
+
+/**
+ * A coroutine spawns and joins the others one by one. Without the
+ * caches each of them is allocated, and so is its stack.
+ */
+static double
+bench_spawn(size_t coro_cache_size, size_t stack_cache_size, int count)
+{
+	bench_sched_init(coro_cache_size, stack_cache_size);
+	struct spawn_ctx ctx;
+	ctx.count = count;
+	struct coro *c = coro_new(spawn_main_f, &ctx);
+	coro_sched_run();
+	coro_join(c);
+	coro_sched_destroy();
+	return (double)ctx.duration / count;
+}
+
+static void *
+yield_f(void *arg)
+{
+	uint64_t count = *(uint64_t *)arg;
+	for (uint64_t i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+/** The same number of switches spread over the coroutines. */
+static double
+bench_yield(int coro_count)
+{
+	bench_sched_init(coro_count, coro_count);
+	uint64_t count = switch_count / coro_count;
+	struct coro **coros = new struct coro *[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(yield_f, &count);
+	uint64_t start_ts = bench_now_ns();
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start_ts;
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	delete[] coros;
+	coro_sched_destroy();
+	return (double)duration / (count * coro_count);
+}
+
+struct chain_ctx {
+	struct coro *coros[chain_length];
+	/** Who the last link wakes up. */
+	struct coro *main;
+	bool is_stopped;
+	std::vector<double> *samples;
+};
+
+struct chain_link {
+	struct chain_ctx *ctx;
+	int index;
+};
+
+/** Wait for a wakeup, and pass it on to the next link. */
+static void *
+chain_link_f(void *arg)
+{
+	struct chain_link *link = (struct chain_link *)arg;
+	struct chain_ctx *ctx = link->ctx;
+	while (true) {
+		coro_suspend();
+		if (ctx->is_stopped)
+			return NULL;
+		int next = link->index + 1;
+		coro_wakeup(next < chain_length ? ctx->coros[next] : ctx->main);
+	}
+}
+
+static void *
+chain_main_f(void *arg)
+{
+	struct chain_ctx *ctx = (struct chain_ctx *)arg;
+	static struct chain_link links[chain_length];
+	ctx->main = coro_this();
+	ctx->is_stopped = false;
+	for (int i = 0; i < chain_length; ++i) {
+		links[i].ctx = ctx;
+		links[i].index = i;
+		ctx->coros[i] = coro_new(chain_link_f, &links[i]);
+	}
+	/* Let them all suspend. */
+	coro_yield();
+	for (int r = 0; r < chain_round_count; ++r) {
+		uint64_t start_ts = bench_now_ns();
+		coro_wakeup(ctx->coros[0]);
+		coro_suspend();
+		uint64_t duration = bench_now_ns() - start_ts;
+		ctx->samples->push_back((double)duration / (chain_length + 1));
+	}
+	ctx->is_stopped = true;
+	for (int i = 0; i < chain_length; ++i) {
+		coro_wakeup(ctx->coros[i]);
+		coro_join(ctx->coros[i]);
+	}
+	return NULL;
+}
+
+/**
+ * Each round a wakeup goes through all the links and back to the
+ * main coroutine. A sample is a round, per hop.
+ */
+static void
+bench_chain(std::vector<double> *samples)
+{
+	bench_sched_init(chain_length, chain_length);
+	static struct chain_ctx ctx;
+	ctx.samples = samples;
+	struct coro *c = coro_new(chain_main_f, &ctx);
+	coro_sched_run();
+	coro_join(c);
+	coro_sched_destroy();
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_init(argc, argv);
+	std::vector<double> samples;
+	for (int i = 0; i < run_count; ++i)
+		samples.push_back(bench_spawn(0, 0, fresh_spawn_count));
+	bench_report("coro_new() + coro_join(), fresh coroutine and stack",
+		samples, "ns");
+
+	samples.clear();
+	for (int i = 0; i < run_count; ++i)
+		samples.push_back(bench_spawn(0, 16, fresh_spawn_count));
+	bench_report("coro_new() + coro_join(), fresh coroutine, cached stack",
+		samples, "ns");
+
+	samples.clear();
+	for (int i = 0; i < run_count; ++i)
+		samples.push_back(bench_spawn(16, 16, pooled_spawn_count));
+	bench_report("coro_new() + coro_join(), pooled coroutine", samples,
+		"ns");
+
+	int coro_counts[] = {2, 10, 100, 1000, 10000};
+	for (int count : coro_counts) {
+		samples.clear();
+		for (int i = 0; i < run_count; ++i)
+			samples.push_back(bench_yield(count));
+		char scenario[128];
+		snprintf(scenario, sizeof(scenario), "coro_yield() switch, %d "
+			"runnable coroutines", count);
+		bench_report(scenario, samples, "ns");
+	}
+
+	samples.clear();
+	bench_chain(&samples);
+	char scenario[128];
+	snprintf(scenario, sizeof(scenario), "coro_wakeup() chain of %d "
+		"suspended coroutines, per hop", chain_length);
+	bench_report(scenario, samples, "ns");
+	return 0;
+}
@@ -0,0 +1,97 @@
+/**
+ * Wakeup latency of an interactive coroutine next to a saturating
+ * background load. The background coroutines burn the CPU in short
+ * chunks and yield. One of them wakes the interactive coroutine up
+ * periodically, and the interactive one measures how long it took
+ * to get running.
+ */
+#include "bench.h"
+#include "libcoro.h"
+
+static const int background_count = 100;
+static const uint64_t chunk_ns = 5000;
+static const uint64_t wakeup_period_ns = 200000;
+static const int wakeup_count = 2000;
+
+struct bench_ctx {
+	struct coro *interactive;
+	bool is_suspended;
+	bool is_stopped;
+	uint64_t wakeup_ts;
+	std::vector<double> latencies;
+};
+
+static void *
+background_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	while (!ctx->is_stopped) {
+		uint64_t start = bench_now_ns();
+		while (bench_now_ns() - start < chunk_ns)
+			;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+waker_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	while (!ctx->is_stopped) {
+		uint64_t now = bench_now_ns();
+		if (ctx->is_suspended && now - ctx->wakeup_ts >= wakeup_period_ns) {
+			ctx->is_suspended = false;
+			ctx->wakeup_ts = now;
+			coro_wakeup(ctx->interactive);
+		}
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+interactive_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	for (int i = 0; i < wakeup_count; ++i) {
+		ctx->is_suspended = true;
+		coro_suspend();
+		ctx->latencies.push_back(
+			(bench_now_ns() - ctx->wakeup_ts) / 1000.0);
+	}
+	ctx->is_stopped = true;
+	return NULL;
+}
+
+static void
+bench_latency(enum coro_priority prio, const char *scenario)
+{
+	coro_sched_init();
+	struct bench_ctx ctx;
+	ctx.is_suspended = false;
+	ctx.is_stopped = false;
+	ctx.wakeup_ts = 0;
+	ctx.interactive = coro_new(interactive_f, &ctx);
+	coro_set_priority(ctx.interactive, prio);
+	struct coro *waker = coro_new(waker_f, &ctx);
+	struct coro *background[background_count];
+	for (int i = 0; i < background_count; ++i)
+		background[i] = coro_new(background_f, &ctx);
+	coro_sched_run();
+	coro_join(ctx.interactive);
+	coro_join(waker);
+	for (int i = 0; i < background_count; ++i)
+		coro_join(background[i]);
+	coro_sched_destroy();
+	bench_report_latency(scenario, ctx.latencies, "us");
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_init(argc, argv);
+	bench_latency(CORO_PRIO_NORMAL, "wakeup latency, normal priority");
+	bench_latency(CORO_PRIO_HIGH, "wakeup latency, high priority");
+	return 0;
+}
@@ -0,0 +1,94 @@
+/**
+ * Scaling of a CPU-bound coroutine workload with the number of
+ * the scheduler worker threads, from 1 up to the number of the
+ * online CPUs. Each coroutine crunches numbers in small chunks
+ * and yields between them, so the workers have to balance the
+ * load via the run queues and stealing.
+ *
+ * The max number of the workers can be given as the first
+ * argument.
+ */
+#include "bench.h"
+#include "libcoro.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static const int run_count = 5;
+static const int coro_count = 512;
+static const int chunk_count = 200;
+static const int chunk_size = 20000;
+
+static volatile uint64_t sink;
+
+static void *
+crunch_f(void *arg)
+{
+	(void)arg;
+	uint64_t x = 0;
+	for (int i = 0; i < chunk_count; ++i) {
+		for (int j = 0; j < chunk_size; ++j)
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		coro_yield();
+	}
+	sink = x;
+	return NULL;
+}
+
+static void *
+main_f(void *arg)
+{
+	(void)arg;
+	static struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(crunch_f, NULL);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	return NULL;
+}
+
+/** Returns the chunks done per second. */
+static double
+bench_scale(int worker_count)
+{
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = worker_count;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+	uint64_t start_ts = bench_now_ns();
+	struct coro *c = coro_new(main_f, NULL);
+	coro_sched_run();
+	coro_join(c);
+	uint64_t duration = bench_now_ns() - start_ts;
+	coro_sched_destroy();
+	return (double)coro_count * chunk_count * 1000000000 / duration;
+}
+
+int
+main(int argc, char **argv)
+{
+	argc = bench_init(argc, argv);
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 1)
+		cpu_count = atol(argv[1]);
+	if (cpu_count < 1)
+		cpu_count = 1;
+	double base = 0;
+	for (int workers = 1; workers <= cpu_count; ++workers) {
+		std::vector<double> samples;
+		for (int i = 0; i < run_count; ++i)
+			samples.push_back(bench_scale(workers));
+		char scenario[128];
+		snprintf(scenario, sizeof(scenario),
+			"%d coroutines x %d chunks, %d worker(s)", coro_count,
+			chunk_count, workers);
+		bench_report(scenario, samples, "chunks/sec");
+		double med = samples[samples.size() / 2];
+		if (workers == 1)
+			base = med;
+		if (!bench_is_json)
+			printf("    speedup: %.2fx\n", med / base);
+	}
+	return 0;
+}
@@ -0,0 +1,201 @@
+/**
+ * Memory and switch cost of the shared stack mode versus the
+ * dedicated stacks. Many coroutines are parked at a given stack
+ * depth, and the resident memory per coroutine is measured. Then
+ * a group of coroutines of the same depth yield to each other,
+ * which in the shared mode costs a copy of their frames out and
+ * in.
+ *
+ * Each sample is taken in a new process, so the memory freed by
+ * the previous ones does not hide the growth.
+ *
+ * The number of the parked coroutines with the shared stack can
+ * be given as the first argument. With the dedicated ones it is
+ * limited by the number of the memory mappings.
+ */
+#include "bench.h"
+#include "libcoro.h"
+
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const int run_count = 5;
+static const int dedicated_count = 20000;
+static const int yield_coro_count = 100;
+static const int yield_count = 10000;
+
+typedef void (*deep_f)(void *arg);
+
+/**
+ * Call the function kb kilobytes deeper into the stack. Not
+ * inlined, or the frames of several levels are merged into one.
+ */
+static void __attribute__((noinline))
+go_deep(int kb, deep_f func, void *arg)
+{
+	if (kb == 0) {
+		func(arg);
+		return;
+	}
+	volatile char frame[1024];
+	for (int i = 0; i < 1024; i += 64)
+		frame[i] = (char)i;
+	go_deep(kb - 1, func, arg);
+	/* Keep the frame alive until the end. */
+	frame[0] = frame[64];
+}
+
+struct deep_ctx {
+	int kb;
+	deep_f func;
+};
+
+static void *
+deep_coro_f(void *arg)
+{
+	struct deep_ctx *ctx = (struct deep_ctx *)arg;
+	go_deep(ctx->kb, ctx->func, NULL);
+	return NULL;
+}
+
+static void
+park_f(void *arg)
+{
+	(void)arg;
+	coro_suspend();
+}
+
+static void
+yield_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < yield_count; ++i)
+		coro_yield();
+}
+
+static size_t
+rss_bytes(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	unsigned long size = 0;
+	unsigned long resident = 0;
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+struct bench_ctx {
+	int count;
+	int kb;
+	double bytes_per_coro;
+	double switches_per_sec;
+};
+
+static void *
+main_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	struct coro **coros = new struct coro *[ctx->count];
+	/* The others can't see the stack in the shared mode. */
+	static struct deep_ctx park;
+	park.kb = ctx->kb;
+	park.func = park_f;
+	size_t rss = rss_bytes();
+	for (int i = 0; i < ctx->count; ++i)
+		coros[i] = coro_new(deep_coro_f, &park);
+	/* Let them all park. */
+	coro_yield();
+	ctx->bytes_per_coro = (double)(rss_bytes() - rss) / ctx->count;
+	for (int i = 0; i < ctx->count; ++i) {
+		coro_wakeup(coros[i]);
+		coro_join(coros[i]);
+	}
+
+	static struct deep_ctx yield;
+	yield.kb = ctx->kb;
+	yield.func = yield_f;
+	uint64_t start_ts = bench_now_ns();
+	for (int i = 0; i < yield_coro_count; ++i)
+		coros[i] = coro_new(deep_coro_f, &yield);
+	for (int i = 0; i < yield_coro_count; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = bench_now_ns() - start_ts;
+	ctx->switches_per_sec = (double)yield_coro_count * yield_count *
+		1000000000 / duration;
+	delete[] coros;
+	return NULL;
+}
+
+static void
+bench_sample(bool is_shared, struct bench_ctx *ctx)
+{
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.stack_size = 256 * 1024;
+	opts.stack_shared = is_shared;
+	/* Measure the coroutines, not the caches. */
+	opts.coro_cache_size = 0;
+	opts.stack_cache_size = 0;
+	coro_sched_init_opts(&opts);
+	struct coro *c = coro_new(main_f, ctx);
+	coro_sched_run();
+	coro_join(c);
+	coro_sched_destroy();
+}
+
+static void
+bench_run(bool is_shared, int count, int kb)
+{
+	std::vector<double> memory, switches;
+	for (int i = 0; i < run_count; ++i) {
+		struct bench_ctx ctx;
+		ctx.count = count;
+		ctx.kb = kb;
+		int fds[2];
+		if (pipe(fds) != 0)
+			abort();
+		pid_t pid = fork();
+		if (pid == 0) {
+			bench_sample(is_shared, &ctx);
+			if (write(fds[1], &ctx, sizeof(ctx)) != sizeof(ctx))
+				_exit(1);
+			_exit(0);
+		}
+		close(fds[1]);
+		if (read(fds[0], &ctx, sizeof(ctx)) != sizeof(ctx))
+			abort();
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		memory.push_back(ctx.bytes_per_coro);
+		switches.push_back(ctx.switches_per_sec);
+	}
+	const char *mode = is_shared ? "shared stack" : "dedicated stacks";
+	char scenario[128];
+	snprintf(scenario, sizeof(scenario), "%d coroutines parked %d KB deep, "
+		"%s", count, kb, mode);
+	bench_report(scenario, memory, "resident bytes per coro");
+	snprintf(scenario, sizeof(scenario), "coro_yield() between %d "
+		"coroutines %d KB deep, %s", yield_coro_count, kb, mode);
+	bench_report(scenario, switches, "switches/sec");
+}
+
+int
+main(int argc, char **argv)
+{
+	argc = bench_init(argc, argv);
+	int shared_count = 1000000;
+	if (argc > 1)
+		shared_count = atoi(argv[1]);
+	int kbs[] = {0, 1, 8};
+	for (int kb : kbs) {
+		bench_run(false, dedicated_count, kb);
+		/* Keep the total within a couple of gigabytes. */
+		bench_run(true, kb == 0 ? shared_count : shared_count / 10,
+			kb);
+	}
+	return 0;
+}
@@ -0,0 +1,135 @@
+/**
+ * Cost of the coroutine context switches and creation with the
+ * context backend this executable is built with. Each backend
+ * gets its own bench_switch_<backend> executable, so the backends
+ * are compared by running all of them.
+ */
+#include "bench.h"
+#include "coro_ctx.h"
+#include "libcoro.h"
+
+static const int run_count = 5;
+static const uint64_t yield_count = 1000000;
+static const int spawn_count = 10000;
+static const int reuse_count = 1000000;
+
+static void *
+yield_f(void *arg)
+{
+	uint64_t count = *(uint64_t *)arg;
+	for (uint64_t i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void *
+empty_f(void *arg)
+{
+	return arg;
+}
+
+static double
+bench_yield(void)
+{
+	coro_sched_init();
+	uint64_t count = yield_count;
+	struct coro *c1 = coro_new(yield_f, &count);
+	struct coro *c2 = coro_new(yield_f, &count);
+	uint64_t start_ts = bench_now_ns();
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start_ts;
+	coro_join(c1);
+	coro_join(c2);
+	coro_sched_destroy();
+	/*
+	 * Each yield is a switch out of the coroutine. The switches
+	 * in and out of the scheduler are the part of the price.
+	 */
+	return 2.0 * yield_count * 1000000000 / duration;
+}
+
+static double
+bench_spawn(void)
+{
+	static struct coro *coros[spawn_count];
+	coro_sched_init();
+	uint64_t start_ts = bench_now_ns();
+	for (int i = 0; i < spawn_count; ++i)
+		coros[i] = coro_new(empty_f, NULL);
+	coro_sched_run();
+	for (int i = 0; i < spawn_count; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = bench_now_ns() - start_ts;
+	coro_sched_destroy();
+	return (double)duration / spawn_count;
+}
+
+struct reuse_ctx {
+	bool is_inline;
+	uint64_t duration;
+};
+
+static void *
+reuse_main_f(void *arg)
+{
+	struct reuse_ctx *ctx = (struct reuse_ctx *)arg;
+	uint64_t start_ts = bench_now_ns();
+	if (ctx->is_inline) {
+		for (int i = 0; i < reuse_count; ++i)
+			coro_join(coro_new_inline(empty_f, NULL));
+	} else {
+		for (int i = 0; i < reuse_count; ++i)
+			coro_join(coro_new(empty_f, NULL));
+	}
+	ctx->duration = bench_now_ns() - start_ts;
+	return NULL;
+}
+
+/**
+ * Short-lived coroutines spawned and joined one by one from
+ * another coroutine, so the pools are warm.
+ */
+static double
+bench_reuse(bool is_inline)
+{
+	coro_sched_init();
+	struct reuse_ctx ctx;
+	ctx.is_inline = is_inline;
+	struct coro *c = coro_new(reuse_main_f, &ctx);
+	coro_sched_run();
+	coro_join(c);
+	coro_sched_destroy();
+	return (double)ctx.duration / reuse_count;
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_init(argc, argv);
+	if (!bench_is_json)
+		printf("Context backend: %s\n", coro_ctx_backend());
+	std::vector<double> samples;
+	for (int i = 0; i < run_count; ++i)
+		samples.push_back(bench_yield());
+	bench_report("coro_yield() between 2 coroutines", samples,
+		"switches/sec");
+
+	samples.clear();
+	for (int i = 0; i < run_count; ++i)
+		samples.push_back(bench_spawn());
+	bench_report("coro_new() + coro_join() of fresh coroutines", samples,
+		"ns per coro");
+
+	samples.clear();
+	for (int i = 0; i < run_count; ++i)
+		samples.push_back(bench_reuse(false));
+	bench_report("coro_new() + coro_join() of a finishing coroutine",
+		samples, "ns per coro");
+
+	samples.clear();
+	for (int i = 0; i < run_count; ++i)
+		samples.push_back(bench_reuse(true));
+	bench_report("coro_new_inline() + coro_join() of a finishing "
+		"coroutine", samples, "ns per coro");
+	return 0;
+}
@@ -0,0 +1,215 @@
+/**
+ * Contention on the libcoro synchronization primitives versus the
+ * hand-rolled wakeup queues of rlist and coro_wakeup(), like the
+ * one in corobus.cpp. The hand-rolled ones work with a single
+ * worker only, so with many workers only the primitives are
+ * measured.
+ */
+#include "bench.h"
+#include "libcoro.h"
+
+static const int run_count = 5;
+static const int coro_count = 100;
+static const int iter_count = 10000;
+
+/** Mutex on top of a wakeup queue. Woken up waiters recheck it. */
+struct naive_mutex {
+	bool is_locked;
+	struct rlist waiters;
+};
+
+struct naive_entry {
+	struct coro *coro;
+	struct rlist link;
+};
+
+static void
+naive_mutex_lock(struct naive_mutex *m)
+{
+	while (m->is_locked) {
+		struct naive_entry entry;
+		entry.coro = coro_this();
+		rlist_add_tail_entry(&m->waiters, &entry, link);
+		coro_suspend();
+		if (!rlist_empty(&entry.link))
+			rlist_del_entry(&entry, link);
+	}
+	m->is_locked = true;
+}
+
+static void
+naive_mutex_unlock(struct naive_mutex *m)
+{
+	m->is_locked = false;
+	if (rlist_empty(&m->waiters))
+		return;
+	struct naive_entry *entry = rlist_shift_entry(&m->waiters,
+		struct naive_entry, link);
+	rlist_create(&entry->link);
+	coro_wakeup(entry->coro);
+}
+
+/** Semaphore on top of a wakeup queue. */
+struct naive_sem {
+	size_t count;
+	struct rlist waiters;
+};
+
+static void
+naive_sem_wait(struct naive_sem *s)
+{
+	while (s->count == 0) {
+		struct naive_entry entry;
+		entry.coro = coro_this();
+		rlist_add_tail_entry(&s->waiters, &entry, link);
+		coro_suspend();
+		if (!rlist_empty(&entry.link))
+			rlist_del_entry(&entry, link);
+	}
+	--s->count;
+}
+
+static void
+naive_sem_post(struct naive_sem *s)
+{
+	++s->count;
+	if (rlist_empty(&s->waiters))
+		return;
+	struct naive_entry *entry = rlist_shift_entry(&s->waiters,
+		struct naive_entry, link);
+	rlist_create(&entry->link);
+	coro_wakeup(entry->coro);
+}
+
+enum bench_kind {
+	BENCH_NAIVE_MUTEX,
+	BENCH_MUTEX,
+	BENCH_NAIVE_SEM,
+	BENCH_SEM,
+};
+
+struct bench_ctx {
+	enum bench_kind kind;
+	/** Whether to yield while holding the mutex. */
+	bool is_yield_inside;
+	struct naive_mutex naive_mutex;
+	struct coro_mutex mutex;
+	struct naive_sem naive_sem;
+	struct coro_sem sem;
+	long counter;
+};
+
+static void *
+mutex_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	bool is_naive = ctx->kind == BENCH_NAIVE_MUTEX;
+	for (int i = 0; i < iter_count; ++i) {
+		if (is_naive)
+			naive_mutex_lock(&ctx->naive_mutex);
+		else
+			coro_mutex_lock(&ctx->mutex);
+		++ctx->counter;
+		if (ctx->is_yield_inside)
+			coro_yield();
+		if (is_naive)
+			naive_mutex_unlock(&ctx->naive_mutex);
+		else
+			coro_mutex_unlock(&ctx->mutex);
+		if (!ctx->is_yield_inside)
+			coro_yield();
+	}
+	return NULL;
+}
+
+/** Half of the coroutines post, the other half wait. */
+static void *
+sem_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	bool is_naive = ctx->kind == BENCH_NAIVE_SEM;
+	bool is_poster = __atomic_fetch_add(&ctx->counter, 1,
+		__ATOMIC_RELAXED) % 2 == 0;
+	for (int i = 0; i < iter_count; ++i) {
+		if (is_poster) {
+			if (is_naive)
+				naive_sem_post(&ctx->naive_sem);
+			else
+				coro_sem_post(&ctx->sem);
+			coro_yield();
+		} else if (is_naive) {
+			naive_sem_wait(&ctx->naive_sem);
+		} else {
+			coro_sem_wait(&ctx->sem);
+		}
+	}
+	return NULL;
+}
+
+/** Returns the operations per second. */
+static double
+bench_run(enum bench_kind kind, bool is_yield_inside, int worker_count)
+{
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = worker_count;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+	struct bench_ctx ctx;
+	ctx.kind = kind;
+	ctx.is_yield_inside = is_yield_inside;
+	ctx.naive_mutex.is_locked = false;
+	rlist_create(&ctx.naive_mutex.waiters);
+	coro_mutex_create(&ctx.mutex);
+	ctx.naive_sem.count = 0;
+	rlist_create(&ctx.naive_sem.waiters);
+	coro_sem_create(&ctx.sem, 0);
+	ctx.counter = 0;
+	bool is_mutex = kind == BENCH_NAIVE_MUTEX || kind == BENCH_MUTEX;
+	static struct coro *coros[coro_count];
+	uint64_t start_ts = bench_now_ns();
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(is_mutex ? mutex_f : sem_f, &ctx);
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start_ts;
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	coro_sem_destroy(&ctx.sem);
+	coro_mutex_destroy(&ctx.mutex);
+	coro_sched_destroy();
+	double op_count = (double)coro_count * iter_count;
+	/* Only the waiters count for the semaphore. */
+	if (!is_mutex)
+		op_count /= 2;
+	return op_count * 1000000000 / duration;
+}
+
+static void
+bench_scenario(const char *name, enum bench_kind kind, bool is_yield_inside,
+	int worker_count)
+{
+	std::vector<double> samples;
+	for (int i = 0; i < run_count; ++i)
+		samples.push_back(bench_run(kind, is_yield_inside, worker_count));
+	char scenario[128];
+	snprintf(scenario, sizeof(scenario), "%s, %d coroutines, %d worker(s)",
+		name, coro_count, worker_count);
+	bench_report(scenario, samples, "ops/sec");
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_init(argc, argv);
+	bench_scenario("hand-rolled mutex, yield outside", BENCH_NAIVE_MUTEX,
+		false, 1);
+	bench_scenario("coro_mutex, yield outside", BENCH_MUTEX, false, 1);
+	bench_scenario("hand-rolled mutex, yield inside", BENCH_NAIVE_MUTEX,
+		true, 1);
+	bench_scenario("coro_mutex, yield inside", BENCH_MUTEX, true, 1);
+	bench_scenario("coro_mutex, yield inside", BENCH_MUTEX, true, 4);
+	bench_scenario("hand-rolled semaphore", BENCH_NAIVE_SEM, false, 1);
+	bench_scenario("coro_sem", BENCH_SEM, false, 1);
+	bench_scenario("coro_sem", BENCH_SEM, false, 4);
+	return 0;
+}
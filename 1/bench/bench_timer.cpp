@@ -0,0 +1,151 @@
+/**
+ * Cost of the timers. The wheel itself with a million of pending
+ * timeouts, and the scheduler loop with many coroutines suspended
+ * with a timeout. The loop pays for a clock read per iteration
+ * when there are any timers, but not for their number.
+ */
+#include "bench.h"
+#include "coro_timer.h"
+#include "libcoro.h"
+
+static const int run_count = 5;
+static const int timer_count = 1000000;
+static const int suspended_count = 10000;
+static const uint64_t yield_count = 1000000;
+
+static struct coro_timer timers[timer_count];
+
+struct wheel_result {
+	double add_ns;
+	double expire_ns;
+	double del_ns;
+};
+
+static struct wheel_result
+bench_wheel(void)
+{
+	struct wheel_result res;
+	struct coro_timer_wheel wheel;
+	coro_timer_wheel_create(&wheel, 0);
+	unsigned rand = 1;
+	/* Timeouts from a millisecond up to a minute. */
+	for (int i = 0; i < timer_count; ++i) {
+		rand = rand * 1103515245 + 12345;
+		timers[i].expire_tick = 1 + (rand >> 4) % 60000;
+	}
+	uint64_t start_ts = bench_now_ns();
+	for (int i = 0; i < timer_count; ++i)
+		coro_timer_wheel_add(&wheel, &timers[i]);
+	res.add_ns = (double)(bench_now_ns() - start_ts) / timer_count;
+
+	start_ts = bench_now_ns();
+	for (int i = 0; i < timer_count; ++i)
+		coro_timer_wheel_del(&wheel, &timers[i]);
+	res.del_ns = (double)(bench_now_ns() - start_ts) / timer_count;
+
+	for (int i = 0; i < timer_count; ++i)
+		coro_timer_wheel_add(&wheel, &timers[i]);
+	struct rlist expired;
+	rlist_create(&expired);
+	start_ts = bench_now_ns();
+	/* Tick by tick, like a busy scheduler would do. */
+	for (uint64_t tick = 1; wheel.count > 0; ++tick) {
+		coro_timer_wheel_advance(&wheel, tick, &expired);
+		rlist_create(&expired);
+	}
+	res.expire_ns = (double)(bench_now_ns() - start_ts) / timer_count;
+	coro_timer_wheel_destroy(&wheel);
+	return res;
+}
+
+static void *
+suspend_f(void *arg)
+{
+	(void)arg;
+	coro_suspend_timeout(60);
+	return NULL;
+}
+
+static void *
+yield_f(void *arg)
+{
+	uint64_t count = *(uint64_t *)arg;
+	for (uint64_t i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+struct yield_ctx {
+	int suspended_count;
+	uint64_t duration;
+};
+
+static struct coro *suspended[suspended_count];
+
+static void *
+yield_main_f(void *arg)
+{
+	struct yield_ctx *ctx = (struct yield_ctx *)arg;
+	for (int i = 0; i < ctx->suspended_count; ++i)
+		suspended[i] = coro_new(suspend_f, NULL);
+	/* Let them all suspend. */
+	coro_yield();
+	uint64_t n = yield_count;
+	struct coro *c1 = coro_new(yield_f, &n);
+	struct coro *c2 = coro_new(yield_f, &n);
+	uint64_t start_ts = bench_now_ns();
+	coro_join(c1);
+	coro_join(c2);
+	ctx->duration = bench_now_ns() - start_ts;
+	for (int i = 0; i < ctx->suspended_count; ++i) {
+		coro_wakeup(suspended[i]);
+		coro_join(suspended[i]);
+	}
+	return NULL;
+}
+
+/** Yields per second next to the suspended coroutines. */
+static double
+bench_yield(int count)
+{
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.stack_size = 64 * 1024;
+	opts.stack_guard = false;
+	coro_sched_init_opts(&opts);
+	struct yield_ctx ctx;
+	ctx.suspended_count = count;
+	struct coro *c = coro_new(yield_main_f, &ctx);
+	coro_sched_run();
+	coro_join(c);
+	coro_sched_destroy();
+	return 2.0 * yield_count * 1000000000 / ctx.duration;
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_init(argc, argv);
+	std::vector<double> add, del, expire;
+	for (int i = 0; i < run_count; ++i) {
+		struct wheel_result res = bench_wheel();
+		add.push_back(res.add_ns);
+		del.push_back(res.del_ns);
+		expire.push_back(res.expire_ns);
+	}
+	bench_report("arm 1M timers, up to 60s", add, "ns per timer");
+	bench_report("cancel 1M timers", del, "ns per timer");
+	bench_report("expire 1M timers, tick by tick", expire, "ns per timer");
+
+	int counts[] = {0, 100, suspended_count};
+	for (int count : counts) {
+		std::vector<double> samples;
+		for (int i = 0; i < run_count; ++i)
+			samples.push_back(bench_yield(count));
+		char scenario[128];
+		snprintf(scenario, sizeof(scenario), "coro_yield() between 2 "
+			"coroutines, %d suspended with a timeout", count);
+		bench_report(scenario, samples, "switches/sec");
+	}
+	return 0;
+}
@@ -0,0 +1,398 @@
+#include "coro_ctx.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(CORO_CTX_ASM)
+
+#if defined(__APPLE__)
+#define CORO_ASM_SYM(name) "_" #name
+#define CORO_ASM_FUNC_BEGIN(name)					\
+	".text\n"							\
+	".globl " CORO_ASM_SYM(name) "\n"				\
+	".p2align 4\n"							\
+	CORO_ASM_SYM(name) ":\n"
+#define CORO_ASM_FUNC_END(name) ""
+#else
+#define CORO_ASM_SYM(name) #name
+#if defined(__x86_64__)
+#define CORO_ASM_FUNC_TYPE "@function"
+#else
+#define CORO_ASM_FUNC_TYPE "%function"
+#endif
+#define CORO_ASM_FUNC_BEGIN(name)					\
+	".pushsection .text\n"						\
+	".globl " #name "\n"						\
+	".type " #name ", " CORO_ASM_FUNC_TYPE "\n"			\
+	".p2align 4\n"							\
+	#name ":\n"
+#define CORO_ASM_FUNC_END(name)						\
+	".size " #name ", .-" #name "\n"				\
+	".popsection\n"
+#endif
+
+extern "C" void
+coro_ctx_asm_start(void);
+
+#if defined(__x86_64__)
+
+/*
+ * The frame saved on top of a suspended stack, from the lowest
+ * address:
+ *
+ *     mxcsr (4 bytes), x87 control word (4 bytes),
+ *     r15, r14, r13, r12, rbx, rbp, return address.
+ */
+enum {
+	CORO_CTX_FRAME_WORDS = 8,
+	CORO_CTX_FRAME_R13 = 3,
+	CORO_CTX_FRAME_R12 = 4,
+	CORO_CTX_FRAME_RET = 7,
+};
+
+asm(
+CORO_ASM_FUNC_BEGIN(coro_ctx_asm_swap)
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+CORO_ASM_FUNC_END(coro_ctx_asm_swap)
+/*
+ * The first 'ret' into a new context lands here with the function
+ * in r12 and its argument in r13.
+ */
+CORO_ASM_FUNC_BEGIN(coro_ctx_asm_start)
+	"	movq %r13, %rdi\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+CORO_ASM_FUNC_END(coro_ctx_asm_start)
+);
+
+static void
+coro_ctx_frame_init(uintptr_t *frame, coro_ctx_f func, void *arg)
+{
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	asm volatile("stmxcsr %0" : "=m"(mxcsr));
+	asm volatile("fnstcw %0" : "=m"(fpucw));
+	frame[0] = (uintptr_t)mxcsr | ((uintptr_t)fpucw << 32);
+	frame[CORO_CTX_FRAME_R13] = (uintptr_t)arg;
+	frame[CORO_CTX_FRAME_R12] = (uintptr_t)func;
+	frame[CORO_CTX_FRAME_RET] = (uintptr_t)coro_ctx_asm_start;
+}
+
+#elif defined(__aarch64__)
+
+/*
+ * The frame saved on top of a suspended stack, from the lowest
+ * address:
+ *
+ *     x19-x28, x29 (frame pointer), x30 (link register), d8-d15,
+ *     padding up to 16 bytes alignment.
+ */
+enum {
+	CORO_CTX_FRAME_WORDS = 22,
+	CORO_CTX_FRAME_X19 = 0,
+	CORO_CTX_FRAME_X20 = 1,
+	CORO_CTX_FRAME_X30 = 11,
+};
+
+asm(
+CORO_ASM_FUNC_BEGIN(coro_ctx_asm_swap)
+	"	sub sp, sp, #0xb0\n"
+	"	stp x19, x20, [sp, #0x00]\n"
+	"	stp x21, x22, [sp, #0x10]\n"
+	"	stp x23, x24, [sp, #0x20]\n"
+	"	stp x25, x26, [sp, #0x30]\n"
+	"	stp x27, x28, [sp, #0x40]\n"
+	"	stp x29, x30, [sp, #0x50]\n"
+	"	stp d8, d9, [sp, #0x60]\n"
+	"	stp d10, d11, [sp, #0x70]\n"
+	"	stp d12, d13, [sp, #0x80]\n"
+	"	stp d14, d15, [sp, #0x90]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0x00]\n"
+	"	ldp x21, x22, [sp, #0x10]\n"
+	"	ldp x23, x24, [sp, #0x20]\n"
+	"	ldp x25, x26, [sp, #0x30]\n"
+	"	ldp x27, x28, [sp, #0x40]\n"
+	"	ldp x29, x30, [sp, #0x50]\n"
+	"	ldp d8, d9, [sp, #0x60]\n"
+	"	ldp d10, d11, [sp, #0x70]\n"
+	"	ldp d12, d13, [sp, #0x80]\n"
+	"	ldp d14, d15, [sp, #0x90]\n"
+	"	add sp, sp, #0xb0\n"
+	"	ret\n"
+CORO_ASM_FUNC_END(coro_ctx_asm_swap)
+/*
+ * The first 'ret' into a new context lands here with the function
+ * in x19 and its argument in x20.
+ */
+CORO_ASM_FUNC_BEGIN(coro_ctx_asm_start)
+	"	mov x0, x20\n"
+	"	blr x19\n"
+	"	brk #0\n"
+CORO_ASM_FUNC_END(coro_ctx_asm_start)
+);
+
+static void
+coro_ctx_frame_init(uintptr_t *frame, coro_ctx_f func, void *arg)
+{
+	frame[CORO_CTX_FRAME_X19] = (uintptr_t)func;
+	frame[CORO_CTX_FRAME_X20] = (uintptr_t)arg;
+	frame[CORO_CTX_FRAME_X30] = (uintptr_t)coro_ctx_asm_start;
+}
+
+#else
+#error "CORO_CTX_ASM is supported only on x86-64 and aarch64"
+#endif
+
+void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_f func, void *arg)
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	uintptr_t *frame = (uintptr_t *)top - CORO_CTX_FRAME_WORDS;
+	/* Zero frame pointer terminates the backtraces. */
+	memset(frame, 0, CORO_CTX_FRAME_WORDS * sizeof(*frame));
+	coro_ctx_frame_init(frame, func, arg);
+	ctx->sp = frame;
+}
+
+const char *
+coro_ctx_backend(void)
+{
+	return "asm";
+}
+
+size_t
+coro_ctx_min_stack_size(void)
+{
+	return 0;
+}
+
+#elif defined(CORO_CTX_UCONTEXT)
+
+static void
+coro_ctx_uc_body(unsigned func_hi, unsigned func_lo, unsigned arg_hi,
+	unsigned arg_lo)
+{
+	/* makecontext() can pass only ints, pointers are split. */
+	coro_ctx_f func = (coro_ctx_f)(((uintptr_t)func_hi << 16 << 16) |
+		(uintptr_t)func_lo);
+	void *arg = (void *)(((uintptr_t)arg_hi << 16 << 16) |
+		(uintptr_t)arg_lo);
+	func(arg);
+	abort();
+}
+
+void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_f func, void *arg)
+{
+	ctx->is_fresh = true;
+	if (getcontext(&ctx->uc) != 0) {
+		printf("Error: getcontext failed\n");
+		exit(-1);
+	}
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = stack_size;
+	ctx->uc.uc_link = NULL;
+	uintptr_t f = (uintptr_t)func;
+	uintptr_t a = (uintptr_t)arg;
+	makecontext(&ctx->uc, (void (*)(void))coro_ctx_uc_body, 4,
+		(unsigned)(f >> 16 >> 16), (unsigned)f,
+		(unsigned)(a >> 16 >> 16), (unsigned)a);
+}
+
+void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (sigsetjmp(from->buf, 0) != 0)
+		return;
+	if (to->is_fresh) {
+		to->is_fresh = false;
+		setcontext(&to->uc);
+		abort();
+	}
+	siglongjmp(to->buf, 1);
+}
+
+const char *
+coro_ctx_backend(void)
+{
+	return "ucontext";
+}
+
+size_t
+coro_ctx_min_stack_size(void)
+{
+	return 0;
+}
+
+#elif defined(CORO_CTX_SIGJMP)
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#define handle_error() do {														\
+	printf("Error %s\n", strerror(errno));										\
+	exit(-1);																	\
+} while(0)
+
+/** Context being created right now, with its entry point. */
+static __thread struct coro_ctx *new_ctx = NULL;
+static __thread coro_ctx_f new_ctx_func = NULL;
+static __thread void *new_ctx_arg = NULL;
+/**
+ * Buffer, used by the context constructor to escape from the
+ * signal handler back into the constructor to rollback
+ * sigaltstack etc.
+ */
+static __thread sigjmp_buf start_point;
+/**
+ * The signal handler is global for the process, so only one
+ * thread at a time can create a context.
+ */
+static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The core part of the context creation - this signal handler
+ * runs on a separate stack using sigaltstack. At invocation it
+ * remembers its current context and jumps back to the context
+ * constructor. Later the execution continues from here.
+ */
+static void
+coro_ctx_sig_body(int signum)
+{
+	(void)signum;
+	struct coro_ctx *ctx = new_ctx;
+	coro_ctx_f func = new_ctx_func;
+	void *arg = new_ctx_arg;
+	new_ctx = NULL;
+	/*
+	 * On invocation jump back to the constructor right after
+	 * remembering the context.
+	 */
+	if (sigsetjmp(ctx->buf, 0) == 0)
+		siglongjmp(start_point, 1);
+	/*
+	 * If the execution is here, then the context is entered
+	 * for the first time.
+	 */
+	func(arg);
+	abort();
+}
+
+void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_f func, void *arg)
+{
+	assert(stack_size >= (size_t)SIGSTKSZ);
+	/*
+	 * SIGUSR2 is used. First of all, block new signals to be
+	 * able to set a new handler.
+	 */
+	sigset_t news, olds, suss;
+	sigemptyset(&news);
+	sigaddset(&news, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+		handle_error();
+	pthread_mutex_lock(&create_lock);
+	/*
+	 * New handler should jump onto a new stack and remember
+	 * that position. Afterwards the stack is disabled and
+	 * becomes dedicated to that single context.
+	 */
+	struct sigaction newsa, oldsa;
+	newsa.sa_handler = coro_ctx_sig_body;
+	newsa.sa_flags = SA_ONSTACK;
+	sigemptyset(&newsa.sa_mask);
+	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
+		handle_error();
+	/* Install that new stack. */
+	stack_t oldst, newst;
+	newst.ss_sp = stack;
+	newst.ss_size = stack_size;
+	newst.ss_flags = 0;
+	if (sigaltstack(&newst, &oldst) != 0)
+		handle_error();
+
+	/* Jump onto the stack and remember its position. */
+	assert(new_ctx == NULL);
+	new_ctx = ctx;
+	new_ctx_func = func;
+	new_ctx_arg = arg;
+	sigemptyset(&suss);
+	if (sigsetjmp(start_point, 1) == 0) {
+		raise(SIGUSR2);
+		while (new_ctx != NULL)
+			sigsuspend(&suss);
+	}
+	assert(new_ctx == NULL);
+
+	/*
+	 * Return the old stack, unblock SIGUSR2. In other words,
+	 * rollback all global changes. The newly created stack
+	 * now is remembered only by the new context, and can be
+	 * used by it only.
+	 */
+	if (sigaltstack(NULL, &newst) != 0)
+		handle_error();
+	newst.ss_flags = SS_DISABLE;
+	if (sigaltstack(&newst, NULL) != 0)
+		handle_error();
+	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
+	    sigaltstack(&oldst, NULL) != 0)
+		handle_error();
+	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
+		handle_error();
+	pthread_mutex_unlock(&create_lock);
+	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+		handle_error();
+}
+
+void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
+}
+
+const char *
+coro_ctx_backend(void)
+{
+	return "sigjmp";
+}
+
+/** The stack is a signal stack at first, it has a minimum. */
+size_t
+coro_ctx_min_stack_size(void)
+{
+	return (size_t)SIGSTKSZ;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Machine context of a coroutine and the way to switch between
+ * such contexts. The backend is selected at build time:
+ *
+ * - CORO_CTX_ASM - hand-written swap of the callee-saved
+ *   registers and the stack pointer. Available on x86-64 and
+ *   aarch64. Neither creation nor switch do any syscalls.
+ * - CORO_CTX_UCONTEXT - makecontext() to bootstrap a new stack,
+ *   then sigsetjmp()/siglongjmp() without the signal mask for the
+ *   switches. Portable fallback, a syscall only on the first
+ *   entry into a coroutine.
+ * - CORO_CTX_SIGJMP - the original sigaltstack() + SIGUSR2
+ *   bootstrap. Kept for comparison, it does a dozen of syscalls
+ *   per coroutine creation.
+ *
+ * When nothing is specified, the asm backend is used where it
+ * exists, and ucontext otherwise.
+ */
+#if !defined(CORO_CTX_ASM) && !defined(CORO_CTX_UCONTEXT) && \
+	!defined(CORO_CTX_SIGJMP)
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CORO_CTX_ASM 1
+#else
+#define CORO_CTX_UCONTEXT 1
+#endif
+#endif
+
+#if defined(CORO_CTX_ASM)
+
+struct coro_ctx {
+	/**
+	 * Stack pointer of the suspended context. The registers
+	 * are saved right on its stack.
+	 */
+	void *sp;
+};
+
+extern "C" void
+coro_ctx_asm_swap(void **from_sp, void *to_sp);
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	coro_ctx_asm_swap(&from->sp, to->sp);
+}
+
+#else /* !CORO_CTX_ASM */
+
+#include <setjmp.h>
+#if defined(CORO_CTX_UCONTEXT)
+#include <ucontext.h>
+#endif
+
+struct coro_ctx {
+	/** Registers of the suspended context. */
+	sigjmp_buf buf;
+#if defined(CORO_CTX_UCONTEXT)
+	/** True if the context was never entered yet. */
+	bool is_fresh;
+	/** Bootstrap context, used for the first entry only. */
+	ucontext_t uc;
+#endif
+};
+
+/**
+ * Save the current context into @a from and continue the one
+ * stored in @a to. Returns when someone switches back to
+ * @a from.
+ */
+void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to);
+
+#endif /* !CORO_CTX_ASM */
+
+typedef void (*coro_ctx_f)(void *);
+
+/**
+ * Prepare a context which on the first switch into it is going
+ * to call @a func with @a arg on the given stack. The function
+ * must never return.
+ */
+void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_f func, void *arg);
+
+/** Name of the backend the library is built with. */
+const char *
+coro_ctx_backend(void);
+
+/** Smallest stack the backend can run a context on. */
+size_t
+coro_ctx_min_stack_size(void);
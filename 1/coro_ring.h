@@ -0,0 +1,124 @@
+#pragma once
+
+#include "corobus.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Bounded FIFO of bus messages on an array of a power of two
+ * size, allocated once. The read and write positions only grow,
+ * and are masked on each access. So the full and the empty rings
+ * differ without a spare slot, and a batch is at most two
+ * contiguous pieces.
+ */
+struct coro_ring {
+	struct coro_bus_msg *data;
+	/** Capacity - 1. */
+	size_t mask;
+	/** Position of the oldest message. */
+	size_t head;
+	/** Position of the next message. */
+	size_t tail;
+};
+
+/** Create a ring for at least the given number of messages. */
+static inline void
+coro_ring_create(struct coro_ring *ring, size_t capacity)
+{
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	ring->data = (struct coro_bus_msg *)malloc(size * sizeof(ring->data[0]));
+	if (ring->data == NULL)
+		abort();
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+static inline void
+coro_ring_destroy(struct coro_ring *ring)
+{
+	free(ring->data);
+}
+
+static inline size_t
+coro_ring_capacity(const struct coro_ring *ring)
+{
+	return ring->mask + 1;
+}
+
+static inline size_t
+coro_ring_size(const struct coro_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+static inline bool
+coro_ring_is_empty(const struct coro_ring *ring)
+{
+	return ring->tail == ring->head;
+}
+
+/**
+ * Slot for a new message at the end. It is a part of the ring
+ * right away. The ring must not be full.
+ */
+static inline struct coro_bus_msg *
+coro_ring_push(struct coro_ring *ring)
+{
+	assert(coro_ring_size(ring) < coro_ring_capacity(ring));
+	return &ring->data[ring->tail++ & ring->mask];
+}
+
+/**
+ * Take the oldest message. Its slot is valid until the next push.
+ * The ring must not be empty.
+ */
+static inline struct coro_bus_msg *
+coro_ring_pop(struct coro_ring *ring)
+{
+	assert(!coro_ring_is_empty(ring));
+	return &ring->data[ring->head++ & ring->mask];
+}
+
+/** The message at the given offset from the oldest one. */
+static inline struct coro_bus_msg *
+coro_ring_at(struct coro_ring *ring, size_t offset)
+{
+	assert(offset < coro_ring_size(ring));
+	return &ring->data[(ring->head + offset) & ring->mask];
+}
+
+/** Append count messages. They must fit. */
+static inline void
+coro_ring_push_n(struct coro_ring *ring, const struct coro_bus_msg *msgs,
+	size_t count)
+{
+	assert(coro_ring_size(ring) + count <= coro_ring_capacity(ring));
+	size_t pos = ring->tail & ring->mask;
+	size_t first = coro_ring_capacity(ring) - pos;
+	if (first > count)
+		first = count;
+	memcpy(&ring->data[pos], msgs, first * sizeof(msgs[0]));
+	memcpy(ring->data, msgs + first, (count - first) * sizeof(msgs[0]));
+	ring->tail += count;
+}
+
+/** Take the count oldest messages. There must be enough. */
+static inline void
+coro_ring_pop_n(struct coro_ring *ring, struct coro_bus_msg *msgs,
+	size_t count)
+{
+	assert(count <= coro_ring_size(ring));
+	size_t pos = ring->head & ring->mask;
+	size_t first = coro_ring_capacity(ring) - pos;
+	if (first > count)
+		first = count;
+	memcpy(msgs, &ring->data[pos], first * sizeof(msgs[0]));
+	memcpy(msgs + first, ring->data, (count - first) * sizeof(msgs[0]));
+	ring->head += count;
+}
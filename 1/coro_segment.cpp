@@ -0,0 +1,295 @@
+#include "coro_segment.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define handle_error() do {														\
+	printf("Error %s\n", strerror(errno));										\
+	exit(-1);																	\
+} while(0)
+
+/** Magic of the format, with its version in the last byte. */
+static const char coro_segment_magic[8] = {'C', 'O', 'R', 'O', 'S', 'E', 'G',
+	1};
+
+/** The first bytes of the file. */
+struct coro_segment_header {
+	char magic[8];
+	/** Size of the records area. */
+	uint64_t capacity;
+	/** Committed position of the next record to read. */
+	uint64_t read_pos;
+	/** Committed end of the records. */
+	uint64_t write_pos;
+};
+
+static struct coro_segment_header *
+coro_segment_header(struct coro_segment *seg)
+{
+	return (struct coro_segment_header *)seg->map;
+}
+
+/** Sync the bytes of the mapping, on the page boundaries. */
+static void
+coro_segment_sync(struct coro_segment *seg, size_t begin, size_t end)
+{
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	begin &= ~(page_size - 1);
+	if (end > begin && msync(seg->map + begin, end - begin, MS_SYNC) != 0)
+		handle_error();
+}
+
+/** Sync the records between the positions. */
+static void
+coro_segment_sync_records(struct coro_segment *seg, uint64_t begin,
+	uint64_t end)
+{
+	size_t base = CORO_SEGMENT_HEADER_SIZE;
+	if (end - begin >= seg->capacity) {
+		coro_segment_sync(seg, base, base + seg->capacity);
+		return;
+	}
+	size_t first = begin % seg->capacity;
+	size_t last = end % seg->capacity;
+	if (first < last) {
+		coro_segment_sync(seg, base + first, base + last);
+		return;
+	}
+	coro_segment_sync(seg, base + first, base + seg->capacity);
+	coro_segment_sync(seg, base, base + last);
+}
+
+static int
+coro_segment_map(struct coro_segment *seg, size_t size)
+{
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		seg->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	seg->map = (uint8_t *)map;
+	seg->map_size = size;
+	return 0;
+}
+
+/** Check the header, and that the records after the reader are whole. */
+static bool
+coro_segment_is_valid(struct coro_segment *seg)
+{
+	struct coro_segment_header *header = coro_segment_header(seg);
+	if (memcmp(header->magic, coro_segment_magic,
+		   sizeof(header->magic)) != 0)
+		return false;
+	uint64_t capacity = header->capacity;
+	if (capacity == 0 || capacity % CORO_SEGMENT_ALIGN != 0 ||
+	    capacity > seg->map_size - CORO_SEGMENT_HEADER_SIZE)
+		return false;
+	uint64_t read_pos = header->read_pos;
+	uint64_t write_pos = header->write_pos;
+	if (read_pos > write_pos || write_pos - read_pos > capacity ||
+	    read_pos % CORO_SEGMENT_ALIGN != 0)
+		return false;
+	seg->capacity = capacity;
+	for (uint64_t pos = read_pos; pos < write_pos;) {
+		size_t len = coro_segment_record_len(seg, pos);
+		if (len > write_pos - pos)
+			return false;
+		pos += coro_segment_record_size(len);
+		if (pos > write_pos)
+			return false;
+	}
+	return true;
+}
+
+int
+coro_segment_open(struct coro_segment *seg, const char *path, size_t size)
+{
+	seg->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (seg->fd < 0)
+		return -1;
+	struct stat st;
+	struct coro_segment_header *header;
+	if (fstat(seg->fd, &st) != 0)
+		goto error;
+	if (st.st_size == 0) {
+		uint64_t capacity = size < 64 ? 64 : size;
+		capacity = (capacity + CORO_SEGMENT_ALIGN - 1) &
+			~(uint64_t)(CORO_SEGMENT_ALIGN - 1);
+		size_t file_size = CORO_SEGMENT_HEADER_SIZE + capacity;
+		if (ftruncate(seg->fd, file_size) != 0 ||
+		    coro_segment_map(seg, file_size) != 0)
+			goto error;
+		header = coro_segment_header(seg);
+		memcpy(header->magic, coro_segment_magic, sizeof(header->magic));
+		header->capacity = capacity;
+		header->read_pos = 0;
+		header->write_pos = 0;
+		coro_segment_sync(seg, 0, sizeof(*header));
+	} else {
+		if ((size_t)st.st_size <= CORO_SEGMENT_HEADER_SIZE) {
+			errno = EINVAL;
+			goto error;
+		}
+		if (coro_segment_map(seg, st.st_size) != 0)
+			goto error;
+		if (!coro_segment_is_valid(seg)) {
+			munmap(seg->map, seg->map_size);
+			errno = EINVAL;
+			goto error;
+		}
+	}
+	header = coro_segment_header(seg);
+	seg->capacity = header->capacity;
+	seg->read_pos = header->read_pos;
+	seg->write_pos = header->write_pos;
+	seg->synced_pos = seg->write_pos;
+	seg->committed_read_pos = seg->read_pos;
+	seg->append_count = 0;
+	seg->is_syncing = false;
+	return 0;
+error:
+	int err = errno;
+	close(seg->fd);
+	errno = err;
+	return -1;
+}
+
+void
+coro_segment_close(struct coro_segment *seg)
+{
+	coro_segment_commit(seg);
+	if (munmap(seg->map, seg->map_size) != 0 || close(seg->fd) != 0)
+		handle_error();
+}
+
+void
+coro_segment_commit(struct coro_segment *seg)
+{
+	if (seg->write_pos > seg->synced_pos) {
+		coro_segment_sync_records(seg, seg->synced_pos, seg->write_pos);
+		seg->synced_pos = seg->write_pos;
+	}
+	/* The positions are in one sector, so they are written together. */
+	struct coro_segment_header *header = coro_segment_header(seg);
+	header->read_pos = seg->read_pos;
+	header->write_pos = seg->write_pos;
+	coro_segment_sync(seg, 0, sizeof(*header));
+	seg->committed_read_pos = seg->read_pos;
+	seg->append_count = 0;
+}
+
+bool
+coro_segment_sync_begin(struct coro_segment *seg,
+	struct coro_segment_sync *sync)
+{
+	if (seg->is_syncing)
+		return false;
+	sync->fd = dup(seg->fd);
+	if (sync->fd < 0)
+		handle_error();
+	sync->read_pos = seg->read_pos;
+	sync->write_pos = seg->write_pos;
+	seg->is_syncing = true;
+	seg->append_count = 0;
+	return true;
+}
+
+void
+coro_segment_sync_flush(struct coro_segment_sync *sync)
+{
+	/* The pages written via the mapping are flushed with the file. */
+	if (fdatasync(sync->fd) != 0)
+		handle_error();
+}
+
+bool
+coro_segment_sync_header(struct coro_segment *seg,
+	struct coro_segment_sync *sync)
+{
+	if (sync->write_pos > seg->synced_pos)
+		seg->synced_pos = sync->write_pos;
+	struct coro_segment_header *header = coro_segment_header(seg);
+	/* A commit started later has the positions not older. */
+	if (header->write_pos >= sync->write_pos &&
+	    header->read_pos >= sync->read_pos)
+		return false;
+	header->read_pos = sync->read_pos;
+	header->write_pos = sync->write_pos;
+	return true;
+}
+
+void
+coro_segment_sync_end(struct coro_segment *seg,
+	struct coro_segment_sync *sync)
+{
+	/* Only now the read records can be overwritten. */
+	if (sync->read_pos > seg->committed_read_pos)
+		seg->committed_read_pos = sync->read_pos;
+	seg->is_syncing = false;
+}
+
+void
+coro_segment_sync_close(struct coro_segment_sync *sync)
+{
+	if (close(sync->fd) != 0)
+		handle_error();
+}
+
+/**
+ * Double the records area until the live records and the new one
+ * fit. A record moves when its position maps to the new part, and
+ * it is only copied there. The old copy is the one in use until
+ * the new capacity is committed.
+ */
+static void
+coro_segment_grow(struct coro_segment *seg, uint64_t size)
+{
+	uint64_t old_capacity = seg->capacity;
+	uint64_t capacity = old_capacity * 2;
+	uint64_t live = seg->write_pos - seg->committed_read_pos;
+	while (live + size > capacity)
+		capacity *= 2;
+	size_t file_size = CORO_SEGMENT_HEADER_SIZE + capacity;
+	if (munmap(seg->map, seg->map_size) != 0)
+		handle_error();
+	if (file_size > seg->map_size && ftruncate(seg->fd, file_size) != 0)
+		handle_error();
+	if (coro_segment_map(seg, file_size > seg->map_size ? file_size :
+			     seg->map_size) != 0)
+		handle_error();
+	uint8_t *area = seg->map + CORO_SEGMENT_HEADER_SIZE;
+	for (uint64_t pos = seg->committed_read_pos; pos < seg->write_pos;) {
+		uint64_t from = pos % old_capacity;
+		uint64_t to = pos % capacity;
+		uint64_t chunk = seg->write_pos - pos;
+		if (chunk > old_capacity - from)
+			chunk = old_capacity - from;
+		if (chunk > capacity - to)
+			chunk = capacity - to;
+		if (from != to)
+			memcpy(area + to, area + from, chunk);
+		pos += chunk;
+	}
+	seg->capacity = capacity;
+	coro_segment_sync(seg, CORO_SEGMENT_HEADER_SIZE,
+		CORO_SEGMENT_HEADER_SIZE + capacity);
+	seg->synced_pos = seg->write_pos;
+	struct coro_segment_header *header = coro_segment_header(seg);
+	header->capacity = capacity;
+	coro_segment_sync(seg, 0, sizeof(*header));
+}
+
+void
+coro_segment_reserve(struct coro_segment *seg, uint64_t size)
+{
+	/* The read records are free after their position is committed. */
+	coro_segment_commit(seg);
+	if (seg->write_pos + size - seg->committed_read_pos > seg->capacity)
+		coro_segment_grow(seg, size);
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+enum {
+	/** The file header takes the first bytes, the records follow. */
+	CORO_SEGMENT_HEADER_SIZE = 4096,
+	/** Records are aligned on the size of their length field. */
+	CORO_SEGMENT_ALIGN = 8,
+};
+
+/**
+ * A file of records, mapped into memory. A record is its length
+ * and the bytes, so an append is a memcpy() into the mapping. The
+ * positions only grow, and wrap around the records area of the
+ * file. The file header keeps the committed positions of the
+ * writer and the reader. Only a commit makes the records and the
+ * reader position durable, and one commit syncs all the records
+ * appended before it at once. After a restart the records between
+ * the committed positions are there to read again.
+ *
+ * An append never overwrites the records after the committed
+ * reader position, even if they are read already. When there is
+ * no room, the segment is committed to free the read ones, and
+ * grows if that is not enough. The growth copies the records to
+ * the new part of the file only, and they are found there after
+ * the commit of the new size. So a crash in the middle leaves the
+ * old segment intact.
+ */
+struct coro_segment {
+	int fd;
+	/** The mapping of the whole file. */
+	uint8_t *map;
+	size_t map_size;
+	/** Size of the records area, a multiple of the alignment. */
+	uint64_t capacity;
+	/** Position of the next record to read. */
+	uint64_t read_pos;
+	/** Position of the next record to append. */
+	uint64_t write_pos;
+	/** The records before this position are synced to the disk. */
+	uint64_t synced_pos;
+	/** The reader position in the file header. */
+	uint64_t committed_read_pos;
+	/** Records appended since the last commit. */
+	unsigned append_count;
+	/** A commit by the steps of coro_segment_sync is going on. */
+	bool is_syncing;
+};
+
+/**
+ * A commit done in steps, so the slow disk syncs don't need the
+ * segment. The positions are taken first, then the records are
+ * synced through a duplicate of the file descriptor. Then the
+ * header is updated, and synced the same way. Meanwhile the
+ * segment can be appended to, read, committed, grown and closed.
+ * One such commit can go at a time.
+ */
+struct coro_segment_sync {
+	/** Duplicate of the descriptor of the file. */
+	int fd;
+	uint64_t read_pos;
+	uint64_t write_pos;
+};
+
+/**
+ * Open the segment file, or create it with room for the given
+ * number of bytes of records. Returns 0 on success. Otherwise -1,
+ * and errno is set. EINVAL means the file is not a valid segment.
+ */
+int
+coro_segment_open(struct coro_segment *seg, const char *path, size_t size);
+
+/** Commit, and close the file. It stays on the disk. */
+void
+coro_segment_close(struct coro_segment *seg);
+
+/**
+ * Sync the appended records, then the positions. After a crash
+ * the segment is the same as after the last commit.
+ */
+void
+coro_segment_commit(struct coro_segment *seg);
+
+/**
+ * Take the positions to commit. Returns false if another commit
+ * by the steps is going on, then there is nothing to do.
+ */
+bool
+coro_segment_sync_begin(struct coro_segment *seg,
+	struct coro_segment_sync *sync);
+
+/** Sync the file to the disk. Doesn't touch the segment. */
+void
+coro_segment_sync_flush(struct coro_segment_sync *sync);
+
+/**
+ * Write the positions into the header, after the records are
+ * flushed. Returns true if it has to be flushed again then. False
+ * means a newer commit has done it already.
+ */
+bool
+coro_segment_sync_header(struct coro_segment *seg,
+	struct coro_segment_sync *sync);
+
+/** Finish the commit, after the header is flushed. */
+void
+coro_segment_sync_end(struct coro_segment *seg,
+	struct coro_segment_sync *sync);
+
+/** Close the duplicate descriptor. The segment can be gone by now. */
+void
+coro_segment_sync_close(struct coro_segment_sync *sync);
+
+/** Make room for a record of the given size. */
+void
+coro_segment_reserve(struct coro_segment *seg, uint64_t size);
+
+/** Size of a record of the given length in the file. */
+static inline uint64_t
+coro_segment_record_size(size_t len)
+{
+	return (sizeof(uint64_t) + len + CORO_SEGMENT_ALIGN - 1) &
+		~(uint64_t)(CORO_SEGMENT_ALIGN - 1);
+}
+
+static inline uint8_t *
+coro_segment_data(struct coro_segment *seg, uint64_t pos)
+{
+	return seg->map + CORO_SEGMENT_HEADER_SIZE + pos % seg->capacity;
+}
+
+/**
+ * Copy the bytes from the given position. A record can wrap
+ * around the end of the area, but its length field can't, as it
+ * is aligned.
+ */
+static inline void
+coro_segment_read(struct coro_segment *seg, uint64_t pos, void *buf,
+	size_t len)
+{
+	size_t first = seg->capacity - pos % seg->capacity;
+	if (first > len)
+		first = len;
+	memcpy(buf, coro_segment_data(seg, pos), first);
+	memcpy((uint8_t *)buf + first, coro_segment_data(seg, 0), len - first);
+}
+
+static inline void
+coro_segment_write(struct coro_segment *seg, uint64_t pos, const void *buf,
+	size_t len)
+{
+	size_t first = seg->capacity - pos % seg->capacity;
+	if (first > len)
+		first = len;
+	memcpy(coro_segment_data(seg, pos), buf, first);
+	memcpy(coro_segment_data(seg, 0), (const uint8_t *)buf + first,
+		len - first);
+}
+
+/** Append a record. Not durable until the next commit. */
+static inline void
+coro_segment_append(struct coro_segment *seg, const void *data, size_t len)
+{
+	uint64_t size = coro_segment_record_size(len);
+	if (seg->write_pos + size - seg->committed_read_pos > seg->capacity)
+		coro_segment_reserve(seg, size);
+	uint64_t len64 = len;
+	memcpy(coro_segment_data(seg, seg->write_pos), &len64, sizeof(len64));
+	coro_segment_write(seg, seg->write_pos + sizeof(len64), data, len);
+	seg->write_pos += size;
+	++seg->append_count;
+}
+
+/** Length of the record at the given position. */
+static inline size_t
+coro_segment_record_len(struct coro_segment *seg, uint64_t pos)
+{
+	uint64_t len64;
+	memcpy(&len64, coro_segment_data(seg, pos), sizeof(len64));
+	return (size_t)len64;
+}
+
+/** Mark the oldest record of the given length as read. */
+static inline void
+coro_segment_consume(struct coro_segment *seg, size_t len)
+{
+	seg->read_pos += coro_segment_record_size(len);
+}
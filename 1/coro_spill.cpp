@@ -0,0 +1,156 @@
+#include "coro_spill.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define handle_error() do {														\
+	printf("Error %s\n", strerror(errno));										\
+	exit(-1);																	\
+} while(0)
+
+int
+coro_spill_create(struct coro_spill *spill, const char *dir, size_t capacity)
+{
+	char path[4096];
+	int rc = snprintf(path, sizeof(path), "%s/coro_bus_spill.XXXXXX", dir);
+	if (rc < 0 || (size_t)rc >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	spill->fd = mkstemp(path);
+	if (spill->fd < 0)
+		return -1;
+	if (unlink(path) != 0) {
+		int err = errno;
+		close(spill->fd);
+		errno = err;
+		return -1;
+	}
+	spill->capacity = capacity;
+	spill->head = 0;
+	spill->tail = 0;
+	spill->flushed = 0;
+	spill->read_begin = 0;
+	spill->read_end = 0;
+	return 0;
+}
+
+void
+coro_spill_destroy(struct coro_spill *spill)
+{
+	if (close(spill->fd) != 0)
+		handle_error();
+}
+
+/** Offset of the message position in the file. */
+static off_t
+coro_spill_offset(struct coro_spill *spill, uint64_t pos)
+{
+	return (off_t)(pos % spill->capacity * sizeof(struct coro_bus_msg));
+}
+
+/**
+ * Write or read the messages at the position, in two pieces if
+ * they wrap around the end of the file.
+ */
+static void
+coro_spill_io(struct coro_spill *spill, uint64_t pos,
+	struct coro_bus_msg *msgs, size_t count, bool is_write)
+{
+	while (count > 0) {
+		size_t piece = spill->capacity - pos % spill->capacity;
+		if (piece > count)
+			piece = count;
+		size_t size = piece * sizeof(msgs[0]);
+		off_t offset = coro_spill_offset(spill, pos);
+		ssize_t rc = is_write ? pwrite(spill->fd, msgs, size, offset) :
+			pread(spill->fd, msgs, size, offset);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			handle_error();
+		}
+		if ((size_t)rc != size) {
+			/* Partial I/O, retry the rest of the piece. */
+			piece = (size_t)rc / sizeof(msgs[0]);
+			if (piece == 0) {
+				errno = EIO;
+				handle_error();
+			}
+		}
+		pos += piece;
+		msgs += piece;
+		count -= piece;
+	}
+}
+
+/** Write the collected chunk of messages to the file. */
+static void
+coro_spill_flush(struct coro_spill *spill)
+{
+	/* The ones popped from the chunk already are not needed. */
+	uint64_t begin = spill->head > spill->flushed ? spill->head :
+		spill->flushed;
+	coro_spill_io(spill, begin, &spill->write_buf[begin - spill->flushed],
+		spill->tail - begin, true);
+	spill->flushed = spill->tail;
+}
+
+/** Read the chunk of messages from the head position. */
+static void
+coro_spill_fill(struct coro_spill *spill)
+{
+	size_t count = spill->flushed - spill->head;
+	if (count > CORO_SPILL_CHUNK)
+		count = CORO_SPILL_CHUNK;
+	coro_spill_io(spill, spill->head, spill->read_buf, count, false);
+	spill->read_begin = spill->head;
+	spill->read_end = spill->head + count;
+}
+
+void
+coro_spill_push(struct coro_spill *spill, const struct coro_bus_msg *msg)
+{
+	if (spill->tail - spill->flushed == CORO_SPILL_CHUNK)
+		coro_spill_flush(spill);
+	spill->write_buf[spill->tail++ - spill->flushed] = *msg;
+}
+
+void
+coro_spill_push_n(struct coro_spill *spill, const unsigned *values,
+	const struct coro_bus_msg *msgs, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (values == NULL) {
+			coro_spill_push(spill, &msgs[i]);
+			continue;
+		}
+		struct coro_bus_msg msg;
+		msg.len = sizeof(values[i]);
+		memcpy(msg.data, &values[i], sizeof(values[i]));
+		coro_spill_push(spill, &msg);
+	}
+}
+
+void
+coro_spill_pop(struct coro_spill *spill, struct coro_bus_msg *msg)
+{
+	if (spill->head >= spill->flushed) {
+		*msg = spill->write_buf[spill->head++ - spill->flushed];
+	} else {
+		if (spill->head >= spill->read_end)
+			coro_spill_fill(spill);
+		*msg = spill->read_buf[spill->head++ - spill->read_begin];
+	}
+	if (spill->head == spill->tail) {
+		/* Empty, start over from the beginning of the buffers. */
+		spill->head = 0;
+		spill->tail = 0;
+		spill->flushed = 0;
+		spill->read_begin = 0;
+		spill->read_end = 0;
+	}
+}
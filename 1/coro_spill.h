@@ -0,0 +1,79 @@
+#pragma once
+
+#include "corobus.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	/** Messages written or read with one system call. */
+	CORO_SPILL_CHUNK = 256,
+};
+
+/**
+ * FIFO of bus messages in a temporary file, for the ones which
+ * don't fit into the memory of a channel. The file is a ring of
+ * up to the given number of messages. The appended messages are
+ * collected in a chunk and written at once when it is full, and
+ * are read back a chunk at a time. So the memory is two chunks
+ * however many messages there are, and the file is accessed
+ * sequentially. The messages which are popped before their chunk
+ * is written never reach the file. The file is deleted right
+ * after creation, and is gone with its descriptor.
+ */
+struct coro_spill {
+	int fd;
+	/** Max messages in the file. */
+	size_t capacity;
+	/** Position of the oldest message. */
+	uint64_t head;
+	/** Position of the next message. */
+	uint64_t tail;
+	/** The messages before this position are in the file. */
+	uint64_t flushed;
+	/** The messages from the flushed position to the tail. */
+	struct coro_bus_msg write_buf[CORO_SPILL_CHUNK];
+	/** The messages read from the file, and their positions. */
+	struct coro_bus_msg read_buf[CORO_SPILL_CHUNK];
+	uint64_t read_begin;
+	uint64_t read_end;
+};
+
+/**
+ * Create a spill for the given number of messages, in a new file
+ * in the directory. Returns 0 on success. Otherwise -1, and errno
+ * is set.
+ */
+int
+coro_spill_create(struct coro_spill *spill, const char *dir, size_t capacity);
+
+void
+coro_spill_destroy(struct coro_spill *spill);
+
+static inline size_t
+coro_spill_size(const struct coro_spill *spill)
+{
+	return spill->tail - spill->head;
+}
+
+static inline bool
+coro_spill_is_empty(const struct coro_spill *spill)
+{
+	return spill->tail == spill->head;
+}
+
+/** Append a message. The spill must not be full. */
+void
+coro_spill_push(struct coro_spill *spill, const struct coro_bus_msg *msg);
+
+/**
+ * Append count messages, either the ready ones or the unsigned
+ * values. Only one of the sources is not NULL. They must fit.
+ */
+void
+coro_spill_push_n(struct coro_spill *spill, const unsigned *values,
+	const struct coro_bus_msg *msgs, size_t count);
+
+/** Take the oldest message. The spill must not be empty. */
+void
+coro_spill_pop(struct coro_spill *spill, struct coro_bus_msg *msg);
@@ -0,0 +1,162 @@
+#include "coro_stack.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define handle_error() do {														\
+	printf("Error %s\n", strerror(errno));										\
+	exit(-1);																	\
+} while(0)
+
+/** The descriptor occupies the top bytes of its own page. */
+static const size_t coro_stack_desc_size =
+	(sizeof(struct coro_stack) + 63) & ~(size_t)63;
+
+static size_t
+coro_stack_round_up(size_t size, size_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+void
+coro_stack_pool_create(struct coro_stack_pool *pool, size_t cache_limit,
+	bool use_guard, bool use_madvise)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0)
+		page_size = 4096;
+	pool->page_size = page_size;
+	pool->use_guard = use_guard;
+	pool->use_madvise = use_madvise;
+	pool->cache_limit = cache_limit;
+	pool->cache_count = 0;
+	pool->used_count = 0;
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i)
+		rlist_create(&pool->free_lists[i]);
+}
+
+static void
+coro_stack_unmap(struct coro_stack *stack)
+{
+	if (munmap(stack->map, stack->map_size) != 0)
+		handle_error();
+}
+
+void
+coro_stack_pool_destroy(struct coro_stack_pool *pool)
+{
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		while (!rlist_empty(&pool->free_lists[i])) {
+			struct coro_stack *stack = rlist_shift_entry(
+				&pool->free_lists[i], struct coro_stack, link);
+			assert(pool->cache_count > 0);
+			--pool->cache_count;
+			coro_stack_unmap(stack);
+		}
+	}
+	assert(pool->cache_count == 0);
+}
+
+/**
+ * Size class able to fit the given number of bytes of the body.
+ * -1 if none is big enough.
+ */
+static int
+coro_stack_class(size_t size)
+{
+	size_t class_size = (size_t)1 << CORO_STACK_CLASS_MIN_LOG;
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		if (size <= class_size)
+			return i;
+		class_size <<= 1;
+	}
+	return -1;
+}
+
+static struct coro_stack *
+coro_stack_map(struct coro_stack_pool *pool, size_t size, int size_class)
+{
+	size_t body_size;
+	if (size_class >= 0)
+		body_size = (size_t)1 << (CORO_STACK_CLASS_MIN_LOG + size_class);
+	else
+		body_size = coro_stack_round_up(size, pool->page_size);
+	size_t guard_size = pool->use_guard ? pool->page_size : 0;
+	/*
+	 * The descriptor is in a page above the body, so a stack of
+	 * a power of 2 size doesn't take the next class.
+	 */
+	size_t desc_page_size = coro_stack_round_up(coro_stack_desc_size,
+		pool->page_size);
+	size_t map_size = guard_size + body_size + desc_page_size;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	if (guard_size != 0 && mprotect(map, guard_size, PROT_NONE) != 0)
+		handle_error();
+	uint8_t *top = (uint8_t *)map + map_size;
+	struct coro_stack *stack =
+		(struct coro_stack *)(top - coro_stack_desc_size);
+	stack->map = (uint8_t *)map;
+	stack->map_size = map_size;
+	stack->base = stack->map + guard_size;
+	stack->size = (uint8_t *)stack - stack->base;
+	stack->size_class = size_class;
+	rlist_create(&stack->link);
+	return stack;
+}
+
+struct coro_stack *
+coro_stack_pool_get(struct coro_stack_pool *pool, size_t size)
+{
+	int size_class = coro_stack_class(size);
+	struct coro_stack *stack;
+	if (size_class >= 0 && !rlist_empty(&pool->free_lists[size_class])) {
+		stack = rlist_shift_entry(&pool->free_lists[size_class],
+			struct coro_stack, link);
+		assert(pool->cache_count > 0);
+		--pool->cache_count;
+	} else {
+		stack = coro_stack_map(pool, size, size_class);
+	}
+	assert(stack->size >= size);
+	++pool->used_count;
+	return stack;
+}
+
+void
+coro_stack_pool_put(struct coro_stack_pool *pool, struct coro_stack *stack)
+{
+	--pool->used_count;
+	if (stack->size_class < 0 || pool->cache_count >= pool->cache_limit) {
+		coro_stack_unmap(stack);
+		return;
+	}
+#ifdef MADV_DONTNEED
+	if (pool->use_madvise) {
+		/*
+		 * Keep only the top page with the descriptor. The rest
+		 * is going to be committed again on demand.
+		 */
+		uint8_t *end = (uint8_t *)((uintptr_t)stack &
+			~(uintptr_t)(pool->page_size - 1));
+		if (end > stack->base &&
+		    madvise(stack->base, end - stack->base, MADV_DONTNEED) != 0)
+			handle_error();
+	}
+#endif
+	rlist_add_entry(&pool->free_lists[stack->size_class], stack, link);
+	++pool->cache_count;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "rlist.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	/** Log2 of the smallest stack size class, 16KB. */
+	CORO_STACK_CLASS_MIN_LOG = 14,
+	/** Classes are powers of 2 from 16KB to 1GB. */
+	CORO_STACK_CLASS_COUNT = 17,
+};
+
+/**
+ * Coroutine stack. It is mapped with mmap() and is committed by
+ * the kernel lazily, page by page, as the coroutine goes deeper.
+ * The lowest page is a PROT_NONE guard, so an overflow crashes
+ * instead of corrupting the neighbour memory. The descriptor
+ * itself is stored in the top bytes of the mapping, in a page of
+ * its own above the body. So the body is exactly of the size
+ * class, and a stack of a power of 2 size fits its class.
+ */
+struct coro_stack {
+	/** Lowest usable address, right above the guard page. */
+	uint8_t *base;
+	/** Usable size, from the base up to the descriptor. */
+	size_t size;
+	/** Start of the whole mapping, including the guard. */
+	uint8_t *map;
+	/** Size of the whole mapping. */
+	size_t map_size;
+	/** Size class or -1 if the stack is too big to cache. */
+	int size_class;
+	/** Link in a free list of the pool. */
+	struct rlist link;
+};
+
+/** Free stacks kept for reuse, grouped by size classes. */
+struct coro_stack_pool {
+	/** System page size. */
+	size_t page_size;
+	/** Whether to protect the lowest page of each stack. */
+	bool use_guard;
+	/**
+	 * Whether to give the pages of the cached stacks back to
+	 * the kernel. Then the cache costs only address space.
+	 */
+	bool use_madvise;
+	/** Max number of free stacks to keep. */
+	size_t cache_limit;
+	/** Number of free stacks kept now, in all the classes. */
+	size_t cache_count;
+	/**
+	 * Number of stacks taken from the pool minus the ones put
+	 * back. A stack can be put into another pool, so only the
+	 * sum over all the pools makes sense.
+	 */
+	long used_count;
+	/** Free stacks, one list per size class. */
+	struct rlist free_lists[CORO_STACK_CLASS_COUNT];
+};
+
+void
+coro_stack_pool_create(struct coro_stack_pool *pool, size_t cache_limit,
+	bool use_guard, bool use_madvise);
+
+/** Unmap all the cached stacks. */
+void
+coro_stack_pool_destroy(struct coro_stack_pool *pool);
+
+/**
+ * Get a stack with at least @a size usable bytes. Taken from the
+ * cache when possible, mapped otherwise.
+ */
+struct coro_stack *
+coro_stack_pool_get(struct coro_stack_pool *pool, size_t size);
+
+/**
+ * Return a stack into the pool. It is either cached with its
+ * pages released, or unmapped when the cache is full.
+ */
+void
+coro_stack_pool_put(struct coro_stack_pool *pool, struct coro_stack *stack);
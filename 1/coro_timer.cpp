@@ -0,0 +1,145 @@
+#include "coro_timer.h"
+
+#include <assert.h>
+
+void
+coro_timer_wheel_create(struct coro_timer_wheel *wheel, uint64_t tick)
+{
+	wheel->tick = tick;
+	wheel->count = 0;
+	for (int l = 0; l < CORO_TIMER_LEVEL_COUNT; ++l) {
+		wheel->bitmaps[l] = 0;
+		for (int s = 0; s < CORO_TIMER_SLOT_COUNT; ++s)
+			rlist_create(&wheel->slots[l][s]);
+	}
+}
+
+void
+coro_timer_wheel_destroy(struct coro_timer_wheel *wheel)
+{
+	assert(wheel->count == 0);
+	(void)wheel;
+}
+
+/** Mask of the slots after the given one. */
+static inline uint64_t
+coro_timer_slots_after(int slot)
+{
+	return slot == CORO_TIMER_SLOT_COUNT - 1 ? 0 : ~0ull << (slot + 1);
+}
+
+/** Put the timer into a slot. It must expire after the tick. */
+static void
+coro_timer_wheel_insert(struct coro_timer_wheel *wheel,
+	struct coro_timer *timer, uint64_t expire)
+{
+	assert(expire > wheel->tick);
+	int top_bit = 63 - __builtin_clzll(expire ^ wheel->tick);
+	int level = top_bit / CORO_TIMER_SLOT_BITS;
+	int slot = (expire >> (level * CORO_TIMER_SLOT_BITS)) &
+		(CORO_TIMER_SLOT_COUNT - 1);
+	timer->level = level;
+	timer->slot = slot;
+	rlist_add_tail_entry(&wheel->slots[level][slot], timer, link);
+	wheel->bitmaps[level] |= 1ull << slot;
+}
+
+void
+coro_timer_wheel_add(struct coro_timer_wheel *wheel, struct coro_timer *timer)
+{
+	uint64_t expire = timer->expire_tick;
+	if (expire <= wheel->tick)
+		expire = wheel->tick + 1;
+	coro_timer_wheel_insert(wheel, timer, expire);
+	++wheel->count;
+}
+
+void
+coro_timer_wheel_del(struct coro_timer_wheel *wheel, struct coro_timer *timer)
+{
+	rlist_del_entry(timer, link);
+	if (rlist_empty(&wheel->slots[timer->level][timer->slot]))
+		wheel->bitmaps[timer->level] &= ~(1ull << timer->slot);
+	assert(wheel->count > 0);
+	--wheel->count;
+}
+
+uint64_t
+coro_timer_wheel_next_tick(const struct coro_timer_wheel *wheel)
+{
+	uint64_t res = UINT64_MAX;
+	if (wheel->count == 0)
+		return res;
+	uint64_t tick = wheel->tick;
+	for (int l = 0; l < CORO_TIMER_LEVEL_COUNT; ++l) {
+		int shift = l * CORO_TIMER_SLOT_BITS;
+		int current = (tick >> shift) & (CORO_TIMER_SLOT_COUNT - 1);
+		uint64_t bits = wheel->bitmaps[l] &
+			coro_timer_slots_after(current);
+		if (bits == 0)
+			continue;
+		/*
+		 * The slot is reached when the tick has the slot in
+		 * this group, and zeros in all the lower ones.
+		 */
+		int upper_shift = shift + CORO_TIMER_SLOT_BITS;
+		uint64_t base = upper_shift >= 64 ? 0 :
+			tick >> upper_shift << upper_shift;
+		uint64_t when = base | ((uint64_t)__builtin_ctzll(bits) << shift);
+		if (when < res)
+			res = when;
+	}
+	return res;
+}
+
+void
+coro_timer_wheel_advance(struct coro_timer_wheel *wheel, uint64_t tick,
+	struct rlist *expired)
+{
+	while (wheel->tick < tick) {
+		uint64_t next = coro_timer_wheel_next_tick(wheel);
+		if (next > tick) {
+			/*
+			 * Nothing happens in between, so the time can
+			 * jump right to the end.
+			 */
+			wheel->tick = tick;
+			return;
+		}
+		wheel->tick = next;
+		/* Cascade from the top, so the timers fall down in time. */
+		for (int l = CORO_TIMER_LEVEL_COUNT - 1; l >= 1; --l) {
+			int shift = l * CORO_TIMER_SLOT_BITS;
+			if ((next & ((1ull << shift) - 1)) != 0)
+				continue;
+			int slot = (next >> shift) & (CORO_TIMER_SLOT_COUNT - 1);
+			if ((wheel->bitmaps[l] & (1ull << slot)) == 0)
+				continue;
+			wheel->bitmaps[l] &= ~(1ull << slot);
+			struct rlist list;
+			rlist_create(&list);
+			rlist_splice(&list, &wheel->slots[l][slot]);
+			while (!rlist_empty(&list)) {
+				struct coro_timer *timer = rlist_shift_entry(&list,
+					struct coro_timer, link);
+				if (timer->expire_tick <= next) {
+					rlist_add_tail_entry(expired, timer, link);
+					--wheel->count;
+				} else {
+					coro_timer_wheel_insert(wheel, timer,
+						timer->expire_tick);
+				}
+			}
+		}
+		int slot = next & (CORO_TIMER_SLOT_COUNT - 1);
+		if ((wheel->bitmaps[0] & (1ull << slot)) == 0)
+			continue;
+		wheel->bitmaps[0] &= ~(1ull << slot);
+		while (!rlist_empty(&wheel->slots[0][slot])) {
+			struct coro_timer *timer = rlist_shift_entry(
+				&wheel->slots[0][slot], struct coro_timer, link);
+			rlist_add_tail_entry(expired, timer, link);
+			--wheel->count;
+		}
+	}
+}
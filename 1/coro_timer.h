@@ -0,0 +1,87 @@
+#pragma once
+
+#include "rlist.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	/** Log2 of the number of slots on each level of the wheel. */
+	CORO_TIMER_SLOT_BITS = 6,
+	CORO_TIMER_SLOT_COUNT = 1 << CORO_TIMER_SLOT_BITS,
+	/** Enough levels to cover all the 64-bit ticks. */
+	CORO_TIMER_LEVEL_COUNT = 11,
+};
+
+struct coro_timer;
+
+typedef void (*coro_timer_f)(struct coro_timer *timer);
+
+/** A timer, usually embedded into a bigger object. */
+struct coro_timer {
+	/** Tick when the timer expires. */
+	uint64_t expire_tick;
+	/** Called by the owner of the wheel on the expiration. */
+	coro_timer_f func;
+	/** Level and slot of the wheel the timer is in. */
+	int level;
+	int slot;
+	/** Link in the slot, or in the list of the expired timers. */
+	struct rlist link;
+};
+
+/**
+ * Hierarchical timer wheel. Each level has 64 slots. A slot on
+ * the level L covers 64^L ticks. A timer is stored on the level
+ * of the highest 6-bit group of its expiration tick which differs
+ * from the current tick, and moves to the lower levels as the
+ * time goes (cascades). So arming and cancellation are O(1). The
+ * nearest non-empty slot is found with the per-level bitmaps, so
+ * the time can jump over the empty periods at once.
+ */
+struct coro_timer_wheel {
+	/** Last processed tick. All the timers before it expired. */
+	uint64_t tick;
+	/** Number of the armed timers. */
+	size_t count;
+	/** Bit per non-empty slot, on each level. */
+	uint64_t bitmaps[CORO_TIMER_LEVEL_COUNT];
+	/** The timers. */
+	struct rlist slots[CORO_TIMER_LEVEL_COUNT][CORO_TIMER_SLOT_COUNT];
+};
+
+void
+coro_timer_wheel_create(struct coro_timer_wheel *wheel, uint64_t tick);
+
+/** The wheel must have no timers. */
+void
+coro_timer_wheel_destroy(struct coro_timer_wheel *wheel);
+
+/**
+ * Arm the timer with its expire_tick already set. A timer in the
+ * past expires on the next advance.
+ */
+void
+coro_timer_wheel_add(struct coro_timer_wheel *wheel, struct coro_timer *timer);
+
+/** Cancel an armed timer. */
+void
+coro_timer_wheel_del(struct coro_timer_wheel *wheel, struct coro_timer *timer);
+
+/**
+ * The nearest tick when the wheel has something to do: either a
+ * timer expires, or the timers of a slot move to a lower level.
+ * Never later than the first expiration. UINT64_MAX when the
+ * wheel is empty.
+ */
+uint64_t
+coro_timer_wheel_next_tick(const struct coro_timer_wheel *wheel);
+
+/**
+ * Move the time forward up to the given tick. The expired timers
+ * are appended to the list, in the order of their expiration.
+ * Their callbacks are up to the caller.
+ */
+void
+coro_timer_wheel_advance(struct coro_timer_wheel *wheel, uint64_t tick,
+	struct rlist *expired);
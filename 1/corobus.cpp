@@ -1,13 +1,15 @@
 #include "corobus.h"
 
+#include "coro_ring.h"
+#include "coro_segment.h"
+#include "coro_spill.h"
 #include "libcoro.h"
 #include "rlist.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include <deque>
-#include <algorithm>
+#include <time.h>
 
 /**
  * One coroutine waiting to be woken up in a list of other
@@ -16,8 +18,53 @@
 struct wakeup_entry {
 	struct rlist base;
 	struct coro *coro;
+	/**
+	 * How many messages the waiter takes at once, or how many
+	 * slots it fills. A wakeup is passed on to the next waiters
+	 * only when there is more than this one can take.
+	 */
+	unsigned count;
+	/** The group the entry is a part of, or NULL. */
+	struct wakeup_group *group;
 };
 
+/**
+ * A coroutine waiting in several queues at once. It has an entry
+ * in each of them, and is woken up once, when all the entries are
+ * signalled, or right away when any of the queues is destroyed.
+ */
+struct wakeup_group {
+	struct coro *coro;
+	/** How many entries are not signalled yet. */
+	int pending;
+	/** Whether the coroutine was woken up already. */
+	bool is_woken;
+	/**
+	 * The entries are added under the locks of their queues one
+	 * by one, so they can be signalled before the coroutine is
+	 * suspended. The wakeup is done under this lock, and the
+	 * coroutine suspends with it, so the wakeup is not lost.
+	 */
+	struct coro_spinlock lock;
+};
+
+/**
+ * Signal an entry of the group. The entries are signalled under
+ * the locks of different queues, hence the atomics.
+ */
+static void
+wakeup_group_signal(struct wakeup_group *group, bool is_final)
+{
+	if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) != 0 &&
+	    !is_final)
+		return;
+	if (!__atomic_exchange_n(&group->is_woken, true, __ATOMIC_ACQ_REL)) {
+		coro_spinlock_lock(&group->lock);
+		coro_wakeup(group->coro);
+		coro_spinlock_unlock(&group->lock);
+	}
+}
+
 /** A queue of suspended coros waiting to be woken up. */
 struct wakeup_queue {
 	struct rlist coros;
@@ -29,320 +76,1800 @@ wakeup_queue_init(struct wakeup_queue *queue)
 	rlist_create(&queue->coros);
 }
 
+/** Wake up everyone, before the queue is destroyed. */
 static void
-wakeup_queue_suspend_this(struct wakeup_queue *queue)
+wakeup_queue_wakeup_all(struct wakeup_queue *queue)
+{
+	while (!rlist_empty(&queue->coros)) {
+		struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
+			struct wakeup_entry, base);
+		rlist_del_entry(entry, base);
+		if (entry->group == NULL)
+			coro_wakeup(entry->coro);
+		else
+			wakeup_group_signal(entry->group, true);
+	}
+}
+
+/**
+ * Wake up just enough single waiters to take the given number of
+ * messages or slots, each as many as it asked for. So a batch is
+ * not handed out one message per waiter, when the first one would
+ * take it all, and the rest would only suspend again. The groups
+ * on the way are signalled, and take nothing.
+ */
+static void
+wakeup_queue_hand_out(struct wakeup_queue *queue, size_t count)
+{
+	while (count > 0 && !rlist_empty(&queue->coros)) {
+		struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
+			struct wakeup_entry, base);
+		rlist_del_entry(entry, base);
+		if (entry->group != NULL) {
+			wakeup_group_signal(entry->group, false);
+			continue;
+		}
+		coro_wakeup(entry->coro);
+		count -= entry->count < count ? entry->count : count;
+	}
+}
+
+static inline void
+wakeup_queue_wakeup_n(struct wakeup_queue *queue, size_t count)
+{
+	/* Mostly nobody waits, don't pay for a call then. */
+	if (!rlist_empty(&queue->coros))
+		wakeup_queue_hand_out(queue, count);
+}
+
+/**
+ * Check whether the coroutine woken up from the queue is
+ * cancelled. Then it leaves, and passes on the wakeups of the
+ * given number of ready messages or slots, which it might have
+ * taken, so the other waiters don't miss them.
+ */
+static bool
+wakeup_queue_is_cancelled(struct wakeup_queue *queue, size_t ready_count)
+{
+	if (!coro_is_cancelled())
+		return false;
+	wakeup_queue_wakeup_n(queue, ready_count);
+	coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+	return true;
+}
+
+struct coro_bus_channel {
+	/** Channel max capacity. */
+	size_t size_limit;
+	/** Lock of the descriptor, see struct bus_slot. */
+	struct coro_spinlock *lock;
+	/** Coroutines waiting until the channel is not full. */
+	struct wakeup_queue send_queue;
+	/** Coroutines waiting until the channel is not empty. */
+	struct wakeup_queue recv_queue;
+	/**
+	 * Message queue. Allocated at once for size_limit messages,
+	 * so the sends and receives never allocate.
+	 */
+	struct coro_ring data;
+	/** File of a durable channel, NULL for the others. */
+	struct coro_segment *segment;
+	/** Commit a durable channel after this many sent messages. */
+	unsigned commit_batch;
+	/**
+	 * The messages beyond the size limit, NULL when the channel
+	 * doesn't spill. When it has any, the memory is full, so the
+	 * order is the memory and then the spill.
+	 */
+	struct coro_spill *spill;
+	/** Counters of the channel, all but the current size. */
+	struct coro_bus_stats stats;
+	/** Descriptor of the channel. */
+	int desc;
+	/** Generation of the descriptor when the channel was opened. */
+	unsigned long long gen;
+	/** Position in the active channels of the bus. */
+	int active_index;
+};
+
+/** A subscription to a topic. */
+struct topic_sub {
+	/** Position of the next message to receive. */
+	size_t pos;
+	/**
+	 * The message before the position is still in use by the
+	 * subscriber, because its payload is shared by the pointer.
+	 */
+	bool is_holding;
+	bool is_active;
+	/**
+	 * Generation of the descriptor, bumped on each unsubscribe.
+	 * So a waiter of a cancelled subscription doesn't take over
+	 * a new one with the same descriptor.
+	 */
+	unsigned long long gen;
+};
+
+/**
+ * A topic is one ring of messages for all the subscribers. Each
+ * of them reads it from its own position, and a slot stays in use
+ * until all the subscribers which were there at the publish have
+ * released it. The oldest slots are freed when they have no
+ * references left, so the slowest subscriber bounds the topic.
+ */
+struct coro_bus_topic {
+	/** Max messages in the topic. */
+	size_t size_limit;
+	/** Lock of the descriptor, see struct bus_slot. */
+	struct coro_spinlock *lock;
+	/** Publishers waiting until the topic is not full. */
+	struct wakeup_queue send_queue;
+	/** Subscribers waiting for a new message. */
+	struct wakeup_queue recv_queue;
+	/** The published messages, not released by someone yet. */
+	struct coro_ring data;
+	/** References to each slot of the ring, by the same mask. */
+	unsigned *refs;
+	/** Subscriptions by their descriptors. */
+	struct topic_sub *subs;
+	/** How many descriptors were ever given out. */
+	int sub_count;
+	int sub_capacity;
+	/** The cancelled descriptors to reuse, the last first. */
+	int *free_subs;
+	int free_sub_count;
+	/** How many subscriptions are active. */
+	int active_sub_count;
+};
+
+enum {
+	/** Descriptors in the first chunk of a table. */
+	BUS_CHUNK_MIN = 8,
+	/** Chunks of a table, enough for any int descriptor. */
+	BUS_CHUNK_COUNT = 29,
+};
+
+/**
+ * A descriptor of a channel or a topic. It stays at the same
+ * address while the bus lives, and the lock of its object is in
+ * it. So a lookup locks the descriptor without the bus lock, and
+ * then checks what is open on it. The objects are opened and
+ * closed under both the bus lock and this one.
+ */
+struct bus_slot {
+	/** Guards the object in a multi-threaded bus. */
+	struct coro_spinlock lock;
+	/** The open channel or topic, NULL for a free descriptor. */
+	void *obj;
+	/** Generation of the descriptor, bumped on each close. */
+	unsigned long long gen;
+};
+
+/**
+ * Descriptors of one kind. They are allocated in chunks, each
+ * twice bigger than the previous one, and the chunks never move.
+ * So the lookups read them without a lock, and only a new chunk
+ * is published, under the bus lock.
+ */
+struct bus_table {
+	struct bus_slot *chunks[BUS_CHUNK_COUNT];
+	/** How many descriptors were ever given out. */
+	int count;
+};
+
+struct coro_bus {
+	/** Descriptors of the channels. */
+	struct bus_table channels;
+	/** Size of the free and active arrays. Grows twice at once. */
+	int channel_capacity;
+	/** The closed descriptors to reuse, the last closed first. */
+	int *free_descs;
+	int free_count;
+	/**
+	 * The open channels, densely, in no particular order. So the
+	 * broadcasts don't walk the closed descriptors.
+	 */
+	struct coro_bus_channel **active;
+	int active_count;
+	/** Descriptors of the topics, apart from the channels. */
+	struct bus_table topics;
+	/** Size of free_topics. Grows twice at once. */
+	int topic_capacity;
+	/** The closed topic descriptors to reuse, the last closed first. */
+	int *free_topics;
+	int free_topic_count;
+	/** The bus is used by the coroutines of multiple workers. */
+	bool is_mt;
+	/** Frees the payloads of the messages deleted unreceived. */
+	coro_bus_msg_free_f msg_free;
+	/**
+	 * Guards the descriptor tables and the arrays of a
+	 * multi-threaded bus. The channels and topics are opened and
+	 * closed under it, and a broadcast holds it to keep the set
+	 * of the channels. The lookups don't take it, they lock the
+	 * descriptor, see struct bus_slot. The bus lock is never
+	 * taken while holding a descriptor lock.
+	 */
+	struct coro_spinlock lock;
+};
+
+/**
+ * The error of the latest call in this thread. Each worker has
+ * its own, and a call sets it before return without switching
+ * the coroutine out.
+ */
+static __thread enum coro_bus_error_code thread_error = CORO_BUS_ERR_NONE;
+
+enum coro_bus_error_code
+coro_bus_errno(void)
+{
+	return thread_error;
+}
+
+void
+coro_bus_errno_set(enum coro_bus_error_code err)
+{
+	thread_error = err;
+}
+
+static inline void
+bus_lock(struct coro_bus *bus)
+{
+	if (bus->is_mt)
+		coro_spinlock_lock(&bus->lock);
+}
+
+static inline void
+bus_unlock(struct coro_bus *bus)
+{
+	if (bus->is_mt)
+		coro_spinlock_unlock(&bus->lock);
+}
+
+static inline void
+channel_lock(struct coro_bus *bus, struct coro_bus_channel *channel)
+{
+	if (bus->is_mt)
+		coro_spinlock_lock(channel->lock);
+}
+
+static inline void
+channel_unlock(struct coro_bus *bus, struct coro_bus_channel *channel)
+{
+	if (bus->is_mt)
+		coro_spinlock_unlock(channel->lock);
+}
+
+/** Chunk of a table the descriptor is in. */
+static inline int
+bus_table_chunk(int desc)
+{
+	unsigned n = (unsigned)desc + BUS_CHUNK_MIN;
+	return __builtin_clz(BUS_CHUNK_MIN) - __builtin_clz(n);
+}
+
+/** The descriptor, if it was ever given out. Otherwise NULL. */
+static inline struct bus_slot *
+bus_table_get(struct bus_table *table, int desc)
+{
+	if (desc < 0)
+		return NULL;
+	int i = bus_table_chunk(desc);
+	struct bus_slot *chunk = __atomic_load_n(&table->chunks[i],
+						 __ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+		return NULL;
+	return &chunk[desc + BUS_CHUNK_MIN - (BUS_CHUNK_MIN << i)];
+}
+
+/**
+ * Give out a new descriptor, free. A new chunk is filled before
+ * it is published, so the lookups see it ready. The bus is
+ * locked.
+ */
+static int
+bus_table_add(struct bus_table *table)
+{
+	int desc = table->count++;
+	int i = bus_table_chunk(desc);
+	if (table->chunks[i] == NULL) {
+		int size = BUS_CHUNK_MIN << i;
+		struct bus_slot *chunk = new bus_slot[size];
+		for (int j = 0; j < size; ++j) {
+			coro_spinlock_create(&chunk[j].lock);
+			chunk[j].obj = NULL;
+			chunk[j].gen = 1;
+		}
+		__atomic_store_n(&table->chunks[i], chunk, __ATOMIC_RELEASE);
+	}
+	return desc;
+}
+
+static void
+bus_table_create(struct bus_table *table)
+{
+	memset(table->chunks, 0, sizeof(table->chunks));
+	table->count = 0;
+}
+
+static void
+bus_table_destroy(struct bus_table *table)
+{
+	for (int i = 0; i < BUS_CHUNK_COUNT; ++i)
+		delete[] table->chunks[i];
+}
+
+static inline void
+bus_slot_lock(struct coro_bus *bus, struct bus_slot *slot)
+{
+	if (bus->is_mt)
+		coro_spinlock_lock(&slot->lock);
+}
+
+static inline void
+bus_slot_unlock(struct coro_bus *bus, struct bus_slot *slot)
+{
+	if (bus->is_mt)
+		coro_spinlock_unlock(&slot->lock);
+}
+
+/**
+ * Lock the descriptor and get its open object, with the
+ * generation. When there is none, NULL is returned with nothing
+ * locked.
+ */
+static inline void *
+bus_slot_acquire(struct coro_bus *bus, struct bus_table *table, int desc,
+	unsigned long long *gen)
+{
+	struct bus_slot *slot = bus_table_get(table, desc);
+	if (slot == NULL)
+		return NULL;
+	bus_slot_lock(bus, slot);
+	void *obj = slot->obj;
+	if (obj == NULL) {
+		bus_slot_unlock(bus, slot);
+		return NULL;
+	}
+	*gen = slot->gen;
+	return obj;
+}
+
+/** Same as bus_slot_acquire(), if the generation is the same. */
+static void *
+bus_slot_relock(struct coro_bus *bus, struct bus_table *table, int desc,
+	unsigned long long gen)
+{
+	unsigned long long cur_gen;
+	void *obj = bus_slot_acquire(bus, table, desc, &cur_gen);
+	if (obj != NULL && cur_gen != gen) {
+		bus_slot_unlock(bus, bus_table_get(table, desc));
+		return NULL;
+	}
+	return obj;
+}
+
+/** The capacity can be bigger than the limit, if it is exceeded. */
+static void
+channel_init(struct coro_bus_channel *channel, size_t size_limit,
+	size_t capacity)
+{
+	channel->size_limit = size_limit;
+	channel->lock = NULL;
+	wakeup_queue_init(&channel->send_queue);
+	wakeup_queue_init(&channel->recv_queue);
+	coro_ring_create(&channel->data, capacity);
+	channel->segment = NULL;
+	channel->commit_batch = 0;
+	channel->spill = NULL;
+	memset(&channel->stats, 0, sizeof(channel->stats));
+}
+
+enum {
+	/**
+	 * One in this many waits is timed, and counts as that many. A
+	 * clock read costs about as much as a coroutine switch, and
+	 * the waits are frequent when the channels are small.
+	 */
+	WAIT_SAMPLE_RATE = 16,
+};
+
+/** State of the random pick of the timed waits. */
+static __thread uint32_t wait_sample_state = 2463534242;
+
+/** Monotonic time in nanoseconds, to measure the waits. */
+static uint64_t
+bus_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Weight of the next wait in a queue of the locked channel, 0
+ * when it is not timed. The first wait is always timed as is, so
+ * a channel which had waits has their time. Of the others a
+ * random one in the sample rate is timed, and counts as that
+ * many. The pick is random, so a periodic pattern of the waits
+ * doesn't skew it.
+ */
+static unsigned
+channel_wait_weight(const struct coro_bus_channel *ch,
+	const struct wakeup_queue *queue)
+{
+	uint64_t count = queue == &ch->send_queue ? ch->stats.send_wait_count :
+		ch->stats.recv_wait_count;
+	if (count == 0)
+		return 1;
+	uint32_t x = wait_sample_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	wait_sample_state = x;
+	return x % WAIT_SAMPLE_RATE == 0 ? WAIT_SAMPLE_RATE : 0;
+}
+
+/** Account a wait in a queue of the channel, with its weighted time. */
+static void
+channel_account_wait(struct coro_bus_channel *ch, struct wakeup_queue *queue,
+	uint64_t wait_ns)
+{
+	if (queue == &ch->send_queue) {
+		++ch->stats.send_wait_count;
+		ch->stats.send_wait_ns += wait_ns;
+	} else {
+		++ch->stats.recv_wait_count;
+		ch->stats.recv_wait_ns += wait_ns;
+	}
+}
+
+/** How many messages can be sent without waiting. */
+static inline size_t
+channel_free_space(const struct coro_bus_channel *ch)
+{
+	size_t size = coro_ring_size(&ch->data);
+	size_t free_space = size < ch->size_limit ? ch->size_limit - size : 0;
+	if (ch->spill != NULL)
+		free_space += ch->spill->capacity - coro_spill_size(ch->spill);
+	return free_space;
+}
+
+static inline bool
+channel_is_full(const struct coro_bus_channel *ch)
+{
+	if (coro_ring_size(&ch->data) < ch->size_limit)
+		return false;
+	return ch->spill == NULL ||
+	       coro_spill_size(ch->spill) >= ch->spill->capacity;
+}
+
+static void
+channel_delete(struct coro_bus *bus, struct coro_bus_channel *channel)
+{
+	if (bus->msg_free != NULL) {
+		size_t size = coro_ring_size(&channel->data);
+		for (size_t i = 0; i < size; ++i) {
+			struct coro_bus_msg *msg = coro_ring_at(&channel->data, i);
+			if (msg->len > CORO_BUS_MSG_INLINE_SIZE)
+				bus->msg_free(msg->ptr, msg->len);
+		}
+	}
+	coro_ring_destroy(&channel->data);
+	if (channel->spill != NULL) {
+		while (bus->msg_free != NULL && !coro_spill_is_empty(channel->spill)) {
+			struct coro_bus_msg msg;
+			coro_spill_pop(channel->spill, &msg);
+			if (msg.len > CORO_BUS_MSG_INLINE_SIZE)
+				bus->msg_free(msg.ptr, msg.len);
+		}
+		coro_spill_destroy(channel->spill);
+		delete channel->spill;
+	}
+	if (channel->segment != NULL) {
+		coro_segment_close(channel->segment);
+		delete channel->segment;
+	}
+	delete channel;
+}
+
+static void
+topic_delete(struct coro_bus *bus, struct coro_bus_topic *t)
+{
+	if (bus->msg_free != NULL) {
+		size_t size = coro_ring_size(&t->data);
+		for (size_t i = 0; i < size; ++i) {
+			struct coro_bus_msg *msg = coro_ring_at(&t->data, i);
+			if (msg->len > CORO_BUS_MSG_INLINE_SIZE)
+				bus->msg_free(msg->ptr, msg->len);
+		}
+	}
+	coro_ring_destroy(&t->data);
+	delete[] t->refs;
+	delete[] t->subs;
+	delete[] t->free_subs;
+	delete t;
+}
+
+/**
+ * A group commit of a durable channel, started by a send in this
+ * thread. The sender finishes it after unlocking the channel, so
+ * the other senders and receivers don't wait for the disk.
+ */
+struct channel_commit {
+	/** The channel, or -1 when there is no commit. */
+	int desc;
+	unsigned long long gen;
+	struct coro_segment_sync sync;
+};
+
+static __thread struct channel_commit pending_commit = {-1, 0, {-1, 0, 0}};
+
+/**
+ * Append the sent messages to the file of a durable channel. Not
+ * inlined, so the sends into the other channels stay short.
+ */
+static void __attribute__((noinline))
+channel_persist(struct coro_bus_channel *ch, const unsigned *values,
+	const struct coro_bus_msg *msgs, unsigned count)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		if (values != NULL) {
+			coro_segment_append(ch->segment, &values[i], sizeof(values[i]));
+		} else if (msgs[i].len <= CORO_BUS_MSG_INLINE_SIZE) {
+			coro_segment_append(ch->segment, msgs[i].data, msgs[i].len);
+		} else {
+			coro_segment_append(ch->segment, msgs[i].ptr, msgs[i].len);
+		}
+	}
+	/* One commit per thread, a broadcast can fill several batches. */
+	if (ch->commit_batch != 0 &&
+	    ch->segment->append_count >= ch->commit_batch &&
+	    pending_commit.desc < 0 &&
+	    coro_segment_sync_begin(ch->segment, &pending_commit.sync)) {
+		pending_commit.desc = ch->desc;
+		pending_commit.gen = ch->gen;
+	}
+}
+
+/** Move the spilled messages into the freed memory. Same, not inlined. */
+static void __attribute__((noinline))
+channel_unspill(struct coro_bus_channel *ch)
+{
+	while (!coro_spill_is_empty(ch->spill) &&
+	       coro_ring_size(&ch->data) < ch->size_limit)
+		coro_spill_pop(ch->spill, coro_ring_push(&ch->data));
+}
+
+/**
+ * Append the messages to the channel, either the ready ones or
+ * the unsigned values. Only one of the sources is not NULL. They
+ * must fit.
+ */
+static inline void
+channel_push(struct coro_bus_channel *ch, const unsigned *values,
+	const struct coro_bus_msg *msgs, unsigned count)
+{
+	if (ch->segment != NULL)
+		channel_persist(ch, values, msgs, count);
+	ch->stats.send_count += count;
+	size_t size = coro_ring_size(&ch->data);
+	if (size + count > ch->size_limit) {
+		/*
+		 * Only a spilling channel can be sent more than fits. The
+		 * rest goes after the ones which are spilled already.
+		 */
+		unsigned mem_count = 0;
+		if (coro_spill_is_empty(ch->spill))
+			mem_count = (unsigned)(ch->size_limit - size);
+		coro_spill_push_n(ch->spill, values == NULL ? NULL :
+			values + mem_count, values == NULL ? msgs + mem_count :
+			NULL, count - mem_count);
+		uint64_t total = ch->size_limit + coro_spill_size(ch->spill);
+		if (total > ch->stats.max_size)
+			ch->stats.max_size = total;
+		count = mem_count;
+	}
+	if (size + count > ch->stats.max_size)
+		ch->stats.max_size = size + count;
+	if (values == NULL) {
+		/* Single messages are the common case, don't split a copy. */
+		if (count == 1)
+			*coro_ring_push(&ch->data) = msgs[0];
+		else
+			coro_ring_push_n(&ch->data, msgs, count);
+		return;
+	}
+	for (unsigned i = 0; i < count; ++i) {
+		struct coro_bus_msg *msg = coro_ring_push(&ch->data);
+		msg->len = sizeof(values[i]);
+		memcpy(msg->data, &values[i], sizeof(values[i]));
+	}
+}
+
+/** Take the oldest messages, either as they are or as values. */
+static inline void
+channel_pop(struct coro_bus_channel *ch, unsigned *values,
+	struct coro_bus_msg *msgs, unsigned count)
+{
+	if (values == NULL) {
+		if (count == 1)
+			msgs[0] = *coro_ring_pop(&ch->data);
+		else
+			coro_ring_pop_n(&ch->data, msgs, count);
+		if (ch->segment != NULL) {
+			for (unsigned i = 0; i < count; ++i)
+				coro_segment_consume(ch->segment, msgs[i].len);
+		}
+	} else {
+		for (unsigned i = 0; i < count; ++i) {
+			struct coro_bus_msg *msg = coro_ring_pop(&ch->data);
+			memcpy(&values[i], msg->data, sizeof(values[i]));
+			if (ch->segment != NULL)
+				coro_segment_consume(ch->segment, msg->len);
+		}
+	}
+	ch->stats.recv_count += count;
+	/* There is a spill only behind the full memory. */
+	if (coro_ring_size(&ch->data) + count == ch->size_limit &&
+	    ch->spill != NULL)
+		channel_unspill(ch);
+}
+
+/**
+ * Find the channel by its descriptor and lock it. The generation
+ * of the channel is saved into @a gen. On failure the error is
+ * set, and NULL is returned. Only the descriptor is locked, so
+ * the calls on the different channels don't contend.
+ */
+static inline struct coro_bus_channel *
+channel_acquire(struct coro_bus *bus, int channel, unsigned long long *gen)
+{
+	struct coro_bus_channel *ch = NULL;
+	if (bus != NULL) {
+		ch = (struct coro_bus_channel *)bus_slot_acquire(bus,
+			&bus->channels, channel, gen);
+	}
+	if (ch == NULL)
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return ch;
+}
+
+/** Lock the channel if it is still the same. Otherwise NULL. */
+static struct coro_bus_channel *
+channel_relock(struct coro_bus *bus, int channel, unsigned long long gen)
+{
+	return (struct coro_bus_channel *)bus_slot_relock(bus, &bus->channels,
+		channel, gen);
+}
+
+/**
+ * Do the disk syncs of the commit started by a send, with nothing
+ * locked. The channel can be closed in the meantime, then the
+ * rest is not needed.
+ */
+static void __attribute__((noinline))
+channel_commit_finish(struct coro_bus *bus)
+{
+	struct channel_commit *c = &pending_commit;
+	coro_segment_sync_flush(&c->sync);
+	struct coro_bus_channel *ch = channel_relock(bus, c->desc, c->gen);
+	if (ch != NULL) {
+		bool is_header = coro_segment_sync_header(ch->segment, &c->sync);
+		if (is_header) {
+			channel_unlock(bus, ch);
+			coro_segment_sync_flush(&c->sync);
+			ch = channel_relock(bus, c->desc, c->gen);
+		}
+		if (ch != NULL) {
+			coro_segment_sync_end(ch->segment, &c->sync);
+			channel_unlock(bus, ch);
+		}
+	}
+	coro_segment_sync_close(&c->sync);
+	c->desc = -1;
+}
+
+/** Finish the commit started by the latest send, if there is one. */
+static inline void
+channel_commit_check(struct coro_bus *bus)
+{
+	if (pending_commit.desc >= 0)
+		channel_commit_finish(bus);
+}
+
+/**
+ * Suspend the current coroutine in a queue of the locked channel
+ * until a wakeup. The count is how many messages or slots it
+ * wants. Returns true when the channel is still open, and is
+ * locked again. Otherwise the channel is closed and deleted,
+ * nothing is locked, and the error is set.
+ */
+static bool
+channel_wait(struct coro_bus *bus, int channel, unsigned long long gen,
+	struct coro_bus_channel *ch, struct wakeup_queue *queue, unsigned count)
 {
 	struct wakeup_entry entry;
-	rlist_create(&entry.base);
 	entry.coro = coro_this();
+	entry.count = count;
+	entry.group = NULL;
 	rlist_add_tail_entry(&queue->coros, &entry, base);
-	coro_suspend();
-	if (entry.base.next != &entry.base || entry.base.prev != &entry.base)
+	unsigned weight = channel_wait_weight(ch, queue);
+	uint64_t start_ts = weight != 0 ? bus_clock_ns() : 0;
+	if (bus->is_mt)
+		coro_suspend_unlock(ch->lock);
+	else
+		coro_suspend();
+	if (channel_relock(bus, channel, gen) == NULL) {
+		/* The closure has removed the entry from the queue. */
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return false;
+	}
+	if (!rlist_empty(&entry.base))
 		rlist_del_entry(&entry, base);
+	channel_account_wait(ch, queue, weight != 0 ?
+		(bus_clock_ns() - start_ts) * weight : 0);
+	return true;
 }
 
+/**
+ * Send up to count messages or values, as many as fit. The
+ * blocking send waits until at least one fits.
+ */
+static inline int
+channel_send_v(struct coro_bus *bus, int channel, const unsigned *values,
+	const struct coro_bus_msg *msgs, unsigned count, bool is_blocking)
+{
+	unsigned long long gen;
+	struct coro_bus_channel *ch = channel_acquire(bus, channel, &gen);
+	if (ch == NULL)
+		return -1;
+	while (channel_is_full(ch)) {
+		if (!is_blocking) {
+			channel_unlock(bus, ch);
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		if (!channel_wait(bus, channel, gen, ch, &ch->send_queue, count))
+			return -1;
+		if (wakeup_queue_is_cancelled(&ch->send_queue,
+					      channel_free_space(ch))) {
+			channel_unlock(bus, ch);
+			return -1;
+		}
+	}
+	/* Not full, so the memory is not over the limit at least. */
+	size_t free_space = ch->size_limit - coro_ring_size(&ch->data);
+	if (count > free_space) {
+		free_space = channel_free_space(ch);
+		if (count > free_space)
+			count = (unsigned)free_space;
+	}
+	channel_push(ch, values, msgs, count);
+	wakeup_queue_wakeup_n(&ch->recv_queue, count);
+	channel_unlock(bus, ch);
+	channel_commit_check(bus);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return (int)count;
+}
+
+/**
+ * Receive up to capacity messages or values, as many as there
+ * are. The blocking receive waits until there is at least one.
+ */
+static inline int
+channel_recv_v(struct coro_bus *bus, int channel, unsigned *values,
+	struct coro_bus_msg *msgs, unsigned capacity, bool is_blocking)
+{
+	unsigned long long gen;
+	struct coro_bus_channel *ch = channel_acquire(bus, channel, &gen);
+	if (ch == NULL)
+		return -1;
+	while (coro_ring_is_empty(&ch->data)) {
+		if (!is_blocking) {
+			channel_unlock(bus, ch);
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		if (!channel_wait(bus, channel, gen, ch, &ch->recv_queue,
+				  capacity))
+			return -1;
+		if (wakeup_queue_is_cancelled(&ch->recv_queue,
+					      coro_ring_size(&ch->data))) {
+			channel_unlock(bus, ch);
+			return -1;
+		}
+	}
+	size_t size = coro_ring_size(&ch->data);
+	if (capacity > size)
+		capacity = (unsigned)size;
+	channel_pop(ch, values, msgs, capacity);
+	wakeup_queue_wakeup_n(&ch->send_queue, capacity);
+	channel_unlock(bus, ch);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return (int)capacity;
+}
+
+/**
+ * An entry of a coroutine waiting in the queues of several
+ * channels at once.
+ */
+struct group_entry {
+	struct wakeup_entry entry;
+	/** The channel, to find it again if it is still open. */
+	int desc;
+	unsigned long long gen;
+	/** The queue of the channel it is in. */
+	struct wakeup_queue *queue;
+	/** Weight of the wait time in the channel, 0 if not timed. */
+	unsigned weight;
+};
+
+static void
+wakeup_group_create(struct wakeup_group *group, int pending)
+{
+	group->coro = coro_this();
+	group->pending = pending;
+	group->is_woken = false;
+	coro_spinlock_create(&group->lock);
+}
+
+/** Put the entry into a queue of the channel. Both are locked. */
+static void
+group_entry_add(struct group_entry *e, struct wakeup_group *group,
+	struct coro_bus_channel *ch, struct wakeup_queue *queue)
+{
+	e->entry.coro = group->coro;
+	e->entry.count = 0;
+	e->entry.group = group;
+	e->desc = ch->desc;
+	e->gen = ch->gen;
+	e->queue = queue;
+	e->weight = channel_wait_weight(ch, queue);
+	rlist_add_tail_entry(&queue->coros, &e->entry, base);
+}
+
+/**
+ * Remove the entries from the queues of the channels which are
+ * still open, and haven't signalled them. Nothing is locked. If
+ * it was a wait, it is accounted in each channel with its weight
+ * of the time.
+ */
 static void
-wakeup_queue_wakeup_first(struct wakeup_queue *queue)
+group_leave(struct coro_bus *bus, struct group_entry *entries, int count,
+	bool is_wait, uint64_t wait_ns)
 {
-	if (rlist_empty(&queue->coros))
+	for (int i = 0; i < count; ++i) {
+		struct group_entry *e = &entries[i];
+		/*
+		 * The descriptor is locked even if the channel is closed,
+		 * so whoever signals the group under it is done with the
+		 * group before it is gone.
+		 */
+		struct coro_bus_channel *ch = channel_relock(bus, e->desc,
+							     e->gen);
+		if (ch == NULL)
+			continue;
+		if (!rlist_empty(&e->entry.base))
+			rlist_del_entry(&e->entry, base);
+		if (is_wait)
+			channel_account_wait(ch, e->queue, wait_ns * e->weight);
+		channel_unlock(bus, ch);
+	}
+}
+
+/**
+ * Suspend until the group is woken up, and leave all the queues.
+ * Nothing is locked. The group might be signalled already, then
+ * it doesn't suspend.
+ */
+static void
+group_wait(struct coro_bus *bus, struct wakeup_group *group,
+	struct group_entry *entries, int count)
+{
+	bool is_timed = false;
+	for (int i = 0; i < count && !is_timed; ++i)
+		is_timed = entries[i].weight != 0;
+	uint64_t start_ts = is_timed ? bus_clock_ns() : 0;
+	coro_spinlock_lock(&group->lock);
+	if (__atomic_load_n(&group->is_woken, __ATOMIC_ACQUIRE))
+		coro_spinlock_unlock(&group->lock);
+	else
+		coro_suspend_unlock(&group->lock);
+	uint64_t wait_ns = is_timed ? bus_clock_ns() - start_ts : 0;
+	group_leave(bus, entries, count, true, wait_ns);
+}
+
+static struct coro_bus *
+bus_new(bool is_mt)
+{
+	struct coro_bus *bus = new coro_bus;
+	bus_table_create(&bus->channels);
+	bus->channel_capacity = 0;
+	bus->free_descs = NULL;
+	bus->free_count = 0;
+	bus->active = NULL;
+	bus->active_count = 0;
+	bus_table_create(&bus->topics);
+	bus->topic_capacity = 0;
+	bus->free_topics = NULL;
+	bus->free_topic_count = 0;
+	bus->is_mt = is_mt;
+	bus->msg_free = NULL;
+	coro_spinlock_create(&bus->lock);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return bus;
+}
+
+struct coro_bus *
+coro_bus_new(void)
+{
+	return bus_new(false);
+}
+
+struct coro_bus *
+coro_bus_new_mt(void)
+{
+	return bus_new(true);
+}
+
+void
+coro_bus_delete(struct coro_bus *bus)
+{
+	if (bus == NULL)
 		return;
-	struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
-		struct wakeup_entry, base);
-	rlist_del_entry(entry, base);
-	coro_wakeup(entry->coro);
+	for (int i = 0; i < bus->active_count; ++i) {
+		struct coro_bus_channel *channel = bus->active[i];
+		assert(rlist_empty(&channel->send_queue.coros));
+		assert(rlist_empty(&channel->recv_queue.coros));
+		channel_delete(bus, channel);
+	}
+	for (int i = 0; i < bus->topics.count; ++i) {
+		struct coro_bus_topic *t = (struct coro_bus_topic *)
+			bus_table_get(&bus->topics, i)->obj;
+		if (t == NULL)
+			continue;
+		assert(rlist_empty(&t->send_queue.coros));
+		assert(rlist_empty(&t->recv_queue.coros));
+		topic_delete(bus, t);
+	}
+	bus_table_destroy(&bus->topics);
+	bus_table_destroy(&bus->channels);
+	delete[] bus->free_descs;
+	delete[] bus->active;
+	delete[] bus->free_topics;
+	delete bus;
+}
+
+void
+coro_bus_set_msg_free(struct coro_bus *bus, coro_bus_msg_free_f func)
+{
+	bus->msg_free = func;
 }
 
+/** Double the free and active arrays of the bus. */
 static void
-wakeup_queue_wakeup_all(struct wakeup_queue *queue)
+bus_grow(struct coro_bus *bus)
 {
-	while (!rlist_empty(&queue->coros)) {
-		struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
-			struct wakeup_entry, base);
-		rlist_del_entry(entry, base);
-		coro_wakeup(entry->coro);
+	int capacity = bus->channel_capacity == 0 ? 8 :
+		bus->channel_capacity * 2;
+	int *free_descs = new int[capacity];
+	struct coro_bus_channel **active = new coro_bus_channel *[capacity];
+	if (bus->channel_capacity > 0) {
+		memcpy(free_descs, bus->free_descs,
+		       bus->free_count * sizeof(free_descs[0]));
+		memcpy(active, bus->active, bus->active_count * sizeof(active[0]));
+	}
+	delete[] bus->free_descs;
+	delete[] bus->active;
+	bus->free_descs = free_descs;
+	bus->active = active;
+	bus->channel_capacity = capacity;
+}
+
+/** Double the free array of the topics. */
+static void
+bus_grow_topics(struct coro_bus *bus)
+{
+	int capacity = bus->topic_capacity == 0 ? 4 : bus->topic_capacity * 2;
+	int *free_topics = new int[capacity];
+	if (bus->topic_capacity > 0) {
+		memcpy(free_topics, bus->free_topics,
+		       bus->free_topic_count * sizeof(free_topics[0]));
+	}
+	delete[] bus->free_topics;
+	bus->free_topics = free_topics;
+	bus->topic_capacity = capacity;
+}
+
+/** Give the new channel a descriptor. */
+static int
+bus_add_channel(struct coro_bus *bus, struct coro_bus_channel *channel)
+{
+	bus_lock(bus);
+	int desc;
+	if (bus->free_count > 0) {
+		desc = bus->free_descs[--bus->free_count];
+	} else {
+		if (bus->channels.count == bus->channel_capacity)
+			bus_grow(bus);
+		desc = bus_table_add(&bus->channels);
+	}
+	struct bus_slot *slot = bus_table_get(&bus->channels, desc);
+	channel->desc = desc;
+	channel->gen = slot->gen;
+	channel->lock = &slot->lock;
+	channel->active_index = bus->active_count;
+	bus->active[bus->active_count++] = channel;
+	bus_slot_lock(bus, slot);
+	slot->obj = channel;
+	bus_slot_unlock(bus, slot);
+	bus_unlock(bus);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return desc;
+}
+
+int
+coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+{
+	if (bus == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_channel *channel = new coro_bus_channel;
+	channel_init(channel, size_limit, size_limit);
+	return bus_add_channel(bus, channel);
+}
+
+void
+coro_bus_durable_opts_create(struct coro_bus_durable_opts *opts)
+{
+	opts->segment_size = 1024 * 1024;
+	opts->commit_batch = 64;
+}
+
+/** Load the unread messages of the file into the new channel. */
+static void
+channel_recover(struct coro_bus_channel *ch)
+{
+	struct coro_segment *seg = ch->segment;
+	for (uint64_t pos = seg->read_pos; pos < seg->write_pos;) {
+		size_t len = coro_segment_record_len(seg, pos);
+		struct coro_bus_msg *msg = coro_ring_push(&ch->data);
+		msg->len = len;
+		if (len > CORO_BUS_MSG_INLINE_SIZE) {
+			msg->ptr = malloc(len);
+			if (msg->ptr == NULL)
+				abort();
+		}
+		coro_segment_read(seg, pos + sizeof(uint64_t),
+			coro_bus_msg_data(msg), len);
+		pos += coro_segment_record_size(len);
+	}
+}
+
+int
+coro_bus_channel_open_durable(struct coro_bus *bus, size_t size_limit,
+	const char *path, const struct coro_bus_durable_opts *opts)
+{
+	if (bus == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_durable_opts default_opts;
+	if (opts == NULL) {
+		coro_bus_durable_opts_create(&default_opts);
+		opts = &default_opts;
+	}
+	struct coro_segment *seg = new coro_segment;
+	if (coro_segment_open(seg, path, opts->segment_size) != 0) {
+		delete seg;
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	size_t count = 0;
+	for (uint64_t pos = seg->read_pos; pos < seg->write_pos; ++count)
+		pos += coro_segment_record_size(coro_segment_record_len(seg, pos));
+	struct coro_bus_channel *channel = new coro_bus_channel;
+	channel_init(channel, size_limit, count > size_limit ? count : size_limit);
+	channel->segment = seg;
+	channel->commit_batch = opts->commit_batch;
+	channel_recover(channel);
+	channel->stats.max_size = coro_ring_size(&channel->data);
+	return bus_add_channel(bus, channel);
+}
+
+void
+coro_bus_spill_opts_create(struct coro_bus_spill_opts *opts)
+{
+	opts->dir = "/tmp";
+	opts->spill_limit = 1024 * 1024;
+}
+
+int
+coro_bus_channel_open_spill(struct coro_bus *bus, size_t size_limit,
+	const struct coro_bus_spill_opts *opts)
+{
+	if (bus == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_spill_opts default_opts;
+	if (opts == NULL) {
+		coro_bus_spill_opts_create(&default_opts);
+		opts = &default_opts;
+	}
+	struct coro_spill *spill = new coro_spill;
+	if (coro_spill_create(spill, opts->dir, opts->spill_limit) != 0) {
+		delete spill;
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	struct coro_bus_channel *channel = new coro_bus_channel;
+	channel_init(channel, size_limit, size_limit);
+	channel->spill = spill;
+	return bus_add_channel(bus, channel);
+}
+
+int
+coro_bus_channel_commit(struct coro_bus *bus, int channel)
+{
+	unsigned long long gen;
+	struct coro_bus_channel *ch = channel_acquire(bus, channel, &gen);
+	if (ch == NULL)
+		return -1;
+	if (ch->segment != NULL)
+		coro_segment_commit(ch->segment);
+	channel_unlock(bus, ch);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int
+coro_bus_stats(struct coro_bus *bus, int channel, struct coro_bus_stats *stats)
+{
+	unsigned long long gen;
+	struct coro_bus_channel *ch = channel_acquire(bus, channel, &gen);
+	if (ch == NULL)
+		return -1;
+	*stats = ch->stats;
+	stats->size = coro_ring_size(&ch->data);
+	if (ch->spill != NULL)
+		stats->size += coro_spill_size(ch->spill);
+	channel_unlock(bus, ch);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+void
+coro_bus_channel_close(struct coro_bus *bus, int channel)
+{
+	if (bus == NULL)
+		return;
+	bus_lock(bus);
+	struct bus_slot *slot = bus_table_get(&bus->channels, channel);
+	if (slot == NULL) {
+		bus_unlock(bus);
+		return;
+	}
+	/* Let the current holder finish. Nobody finds it after. */
+	bus_slot_lock(bus, slot);
+	struct coro_bus_channel *ch = (struct coro_bus_channel *)slot->obj;
+	if (ch == NULL) {
+		bus_slot_unlock(bus, slot);
+		bus_unlock(bus);
+		return;
+	}
+	slot->obj = NULL;
+	slot->gen += 1;
+	bus->free_descs[bus->free_count++] = channel;
+	struct coro_bus_channel *last = bus->active[--bus->active_count];
+	bus->active[ch->active_index] = last;
+	last->active_index = ch->active_index;
+	wakeup_queue_wakeup_all(&ch->send_queue);
+	wakeup_queue_wakeup_all(&ch->recv_queue);
+	channel_unlock(bus, ch);
+	bus_unlock(bus);
+	channel_delete(bus, ch);
+}
+
+int
+coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return channel_send_v(bus, channel, &data, NULL, 1, true) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return channel_send_v(bus, channel, &data, NULL, 1, false) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	return channel_recv_v(bus, channel, data, NULL, 1, true) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	return channel_recv_v(bus, channel, data, NULL, 1, false) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel, void *ptr, size_t len)
+{
+	struct coro_bus_msg msg;
+	coro_bus_msg_create(&msg, ptr, len);
+	return channel_send_v(bus, channel, NULL, &msg, 1, true) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel, void *ptr,
+	size_t len)
+{
+	struct coro_bus_msg msg;
+	coro_bus_msg_create(&msg, ptr, len);
+	return channel_send_v(bus, channel, NULL, &msg, 1, false) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, struct coro_bus_msg *msg)
+{
+	return channel_recv_v(bus, channel, NULL, msg, 1, true) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msg)
+{
+	return channel_recv_v(bus, channel, NULL, msg, 1, false) < 0 ? -1 : 0;
+}
+
+/**
+ * Complete the first ready operation. Otherwise the blocking
+ * select waits in the queues of all the channels at once, and
+ * rescans after a wakeup from any of them.
+ */
+static int
+bus_select(struct coro_bus *bus, struct coro_bus_op *ops, unsigned count,
+	bool is_blocking)
+{
+	if (bus == NULL || count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	/* Only allocated if it comes to waiting. */
+	struct group_entry *entries = NULL;
+	for (;;) {
+		struct wakeup_group group;
+		wakeup_group_create(&group, 1);
+		int entry_count = 0;
+		int rc = -1;
+		enum coro_bus_error_code err = CORO_BUS_ERR_WOULD_BLOCK;
+		for (unsigned i = 0; i < count; ++i) {
+			struct coro_bus_op *op = &ops[i];
+			unsigned long long gen;
+			struct coro_bus_channel *ch = channel_acquire(bus,
+				op->channel, &gen);
+			if (ch == NULL) {
+				err = CORO_BUS_ERR_NO_CHANNEL;
+				break;
+			}
+			struct wakeup_queue *queue;
+			if (op->type == CORO_BUS_OP_SEND) {
+				if (!channel_is_full(ch)) {
+					channel_push(ch, NULL, &op->msg, 1);
+					wakeup_queue_wakeup_n(&ch->recv_queue, 1);
+					rc = (int)i;
+				}
+				queue = &ch->send_queue;
+			} else {
+				if (!coro_ring_is_empty(&ch->data)) {
+					channel_pop(ch, NULL, &op->msg, 1);
+					wakeup_queue_wakeup_n(&ch->send_queue, 1);
+					rc = (int)i;
+				}
+				queue = &ch->recv_queue;
+			}
+			if (rc < 0 && is_blocking) {
+				if (entries == NULL)
+					entries = new group_entry[count];
+				group_entry_add(&entries[entry_count++], &group, ch,
+						queue);
+			}
+			channel_unlock(bus, ch);
+			if (rc >= 0)
+				break;
+		}
+		if (rc >= 0 || err == CORO_BUS_ERR_NO_CHANNEL || !is_blocking) {
+			group_leave(bus, entries, entry_count, false, 0);
+			channel_commit_check(bus);
+			delete[] entries;
+			coro_bus_errno_set(rc >= 0 ? CORO_BUS_ERR_NONE : err);
+			return rc;
+		}
+		group_wait(bus, &group, entries, entry_count);
+		if (coro_is_cancelled()) {
+			delete[] entries;
+			coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+			return -1;
+		}
 	}
 }
 
-static void
-wakeup_queue_wakeup_n(struct wakeup_queue *queue, size_t count)
+int
+coro_bus_select(struct coro_bus *bus, struct coro_bus_op *ops, unsigned count)
 {
-	for (size_t i = 0; i < count; ++i) {
-		if (rlist_empty(&queue->coros))
-			return;
-		wakeup_queue_wakeup_first(queue);
-	}
+	return bus_select(bus, ops, count, true);
 }
 
-struct coro_bus_channel {
-	/** Channel max capacity. */
-	size_t size_limit;
-	/** Coroutines waiting until the channel is not full. */
-	struct wakeup_queue send_queue;
-	/** Coroutines waiting until the channel is not empty. */
-	struct wakeup_queue recv_queue;
-	/** Message queue. */
-	std::deque<unsigned> data;
-};
-
-struct coro_bus {
-	struct coro_bus_channel **channels;
-	unsigned long long *channel_gens;
-	int channel_count;
-};
-
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
-
-enum coro_bus_error_code
-coro_bus_errno(void)
+int
+coro_bus_try_select(struct coro_bus *bus, struct coro_bus_op *ops,
+	unsigned count)
 {
-	return global_error;
+	return bus_select(bus, ops, count, false);
 }
 
-void
-coro_bus_errno_set(enum coro_bus_error_code err)
+static inline void
+topic_unlock(struct coro_bus *bus, struct coro_bus_topic *t)
 {
-	global_error = err;
+	if (bus->is_mt)
+		coro_spinlock_unlock(t->lock);
 }
 
-static struct coro_bus_channel *
-channel_get(struct coro_bus *bus, int channel)
+/** Same as channel_acquire(), for a topic. */
+static struct coro_bus_topic *
+topic_acquire(struct coro_bus *bus, int topic, unsigned long long *gen)
 {
-	if (bus == NULL || channel < 0 || channel >= bus->channel_count)
-		return NULL;
-	return bus->channels[channel];
+	struct coro_bus_topic *t = NULL;
+	if (bus != NULL) {
+		t = (struct coro_bus_topic *)bus_slot_acquire(bus, &bus->topics,
+			topic, gen);
+	}
+	if (t == NULL)
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return t;
 }
 
-static unsigned long long
-channel_gen_get(struct coro_bus *bus, int channel)
+/** Same as channel_wait(), for a topic. */
+static bool
+topic_wait(struct coro_bus *bus, int topic, unsigned long long gen,
+	struct coro_bus_topic *t, struct wakeup_queue *queue)
 {
-	if (bus == NULL || channel < 0 || channel >= bus->channel_count)
-		return 0;
-	return bus->channel_gens[channel];
+	struct wakeup_entry entry;
+	entry.coro = coro_this();
+	entry.count = 1;
+	entry.group = NULL;
+	rlist_add_tail_entry(&queue->coros, &entry, base);
+	if (bus->is_mt)
+		coro_suspend_unlock(t->lock);
+	else
+		coro_suspend();
+	if (bus_slot_relock(bus, &bus->topics, topic, gen) == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return false;
+	}
+	if (!rlist_empty(&entry.base))
+		rlist_del_entry(&entry, base);
+	return true;
 }
 
-static bool
-channel_is_same(struct coro_bus *bus, int channel, unsigned long long gen)
+/** The active subscription, or NULL. */
+static struct topic_sub *
+topic_sub_get(struct coro_bus_topic *t, int sub)
 {
-	struct coro_bus_channel *ch = channel_get(bus, channel);
-	if (ch == NULL)
-		return false;
-	return channel_gen_get(bus, channel) == gen;
+	if (sub < 0 || sub >= t->sub_count || !t->subs[sub].is_active)
+		return NULL;
+	return &t->subs[sub];
 }
 
+/**
+ * Drop a reference to the message at the position. The oldest
+ * messages without references are deleted, and their slots are
+ * given to the publishers.
+ */
 static void
-channel_init(struct coro_bus_channel *channel, size_t size_limit)
+topic_release(struct coro_bus *bus, struct coro_bus_topic *t, size_t pos)
 {
-	channel->size_limit = size_limit;
-	wakeup_queue_init(&channel->send_queue);
-	wakeup_queue_init(&channel->recv_queue);
+	struct coro_ring *ring = &t->data;
+	assert(t->refs[pos & ring->mask] > 0);
+	--t->refs[pos & ring->mask];
+	size_t count = 0;
+	while (!coro_ring_is_empty(ring) && t->refs[ring->head & ring->mask] == 0) {
+		struct coro_bus_msg *msg = coro_ring_pop(ring);
+		if (msg->len > CORO_BUS_MSG_INLINE_SIZE && bus->msg_free != NULL)
+			bus->msg_free(msg->ptr, msg->len);
+		++count;
+	}
+	wakeup_queue_wakeup_n(&t->send_queue, count);
 }
 
-struct coro_bus *
-coro_bus_new(void)
+int
+coro_bus_topic_open(struct coro_bus *bus, size_t size_limit)
 {
-	struct coro_bus *bus = new coro_bus;
-	bus->channels = NULL;
-	bus->channel_gens = NULL;
-	bus->channel_count = 0;
+	if (bus == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_topic *t = new coro_bus_topic;
+	t->size_limit = size_limit;
+	wakeup_queue_init(&t->send_queue);
+	wakeup_queue_init(&t->recv_queue);
+	coro_ring_create(&t->data, size_limit);
+	t->refs = new unsigned[coro_ring_capacity(&t->data)];
+	t->subs = NULL;
+	t->sub_count = 0;
+	t->sub_capacity = 0;
+	t->free_subs = NULL;
+	t->free_sub_count = 0;
+	t->active_sub_count = 0;
+	bus_lock(bus);
+	int desc;
+	if (bus->free_topic_count > 0) {
+		desc = bus->free_topics[--bus->free_topic_count];
+	} else {
+		if (bus->topics.count == bus->topic_capacity)
+			bus_grow_topics(bus);
+		desc = bus_table_add(&bus->topics);
+	}
+	struct bus_slot *slot = bus_table_get(&bus->topics, desc);
+	t->lock = &slot->lock;
+	bus_slot_lock(bus, slot);
+	slot->obj = t;
+	bus_slot_unlock(bus, slot);
+	bus_unlock(bus);
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	return bus;
+	return desc;
 }
 
 void
-coro_bus_delete(struct coro_bus *bus)
+coro_bus_topic_close(struct coro_bus *bus, int topic)
 {
 	if (bus == NULL)
 		return;
-	for (int i = 0; i < bus->channel_count; ++i) {
-		struct coro_bus_channel *channel = bus->channels[i];
-		if (channel == NULL)
-			continue;
-		assert(rlist_empty(&channel->send_queue.coros));
-		assert(rlist_empty(&channel->recv_queue.coros));
-		delete channel;
-		bus->channels[i] = NULL;
+	bus_lock(bus);
+	unsigned long long gen;
+	struct coro_bus_topic *t = (struct coro_bus_topic *)bus_slot_acquire(bus,
+		&bus->topics, topic, &gen);
+	if (t == NULL) {
+		bus_unlock(bus);
+		return;
 	}
-	delete[] bus->channels;
-	delete[] bus->channel_gens;
-	delete bus;
+	struct bus_slot *slot = bus_table_get(&bus->topics, topic);
+	slot->obj = NULL;
+	slot->gen += 1;
+	bus->free_topics[bus->free_topic_count++] = topic;
+	wakeup_queue_wakeup_all(&t->send_queue);
+	wakeup_queue_wakeup_all(&t->recv_queue);
+	topic_unlock(bus, t);
+	bus_unlock(bus);
+	topic_delete(bus, t);
 }
 
 int
-coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+coro_bus_subscribe(struct coro_bus *bus, int topic)
 {
-	if (bus == NULL) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	unsigned long long gen;
+	struct coro_bus_topic *t = topic_acquire(bus, topic, &gen);
+	if (t == NULL)
 		return -1;
-	}
-	for (int i = 0; i < bus->channel_count; ++i) {
-		if (bus->channels[i] == NULL) {
-			struct coro_bus_channel *channel = new coro_bus_channel;
-			channel_init(channel, size_limit);
-			bus->channels[i] = channel;
-			coro_bus_errno_set(CORO_BUS_ERR_NONE);
-			return i;
+	int sub;
+	if (t->free_sub_count > 0) {
+		sub = t->free_subs[--t->free_sub_count];
+	} else {
+		if (t->sub_count == t->sub_capacity) {
+			int capacity = t->sub_capacity == 0 ? 8 :
+				t->sub_capacity * 2;
+			struct topic_sub *subs = new topic_sub[capacity];
+			int *free_subs = new int[capacity];
+			if (t->sub_count > 0)
+				memcpy(subs, t->subs, t->sub_count * sizeof(subs[0]));
+			delete[] t->subs;
+			delete[] t->free_subs;
+			t->subs = subs;
+			t->free_subs = free_subs;
+			t->sub_capacity = capacity;
 		}
+		sub = t->sub_count++;
+		t->subs[sub].gen = 1;
 	}
-	int new_count = bus->channel_count + 1;
-	struct coro_bus_channel **new_channels = new coro_bus_channel *[new_count];
-	unsigned long long *new_gens = new unsigned long long[new_count];
-	for (int i = 0; i < new_count; ++i)
-		new_channels[i] = NULL;
-	for (int i = 0; i < bus->channel_count; ++i)
-		new_channels[i] = bus->channels[i];
-	for (int i = 0; i < bus->channel_count; ++i)
-		new_gens[i] = bus->channel_gens[i];
-	new_gens[new_count - 1] = 1;
-	delete[] bus->channels;
-	delete[] bus->channel_gens;
-	bus->channels = new_channels;
-	bus->channel_gens = new_gens;
-	bus->channel_count = new_count;
-
-	struct coro_bus_channel *channel = new coro_bus_channel;
-	channel_init(channel, size_limit);
-	bus->channels[new_count - 1] = channel;
+	struct topic_sub *s = &t->subs[sub];
+	/* The messages published before are not for it. */
+	s->pos = t->data.tail;
+	s->is_holding = false;
+	s->is_active = true;
+	++t->active_sub_count;
+	topic_unlock(bus, t);
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	return new_count - 1;
+	return sub;
 }
 
 void
-coro_bus_channel_close(struct coro_bus *bus, int channel)
+coro_bus_unsubscribe(struct coro_bus *bus, int topic, int sub)
 {
-	struct coro_bus_channel *ch = channel_get(bus, channel);
-	if (ch == NULL)
+	unsigned long long gen;
+	struct coro_bus_topic *t = topic_acquire(bus, topic, &gen);
+	if (t == NULL)
 		return;
-	bus->channels[channel] = NULL;
-	bus->channel_gens[channel] += 1;
-	wakeup_queue_wakeup_all(&ch->send_queue);
-	wakeup_queue_wakeup_all(&ch->recv_queue);
-	delete ch;
+	struct topic_sub *s = topic_sub_get(t, sub);
+	if (s == NULL) {
+		topic_unlock(bus, t);
+		return;
+	}
+	s->is_active = false;
+	s->gen += 1;
+	--t->active_sub_count;
+	t->free_subs[t->free_sub_count++] = sub;
+	if (s->is_holding)
+		topic_release(bus, t, s->pos - 1);
+	for (size_t pos = s->pos; pos != t->data.tail; ++pos)
+		topic_release(bus, t, pos);
+	/* Its waiters leave, the others wait again. */
+	wakeup_queue_wakeup_n(&t->recv_queue, SIZE_MAX);
+	topic_unlock(bus, t);
 }
 
-int
-coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+static int
+topic_publish(struct coro_bus *bus, int topic, const struct coro_bus_msg *msg,
+	bool is_blocking)
 {
-	for (;;) {
-		int rc = coro_bus_try_send(bus, channel, data);
-		if (rc == 0) {
-			return 0;
-		}
-		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
-			return -1;
-		struct coro_bus_channel *ch = channel_get(bus, channel);
-		unsigned long long gen = channel_gen_get(bus, channel);
-		if (ch == NULL) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	unsigned long long gen;
+	struct coro_bus_topic *t = topic_acquire(bus, topic, &gen);
+	if (t == NULL)
+		return -1;
+	while (coro_ring_size(&t->data) >= t->size_limit) {
+		if (!is_blocking) {
+			topic_unlock(bus, t);
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 			return -1;
 		}
-		wakeup_queue_suspend_this(&ch->send_queue);
-		if (!channel_is_same(bus, channel, gen)) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		if (!topic_wait(bus, topic, gen, t, &t->send_queue))
+			return -1;
+		size_t size = coro_ring_size(&t->data);
+		if (wakeup_queue_is_cancelled(&t->send_queue, size < t->size_limit ?
+					      t->size_limit - size : 0)) {
+			topic_unlock(bus, t);
 			return -1;
 		}
 	}
+	if (t->active_sub_count == 0) {
+		topic_unlock(bus, t);
+		/* Nobody would ever release it. */
+		if (msg->len > CORO_BUS_MSG_INLINE_SIZE && bus->msg_free != NULL)
+			bus->msg_free(msg->ptr, msg->len);
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return 0;
+	}
+	t->refs[t->data.tail & t->data.mask] = (unsigned)t->active_sub_count;
+	*coro_ring_push(&t->data) = *msg;
+	/* Each subscriber needs the message, so wake them all. */
+	wakeup_queue_wakeup_n(&t->recv_queue, SIZE_MAX);
+	topic_unlock(bus, t);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
 }
 
-int
-coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+static int
+topic_recv(struct coro_bus *bus, int topic, int sub, struct coro_bus_msg *msg,
+	bool is_blocking)
 {
-	struct coro_bus_channel *ch = channel_get(bus, channel);
-	if (ch == NULL) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	unsigned long long gen;
+	struct coro_bus_topic *t = topic_acquire(bus, topic, &gen);
+	if (t == NULL)
 		return -1;
+	unsigned long long sub_gen;
+	struct topic_sub *s = topic_sub_get(t, sub);
+	if (s == NULL)
+		goto no_sub;
+	sub_gen = s->gen;
+	if (s->is_holding) {
+		s->is_holding = false;
+		topic_release(bus, t, s->pos - 1);
 	}
-	if (ch->data.size() >= ch->size_limit) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return -1;
+	while (s->pos == t->data.tail) {
+		if (!is_blocking) {
+			topic_unlock(bus, t);
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		if (!topic_wait(bus, topic, gen, t, &t->recv_queue))
+			return -1;
+		/*
+		 * The subscriptions could be reallocated or cancelled, and
+		 * the descriptor given to a new one.
+		 */
+		s = topic_sub_get(t, sub);
+		if (s == NULL || s->gen != sub_gen)
+			goto no_sub;
+		/* All the subscribers are woken up, no wakeups to pass. */
+		if (wakeup_queue_is_cancelled(&t->recv_queue, 0)) {
+			topic_unlock(bus, t);
+			return -1;
+		}
 	}
-	ch->data.push_back(data);
-	wakeup_queue_wakeup_first(&ch->recv_queue);
+	*msg = t->data.data[s->pos & t->data.mask];
+	/* A shared payload is held until the next receive. */
+	if (msg->len > CORO_BUS_MSG_INLINE_SIZE)
+		s->is_holding = true;
+	else
+		topic_release(bus, t, s->pos);
+	++s->pos;
+	topic_unlock(bus, t);
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	return 0;
+no_sub:
+	topic_unlock(bus, t);
+	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return -1;
 }
 
 int
-coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+coro_bus_publish_msg(struct coro_bus *bus, int topic, void *ptr, size_t len)
 {
-	for (;;) {
-		int rc = coro_bus_try_recv(bus, channel, data);
-		if (rc == 0)
-			return 0;
-		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
-			return -1;
-		struct coro_bus_channel *ch = channel_get(bus, channel);
-		unsigned long long gen = channel_gen_get(bus, channel);
-		if (ch == NULL) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-			return -1;
-		}
-		wakeup_queue_suspend_this(&ch->recv_queue);
-		if (!channel_is_same(bus, channel, gen)) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-			return -1;
-		}
-	}
+	struct coro_bus_msg msg;
+	coro_bus_msg_create(&msg, ptr, len);
+	return topic_publish(bus, topic, &msg, true);
 }
 
 int
-coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+coro_bus_try_publish_msg(struct coro_bus *bus, int topic, void *ptr,
+	size_t len)
 {
-	struct coro_bus_channel *ch = channel_get(bus, channel);
-	if (ch == NULL) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	struct coro_bus_msg msg;
+	coro_bus_msg_create(&msg, ptr, len);
+	return topic_publish(bus, topic, &msg, false);
+}
+
+int
+coro_bus_publish(struct coro_bus *bus, int topic, unsigned data)
+{
+	return coro_bus_publish_msg(bus, topic, &data, sizeof(data));
+}
+
+int
+coro_bus_try_publish(struct coro_bus *bus, int topic, unsigned data)
+{
+	return coro_bus_try_publish_msg(bus, topic, &data, sizeof(data));
+}
+
+int
+coro_bus_topic_recv_msg(struct coro_bus *bus, int topic, int sub,
+	struct coro_bus_msg *msg)
+{
+	return topic_recv(bus, topic, sub, msg, true);
+}
+
+int
+coro_bus_try_topic_recv_msg(struct coro_bus *bus, int topic, int sub,
+	struct coro_bus_msg *msg)
+{
+	return topic_recv(bus, topic, sub, msg, false);
+}
+
+int
+coro_bus_topic_recv(struct coro_bus *bus, int topic, int sub, unsigned *data)
+{
+	struct coro_bus_msg msg;
+	if (topic_recv(bus, topic, sub, &msg, true) != 0)
 		return -1;
-	}
-	if (ch->data.empty()) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+	memcpy(data, msg.data, sizeof(*data));
+	return 0;
+}
+
+int
+coro_bus_try_topic_recv(struct coro_bus *bus, int topic, int sub,
+	unsigned *data)
+{
+	struct coro_bus_msg msg;
+	if (topic_recv(bus, topic, sub, &msg, false) != 0)
 		return -1;
-	}
-	*data = ch->data.front();
-	ch->data.pop_front();
-	wakeup_queue_wakeup_first(&ch->send_queue);
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	memcpy(data, msg.data, sizeof(*data));
 	return 0;
 }
 
 #if NEED_BROADCAST
 
+/**
+ * Lock all the channels of the locked bus. Returns how many of
+ * them are full. The order doesn't matter, as nobody else locks
+ * more than one channel at once.
+ */
+static int
+bus_lock_channels(struct coro_bus *bus)
+{
+	int full_count = 0;
+	for (int i = 0; i < bus->active_count; ++i) {
+		struct coro_bus_channel *ch = bus->active[i];
+		channel_lock(bus, ch);
+		if (channel_is_full(ch))
+			++full_count;
+	}
+	return full_count;
+}
+
+/** Unlock all the channels. */
+static void
+bus_unlock_channels(struct coro_bus *bus)
+{
+	for (int i = 0; i < bus->active_count; ++i)
+		channel_unlock(bus, bus->active[i]);
+}
+
+/** Push the message into all the locked channels, and unlock them. */
+static void
+bus_push_all(struct coro_bus *bus, unsigned data)
+{
+	for (int i = 0; i < bus->active_count; ++i) {
+		struct coro_bus_channel *ch = bus->active[i];
+		channel_push(ch, &data, NULL, 1);
+		wakeup_queue_wakeup_n(&ch->recv_queue, 1);
+		channel_unlock(bus, ch);
+	}
+}
+
+/**
+ * Wait in the send queues of all the full channels at once, until
+ * each of them has room, or any of them is closed. The bus and all
+ * the channels are locked, and are unlocked on return. Returns
+ * false and sets the error when cancelled.
+ */
+static bool
+bus_wait_full(struct coro_bus *bus, int full_count)
+{
+	struct wakeup_group group;
+	wakeup_group_create(&group, full_count);
+	struct group_entry *entries = new group_entry[full_count];
+	int count = 0;
+	for (int i = 0; i < bus->active_count; ++i) {
+		struct coro_bus_channel *ch = bus->active[i];
+		if (channel_is_full(ch)) {
+			group_entry_add(&entries[count++], &group, ch,
+					&ch->send_queue);
+		}
+	}
+	assert(count == full_count);
+	bus_unlock_channels(bus);
+	bus_unlock(bus);
+	group_wait(bus, &group, entries, count);
+	delete[] entries;
+	if (coro_is_cancelled()) {
+		coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+		return false;
+	}
+	return true;
+}
+
 int
 coro_bus_broadcast(struct coro_bus *bus, unsigned data)
 {
+	if (bus == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
 	for (;;) {
-		if (bus == NULL) {
+		bus_lock(bus);
+		if (bus->active_count == 0) {
+			bus_unlock(bus);
 			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 			return -1;
 		}
-		bool has_channels = false;
-		bool has_full = false;
-		struct coro_bus_channel *block_channel = NULL;
-		for (int i = 0; i < bus->channel_count; ++i) {
-			struct coro_bus_channel *ch = bus->channels[i];
-			if (ch == NULL)
-				continue;
-			has_channels = true;
-			if (ch->data.size() >= ch->size_limit) {
-				has_full = true;
-				block_channel = ch;
-				break;
-			}
-		}
-		if (!has_channels) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-			return -1;
-		}
-		if (!has_full) {
-			for (int i = 0; i < bus->channel_count; ++i) {
-				struct coro_bus_channel *ch = bus->channels[i];
-				if (ch == NULL)
-					continue;
-				ch->data.push_back(data);
-				wakeup_queue_wakeup_first(&ch->recv_queue);
-			}
+		int full_count = bus_lock_channels(bus);
+		if (full_count == 0) {
+			bus_push_all(bus, data);
+			bus_unlock(bus);
+			channel_commit_check(bus);
 			coro_bus_errno_set(CORO_BUS_ERR_NONE);
 			return 0;
 		}
-		wakeup_queue_suspend_this(&block_channel->send_queue);
+		/*
+		 * Woken up once all of them have room. It might be taken
+		 * by the time of the rescan, or a channel might be closed,
+		 * then it is another wait on the new set of full ones.
+		 */
+		if (!bus_wait_full(bus, full_count))
+			return -1;
 	}
 }
 
@@ -353,28 +1880,21 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
-	bool has_channels = false;
-	for (int i = 0; i < bus->channel_count; ++i) {
-		struct coro_bus_channel *ch = bus->channels[i];
-		if (ch == NULL)
-			continue;
-		has_channels = true;
-		if (ch->data.size() >= ch->size_limit) {
-			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-			return -1;
-		}
-	}
-	if (!has_channels) {
+	bus_lock(bus);
+	if (bus->active_count == 0) {
+		bus_unlock(bus);
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
-	for (int i = 0; i < bus->channel_count; ++i) {
-		struct coro_bus_channel *ch = bus->channels[i];
-		if (ch == NULL)
-			continue;
-		ch->data.push_back(data);
-		wakeup_queue_wakeup_first(&ch->recv_queue);
+	if (bus_lock_channels(bus) != 0) {
+		bus_unlock_channels(bus);
+		bus_unlock(bus);
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
 	}
+	bus_push_all(bus, data);
+	bus_unlock(bus);
+	channel_commit_check(bus);
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	return 0;
 }
@@ -390,29 +1910,7 @@ coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigne
 		coro_bus_errno_set(CORO_BUS_ERR_NONE);
 		return 0;
 	}
-	for (;;) {
-		struct coro_bus_channel *ch = channel_get(bus, channel);
-		if (ch == NULL) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-			return -1;
-		}
-		size_t free_space = ch->size_limit - ch->data.size();
-		if (free_space == 0) {
-			unsigned long long gen = channel_gen_get(bus, channel);
-			wakeup_queue_suspend_this(&ch->send_queue);
-			if (!channel_is_same(bus, channel, gen)) {
-				coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-				return -1;
-			}
-			continue;
-		}
-		unsigned to_send = std::min<unsigned>(count, (unsigned)free_space);
-		for (unsigned i = 0; i < to_send; ++i)
-			ch->data.push_back(data[i]);
-		wakeup_queue_wakeup_n(&ch->recv_queue, to_send);
-		coro_bus_errno_set(CORO_BUS_ERR_NONE);
-		return (int)to_send;
-	}
+	return channel_send_v(bus, channel, data, NULL, count, true);
 }
 
 int
@@ -422,22 +1920,7 @@ coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, uns
 		coro_bus_errno_set(CORO_BUS_ERR_NONE);
 		return 0;
 	}
-	struct coro_bus_channel *ch = channel_get(bus, channel);
-	if (ch == NULL) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
-	size_t free_space = ch->size_limit - ch->data.size();
-	if (free_space == 0) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return -1;
-	}
-	unsigned to_send = std::min<unsigned>(count, (unsigned)free_space);
-	for (unsigned i = 0; i < to_send; ++i)
-		ch->data.push_back(data[i]);
-	wakeup_queue_wakeup_n(&ch->recv_queue, to_send);
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	return (int)to_send;
+	return channel_send_v(bus, channel, data, NULL, count, false);
 }
 
 int
@@ -447,30 +1930,7 @@ coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capa
 		coro_bus_errno_set(CORO_BUS_ERR_NONE);
 		return 0;
 	}
-	for (;;) {
-		struct coro_bus_channel *ch = channel_get(bus, channel);
-		if (ch == NULL) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-			return -1;
-		}
-		if (ch->data.empty()) {
-			unsigned long long gen = channel_gen_get(bus, channel);
-			wakeup_queue_suspend_this(&ch->recv_queue);
-			if (!channel_is_same(bus, channel, gen)) {
-				coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-				return -1;
-			}
-			continue;
-		}
-		unsigned to_recv = std::min<unsigned>(capacity, (unsigned)ch->data.size());
-		for (unsigned i = 0; i < to_recv; ++i) {
-			data[i] = ch->data.front();
-			ch->data.pop_front();
-		}
-		wakeup_queue_wakeup_n(&ch->send_queue, to_recv);
-		coro_bus_errno_set(CORO_BUS_ERR_NONE);
-		return (int)to_recv;
-	}
+	return channel_recv_v(bus, channel, data, NULL, capacity, true);
 }
 
 int
@@ -480,23 +1940,51 @@ coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned
 		coro_bus_errno_set(CORO_BUS_ERR_NONE);
 		return 0;
 	}
-	struct coro_bus_channel *ch = channel_get(bus, channel);
-	if (ch == NULL) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
+	return channel_recv_v(bus, channel, data, NULL, capacity, false);
+}
+
+int
+coro_bus_send_msg_v(struct coro_bus *bus, int channel,
+	const struct coro_bus_msg *msgs, unsigned count)
+{
+	if (count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return 0;
 	}
-	if (ch->data.empty()) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return -1;
+	return channel_send_v(bus, channel, NULL, msgs, count, true);
+}
+
+int
+coro_bus_try_send_msg_v(struct coro_bus *bus, int channel,
+	const struct coro_bus_msg *msgs, unsigned count)
+{
+	if (count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return 0;
 	}
-	unsigned to_recv = std::min<unsigned>(capacity, (unsigned)ch->data.size());
-	for (unsigned i = 0; i < to_recv; ++i) {
-		data[i] = ch->data.front();
-		ch->data.pop_front();
+	return channel_send_v(bus, channel, NULL, msgs, count, false);
+}
+
+int
+coro_bus_recv_msg_v(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msgs, unsigned capacity)
+{
+	if (capacity == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return 0;
 	}
-	wakeup_queue_wakeup_n(&ch->send_queue, to_recv);
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	return (int)to_recv;
+	return channel_recv_v(bus, channel, NULL, msgs, capacity, true);
+}
+
+int
+coro_bus_try_recv_msg_v(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msgs, unsigned capacity)
+{
+	if (capacity == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return 0;
+	}
+	return channel_recv_v(bus, channel, NULL, msgs, capacity, false);
 }
 
 #endif
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 /**
  * Here you should specify which bonuses do you want via the
@@ -15,22 +17,98 @@ enum coro_bus_error_code {
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	/** The waiting coroutine is cancelled, see coro_cancel(). */
+	CORO_BUS_ERR_CANCELLED,
+	/** A system call failed. See errno. */
+	CORO_BUS_ERR_SYSTEM,
 };
 
 struct coro_bus;
 
-/** Get the latest error happened in coro_bus. */
+enum {
+	/** Payloads up to this size are stored in the messages. */
+	CORO_BUS_MSG_INLINE_SIZE = 8,
+};
+
+/**
+ * A message with a payload of any size. It takes a slot of a
+ * channel. A small payload is copied into the message itself, a
+ * bigger one is passed by the pointer without copying. The
+ * unsigned values of coro_bus_send() and the others are the
+ * messages of sizeof(unsigned) bytes.
+ */
+struct coro_bus_msg {
+	/** Size of the payload. */
+	size_t len;
+	union {
+		/** The payload bigger than the inline size. */
+		void *ptr;
+		/** The payload of the inline size or smaller. */
+		char data[CORO_BUS_MSG_INLINE_SIZE];
+	};
+};
+
+/**
+ * Fill the message with a payload. Up to CORO_BUS_MSG_INLINE_SIZE
+ * bytes are copied, and @a ptr stays with the caller. A bigger
+ * payload is not copied. The message takes @a ptr instead, and
+ * whoever receives the message owns it then.
+ */
+static inline void
+coro_bus_msg_create(struct coro_bus_msg *msg, void *ptr, size_t len)
+{
+	msg->len = len;
+	if (len <= CORO_BUS_MSG_INLINE_SIZE)
+		memcpy(msg->data, ptr, len);
+	else
+		msg->ptr = ptr;
+}
+
+/** Payload of the message. A small one is inside the message. */
+static inline void *
+coro_bus_msg_data(struct coro_bus_msg *msg)
+{
+	return msg->len <= CORO_BUS_MSG_INLINE_SIZE ? msg->data : msg->ptr;
+}
+
+/**
+ * Called for the payload pointers of the messages which are
+ * deleted unreceived.
+ */
+typedef void (*coro_bus_msg_free_f)(void *ptr, size_t len);
+
+/**
+ * Get the latest error happened in coro_bus in this thread. Each
+ * worker thread has its own. A bus call sets it right before
+ * return, so it should be read before the coroutine can switch
+ * to another worker.
+ */
 enum coro_bus_error_code
 coro_bus_errno(void);
 
-/** Set the global coro_bus error. */
+/** Set the coro_bus error of this thread. */
 void
 coro_bus_errno_set(enum coro_bus_error_code err);
 
-/** Create a new messaging bus with no channels in it. */
+/**
+ * Create a new messaging bus with no channels in it. It can be
+ * used by the coroutines of one worker only.
+ */
 struct coro_bus *
 coro_bus_new(void);
 
+/**
+ * Same as coro_bus_new(), but the bus can be used by the
+ * coroutines of all the workers at once. The channels are guarded
+ * by their own locks, and are looked up without a common one, so
+ * the calls on the different channels don't wait for each other.
+ * Only the opens, the closes, and the broadcasts lock the whole
+ * bus. The waiters are woken up in any thread. Each call costs a
+ * spinlock more than in a single-threaded bus.
+ */
+struct coro_bus *
+coro_bus_new_mt(void);
+
 /**
  * Destroy the bus and all its channels. The channels can not have
  * any suspended coroutines, but might have unconsumed data which
@@ -39,11 +117,19 @@ coro_bus_new(void);
 void
 coro_bus_delete(struct coro_bus *bus);
 
+/**
+ * Set how to free the payloads passed by the pointers, when their
+ * messages are deleted unreceived with the channel or the bus. By
+ * default they are not freed.
+ */
+void
+coro_bus_set_msg_free(struct coro_bus *bus, coro_bus_msg_free_f func);
+
 /**
  * Create a channel inside the bus.
  * @param bus The bus to create the channel in.
  * @param size_limit Maximum messages a channel can hold in memory
- *     at once.
+ *     at once. The memory for them is allocated right away.
  *
  * @retval >=0 Descriptor of the channel. It must be passed to the
  *     send/recv functions.
@@ -51,10 +137,152 @@ coro_bus_delete(struct coro_bus *bus);
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 
+/** Options of a durable channel. */
+struct coro_bus_durable_opts {
+	/**
+	 * Bytes of the messages the file has room for when it is
+	 * created. It grows when they don't fit.
+	 */
+	size_t segment_size;
+	/**
+	 * Commit after this many messages are sent into the channel.
+	 * All the messages sent before the commit are synced to the
+	 * disk at once. 0 means to commit only with
+	 * coro_bus_channel_commit() and on close. The send which
+	 * fills the batch does the commit, and blocks its thread
+	 * until the disk syncs are done. The channel is not locked
+	 * meanwhile, the others can use it.
+	 */
+	unsigned commit_batch;
+};
+
+/** Fill the options with the defaults. */
+void
+coro_bus_durable_opts_create(struct coro_bus_durable_opts *opts);
+
+/**
+ * Same as coro_bus_channel_open(), but the channel is durable.
+ * The sent messages are also appended to a file mapped into
+ * memory, with their payloads, and the received ones are marked
+ * as read. A commit makes both durable. When the file exists, the
+ * channel starts with the messages which were not read as of the
+ * last commit, even if there are more of them than @a size_limit.
+ * So after a restart the receivers resume where the committed
+ * ones stopped, and the messages received after the last commit
+ * are delivered again. The bigger payloads of such messages are
+ * allocated with malloc(). The file stays after the channel is
+ * closed. A send into a durable channel can block the thread on
+ * the disk: on a commit, see commit_batch, and when the file has
+ * to grow.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages a channel can hold at once.
+ * @param path File of the channel.
+ * @param opts Options, NULL for the defaults.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_SYSTEM - the file can't be opened or is not
+ *       a channel file, see errno.
+ */
+int
+coro_bus_channel_open_durable(struct coro_bus *bus, size_t size_limit,
+	const char *path, const struct coro_bus_durable_opts *opts);
+
+/** Options of a channel spilling to a file. */
+struct coro_bus_spill_opts {
+	/** Directory of the temporary file. */
+	const char *dir;
+	/**
+	 * Maximum messages in the file. When it is full too, the
+	 * senders wait.
+	 */
+	size_t spill_limit;
+};
+
+/** Fill the options with the defaults. */
+void
+coro_bus_spill_opts_create(struct coro_bus_spill_opts *opts);
+
+/**
+ * Same as coro_bus_channel_open(), but when the memory of the
+ * channel is full, the sent messages go to a temporary file
+ * instead of suspending the senders. The messages are received in
+ * the same order, the ones from the file are read back into the
+ * memory as it frees up. So a burst of sends doesn't wait for the
+ * receivers, and the memory is @a size_limit messages still. The
+ * payloads passed by the pointers stay where they are, only the
+ * messages go to the file. The file is deleted right away, and
+ * is gone with the channel.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages the channel holds in memory.
+ * @param opts Options, NULL for the defaults.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_SYSTEM - the file can't be created, see
+ *       errno.
+ */
+int
+coro_bus_channel_open_spill(struct coro_bus *bus, size_t size_limit,
+	const struct coro_bus_spill_opts *opts);
+
+/**
+ * Make the messages sent into a durable channel and the receive
+ * position durable. The messages sent by then and not committed
+ * yet are synced with one call. Does nothing for the other
+ * channels. It doesn't suspend the coroutine, but blocks the
+ * thread for the time of the sync.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_commit(struct coro_bus *bus, int channel);
+
+/** Counters of a channel, since it was opened. */
+struct coro_bus_stats {
+	/** Messages sent into the channel. */
+	uint64_t send_count;
+	/** Messages received from the channel. */
+	uint64_t recv_count;
+	/**
+	 * How many times the senders waited for room, and the time
+	 * they spent suspended, in nanoseconds. The time is estimated
+	 * from a random sample of the waits, about one in 16. The
+	 * waits in several channels at once count in each of them.
+	 */
+	uint64_t send_wait_count;
+	uint64_t send_wait_ns;
+	/** Same for the receivers waiting for messages. */
+	uint64_t recv_wait_count;
+	uint64_t recv_wait_ns;
+	/**
+	 * Messages in the channel now, and the most there ever
+	 * were. The spilled ones count too.
+	 */
+	uint64_t size;
+	uint64_t max_size;
+};
+
+/**
+ * Get the counters of the channel. They are always collected, at
+ * the cost of a few additions per call, and a clock read per a
+ * sampled wait.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_stats(struct coro_bus *bus, int channel, struct coro_bus_stats *stats);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
- * deleted and lost. All the coroutines suspended on this channel
+ * deleted and lost, see coro_bus_set_msg_free() for their
+ * payloads. A durable channel is committed and keeps them in its
+ * file. All the coroutines suspended on this channel
  * are woken up and get the error that the channel is missing.
  * @param bus Bus to destroy the channel in.
  * @param channel Descriptor of the channel to destroy.
@@ -73,6 +301,8 @@ coro_bus_channel_close(struct coro_bus *bus, int channel);
  * @retval 0 Success.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
  */
 int
 coro_bus_send(struct coro_bus *bus, int channel, unsigned data);
@@ -105,6 +335,8 @@ coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data);
  *     message.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
  */
 int
 coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
@@ -126,6 +358,217 @@ coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
+/**
+ * Same as coro_bus_send(), but the message has a payload of any
+ * size. See coro_bus_msg_create() for who owns @a ptr after the
+ * call. On failure it stays with the caller.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param ptr Payload.
+ * @param len Size of the payload.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
+ */
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel, void *ptr, size_t len);
+
+/**
+ * Same as coro_bus_send_msg(), but if the channel is full, the
+ * function immediately returns with CORO_BUS_ERR_WOULD_BLOCK.
+ */
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel, void *ptr,
+	size_t len);
+
+/**
+ * Same as coro_bus_recv(), but receives a message. Use
+ * coro_bus_msg_data() to get the payload. A channel should carry
+ * either the unsigned values or the messages of other sizes. The
+ * unsigned values are received as messages fine. But the other
+ * messages received as unsigned values are cut to their first
+ * bytes, and their pointers are lost.
+ *
+ * @retval 0 Success. @a msg is filled with the received message.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
+ */
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, struct coro_bus_msg *msg);
+
+/**
+ * Same as coro_bus_recv_msg(), but if the channel is empty, the
+ * function immediately returns with CORO_BUS_ERR_WOULD_BLOCK.
+ */
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msg);
+
+enum coro_bus_op_type {
+	CORO_BUS_OP_SEND,
+	CORO_BUS_OP_RECV,
+};
+
+/** One of the operations to choose from in coro_bus_select(). */
+struct coro_bus_op {
+	/** Descriptor of the channel. */
+	int channel;
+	enum coro_bus_op_type type;
+	/**
+	 * The message to send, made with coro_bus_msg_create(). Or
+	 * where to save the received one.
+	 */
+	struct coro_bus_msg msg;
+};
+
+/**
+ * Complete exactly one of the operations, whichever is ready. If
+ * several are ready, the first one in @a ops is taken. If none,
+ * the coroutine is suspended until any of the channels has a
+ * message or room for one. So one coroutine can serve many
+ * channels. The same channel can be used in several operations.
+ * The messages of the other operations stay with the caller.
+ * @param bus Bus where the channels are located.
+ * @param ops Operations to choose from.
+ * @param count Size of @a ops.
+ *
+ * @retval >=0 Success, index of the completed operation.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - any of the channels doesn't
+ *       exist, or is closed while waiting, or @a count is 0.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
+ */
+int
+coro_bus_select(struct coro_bus *bus, struct coro_bus_op *ops, unsigned count);
+
+/**
+ * Same as coro_bus_select(), but if none of the operations is
+ * ready, the function immediately returns with
+ * CORO_BUS_ERR_WOULD_BLOCK.
+ */
+int
+coro_bus_try_select(struct coro_bus *bus, struct coro_bus_op *ops,
+	unsigned count);
+
+/**
+ * Create a topic inside the bus. It is one queue of messages,
+ * and each subscriber reads all of them with its own position. A
+ * message is published once however many subscribers there are,
+ * and its slot is free when all of them have read it. So the
+ * memory of a topic doesn't depend on the number of subscribers,
+ * but the slowest one holds the publishers back. The topics have
+ * their own descriptors, apart from the channels.
+ * @param bus The bus to create the topic in.
+ * @param size_limit Maximum messages the topic holds at once.
+ *
+ * @retval >=0 Descriptor of the topic.
+ */
+int
+coro_bus_topic_open(struct coro_bus *bus, size_t size_limit);
+
+/**
+ * Destroy the topic with all its subscriptions. The unread
+ * payloads are freed, see coro_bus_set_msg_free(). The
+ * coroutines suspended on the topic are woken up and get the
+ * error that the topic is missing.
+ */
+void
+coro_bus_topic_close(struct coro_bus *bus, int topic);
+
+/**
+ * Subscribe to the topic. The subscriber gets the messages
+ * published from now on.
+ *
+ * @retval >=0 Descriptor of the subscription, within the topic.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the topic doesn't exist.
+ */
+int
+coro_bus_subscribe(struct coro_bus *bus, int topic);
+
+/**
+ * Cancel the subscription. Its unread messages are not held
+ * anymore.
+ */
+void
+coro_bus_unsubscribe(struct coro_bus *bus, int topic, int sub);
+
+/**
+ * Publish the message to all the current subscribers of the
+ * topic. If the slowest of them has not read the oldest message
+ * of the full topic, the coroutine is suspended until it does.
+ * When there are no subscribers, the message is dropped, and its
+ * payload is freed. A payload passed by the pointer is shared by
+ * the subscribers, they must not change or free it. It is freed
+ * when the last one is done with it, see coro_bus_topic_recv_msg()
+ * and coro_bus_set_msg_free().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the topic doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
+ */
+int
+coro_bus_publish_msg(struct coro_bus *bus, int topic, void *ptr, size_t len);
+
+/**
+ * Same as coro_bus_publish_msg(), but if the topic is full, the
+ * function immediately returns with CORO_BUS_ERR_WOULD_BLOCK.
+ */
+int
+coro_bus_try_publish_msg(struct coro_bus *bus, int topic, void *ptr,
+	size_t len);
+
+/** Same as coro_bus_publish_msg() with an unsigned value. */
+int
+coro_bus_publish(struct coro_bus *bus, int topic, unsigned data);
+
+/** Same as coro_bus_try_publish_msg() with an unsigned value. */
+int
+coro_bus_try_publish(struct coro_bus *bus, int topic, unsigned data);
+
+/**
+ * Receive the next message of the subscription. If there is none
+ * yet, the coroutine is suspended until it is published. A
+ * payload passed by the pointer stays valid until the next
+ * receive of the same subscriber, or its unsubscription.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the topic or the subscription
+ *       doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
+ */
+int
+coro_bus_topic_recv_msg(struct coro_bus *bus, int topic, int sub,
+	struct coro_bus_msg *msg);
+
+/**
+ * Same as coro_bus_topic_recv_msg(), but if there are no new
+ * messages, the function immediately returns with
+ * CORO_BUS_ERR_WOULD_BLOCK.
+ */
+int
+coro_bus_try_topic_recv_msg(struct coro_bus *bus, int topic, int sub,
+	struct coro_bus_msg *msg);
+
+/** Same as coro_bus_topic_recv_msg() with an unsigned value. */
+int
+coro_bus_topic_recv(struct coro_bus *bus, int topic, int sub, unsigned *data);
+
+/** Same as coro_bus_try_topic_recv_msg() with an unsigned value. */
+int
+coro_bus_try_topic_recv(struct coro_bus *bus, int topic, int sub,
+	unsigned *data);
+
 
 #if NEED_BROADCAST /* Bonus 1 */
 
@@ -140,6 +583,8 @@ coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
  * @retval 0 Success. Sent to all the channels.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
  */
 int
 coro_bus_broadcast(struct coro_bus *bus, unsigned data);
@@ -178,6 +623,8 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
  *     messages are sent, they are guaranteed data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
  */
 int
 coro_bus_send_v(struct coro_bus *bus, int channel,
@@ -219,6 +666,8 @@ coro_bus_try_send_v(struct coro_bus *bus, int channel,
  *     data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
  */
 int
 coro_bus_recv_v(struct coro_bus *bus, int channel,
@@ -244,4 +693,50 @@ int
 coro_bus_try_recv_v(struct coro_bus *bus, int channel,
 	unsigned *data, unsigned capacity);
 
+/**
+ * Same as coro_bus_send_v(), but sends the messages made with
+ * coro_bus_msg_create(). Only the messages are copied, not the
+ * payloads behind their pointers. The pointers of the sent
+ * messages go to the receivers, the rest stay with the caller.
+ *
+ * @retval >0 Success, how many first messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
+ */
+int
+coro_bus_send_msg_v(struct coro_bus *bus, int channel,
+	const struct coro_bus_msg *msgs, unsigned count);
+
+/**
+ * Same as coro_bus_send_msg_v(), but fails instantly with
+ * CORO_BUS_ERR_WOULD_BLOCK in case the channel is full.
+ */
+int
+coro_bus_try_send_msg_v(struct coro_bus *bus, int channel,
+	const struct coro_bus_msg *msgs, unsigned count);
+
+/**
+ * Same as coro_bus_recv_v(), but receives the messages.
+ *
+ * @retval >0 Success, how many messages were received into the
+ *     first slots of @a msgs.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled
+ *       while waiting.
+ */
+int
+coro_bus_recv_msg_v(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msgs, unsigned capacity);
+
+/**
+ * Same as coro_bus_recv_msg_v(), but fails instantly with
+ * CORO_BUS_ERR_WOULD_BLOCK if the channel is empty.
+ */
+int
+coro_bus_try_recv_msg_v(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msgs, unsigned capacity);
+
 #endif /* Bonus 2 */
@@ -1,16 +1,28 @@
 #include "libcoro.h"
 
+#include "coro_ctx.h"
+#include "coro_stack.h"
+#include "coro_timer.h"
 #include "rlist.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <setjmp.h>
-#include <signal.h>
-#include <errno.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef CORO_STATS
+#include <algorithm>
+#include <vector>
+#endif
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
@@ -23,6 +35,84 @@ enum coro_state {
 	CORO_STATE_FINISHED,
 };
 
+/**
+ * What a coroutine asks the scheduler to do with it when switches
+ * back into the scheduler.
+ */
+enum coro_op {
+	/** Put it back into the run queue. */
+	CORO_OP_YIELD,
+	/** Mark as suspended, wait for a wakeup. */
+	CORO_OP_SUSPEND,
+	/** Same, but a cancellation is a wakeup too. */
+	CORO_OP_SUSPEND_CANCELLABLE,
+	/** Mark as finished, wakeup the joiner. */
+	CORO_OP_FINISH,
+};
+
+/**
+ * A coroutine waiting for a descriptor. Lives in the coroutine,
+ * and is owned by the engine whose epoll watches the
+ * descriptor. Only that engine completes it, even if the
+ * coroutine is woken up spuriously and migrates to another
+ * worker.
+ */
+struct coro_io_wait {
+	/** The waiting coroutine. */
+	struct coro *coro;
+	/** The owner engine. */
+	struct coro_engine *engine;
+	/** The watched descriptor. */
+	int fd;
+	/** Ready events, enum coro_event. 0 on timeout. */
+	int revents;
+	/** Set by the engine when the wait is over. */
+	bool is_done;
+	/** Whether the wait has a timeout. */
+	bool has_timer;
+	/** Timer of the timeout. */
+	struct coro_timer timer;
+};
+
+/**
+ * A coroutine sleeping or suspended with a timeout. Lives in the
+ * coroutine.
+ */
+struct coro_sleep {
+	struct coro_timer timer;
+	/** The sleeping coroutine. */
+	struct coro *coro;
+	/** Engine, whose wheel has the timer. */
+	struct coro_engine *engine;
+	/** Set when the timer expires. */
+	bool is_fired;
+};
+
+/**
+ * A coroutine waiting on a mutex, a condition, a semaphore, or a
+ * wait group. Lives in the coroutine, queued in the primitive.
+ */
+struct coro_sync_wait {
+	/** The waiting coroutine. */
+	struct coro *coro;
+	/** Link in the waiters of the primitive. */
+	struct rlist link;
+	/**
+	 * Set by the waker under the lock of the primitive, when
+	 * the wait is over.
+	 */
+	bool is_done;
+};
+
+enum {
+	/** Number of the coroutine-local keys stored in the coroutine. */
+	CORO_LOCAL_INLINE_COUNT = 4,
+	/** Max number of the coroutine-local keys. */
+	CORO_KEY_MAX = 1024,
+	/** How many times the destructors of the locals are called at most. */
+	CORO_LOCAL_DESTRUCTOR_PASSES = 4,
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** Coroutine state. */
@@ -30,378 +120,2532 @@ struct coro {
 	/** A value, returned by func. */
 	void *ret;
 	/** Stack, used by the coroutine. */
-	uint8_t *stack;
+	struct coro_stack *stack;
+	/** Stack size requested at the coroutine creation. */
+	size_t stack_size;
+	/**
+	 * Engine which runs the coroutine or ran it last time.
+	 * Wakeups from other threads are sent into its inbox.
+	 */
+	struct coro_engine *engine;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
 	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
+	struct coro_ctx ctx;
 	/**
 	 * Coroutine which is trying to join this one right now.
 	 */
 	struct coro *joiner;
+	/**
+	 * Protects the joiner, the cancellation, and the transitions
+	 * to finished and to suspended in a cancellable wait.
+	 */
+	struct coro_spinlock join_lock;
+	/** Set by coro_cancel(), never reset until the coroutine ends. */
+	bool is_cancelled;
+	/** Group of the coroutine, if any. */
+	struct coro_group *group;
+	/** Link in the children of the group. */
+	struct rlist group_link;
+	/** Values of the first coroutine-local keys. */
+	void *locals[CORO_LOCAL_INLINE_COUNT];
+	/** Values of the other keys, allocated on demand. */
+	void **locals_ext;
+	/** Size of locals_ext. */
+	size_t locals_ext_size;
+	/** Whether any value could be set since the start. */
+	bool has_locals;
 	/** Links in a coroutine list, used by the scheduler. */
 	struct rlist link;
+	/** Next coroutine in the inbox of an engine. */
+	struct coro *inbox_next;
+	/** Priority class. */
+	enum coro_priority prio;
+	/**
+	 * Class of the priority queue the coroutine is in. The
+	 * priority can change while it is queued.
+	 */
+	enum coro_priority queue_prio;
+	/**
+	 * The wait the coroutine is in, if any. Not on the stack,
+	 * because a switched out coroutine's stack is not
+	 * addressable in the shared stack mode.
+	 */
+	union {
+		struct coro_sleep sleep;
+		struct coro_io_wait io;
+		struct coro_sync_wait sync;
+	} wait;
+	/** True if the coroutine runs on the shared stack of its engine. */
+	bool is_shared;
+	/**
+	 * Lowest address of the shared stack the coroutine used
+	 * when switched out. NULL if it has never run.
+	 */
+	uint8_t *shared_sp;
+	/**
+	 * Copy of the used part of the shared stack, when another
+	 * coroutine took the stack.
+	 */
+	uint8_t *saved;
+	/** Size of the copy. */
+	size_t saved_size;
+	/** Size of the copy buffer. */
+	size_t saved_capacity;
+#ifdef CORO_STATS
+	/** Counters of the coroutine. */
+	struct coro_stats stats;
+	/** When the coroutine became runnable the last time. */
+	uint64_t runnable_ts;
+	/** Link in the list of all the not joined coroutines. */
+	struct rlist stats_link;
+#endif
+};
+
+enum {
+	/** Capacity of the local run queue of each worker. */
+	CORO_RUNQ_SIZE = 256,
+	/** Each that many picks the global queue is checked first. */
+	CORO_GLOBAL_QUEUE_PERIOD = 61,
+	/**
+	 * How many times in a row a non-empty priority class can be
+	 * passed over in favor of the higher ones.
+	 */
+	CORO_PRIO_MAX_SKIPS = 8,
+	/**
+	 * Each that many picks a worker with multiple workers
+	 * polls its I/O, even if it has other work to do.
+	 */
+	CORO_POLL_PERIOD = 61,
+	/** Max number of events taken by one epoll_wait(). */
+	CORO_POLL_BATCH = 64,
+	/** Timers resolution, 1 millisecond - same as of epoll_wait(). */
+	CORO_TICK_NS = 1000000,
+	/**
+	 * How many bytes below the switch-out point of a coroutine on
+	 * the shared stack are saved too. The frames of the context
+	 * switch itself are there.
+	 */
+	CORO_SHARED_STACK_SLACK = 256,
+};
+
+/**
+ * Run queue of a worker thread. Only the owner pushes, to the
+ * tail. The owner and the thieves take from the head.
+ */
+struct coro_runq {
+	uint32_t head;
+	uint32_t tail;
+	struct coro *slots[CORO_RUNQ_SIZE];
 };
 
+/**
+ * Runnable coroutines split by the priority classes. FIFO inside
+ * each class.
+ */
+struct coro_prio_queue {
+	/** Coroutines of each class. */
+	struct rlist lists[CORO_PRIO_COUNT];
+	/** Number of coroutines of each class. */
+	size_t counts[CORO_PRIO_COUNT];
+	/** Total number of coroutines. */
+	size_t count;
+	/** How many picks in a row each class was passed over. */
+	unsigned skips[CORO_PRIO_COUNT];
+};
+
+static void
+coro_prio_queue_create(struct coro_prio_queue *q)
+{
+	for (int p = 0; p < CORO_PRIO_COUNT; ++p) {
+		rlist_create(&q->lists[p]);
+		q->counts[p] = 0;
+		q->skips[p] = 0;
+	}
+	q->count = 0;
+}
+
+static void
+coro_prio_queue_push(struct coro_prio_queue *q, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	enum coro_priority p = __atomic_load_n(&c->prio, __ATOMIC_RELAXED);
+	c->queue_prio = p;
+	rlist_add_tail_entry(&q->lists[p], c, link);
+	/*
+	 * The counters are read without the lock as hints. The
+	 * waking up of the idle workers has its own fences.
+	 */
+	__atomic_store_n(&q->counts[p], q->counts[p] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELAXED);
+}
+
+static void
+coro_prio_queue_del(struct coro_prio_queue *q, struct coro *c)
+{
+	enum coro_priority p = c->queue_prio;
+	rlist_del_entry(c, link);
+	__atomic_store_n(&q->counts[p], q->counts[p] - 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take the first coroutine of the highest non-empty class, unless
+ * a lower class was passed over too many times. Then the lowest
+ * of such classes is served. O(1), the number of classes is
+ * fixed.
+ */
+static struct coro *
+coro_prio_queue_pop(struct coro_prio_queue *q)
+{
+	if (q->count == 0)
+		return NULL;
+	int pick;
+	if (q->counts[CORO_PRIO_NORMAL] == q->count) {
+		/* The most common case, no other classes. */
+		pick = CORO_PRIO_NORMAL;
+	} else {
+		int best = -1;
+		int starved = -1;
+		for (int p = 0; p < CORO_PRIO_COUNT; ++p) {
+			if (q->counts[p] == 0)
+				continue;
+			if (best < 0)
+				best = p;
+			else if (q->skips[p] >= CORO_PRIO_MAX_SKIPS)
+				starved = p;
+		}
+		pick = starved >= 0 ? starved : best;
+		for (int p = 0; p < CORO_PRIO_COUNT; ++p) {
+			if (p != pick && q->counts[p] != 0)
+				++q->skips[p];
+		}
+		q->skips[pick] = 0;
+	}
+	struct coro *c = rlist_first_entry(&q->lists[pick], struct coro, link);
+	coro_prio_queue_del(q, c);
+	return c;
+}
+
+/**
+ * Engine runs the coroutines in one thread. When the scheduler
+ * has multiple workers, each thread has its own engine.
+ */
 struct coro_engine {
+	/** The scheduler this engine is a part of. */
+	struct coro_sched *sched;
+	/** Index of the engine in the scheduler. */
+	int id;
+	/**
+	 * Context of the scheduler loop. The coroutines switch to
+	 * it to yield, suspend, or finish.
+	 */
+	struct coro_ctx sched_ctx;
 	/**
-	 * Scheduler is the main coroutine - it represents the
-	 * context in which the scheduler itself runs.
+	 * Where the current coroutine switches to. It is the
+	 * scheduler loop, or the caller of an inline coroutine
+	 * while it runs for the first time.
 	 */
-	struct coro sched;
+	struct coro_ctx *return_ctx;
 	/** Which coroutine works at this moment. */
 	struct coro *this_coro;
+	/** What the last switched out coroutine asked for. */
+	enum coro_op op;
+	/**
+	 * A lock to release after the coroutine is switched out.
+	 * Allows to suspend under a lock without losing a wakeup
+	 * from another thread.
+	 */
+	struct coro_spinlock *op_lock;
 
 	/**
-	 * Coroutines to run in this iteration of the loop. The
-	 * list gets populated once at the start of the iteration.
+	 * Runnable coroutines, used with a single worker only. The
+	 * wakeups, yields, and new coros go to the tails. An
+	 * iteration of the loop takes as many coroutines as there
+	 * were at its start, so within a class it is a round-robin.
 	 */
-	struct rlist coros_running_now;
+	struct coro_prio_queue coros_running;
+	/** Local run queue, used with multiple workers only. */
+	alignas(64) struct coro_runq runq;
 	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
+	 * Coroutines woken up from other threads. A lock-free
+	 * stack, linked via coro.inbox_next.
 	 */
-	struct rlist coros_running_next;
+	alignas(64) struct coro *inbox;
+	/** Counter of picks for the fairness of the global queue. */
+	alignas(64) unsigned tick;
+	/** State of the random generator for the victim choice. */
+	unsigned rand;
+	/** Number of high priority picks from the global queue in a row. */
+	unsigned high_streak;
+
 	/** Joined coroutines to be reused. */
 	struct rlist coros_pool;
-	/** Total number of coroutines, including the pool. */
-	size_t coro_count;
+	/** Number of coroutines in the pool. */
+	size_t pool_count;
+	/** Max number of coroutines to keep in the pool. */
+	size_t pool_limit;
+	/**
+	 * Joined inline coroutines which finished without switching
+	 * out, so have no stacks. Limited by the same pool_limit.
+	 */
+	struct rlist inline_pool;
+	/** Number of coroutines in the inline pool. */
+	size_t inline_pool_count;
+	/**
+	 * Stack for the next inline coroutine, with its context
+	 * parked at the end of coro_body() and ready to run the
+	 * next function. NULL when an inline coroutine has it or
+	 * took it for good.
+	 */
+	struct coro_stack *inline_stack;
+	struct coro_ctx inline_ctx;
+	/**
+	 * The stack of the coroutines created by coro_new() in the
+	 * shared stack mode. NULL in the normal mode.
+	 */
+	struct coro_stack *shared_stack;
+	/**
+	 * Coroutine whose frames are on the shared stack now. Their
+	 * copy is made only when another coroutine needs the stack.
+	 */
+	struct coro *shared_owner;
+	/**
+	 * Number of coroutines created by this engine minus the
+	 * ones freed by it. A coroutine can be freed by another
+	 * engine, so only the sum over all engines makes sense.
+	 */
+	long coro_count;
+	/** Default stack size of the new coroutines. */
+	size_t stack_size;
+	/** Stacks of the coroutines. */
+	struct coro_stack_pool stack_pool;
+
+	/** Epoll of the I/O waits, created on the first wait. */
+	int epoll_fd;
+	/**
+	 * Eventfd in the epoll, to interrupt a blocking poll when
+	 * another thread sends a coroutine into the inbox. Used
+	 * with multiple workers only.
+	 */
+	int event_fd;
+	/** True while the worker can be blocked in epoll_wait(). */
+	bool is_polling;
+	/** Number of the I/O waits. */
+	size_t io_count;
 	/**
-	 * Buffer, used by the coroutine constructor to escape
-	 * from the signal handler back into the constructor to
-	 * rollback sigaltstack etc.
+	 * Protects the timers and the I/O waits. A coroutine can be
+	 * woken up before its timeout and cancel the timer from
+	 * another worker.
 	 */
-	sigjmp_buf start_point;
+	struct coro_spinlock wait_lock;
+	/** Timers of the coroutines suspended in this engine. */
+	struct coro_timer_wheel timers;
+	/** Tick of the last poll. */
+	uint64_t poll_tick;
+#ifdef CORO_STATS
+	/** Counters of this worker. */
+	struct coro_sched_stats stats;
+#endif
 };
 
-static void
-coro_engine_create(struct coro_engine *engine)
+/** A set of engines, each working in its own thread. */
+struct coro_sched {
+	/** Engines, one per worker thread. */
+	struct coro_engine *engines;
+	/** Number of the engines. */
+	int engine_count;
+	/**
+	 * Number of coroutines which are running, ready to run, or
+	 * waiting for I/O. When it drops to zero, the scheduler is
+	 * done. Used with multiple workers only.
+	 */
+	alignas(64) long runnable_count;
+	/** Number of workers sleeping in the idle wait. */
+	alignas(64) int idle_count;
+	/** True when the workers should stop. */
+	bool is_done;
+	/** Protects the idle waiting. */
+	pthread_mutex_t idle_lock;
+	/** Signaled when there is new work or the end. */
+	pthread_cond_t idle_cond;
+	/**
+	 * Queue for the coroutines not fitting into the local run
+	 * queues, and for all the high and low priority ones.
+	 */
+	pthread_mutex_t global_lock;
+	struct coro_prio_queue global_queue;
+#ifdef CORO_STATS
+	/** Protects the list of the coroutines. */
+	pthread_mutex_t stats_lock;
+	/** All the not joined coroutines. */
+	struct rlist stats_coros;
+#endif
+};
+
+/**
+ * Engine of the current thread. The coroutines can migrate
+ * between the threads, so it must not be cached across the
+ * switches.
+ */
+static __thread struct coro_engine *this_engine = NULL;
+
+static inline bool
+coro_sched_is_mt(const struct coro_sched *sched)
 {
-	memset(engine, 0, sizeof(*engine));
-	rlist_create(&engine->sched.link);
-	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	return sched->engine_count > 1;
 }
 
-static void
-coro_engine_resume_next(struct coro_engine *engine)
+static inline enum coro_state
+coro_state_get(const struct coro *c)
 {
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
-		struct coro, link);
-	struct coro *from = engine->this_coro;
-	assert(from != NULL);
+	return __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+}
 
-	engine->this_coro = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	assert(rlist_empty(&from->link));
-	assert(engine->this_coro == NULL);
-	engine->this_coro = from;
+static inline void
+coro_state_set(struct coro *c, enum coro_state state)
+{
+	__atomic_store_n(&c->state, state, __ATOMIC_RELEASE);
 }
 
-static void
-coro_engine_suspend(struct coro_engine *engine)
+static inline bool
+coro_cancel_is_set(const struct coro *c)
 {
-	struct coro *this_coro = engine->this_coro;
-	if (this_coro == NULL) {
-		printf("Error: deadlock - suspension with no active "
-			"coroutines\n");
-		exit(-1);
-	}
-	assert(rlist_empty(&this_coro->link));
-	assert(this_coro->state == CORO_STATE_RUNNING);
-	this_coro->state = CORO_STATE_SUSPENDED;
-	coro_engine_resume_next(engine);
+	return __atomic_load_n(&c->is_cancelled, __ATOMIC_RELAXED);
 }
 
-static void
-coro_engine_yield(struct coro_engine *engine)
+/** Monotonic time in nanoseconds. */
+static uint64_t
+coro_clock_ns(void)
 {
-	struct coro *this_coro = engine->this_coro;
-	assert(rlist_empty(&this_coro->link));
-	assert(this_coro->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this_coro, link);
-	coro_engine_resume_next(engine);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+//////////////////////////////////////////////////////////////////
+// Instrumentation. Compiled out without CORO_STATS.
+
+#ifdef CORO_STATS
+
+static inline uint64_t
+coro_stats_now(void)
 {
-	if (coro->state == CORO_STATE_RUNNING)
-		return;
-	if (coro->state == CORO_STATE_FINISHED)
-		return;
-	assert(coro->state == CORO_STATE_SUSPENDED);
-	assert(rlist_empty(&coro->link));
-	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	return coro_clock_ns();
 }
 
-static void
-coro_engine_run(struct coro_engine *engine)
+static inline void
+coro_stats_on_runnable(struct coro *c, uint64_t now)
 {
-	while (true) {
-		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+	c->runnable_ts = now;
+}
 
-		assert(engine->this_coro == NULL);
-		engine->this_coro = &engine->sched;
-		assert(rlist_empty(&engine->sched.link));
-		/*
-		 * Add the scheduler to the tail so the control
-		 * comes back in the end of this iteration of the
-		 * loop.
-		 */
-		rlist_add_tail_entry(&engine->coros_running_now,
-			&engine->sched, link);
-		coro_engine_resume_next(engine);
-		assert(rlist_empty(&engine->coros_running_now));
-		assert(engine->this_coro == &engine->sched);
-		engine->this_coro = NULL;
-	}
+/** Account a switch into the coroutine. */
+static inline void
+coro_stats_on_switch_in(struct coro_engine *engine, struct coro *c,
+	uint64_t now)
+{
+	c->stats.wait_ns += now - c->runnable_ts;
+	++c->stats.switch_count;
+	++engine->stats.switch_count;
 }
 
-static void
-coro_engine_destroy(struct coro_engine *engine)
+/** Account a switch out of the coroutine. */
+static inline void
+coro_stats_on_switch_out(struct coro_engine *engine, struct coro *c,
+	uint64_t start, uint64_t now, enum coro_op op)
 {
-	assert(engine->this_coro == NULL);
-	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		delete[] c->stack;
-		delete c;
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
+	c->stats.cpu_ns += now - start;
+	engine->stats.cpu_ns += now - start;
+	if (op == CORO_OP_YIELD) {
+		++c->stats.yield_count;
+		c->runnable_ts = now;
+	} else if (op == CORO_OP_SUSPEND ||
+		   op == CORO_OP_SUSPEND_CANCELLABLE) {
+		++c->stats.suspend_count;
 	}
-	assert(engine->coro_count == 0);
-	memset(engine, '#', sizeof(*engine));
 }
 
-static __thread struct coro_engine *new_coro_engine = NULL;
+static inline void
+coro_stats_on_idle(struct coro_engine *engine, uint64_t start)
+{
+	engine->stats.idle_ns += coro_stats_now() - start;
+}
+
+static inline void
+coro_stats_on_runq_len(struct coro_engine *engine, uint64_t len)
+{
+	++engine->stats.runq_sample_count;
+	engine->stats.runq_len_sum += len;
+	if (len > engine->stats.runq_len_max)
+		engine->stats.runq_len_max = len;
+}
 
-/**
- * The core part of the coroutines creation - this signal handler
- * runs on a separate stack using sigaltstack. At invocation it
- * remembers its current context and jumps back to the coroutine
- * constructor. Later the coroutine continues from here.
- */
 static void
-coro_body(int signum)
+coro_stats_on_spawn(struct coro_sched *sched, struct coro *c)
 {
-	(void)signum;
-	struct coro_engine *my_engine = new_coro_engine;
-	new_coro_engine = NULL;
+	memset(&c->stats, 0, sizeof(c->stats));
+	c->runnable_ts = coro_stats_now();
+	pthread_mutex_lock(&sched->stats_lock);
+	rlist_add_tail_entry(&sched->stats_coros, c, stats_link);
+	pthread_mutex_unlock(&sched->stats_lock);
+}
 
-	struct coro *c = my_engine->this_coro;
-	my_engine->this_coro = NULL;
-	/*
-	 * On invocation jump back to the constructor right after
-	 * remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(my_engine->start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finally start work.
-	 */
-	my_engine->this_coro = c;
-	while (true) {
-		c->ret = c->func(c->func_arg);
-		c->func = NULL;
-		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
-		/*
-		 * Here it is restarted already, must have its
-		 * state restored.
-		 */
-		assert(c->state == CORO_STATE_RUNNING);
-		assert(c->func != NULL);
-	}
+static void
+coro_stats_on_join(struct coro_sched *sched, struct coro *c)
+{
+	pthread_mutex_lock(&sched->stats_lock);
+	rlist_del_entry(c, stats_link);
+	pthread_mutex_unlock(&sched->stats_lock);
 }
 
-static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+#else /* !CORO_STATS */
+
+static inline uint64_t
+coro_stats_now(void)
 {
-	struct coro *c = new coro();
-	c->state = CORO_STATE_RUNNING;
-	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = new uint8_t[stack_size];
-	c->func = func;
-	c->func_arg = func_arg;
-	c->joiner = NULL;
-	rlist_create(&c->link);
-	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
-	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-		handle_error();
-	/*
-	 * New handler should jump onto a new stack and remember
-	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
-	 */
-	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
-	sigemptyset(&newsa.sa_mask);
-	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-		handle_error();
-	/* Create that new stack. */
-	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
-	newst.ss_flags = 0;
-	if (sigaltstack(&newst, &oldst) != 0)
-		handle_error();
+	return 0;
+}
 
-	/* Jump onto the stack and remember its position. */
-	assert(new_coro_engine == NULL);
-	new_coro_engine = engine;
-	struct coro *old_this = engine->this_coro;
-	engine->this_coro = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(engine->start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (engine->this_coro != NULL)
-			sigsuspend(&suss);
-	}
-	assert(new_coro_engine == NULL);
-	engine->this_coro = old_this;
+static inline void
+coro_stats_on_runnable(struct coro *, uint64_t) {}
 
-	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
-	 */
-	if (sigaltstack(NULL, &newst) != 0)
-		handle_error();
-	newst.ss_flags = SS_DISABLE;
-	if (sigaltstack(&newst, NULL) != 0)
-		handle_error();
-	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-	    sigaltstack(&oldst, NULL) != 0)
-		handle_error();
-	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
-		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
-		handle_error();
+static inline void
+coro_stats_on_switch_in(struct coro_engine *, struct coro *, uint64_t) {}
 
-	/* Now scheduler can work with that coroutine. */
-	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
-}
+static inline void
+coro_stats_on_switch_out(struct coro_engine *, struct coro *, uint64_t,
+	uint64_t, enum coro_op) {}
 
-static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
-{
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
+static inline void
+coro_stats_on_idle(struct coro_engine *, uint64_t) {}
 
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->state = CORO_STATE_RUNNING;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+static inline void
+coro_stats_on_runq_len(struct coro_engine *, uint64_t) {}
+
+static inline void
+coro_stats_on_spawn(struct coro_sched *, struct coro *) {}
+
+static inline void
+coro_stats_on_join(struct coro_sched *, struct coro *) {}
+
+#endif /* !CORO_STATS */
+
+/** Get a stack of the size, at least as big as the context needs. */
+static struct coro_stack *
+coro_engine_stack_get(struct coro_engine *engine, size_t size)
+{
+	size_t min_size = coro_ctx_min_stack_size();
+	return coro_stack_pool_get(&engine->stack_pool,
+		size < min_size ? min_size : size);
 }
 
-static void *
-coro_engine_join(struct coro_engine *engine, struct coro *coro)
+static void
+coro_engine_create(struct coro_engine *engine, struct coro_sched *sched,
+	int id, const struct coro_sched_opts *opts)
 {
-	assert(coro->joiner == NULL);
-	coro->joiner = engine->this_coro;
-	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
-	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this_coro);
-	coro->joiner = NULL;
-	void *ret = coro->ret;
-	coro->ret = NULL;
-	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
-	return ret;
+	memset(engine, 0, sizeof(*engine));
+	engine->sched = sched;
+	engine->id = id;
+	engine->rand = id * 2654435761u + 1;
+	engine->pool_limit = opts->coro_cache_size;
+	engine->stack_size = opts->stack_size;
+	coro_stack_pool_create(&engine->stack_pool, opts->stack_cache_size,
+		opts->stack_guard, opts->stack_madvise);
+	engine->return_ctx = &engine->sched_ctx;
+	coro_prio_queue_create(&engine->coros_running);
+	rlist_create(&engine->coros_pool);
+	rlist_create(&engine->inline_pool);
+	engine->epoll_fd = -1;
+	engine->event_fd = -1;
+	coro_timer_wheel_create(&engine->timers, coro_clock_ns() / CORO_TICK_NS);
+	if (opts->stack_shared) {
+		engine->shared_stack = coro_engine_stack_get(engine,
+			opts->stack_size);
+	}
 }
 
 //////////////////////////////////////////////////////////////////
+// Multi-worker run queues.
 
-static struct coro_engine glob_engine;
-
-void
-coro_sched_init(void)
+static bool
+coro_runq_push(struct coro_runq *q, struct coro *c)
 {
-	coro_engine_create(&glob_engine);
+	uint32_t h = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	uint32_t t = q->tail;
+	if (t - h >= CORO_RUNQ_SIZE)
+		return false;
+	__atomic_store_n(&q->slots[t % CORO_RUNQ_SIZE], c, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->tail, t + 1, __ATOMIC_RELEASE);
+	return true;
 }
 
-void
-coro_sched_run(void)
+static struct coro *
+coro_runq_pop(struct coro_runq *q)
 {
-	coro_engine_run(&glob_engine);
+	uint32_t h = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	while (true) {
+		if (h == q->tail)
+			return NULL;
+		struct coro *c = __atomic_load_n(&q->slots[h % CORO_RUNQ_SIZE],
+			__ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&q->head, &h, h + 1, false,
+						__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+			return c;
+	}
 }
 
-void
-coro_sched_destroy(void)
+static bool
+coro_runq_is_empty(struct coro_runq *q)
 {
-	coro_engine_destroy(&glob_engine);
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) ==
+		__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
 }
 
-struct coro *
-coro_this(void)
+/**
+ * Move a half of the victim's queue into the own empty one.
+ * Returns the number of the stolen coroutines.
+ */
+static uint32_t
+coro_runq_steal(struct coro_runq *victim, struct coro_runq *q)
 {
-	return glob_engine.this_coro;
+	while (true) {
+		uint32_t h = __atomic_load_n(&victim->head, __ATOMIC_ACQUIRE);
+		uint32_t t = __atomic_load_n(&victim->tail, __ATOMIC_ACQUIRE);
+		uint32_t n = t - h;
+		n = n - n / 2;
+		if (n == 0)
+			return 0;
+		/* Head and tail were read at different moments. */
+		if (n > CORO_RUNQ_SIZE / 2)
+			continue;
+		uint32_t my_t = q->tail;
+		assert(my_t == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE));
+		for (uint32_t i = 0; i < n; ++i) {
+			struct coro *c = __atomic_load_n(
+				&victim->slots[(h + i) % CORO_RUNQ_SIZE],
+				__ATOMIC_RELAXED);
+			__atomic_store_n(&q->slots[(my_t + i) % CORO_RUNQ_SIZE],
+				c, __ATOMIC_RELAXED);
+		}
+		if (__atomic_compare_exchange_n(&victim->head, &h, h + n, false,
+						__ATOMIC_RELEASE,
+						__ATOMIC_RELAXED)) {
+			__atomic_store_n(&q->tail, my_t + n, __ATOMIC_RELEASE);
+			return n;
+		}
+	}
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+static void
+coro_sched_global_push(struct coro_sched *sched, struct coro *c)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	pthread_mutex_lock(&sched->global_lock);
+	coro_prio_queue_push(&sched->global_queue, c);
+	pthread_mutex_unlock(&sched->global_lock);
 }
 
-void *
-coro_join(struct coro *coro)
+/**
+ * Take a coroutine from the global queue. If it is a normal one,
+ * take a few more normal ones into the local run queue.
+ */
+static struct coro *
+coro_sched_global_pop(struct coro_sched *sched, struct coro_engine *engine)
 {
-	return coro_engine_join(&glob_engine, coro);
+	struct coro_prio_queue *q = &sched->global_queue;
+	if (__atomic_load_n(&q->count, __ATOMIC_RELAXED) == 0)
+		return NULL;
+	pthread_mutex_lock(&sched->global_lock);
+	struct coro *res = coro_prio_queue_pop(q);
+	if (res != NULL && res->queue_prio == CORO_PRIO_NORMAL) {
+		struct rlist *list = &q->lists[CORO_PRIO_NORMAL];
+		for (size_t count = 1; !rlist_empty(list) &&
+		     count < CORO_RUNQ_SIZE / 2; ++count) {
+			struct coro *c = rlist_first_entry(list, struct coro,
+				link);
+			if (!coro_runq_push(&engine->runq, c))
+				break;
+			coro_prio_queue_del(q, c);
+		}
+	}
+	pthread_mutex_unlock(&sched->global_lock);
+	return res;
 }
 
-void
-coro_suspend(void)
+/** Wake up one idle worker, if there are any. */
+static void
+coro_sched_notify(struct coro_sched *sched)
 {
-	coro_engine_suspend(&glob_engine);
+	/*
+	 * Pairs with the idle counter increment in the idle wait.
+	 * Either the sleeper sees the new work, or this thread
+	 * sees the sleeper.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sched->idle_count, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&sched->idle_lock);
+	pthread_cond_signal(&sched->idle_cond);
+	pthread_mutex_unlock(&sched->idle_lock);
 }
 
-void
-coro_yield(void)
+/** Push a runnable coroutine into the queue of its engine. */
+static void
+coro_engine_push_local(struct coro_engine *engine, struct coro *c)
 {
-	coro_engine_yield(&glob_engine);
+	if (__atomic_load_n(&c->prio, __ATOMIC_RELAXED) != CORO_PRIO_NORMAL ||
+	    !coro_runq_push(&engine->runq, c))
+		coro_sched_global_push(engine->sched, c);
 }
 
-void
-coro_wakeup(struct coro *coro)
+/**
+ * Wakeup the worker of the engine if it is blocked in the poll,
+ * so it rechecks its work.
+ */
+static void
+coro_engine_interrupt(struct coro_engine *engine)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	/*
+	 * Pairs with the flag set before the blocking poll. Either
+	 * the poller sees the changes, or this thread sees the
+	 * poller.
+	 */
+	if (!__atomic_load_n(&engine->is_polling, __ATOMIC_SEQ_CST))
+		return;
+	uint64_t one = 1;
+	if (write(engine->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+}
+
+static void
+coro_engine_inbox_push(struct coro_engine *engine, struct coro *c)
+{
+	struct coro *head = __atomic_load_n(&engine->inbox, __ATOMIC_RELAXED);
+	do {
+		c->inbox_next = head;
+	} while (!__atomic_compare_exchange_n(&engine->inbox, &head, c, true,
+					      __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+	coro_engine_interrupt(engine);
+}
+
+/**
+ * Move the coroutines woken up by other threads to the run queue
+ * of @a engine. The inbox can be of another engine - it is taken
+ * whole atomically, so any worker can drain any inbox. Otherwise
+ * a wakeup for a sleeping worker could be noticed by a different
+ * one, and lost.
+ */
+static bool
+coro_engine_inbox_drain(struct coro_engine *engine, struct coro_engine *owner)
+{
+	if (__atomic_load_n(&owner->inbox, __ATOMIC_RELAXED) == NULL)
+		return false;
+	struct coro *list = __atomic_exchange_n(&owner->inbox, NULL,
+		__ATOMIC_ACQUIRE);
+	if (list == NULL)
+		return false;
+	/* The inbox is LIFO, reverse it to wakeup in order. */
+	struct coro *prev = NULL;
+	while (list != NULL) {
+		struct coro *next = list->inbox_next;
+		list->inbox_next = prev;
+		prev = list;
+		list = next;
+	}
+	while (prev != NULL) {
+		struct coro *next = prev->inbox_next;
+		prev->inbox_next = NULL;
+		coro_engine_push_local(engine, prev);
+		prev = next;
+	}
+	return true;
+}
+
+/** Find a coroutine to run next with multiple workers. */
+static struct coro *
+coro_engine_pick_mt(struct coro_engine *engine)
+{
+	struct coro_sched *sched = engine->sched;
+	struct coro *c;
+	/*
+	 * Check the global queue first when it has high priority
+	 * coroutines, but not too many times in a row. And
+	 * sometimes anyway, or it could be starved by the
+	 * coroutines yielding in the local queue.
+	 */
+	bool has_high = engine->high_streak < CORO_PRIO_MAX_SKIPS &&
+		__atomic_load_n(&sched->global_queue.counts[CORO_PRIO_HIGH],
+				__ATOMIC_RELAXED) != 0;
+	if ((++engine->tick % CORO_GLOBAL_QUEUE_PERIOD == 0 || has_high) &&
+	    (c = coro_sched_global_pop(sched, engine)) != NULL) {
+		if (c->queue_prio == CORO_PRIO_HIGH)
+			++engine->high_streak;
+		else
+			engine->high_streak = 0;
+		return c;
+	}
+	engine->high_streak = 0;
+	coro_engine_inbox_drain(engine, engine);
+	if ((c = coro_runq_pop(&engine->runq)) != NULL)
+		return c;
+	if ((c = coro_sched_global_pop(sched, engine)) != NULL)
+		return c;
+	/* Steal from the others, starting at a random victim. */
+	engine->rand = engine->rand * 1103515245 + 12345;
+	int count = sched->engine_count;
+	int start = (engine->rand >> 16) % count;
+	for (int i = 0; i < count; ++i) {
+		struct coro_engine *victim = &sched->engines[(start + i) % count];
+		if (victim == engine)
+			continue;
+		if (coro_engine_inbox_drain(engine, victim) &&
+		    (c = coro_runq_pop(&engine->runq)) != NULL)
+			return c;
+		if (coro_runq_steal(&victim->runq, &engine->runq) > 0)
+			return coro_runq_pop(&engine->runq);
+	}
+	return NULL;
+}
+
+static bool
+coro_sched_has_work(struct coro_sched *sched)
+{
+	if (__atomic_load_n(&sched->global_queue.count, __ATOMIC_SEQ_CST) != 0)
+		return true;
+	for (int i = 0; i < sched->engine_count; ++i) {
+		struct coro_engine *e = &sched->engines[i];
+		if (__atomic_load_n(&e->inbox, __ATOMIC_SEQ_CST) != NULL ||
+		    !coro_runq_is_empty(&e->runq))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Sleep until there is new work. Returns false when there are no
+ * runnable coroutines in the whole scheduler, and the workers
+ * should stop.
+ */
+static bool
+coro_engine_idle_wait(struct coro_engine *engine)
+{
+	struct coro_sched *sched = engine->sched;
+	bool rc = true;
+	pthread_mutex_lock(&sched->idle_lock);
+	__atomic_add_fetch(&sched->idle_count, 1, __ATOMIC_SEQ_CST);
+	/* Pairs with the fence in the notification. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (sched->is_done) {
+		rc = false;
+	} else if (__atomic_load_n(&sched->runnable_count,
+				   __ATOMIC_SEQ_CST) == 0) {
+		sched->is_done = true;
+		pthread_cond_broadcast(&sched->idle_cond);
+		rc = false;
+	} else if (!coro_sched_has_work(sched)) {
+		pthread_cond_wait(&sched->idle_cond, &sched->idle_lock);
+		rc = !sched->is_done;
+	}
+	__atomic_sub_fetch(&sched->idle_count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&sched->idle_lock);
+	return rc;
+}
+
+//////////////////////////////////////////////////////////////////
+// Engine.
+
+/**
+ * Make a coroutine runnable. It goes to the next iteration of the
+ * loop with a single worker. With multiple workers it goes either
+ * to the local queue, or to the inbox of its engine when woken
+ * up from another thread.
+ */
+static void
+coro_sched_make_runnable(struct coro_sched *sched, struct coro *c)
+{
+	coro_stats_on_runnable(c, coro_stats_now());
+	if (!coro_sched_is_mt(sched)) {
+		coro_prio_queue_push(&c->engine->coros_running, c);
+		return;
+	}
+	__atomic_add_fetch(&sched->runnable_count, 1, __ATOMIC_SEQ_CST);
+	struct coro_engine *engine = this_engine;
+	if (engine != NULL && engine == c->engine) {
+		coro_engine_push_local(engine, c);
+	} else {
+		engine = c->engine;
+		coro_engine_inbox_push(engine, c);
+	}
+	coro_sched_notify(sched);
+}
+
+static void
+coro_sched_wakeup(struct coro_sched *sched, struct coro *coro)
+{
+	enum coro_state state = CORO_STATE_SUSPENDED;
+	/* Running and finished coroutines are not affected. */
+	if (!__atomic_compare_exchange_n(&coro->state, &state,
+					 CORO_STATE_RUNNING, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+	coro_sched_make_runnable(sched, coro);
+}
+
+/**
+ * Switch from the current coroutine back to the scheduler loop
+ * with the given request. When the function returns, the
+ * coroutine might be in another thread already.
+ */
+static void
+coro_engine_switch_out(struct coro_engine *engine, enum coro_op op,
+	struct coro_spinlock *lock)
+{
+	struct coro *c = engine->this_coro;
+	assert(c != NULL);
+	assert(coro_state_get(c) == CORO_STATE_RUNNING);
+	engine->op = op;
+	engine->op_lock = lock;
+	if (c->is_shared) {
+		uint8_t marker;
+		c->shared_sp = (uint8_t *)((uintptr_t)&marker -
+			CORO_SHARED_STACK_SLACK);
+	}
+	coro_ctx_switch(&c->ctx, engine->return_ctx);
+}
+
+/** Copy the used part of the shared stack into the coroutine. */
+static void
+coro_shared_save(struct coro_engine *engine, struct coro *c)
+{
+	uint8_t *top = engine->shared_stack->base + engine->shared_stack->size;
+	assert(c->shared_sp >= engine->shared_stack->base && c->shared_sp < top);
+	size_t size = top - c->shared_sp;
+	/* Shrink too, the idle coroutines are many. */
+	if (size > c->saved_capacity || size < c->saved_capacity / 2) {
+		free(c->saved);
+		c->saved = (uint8_t *)malloc(size);
+		if (c->saved == NULL)
+			handle_error();
+		c->saved_capacity = size;
+	}
+	memcpy(c->saved, c->shared_sp, size);
+	c->saved_size = size;
+}
+
+static void
+coro_body(void *arg);
+
+/**
+ * Put the frames of the coroutine onto the shared stack, saving
+ * the ones of the previous owner. Called from the scheduler
+ * stack.
+ */
+static void
+coro_shared_enter(struct coro_engine *engine, struct coro *c)
+{
+	struct coro *owner = engine->shared_owner;
+	if (owner == c)
+		return;
+	if (owner != NULL)
+		coro_shared_save(engine, owner);
+	engine->shared_owner = c;
+	struct coro_stack *stack = engine->shared_stack;
+	if (c->shared_sp == NULL) {
+		/* The context creation writes onto the stack too. */
+		coro_ctx_create(&c->ctx, stack->base, stack->size, coro_body,
+			NULL);
+		return;
+	}
+	memcpy(stack->base + stack->size - c->saved_size, c->saved,
+		c->saved_size);
+}
+
+/** Forget the coroutine's frames, it is about to be deleted. */
+static void
+coro_shared_forget(struct coro_engine *engine, struct coro *c)
+{
+	free(c->saved);
+	c->saved = NULL;
+	c->saved_size = 0;
+	c->saved_capacity = 0;
+	if (engine->shared_owner == c)
+		engine->shared_owner = NULL;
+}
+
+/**
+ * Suspend the current coroutine, and unlock the lock when it is
+ * switched out. A cancellable suspension is woken up by a
+ * cancellation, even a one which comes right before the switch.
+ */
+static void
+coro_suspend_locked(struct coro_spinlock *lock, bool is_cancellable)
+{
+	struct coro_engine *engine = this_engine;
+	if (engine == NULL || engine->this_coro == NULL) {
+		printf("Error: deadlock - suspension with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	coro_engine_switch_out(engine, is_cancellable ?
+		CORO_OP_SUSPEND_CANCELLABLE : CORO_OP_SUSPEND, lock);
+}
+
+/** Put a switched out coroutine back into the run queue. */
+static void
+coro_engine_requeue(struct coro_engine *engine, struct coro *c)
+{
+	if (coro_sched_is_mt(engine->sched))
+		coro_engine_push_local(engine, c);
+	else
+		coro_prio_queue_push(&engine->coros_running, c);
+}
+
+/**
+ * Account a finished child of the group, and wakeup the joiner
+ * of the group after the last one. The child can be joined and
+ * freed as soon as the lock is released.
+ */
+static void
+coro_group_on_finish(struct coro_sched *sched, struct coro_group *group)
+{
+	coro_spinlock_lock(&group->lock);
+	assert(group->active_count > 0);
+	struct coro *joiner = NULL;
+	if (--group->active_count == 0)
+		joiner = group->joiner;
+	if (joiner != NULL)
+		coro_sched_wakeup(sched, joiner);
+	coro_spinlock_unlock(&group->lock);
+}
+
+/**
+ * Mark the switched out coroutine suspended, and unlock the lock
+ * of the operation. A cancellable suspension is not done if the
+ * coroutine is cancelled already, then true is returned, and it
+ * should run again. The canceller sets the flag under the same
+ * lock, so it either sees the coroutine suspended and wakes it
+ * up, or is seen here.
+ */
+static bool
+coro_engine_suspend_done(struct coro_engine *engine, struct coro *c)
+{
+	bool is_cancelled = false;
+	if (engine->op == CORO_OP_SUSPEND_CANCELLABLE) {
+		coro_spinlock_lock(&c->join_lock);
+		is_cancelled = coro_cancel_is_set(c);
+		if (!is_cancelled)
+			coro_state_set(c, CORO_STATE_SUSPENDED);
+		coro_spinlock_unlock(&c->join_lock);
+	} else {
+		coro_state_set(c, CORO_STATE_SUSPENDED);
+	}
+	if (engine->op_lock != NULL)
+		coro_spinlock_unlock(engine->op_lock);
+	return is_cancelled;
+}
+
+/** Mark the switched out coroutine finished, and wake its joiner. */
+static void
+coro_engine_finish_done(struct coro_sched *sched, struct coro *c)
+{
+	coro_spinlock_lock(&c->join_lock);
+	coro_state_set(c, CORO_STATE_FINISHED);
+	struct coro *joiner = c->joiner;
+	coro_spinlock_unlock(&c->join_lock);
+	if (joiner != NULL)
+		coro_sched_wakeup(sched, joiner);
+}
+
+/**
+ * Run one coroutine until it switches back, and do what it asked
+ * for. Here the coroutine is off its stack, so it can be safely
+ * published to the other threads.
+ */
+static void
+coro_engine_run_one(struct coro_engine *engine, struct coro *c)
+{
+	struct coro_sched *sched = engine->sched;
+	assert(engine->this_coro == NULL);
+	assert(coro_state_get(c) == CORO_STATE_RUNNING);
+	c->engine = engine;
+	engine->this_coro = c;
+	if (c->is_shared)
+		coro_shared_enter(engine, c);
+	uint64_t start = coro_stats_now();
+	coro_stats_on_switch_in(engine, c, start);
+	coro_ctx_switch(&engine->sched_ctx, &c->ctx);
+	assert(engine->this_coro == c);
+	engine->this_coro = NULL;
+	coro_stats_on_switch_out(engine, c, start, coro_stats_now(),
+		engine->op);
+
+	switch (engine->op) {
+	case CORO_OP_YIELD:
+		coro_engine_requeue(engine, c);
+		break;
+	case CORO_OP_SUSPEND:
+	case CORO_OP_SUSPEND_CANCELLABLE:
+		if (coro_engine_suspend_done(engine, c))
+			coro_engine_requeue(engine, c);
+		else if (coro_sched_is_mt(sched))
+			__atomic_sub_fetch(&sched->runnable_count, 1,
+				__ATOMIC_SEQ_CST);
+		break;
+	case CORO_OP_FINISH: {
+		struct coro_group *group = c->group;
+		coro_engine_finish_done(sched, c);
+		/* The last access to the child, it can be freed after. */
+		if (group != NULL)
+			coro_group_on_finish(sched, group);
+		if (coro_sched_is_mt(sched))
+			__atomic_sub_fetch(&sched->runnable_count, 1,
+				__ATOMIC_SEQ_CST);
+		break;
+	}
+	}
+}
+
+//////////////////////////////////////////////////////////////////
+// Timers and I/O.
+
+/** Convert a timeout in seconds to the tick of its expiration. */
+static uint64_t
+coro_deadline_tick(double timeout)
+{
+	uint64_t deadline = coro_clock_ns() + (uint64_t)(timeout * 1000000000);
+	/* Round up, not to expire too early. */
+	return (deadline + CORO_TICK_NS - 1) / CORO_TICK_NS;
+}
+
+static inline bool
+coro_engine_has_waits(struct coro_engine *engine)
+{
+	return engine->io_count > 0 ||
+		__atomic_load_n(&engine->timers.count, __ATOMIC_RELAXED) > 0;
+}
+
+static void
+coro_engine_io_create(struct coro_engine *engine)
+{
+	engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (engine->epoll_fd < 0)
+		handle_error();
+	if (!coro_sched_is_mt(engine->sched))
+		return;
+	engine->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (engine->event_fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	/* NULL tells the eventfd from the waits. */
+	ev.data.ptr = NULL;
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, engine->event_fd,
+		      &ev) != 0)
+		handle_error();
+}
+
+static void
+coro_engine_io_destroy(struct coro_engine *engine)
+{
+	assert(engine->io_count == 0);
+	coro_timer_wheel_destroy(&engine->timers);
+	if (engine->event_fd >= 0)
+		close(engine->event_fd);
+	if (engine->epoll_fd >= 0)
+		close(engine->epoll_fd);
+}
+
+/** Called under the wait lock of the engine. */
+static void
+coro_sleep_expire_f(struct coro_timer *timer)
+{
+	struct coro_sleep *s = rlist_entry(timer, struct coro_sleep, timer);
+	struct coro_sched *sched = s->engine->sched;
+	s->is_fired = true;
+	/*
+	 * Under the lock the coroutine can't leave the sleep, so
+	 * the wakeup can't hit any other suspension.
+	 */
+	coro_sched_wakeup(sched, s->coro);
+	if (coro_sched_is_mt(sched))
+		__atomic_sub_fetch(&sched->runnable_count, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Arm the sleep timer in the engine of the current thread. Takes
+ * the wait lock, which stays locked.
+ */
+static void
+coro_engine_sleep_start(struct coro_engine *engine, struct coro_sleep *s,
+	double timeout)
+{
+	struct coro_sched *sched = engine->sched;
+	s->timer.expire_tick = coro_deadline_tick(timeout);
+	s->timer.func = coro_sleep_expire_f;
+	s->coro = engine->this_coro;
+	s->engine = engine;
+	s->is_fired = false;
+	coro_spinlock_lock(&engine->wait_lock);
+	coro_timer_wheel_add(&engine->timers, &s->timer);
+	/* The sleeper stays accounted while it is suspended. */
+	if (coro_sched_is_mt(sched))
+		__atomic_add_fetch(&sched->runnable_count, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Finish the sleep, disarming the timer unless it has fired.
+ * Called under the wait lock of the timer's engine, which is
+ * unlocked. Returns whether the timer has fired.
+ */
+static bool
+coro_engine_sleep_end(struct coro_sleep *s)
+{
+	/* Could be woken up by someone and be in another thread now. */
+	struct coro_engine *engine = s->engine;
+	bool is_fired = s->is_fired;
+	if (!is_fired) {
+		coro_timer_wheel_del(&engine->timers, &s->timer);
+		struct coro_sched *sched = engine->sched;
+		if (coro_sched_is_mt(sched))
+			__atomic_sub_fetch(&sched->runnable_count, 1,
+				__ATOMIC_SEQ_CST);
+	}
+	coro_spinlock_unlock(&engine->wait_lock);
+	/*
+	 * The engine could be sleeping in the poll because of this
+	 * timer. Let it recheck whether it still has to.
+	 */
+	if (!is_fired && engine != this_engine)
+		coro_engine_interrupt(engine);
+	return is_fired;
+}
+
+static void
+coro_engine_sleep(struct coro_engine *engine, double timeout)
+{
+	struct coro *c = engine->this_coro;
+	if (coro_cancel_is_set(c))
+		return;
+	struct coro_sleep *s = &c->wait.sleep;
+	coro_engine_sleep_start(engine, s, timeout);
+	/* The wakeups from the outside can't stop the sleep. */
+	while (!s->is_fired && !coro_cancel_is_set(c)) {
+		coro_suspend_locked(&s->engine->wait_lock, true);
+		coro_spinlock_lock(&s->engine->wait_lock);
+	}
+	coro_engine_sleep_end(s);
+}
+
+static bool
+coro_engine_suspend_timeout(struct coro_engine *engine, double timeout)
+{
+	struct coro *c = engine->this_coro;
+	if (coro_cancel_is_set(c))
+		return true;
+	struct coro_sleep *s = &c->wait.sleep;
+	coro_engine_sleep_start(engine, s, timeout);
+	coro_suspend_locked(&s->engine->wait_lock, true);
+	coro_spinlock_lock(&s->engine->wait_lock);
+	return !coro_engine_sleep_end(s);
+}
+
+/**
+ * Finish the wait and wakeup its coroutine. Called by the owner
+ * engine under its wait lock.
+ */
+static void
+coro_engine_io_complete(struct coro_engine *engine, struct coro_io_wait *w,
+	int revents)
+{
+	struct coro_sched *sched = engine->sched;
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, w->fd, NULL) != 0 &&
+	    errno != EBADF && errno != ENOENT)
+		handle_error();
+	if (w->has_timer && revents != 0)
+		coro_timer_wheel_del(&engine->timers, &w->timer);
+	assert(engine->io_count > 0);
+	--engine->io_count;
+	w->revents = revents;
+	w->is_done = true;
+	coro_sched_wakeup(sched, w->coro);
+	if (coro_sched_is_mt(sched))
+		__atomic_sub_fetch(&sched->runnable_count, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+coro_io_wait_expire_f(struct coro_timer *timer)
+{
+	struct coro_io_wait *w = rlist_entry(timer, struct coro_io_wait, timer);
+	coro_engine_io_complete(w->engine, w, 0);
+}
+
+static int
+coro_events_from_epoll(uint32_t events)
+{
+	int res = 0;
+	if ((events & EPOLLIN) != 0)
+		res |= CORO_EVENT_READ;
+	if ((events & EPOLLOUT) != 0)
+		res |= CORO_EVENT_WRITE;
+	if ((events & (EPOLLERR | EPOLLHUP)) != 0)
+		res |= CORO_EVENT_ERROR;
+	return res;
+}
+
+/**
+ * Wakeup the coroutines with ready descriptors or expired
+ * timers. When @a may_block is set, sleep until the nearest of
+ * them, or until an interruption from another thread.
+ */
+static void
+coro_engine_poll(struct coro_engine *engine, bool may_block)
+{
+	bool is_mt = coro_sched_is_mt(engine->sched);
+	int timeout = 0;
+	uint64_t now_tick = coro_clock_ns() / CORO_TICK_NS;
+	/*
+	 * A busy loop polls often. When there is no I/O, there is
+	 * nothing to do until the next tick.
+	 */
+	if (!may_block && engine->io_count == 0 &&
+	    now_tick == engine->poll_tick)
+		return;
+	engine->poll_tick = now_tick;
+	if (may_block) {
+		if (engine->epoll_fd < 0)
+			coro_engine_io_create(engine);
+		/* Pairs with the flag check in the interruption. */
+		if (is_mt) {
+			__atomic_store_n(&engine->is_polling, true,
+				__ATOMIC_SEQ_CST);
+		}
+		coro_spinlock_lock(&engine->wait_lock);
+		uint64_t next_tick = coro_timer_wheel_next_tick(&engine->timers);
+		bool has_waits = coro_engine_has_waits(engine);
+		coro_spinlock_unlock(&engine->wait_lock);
+		if (next_tick == UINT64_MAX) {
+			timeout = has_waits ? -1 : 0;
+		} else {
+			uint64_t now = coro_clock_ns();
+			uint64_t deadline = next_tick * CORO_TICK_NS;
+			timeout = deadline <= now ? 0 :
+				(deadline - now + 999999) / 1000000;
+		}
+		if (is_mt && __atomic_load_n(&engine->inbox,
+					     __ATOMIC_SEQ_CST) != NULL)
+			timeout = 0;
+	}
+	struct epoll_event events[CORO_POLL_BATCH];
+	int count = 0;
+	if (engine->io_count > 0 || timeout != 0) {
+		count = epoll_wait(engine->epoll_fd, events, CORO_POLL_BATCH,
+			timeout);
+		if (count < 0) {
+			if (errno != EINTR)
+				handle_error();
+			count = 0;
+		}
+	}
+	if (may_block && is_mt)
+		__atomic_store_n(&engine->is_polling, false, __ATOMIC_SEQ_CST);
+
+	coro_spinlock_lock(&engine->wait_lock);
+	for (int i = 0; i < count; ++i) {
+		struct coro_io_wait *w =
+			(struct coro_io_wait *)events[i].data.ptr;
+		if (w == NULL) {
+			uint64_t value;
+			if (read(engine->event_fd, &value, sizeof(value)) < 0 &&
+			    errno != EAGAIN)
+				handle_error();
+			continue;
+		}
+		coro_engine_io_complete(engine, w,
+			coro_events_from_epoll(events[i].events));
+	}
+	if (engine->timers.count > 0) {
+		struct rlist expired;
+		rlist_create(&expired);
+		coro_timer_wheel_advance(&engine->timers,
+			coro_clock_ns() / CORO_TICK_NS, &expired);
+		while (!rlist_empty(&expired)) {
+			struct coro_timer *timer = rlist_shift_entry(&expired,
+				struct coro_timer, link);
+			timer->func(timer);
+		}
+	}
+	coro_spinlock_unlock(&engine->wait_lock);
+}
+
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events,
+	double timeout)
+{
+	struct coro_sched *sched = engine->sched;
+	struct coro *c = engine->this_coro;
+	if (coro_cancel_is_set(c)) {
+		errno = ECANCELED;
+		return -1;
+	}
+	if (engine->epoll_fd < 0)
+		coro_engine_io_create(engine);
+	struct coro_io_wait *w = &c->wait.io;
+	w->coro = c;
+	w->engine = engine;
+	w->fd = fd;
+	w->revents = 0;
+	w->is_done = false;
+	w->has_timer = timeout >= 0;
+	struct epoll_event ev;
+	ev.events = 0;
+	if ((events & CORO_EVENT_READ) != 0)
+		ev.events |= EPOLLIN;
+	if ((events & CORO_EVENT_WRITE) != 0)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = w;
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		return -1;
+	coro_spinlock_lock(&engine->wait_lock);
+	++engine->io_count;
+	if (w->has_timer) {
+		w->timer.expire_tick = coro_deadline_tick(timeout);
+		w->timer.func = coro_io_wait_expire_f;
+		coro_timer_wheel_add(&engine->timers, &w->timer);
+	}
+	/* The waiter stays accounted while it is suspended. */
+	if (coro_sched_is_mt(sched))
+		__atomic_add_fetch(&sched->runnable_count, 1, __ATOMIC_SEQ_CST);
+	/*
+	 * A wakeup from the outside doesn't end the wait, because
+	 * the engine owns it. It is finished only by the engine, or
+	 * by the cancellation under the engine's lock.
+	 */
+	while (!w->is_done && !coro_cancel_is_set(c)) {
+		coro_suspend_locked(&engine->wait_lock, true);
+		coro_spinlock_lock(&engine->wait_lock);
+	}
+	if (w->is_done) {
+		coro_spinlock_unlock(&engine->wait_lock);
+		return w->revents;
+	}
+	if (w->has_timer)
+		coro_timer_wheel_del(&engine->timers, &w->timer);
+	/* The wakeup inside is a nop, the coroutine is running. */
+	coro_engine_io_complete(engine, w, 0);
+	coro_spinlock_unlock(&engine->wait_lock);
+	if (engine != this_engine)
+		coro_engine_interrupt(engine);
+	errno = ECANCELED;
+	return -1;
+}
+
+/** The loop with a single worker, round-robin over the iterations. */
+static void
+coro_engine_run(struct coro_engine *engine)
+{
+	while (true) {
+		size_t count = engine->coros_running.count;
+		if (count == 0) {
+			if (!coro_engine_has_waits(engine))
+				break;
+			uint64_t start = coro_stats_now();
+			coro_engine_poll(engine, true);
+			coro_stats_on_idle(engine, start);
+			continue;
+		}
+		coro_stats_on_runq_len(engine, count);
+		for (size_t i = 0; i < count; ++i) {
+			struct coro *c = coro_prio_queue_pop(
+				&engine->coros_running);
+			if (c == NULL)
+				break;
+			coro_engine_run_one(engine, c);
+		}
+		if (coro_engine_has_waits(engine))
+			coro_engine_poll(engine, false);
+	}
+}
+
+/** The loop of one worker out of many. */
+static void
+coro_engine_run_mt(struct coro_engine *engine)
+{
+	while (true) {
+		if (engine->tick % CORO_POLL_PERIOD == 0 &&
+		    coro_engine_has_waits(engine))
+			coro_engine_poll(engine, false);
+		struct coro *c = coro_engine_pick_mt(engine);
+		if (c != NULL) {
+			coro_stats_on_runq_len(engine, engine->runq.tail -
+				__atomic_load_n(&engine->runq.head,
+						__ATOMIC_RELAXED));
+			coro_engine_run_one(engine, c);
+			continue;
+		}
+		uint64_t start = coro_stats_now();
+		/*
+		 * A worker with I/O waits or timers can't sleep on the
+		 * condition variable. It sleeps in the poll, and is
+		 * interrupted by the inbox.
+		 */
+		if (coro_engine_has_waits(engine)) {
+			coro_engine_poll(engine, true);
+			coro_stats_on_idle(engine, start);
+			continue;
+		}
+		bool is_done = !coro_engine_idle_wait(engine);
+		coro_stats_on_idle(engine, start);
+		if (is_done)
+			break;
+	}
+}
+
+static void
+coro_engine_destroy(struct coro_engine *engine)
+{
+	assert(engine->this_coro == NULL);
+	assert(engine->coros_running.count == 0);
+	assert(coro_runq_is_empty(&engine->runq));
+	assert(engine->inbox == NULL);
+	/* No sense to cache anything anymore. */
+	engine->stack_pool.cache_limit = 0;
+	while (!rlist_empty(&engine->coros_pool)) {
+		struct coro *c = rlist_shift_entry(&engine->coros_pool,
+			struct coro, link);
+		if (c->is_shared)
+			coro_shared_forget(engine, c);
+		else
+			coro_stack_pool_put(&engine->stack_pool, c->stack);
+		delete c;
+		assert(engine->pool_count > 0);
+		--engine->pool_count;
+		--engine->coro_count;
+	}
+	while (!rlist_empty(&engine->inline_pool)) {
+		struct coro *c = rlist_shift_entry(&engine->inline_pool,
+			struct coro, link);
+		delete c;
+		assert(engine->inline_pool_count > 0);
+		--engine->inline_pool_count;
+		--engine->coro_count;
+	}
+	if (engine->inline_stack != NULL)
+		coro_stack_pool_put(&engine->stack_pool, engine->inline_stack);
+	if (engine->shared_stack != NULL)
+		coro_stack_pool_put(&engine->stack_pool, engine->shared_stack);
+	coro_stack_pool_destroy(&engine->stack_pool);
+	coro_engine_io_destroy(engine);
+}
+
+/** Destructors of the coroutine-local keys. */
+static coro_local_destructor_f coro_key_destructors[CORO_KEY_MAX];
+/** Number of the created keys. */
+static int coro_key_count = 0;
+static struct coro_spinlock coro_key_lock;
+
+/**
+ * Slot of the coroutine-local key. NULL if it is beyond the
+ * allocated ones, and is not created when is_alloc is false.
+ */
+static void **
+coro_local_slot(struct coro *c, int key, bool is_alloc)
+{
+	assert(key >= 0 &&
+	       key < __atomic_load_n(&coro_key_count, __ATOMIC_ACQUIRE));
+	if (key < CORO_LOCAL_INLINE_COUNT)
+		return &c->locals[key];
+	size_t i = key - CORO_LOCAL_INLINE_COUNT;
+	if (i < c->locals_ext_size)
+		return &c->locals_ext[i];
+	if (!is_alloc)
+		return NULL;
+	size_t size = c->locals_ext_size * 2;
+	if (size < i + 1)
+		size = i + 1;
+	void **ext = (void **)realloc(c->locals_ext, size * sizeof(ext[0]));
+	if (ext == NULL)
+		handle_error();
+	memset(ext + c->locals_ext_size, 0,
+		(size - c->locals_ext_size) * sizeof(ext[0]));
+	c->locals_ext = ext;
+	c->locals_ext_size = size;
+	return &ext[i];
+}
+
+/**
+ * Call the destructors of the coroutine-local values, and free
+ * them all, so the coroutine can be reused. Called in the
+ * coroutine when its function returns.
+ */
+static void
+coro_locals_destroy(struct coro *c)
+{
+	int count = __atomic_load_n(&coro_key_count, __ATOMIC_ACQUIRE);
+	for (int pass = 0; pass < CORO_LOCAL_DESTRUCTOR_PASSES &&
+	     c->has_locals; ++pass) {
+		/* The destructors can set the values again. */
+		c->has_locals = false;
+		for (int key = 0; key < count; ++key) {
+			void **slot = coro_local_slot(c, key, false);
+			if (slot == NULL)
+				break;
+			void *value = *slot;
+			*slot = NULL;
+			if (value != NULL && coro_key_destructors[key] != NULL)
+				coro_key_destructors[key](value);
+		}
+	}
+	memset(c->locals, 0, sizeof(c->locals));
+	free(c->locals_ext);
+	c->locals_ext = NULL;
+	c->locals_ext_size = 0;
+	c->has_locals = false;
+}
+
+/**
+ * Entry point of each coroutine stack. The context is switched
+ * here on the first resume of the coroutine. Afterwards the stack
+ * keeps running the coroutine functions one by one. Usually for
+ * the same coroutine object reused from the pool, but an inline
+ * stack passes from one object to another, so the coroutine is
+ * taken from the engine each time.
+ */
+static void
+coro_body(void *arg)
+{
+	(void)arg;
+	while (true) {
+		struct coro *c = this_engine->this_coro;
+		assert(coro_state_get(c) == CORO_STATE_RUNNING);
+		assert(c->func != NULL);
+		c->ret = c->func(c->func_arg);
+		c->func = NULL;
+		if (c->has_locals || c->locals_ext != NULL)
+			coro_locals_destroy(c);
+		coro_engine_switch_out(this_engine, CORO_OP_FINISH, NULL);
+		/* Here it is restarted already, maybe as another coroutine. */
+	}
+}
+
+/** Allocate a new coroutine with a stack. It is not runnable yet. */
+static struct coro *
+coro_engine_coro_new(struct coro_engine *engine, size_t stack_size,
+	bool is_shared)
+{
+	struct coro *c = new coro();
+	c->ret = NULL;
+	c->stack_size = stack_size;
+	c->joiner = NULL;
+	rlist_create(&c->link);
+	c->is_shared = is_shared;
+	if (is_shared) {
+		/* The context is created when the stack is free. */
+		c->stack = engine->shared_stack;
+	} else {
+		c->stack = coro_engine_stack_get(engine, stack_size);
+		coro_ctx_create(&c->ctx, c->stack->base, c->stack->size,
+			coro_body, NULL);
+	}
+	++engine->coro_count;
+	return c;
+}
+
+/**
+ * Whether the joined coroutine can go to the pool. It has only the
+ * coroutines with the default stacks, shared ones in the shared
+ * stack mode.
+ */
+static inline bool
+coro_engine_is_poolable(struct coro_engine *engine, size_t stack_size,
+	bool is_shared)
+{
+	return stack_size == engine->stack_size &&
+		is_shared == (engine->shared_stack != NULL);
+}
+
+/**
+ * Create a coroutine, reusing a pooled one when possible, add it
+ * to the group if given, and make it runnable.
+ */
+static struct coro *
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	size_t stack_size, bool is_shared, struct coro_group *group)
+{
+	struct coro *c;
+	if (rlist_empty(&engine->coros_pool) ||
+	    !coro_engine_is_poolable(engine, stack_size, is_shared)) {
+		c = coro_engine_coro_new(engine, stack_size, is_shared);
+	} else {
+		c = rlist_shift_entry(&engine->coros_pool, struct coro, link);
+		assert(engine->pool_count > 0);
+		--engine->pool_count;
+	}
+	c->func = func;
+	c->func_arg = func_arg;
+	c->engine = engine;
+	c->prio = CORO_PRIO_NORMAL;
+	c->is_cancelled = false;
+	c->group = group;
+	coro_state_set(c, CORO_STATE_RUNNING);
+	/* Before it is runnable, it can finish right away. */
+	if (group != NULL) {
+		coro_spinlock_lock(&group->lock);
+		if (group->is_cancelled)
+			c->is_cancelled = true;
+		rlist_add_tail_entry(&group->children, c, group_link);
+		++group->active_count;
+		coro_spinlock_unlock(&group->lock);
+	}
+	/* Now scheduler can work with that coroutine. */
+	coro_stats_on_spawn(engine->sched, c);
+	coro_sched_make_runnable(engine->sched, c);
+	return c;
+}
+
+/**
+ * Create a coroutine and run it right away, on the inline stack
+ * of the engine, until it switches out for the first time. The
+ * caller is suspended meanwhile, in the same thread. If the
+ * coroutine finishes, the stack stays with the engine for the
+ * next one. Otherwise the coroutine keeps the stack and becomes
+ * an ordinary one, and the engine takes a new stack on demand.
+ * The stack is not moved, so the pointers into it stay valid.
+ */
+static struct coro *
+coro_engine_spawn_inline(struct coro_engine *engine, coro_f func,
+	void *func_arg)
+{
+	struct coro_sched *sched = engine->sched;
+	struct coro *c;
+	if (!rlist_empty(&engine->inline_pool)) {
+		c = rlist_shift_entry(&engine->inline_pool, struct coro, link);
+		assert(engine->inline_pool_count > 0);
+		--engine->inline_pool_count;
+	} else {
+		c = new coro();
+		rlist_create(&c->link);
+		++engine->coro_count;
+	}
+	c->state = CORO_STATE_RUNNING;
+	c->ret = NULL;
+	c->stack_size = engine->stack_size;
+	c->engine = engine;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->joiner = NULL;
+	c->prio = CORO_PRIO_NORMAL;
+	c->is_cancelled = false;
+	c->group = NULL;
+	if (engine->inline_stack != NULL) {
+		c->stack = engine->inline_stack;
+		c->ctx = engine->inline_ctx;
+		engine->inline_stack = NULL;
+	} else {
+		/* First inline coroutine, or a nested one. */
+		c->stack = coro_engine_stack_get(engine, engine->stack_size);
+		coro_ctx_create(&c->ctx, c->stack->base, c->stack->size,
+			coro_body, NULL);
+	}
+	coro_stats_on_spawn(sched, c);
+
+	struct coro *caller = engine->this_coro;
+	struct coro_ctx *caller_return_ctx = engine->return_ctx;
+	struct coro_ctx caller_ctx = {};
+	engine->this_coro = c;
+	engine->return_ctx = &caller_ctx;
+	uint64_t start = coro_stats_now();
+	coro_stats_on_switch_in(engine, c, start);
+	coro_ctx_switch(&caller_ctx, &c->ctx);
+	/* Switched out right in this thread, the engine is the same. */
+	assert(engine->this_coro == c);
+	engine->this_coro = caller;
+	engine->return_ctx = caller_return_ctx;
+	coro_stats_on_switch_out(engine, c, start, coro_stats_now(),
+		engine->op);
+
+	/*
+	 * Unlike in coro_engine_run_one(), the coroutine was not
+	 * counted as runnable yet. But the body could already give
+	 * the coroutine to the other workers, to be cancelled or
+	 * joined.
+	 */
+	switch (engine->op) {
+	case CORO_OP_YIELD:
+		coro_sched_make_runnable(sched, c);
+		break;
+	case CORO_OP_SUSPEND:
+	case CORO_OP_SUSPEND_CANCELLABLE:
+		if (coro_engine_suspend_done(engine, c))
+			coro_sched_make_runnable(sched, c);
+		break;
+	case CORO_OP_FINISH:
+		/* A joiner takes the coroutine right away, stack first. */
+		if (engine->inline_stack == NULL) {
+			engine->inline_stack = c->stack;
+			engine->inline_ctx = c->ctx;
+		} else {
+			coro_stack_pool_put(&engine->stack_pool, c->stack);
+		}
+		c->stack = NULL;
+		coro_engine_finish_done(sched, c);
+		break;
+	}
+	return c;
+}
+
+static void *
+coro_engine_join(struct coro *coro)
+{
+	struct coro *this_coro = coro_this();
+	coro_spinlock_lock(&coro->join_lock);
+	assert(coro->joiner == NULL);
+	while (coro_state_get(coro) != CORO_STATE_FINISHED) {
+		coro->joiner = this_coro;
+		/*
+		 * The finisher takes the lock, so it can't miss the
+		 * joiner being suspended.
+		 */
+		coro_suspend_locked(&coro->join_lock, false);
+		coro_spinlock_lock(&coro->join_lock);
+	}
+	coro->joiner = NULL;
+	coro_spinlock_unlock(&coro->join_lock);
+	void *ret = coro->ret;
+	coro->ret = NULL;
+	assert(rlist_empty(&coro->link));
+
+	/* Could be resumed in another thread. */
+	struct coro_engine *engine = this_engine;
+	coro_stats_on_join(engine->sched, coro);
+	if (coro->stack == NULL) {
+		if (engine->inline_pool_count < engine->pool_limit) {
+			rlist_add_entry(&engine->inline_pool, coro, link);
+			++engine->inline_pool_count;
+		} else {
+			delete coro;
+			--engine->coro_count;
+		}
+		return ret;
+	}
+	if (coro_engine_is_poolable(engine, coro->stack_size, coro->is_shared) &&
+	    engine->pool_count < engine->pool_limit) {
+		rlist_add_entry(&engine->coros_pool, coro, link);
+		++engine->pool_count;
+		return ret;
+	}
+	/*
+	 * The coroutine is finished and is never going to be
+	 * resumed again. The frames left on its stack are garbage.
+	 */
+	if (coro->is_shared)
+		coro_shared_forget(engine, coro);
+	else
+		coro_stack_pool_put(&engine->stack_pool, coro->stack);
+	delete coro;
+	--engine->coro_count;
+	return ret;
+}
+
+//////////////////////////////////////////////////////////////////
+// Scheduler.
+
+static void
+coro_sched_create(struct coro_sched *sched, const struct coro_sched_opts *opts)
+{
+	int count = opts->worker_count > 0 ? opts->worker_count : 1;
+	sched->engines = new coro_engine[count];
+	sched->engine_count = count;
+	for (int i = 0; i < count; ++i)
+		coro_engine_create(&sched->engines[i], sched, i, opts);
+	sched->runnable_count = 0;
+	sched->idle_count = 0;
+	sched->is_done = false;
+	pthread_mutex_init(&sched->idle_lock, NULL);
+	pthread_cond_init(&sched->idle_cond, NULL);
+	pthread_mutex_init(&sched->global_lock, NULL);
+	coro_prio_queue_create(&sched->global_queue);
+#ifdef CORO_STATS
+	pthread_mutex_init(&sched->stats_lock, NULL);
+	rlist_create(&sched->stats_coros);
+#endif
+}
+
+static void
+coro_sched_destroy_impl(struct coro_sched *sched)
+{
+	assert(sched->global_queue.count == 0);
+	long coro_count = 0;
+	for (int i = 0; i < sched->engine_count; ++i) {
+		coro_engine_destroy(&sched->engines[i]);
+		coro_count += sched->engines[i].coro_count;
+	}
+	/* All the coroutines must be joined. */
+	assert(coro_count == 0);
+	(void)coro_count;
+	delete[] sched->engines;
+	pthread_mutex_destroy(&sched->idle_lock);
+	pthread_cond_destroy(&sched->idle_cond);
+	pthread_mutex_destroy(&sched->global_lock);
+#ifdef CORO_STATS
+	assert(rlist_empty(&sched->stats_coros));
+	pthread_mutex_destroy(&sched->stats_lock);
+#endif
+	memset(sched, '#', sizeof(*sched));
+}
+
+static void *
+coro_sched_worker_f(void *arg)
+{
+	struct coro_engine *engine = (struct coro_engine *)arg;
+	assert(this_engine == NULL);
+	this_engine = engine;
+	coro_engine_run_mt(engine);
+	this_engine = NULL;
+	return NULL;
+}
+
+static void
+coro_sched_run_impl(struct coro_sched *sched)
+{
+	assert(this_engine == &sched->engines[0]);
+	if (!coro_sched_is_mt(sched)) {
+		coro_engine_run(this_engine);
+		return;
+	}
+	sched->is_done = false;
+	int count = sched->engine_count;
+	pthread_t *threads = new pthread_t[count];
+	/* The current thread is the worker 0. */
+	for (int i = 1; i < count; ++i) {
+		int rc = pthread_create(&threads[i], NULL, coro_sched_worker_f,
+			&sched->engines[i]);
+		if (rc != 0) {
+			printf("Error: pthread_create %s\n", strerror(rc));
+			exit(-1);
+		}
+	}
+	coro_engine_run_mt(this_engine);
+	for (int i = 1; i < count; ++i)
+		pthread_join(threads[i], NULL);
+	delete[] threads;
+}
+
+//////////////////////////////////////////////////////////////////
+
+static struct coro_sched glob_sched;
+
+void
+coro_sched_opts_create(struct coro_sched_opts *opts)
+{
+	opts->stack_size = 1024 * 1024;
+	opts->coro_cache_size = 1024;
+	opts->stack_cache_size = 1024;
+	opts->stack_guard = true;
+	opts->stack_madvise = true;
+	opts->worker_count = 1;
+	opts->stack_shared = false;
+}
+
+void
+coro_sched_init(void)
+{
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	coro_sched_init_opts(&opts);
+}
+
+void
+coro_sched_init_opts(const struct coro_sched_opts *opts)
+{
+	assert(this_engine == NULL);
+	if (opts->stack_shared && opts->worker_count > 1) {
+		printf("Error: the shared stack mode supports only one "
+			"worker\n");
+		exit(-1);
+	}
+	coro_sched_create(&glob_sched, opts);
+	this_engine = &glob_sched.engines[0];
+}
+
+void
+coro_sched_run(void)
+{
+	coro_sched_run_impl(&glob_sched);
+}
+
+void
+coro_sched_destroy(void)
+{
+	assert(this_engine == &glob_sched.engines[0]);
+	this_engine = NULL;
+	coro_sched_destroy_impl(&glob_sched);
+}
+
+struct coro *
+coro_this(void)
+{
+	struct coro_engine *engine = this_engine;
+	return engine != NULL ? engine->this_coro : NULL;
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	struct coro_engine *engine = this_engine;
+	return coro_engine_spawn(engine, func, func_arg, engine->stack_size,
+		engine->shared_stack != NULL, NULL);
+}
+
+struct coro *
+coro_new_sized(coro_f func, void *func_arg, size_t stack_size)
+{
+	return coro_engine_spawn(this_engine, func, func_arg, stack_size,
+		false, NULL);
+}
+
+struct coro *
+coro_new_inline(coro_f func, void *func_arg)
+{
+	return coro_engine_spawn_inline(this_engine, func, func_arg);
+}
+
+void *
+coro_join(struct coro *coro)
+{
+	return coro_engine_join(coro);
+}
+
+void
+coro_suspend(void)
+{
+	struct coro *c = coro_this();
+	if (c != NULL && coro_cancel_is_set(c))
+		return;
+	coro_suspend_locked(NULL, true);
+}
+
+void
+coro_suspend_unlock(struct coro_spinlock *lock)
+{
+	struct coro *c = coro_this();
+	if (c != NULL && coro_cancel_is_set(c)) {
+		coro_spinlock_unlock(lock);
+		return;
+	}
+	coro_suspend_locked(lock, true);
+}
+
+void
+coro_yield(void)
+{
+	coro_engine_switch_out(this_engine, CORO_OP_YIELD, NULL);
+}
+
+void
+coro_set_priority(struct coro *coro, enum coro_priority prio)
+{
+	assert(prio >= 0 && prio < CORO_PRIO_COUNT);
+	/* Queued coroutines keep their place until picked. */
+	__atomic_store_n(&coro->prio, prio, __ATOMIC_RELAXED);
+}
+
+enum coro_priority
+coro_get_priority(const struct coro *coro)
+{
+	return __atomic_load_n(&coro->prio, __ATOMIC_RELAXED);
+}
+
+void
+coro_wakeup(struct coro *coro)
+{
+	coro_sched_wakeup(&glob_sched, coro);
+}
+
+void
+coro_cancel(struct coro *coro)
+{
+	coro_spinlock_lock(&coro->join_lock);
+	__atomic_store_n(&coro->is_cancelled, true, __ATOMIC_RELAXED);
+	coro_spinlock_unlock(&coro->join_lock);
+	/* The non-cancellable waits take it as a spurious wakeup. */
+	coro_sched_wakeup(&glob_sched, coro);
+}
+
+bool
+coro_is_cancelled(void)
+{
+	struct coro *c = coro_this();
+	return c != NULL && coro_cancel_is_set(c);
+}
+
+int
+coro_key_create(coro_local_destructor_f destructor)
+{
+	coro_spinlock_lock(&coro_key_lock);
+	int key = coro_key_count;
+	if (key == CORO_KEY_MAX) {
+		coro_spinlock_unlock(&coro_key_lock);
+		return -1;
+	}
+	coro_key_destructors[key] = destructor;
+	/* The destructor is visible to whoever sees the key. */
+	__atomic_store_n(&coro_key_count, key + 1, __ATOMIC_RELEASE);
+	coro_spinlock_unlock(&coro_key_lock);
+	return key;
+}
+
+void *
+coro_local_get(int key)
+{
+	struct coro *c = this_engine->this_coro;
+	if (key < CORO_LOCAL_INLINE_COUNT)
+		return c->locals[key];
+	void **slot = coro_local_slot(c, key, false);
+	return slot != NULL ? *slot : NULL;
+}
+
+void
+coro_local_set(int key, void *value)
+{
+	struct coro *c = this_engine->this_coro;
+	*coro_local_slot(c, key, true) = value;
+	if (value != NULL)
+		c->has_locals = true;
+}
+
+/** Engine of the current coroutine, which is going to wait. */
+static struct coro_engine *
+coro_engine_for_wait(void)
+{
+	struct coro_engine *engine = this_engine;
+	if (engine == NULL || engine->this_coro == NULL) {
+		printf("Error: waiting with no active coroutines\n");
+		exit(-1);
+	}
+	return engine;
+}
+
+void
+coro_sleep(double timeout)
+{
+	coro_engine_sleep(coro_engine_for_wait(), timeout);
+}
+
+bool
+coro_suspend_timeout(double timeout)
+{
+	return coro_engine_suspend_timeout(coro_engine_for_wait(), timeout);
+}
+
+int
+coro_wait_fd(int fd, int events, double timeout)
+{
+	return coro_engine_wait_fd(coro_engine_for_wait(), fd, events,
+		timeout);
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	while (true) {
+		ssize_t rc = read(fd, buf, size);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+				errno != EINTR))
+			return rc;
+		if (errno != EINTR && coro_wait_fd(fd, CORO_EVENT_READ, -1) < 0)
+			return -1;
+	}
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	while (true) {
+		ssize_t rc = write(fd, buf, size);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+				errno != EINTR))
+			return rc;
+		if (errno != EINTR &&
+		    coro_wait_fd(fd, CORO_EVENT_WRITE, -1) < 0)
+			return -1;
+	}
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	while (true) {
+		int rc = accept4(fd, addr, addrlen, SOCK_NONBLOCK);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+				errno != EINTR && errno != ECONNABORTED))
+			return rc;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			if (coro_wait_fd(fd, CORO_EVENT_READ, -1) < 0)
+				return -1;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////
+// Synchronization.
+
+/**
+ * Queue the current coroutine into the waiters, and suspend it
+ * until a waker dequeues it. The lock of the primitive is held on
+ * the entry and on the return.
+ */
+static void
+coro_sync_wait(struct rlist *waiters, struct coro_spinlock *lock)
+{
+	struct coro *c = coro_engine_for_wait()->this_coro;
+	struct coro_sync_wait *w = &c->wait.sync;
+	w->coro = c;
+	w->is_done = false;
+	rlist_add_tail_entry(waiters, w, link);
+	/*
+	 * The waker needs the lock, so it can't miss the suspension.
+	 * The other wakeups are spurious.
+	 */
+	while (!w->is_done) {
+		coro_suspend_locked(lock, false);
+		coro_spinlock_lock(lock);
+	}
+}
+
+/**
+ * Dequeue and wakeup the first waiter. Called under the lock of
+ * the primitive. Returns false when there are no waiters.
+ */
+static bool
+coro_sync_wakeup_first(struct rlist *waiters)
+{
+	if (rlist_empty(waiters))
+		return false;
+	struct coro_sync_wait *w = rlist_shift_entry(waiters,
+		struct coro_sync_wait, link);
+	w->is_done = true;
+	coro_sched_wakeup(w->coro->engine->sched, w->coro);
+	return true;
+}
+
+void
+coro_mutex_create(struct coro_mutex *mutex)
+{
+	mutex->lock.is_locked = false;
+	mutex->is_locked = false;
+	rlist_create(&mutex->waiters);
+}
+
+void
+coro_mutex_destroy(struct coro_mutex *mutex)
+{
+	assert(!mutex->is_locked);
+	assert(rlist_empty(&mutex->waiters));
+	(void)mutex;
+}
+
+void
+coro_mutex_lock(struct coro_mutex *mutex)
+{
+	coro_spinlock_lock(&mutex->lock);
+	/* The unlocker leaves it locked for the first waiter. */
+	if (mutex->is_locked)
+		coro_sync_wait(&mutex->waiters, &mutex->lock);
+	mutex->is_locked = true;
+	coro_spinlock_unlock(&mutex->lock);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *mutex)
+{
+	coro_spinlock_lock(&mutex->lock);
+	bool rc = !mutex->is_locked;
+	mutex->is_locked = true;
+	coro_spinlock_unlock(&mutex->lock);
+	return rc;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *mutex)
+{
+	coro_spinlock_lock(&mutex->lock);
+	assert(mutex->is_locked);
+	if (!coro_sync_wakeup_first(&mutex->waiters))
+		mutex->is_locked = false;
+	coro_spinlock_unlock(&mutex->lock);
+}
+
+void
+coro_cond_create(struct coro_cond *cond)
+{
+	cond->lock.is_locked = false;
+	rlist_create(&cond->waiters);
+}
+
+void
+coro_cond_destroy(struct coro_cond *cond)
+{
+	assert(rlist_empty(&cond->waiters));
+	(void)cond;
+}
+
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex)
+{
+	coro_spinlock_lock(&cond->lock);
+	/*
+	 * The signals need the condition lock, so the mutex can be
+	 * released before the queuing.
+	 */
+	coro_mutex_unlock(mutex);
+	coro_sync_wait(&cond->waiters, &cond->lock);
+	coro_spinlock_unlock(&cond->lock);
+	coro_mutex_lock(mutex);
+}
+
+void
+coro_cond_signal(struct coro_cond *cond)
+{
+	coro_spinlock_lock(&cond->lock);
+	coro_sync_wakeup_first(&cond->waiters);
+	coro_spinlock_unlock(&cond->lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *cond)
+{
+	coro_spinlock_lock(&cond->lock);
+	while (!rlist_empty(&cond->waiters))
+		coro_sync_wakeup_first(&cond->waiters);
+	coro_spinlock_unlock(&cond->lock);
+}
+
+void
+coro_sem_create(struct coro_sem *sem, size_t count)
+{
+	sem->lock.is_locked = false;
+	sem->count = count;
+	rlist_create(&sem->waiters);
+}
+
+void
+coro_sem_destroy(struct coro_sem *sem)
+{
+	assert(rlist_empty(&sem->waiters));
+	(void)sem;
+}
+
+void
+coro_sem_wait(struct coro_sem *sem)
+{
+	coro_spinlock_lock(&sem->lock);
+	/* The poster hands the unit right to the first waiter. */
+	if (sem->count == 0)
+		coro_sync_wait(&sem->waiters, &sem->lock);
+	else
+		--sem->count;
+	coro_spinlock_unlock(&sem->lock);
+}
+
+bool
+coro_sem_trywait(struct coro_sem *sem)
+{
+	coro_spinlock_lock(&sem->lock);
+	bool rc = sem->count > 0;
+	if (rc)
+		--sem->count;
+	coro_spinlock_unlock(&sem->lock);
+	return rc;
+}
+
+void
+coro_sem_post(struct coro_sem *sem)
+{
+	coro_spinlock_lock(&sem->lock);
+	if (!coro_sync_wakeup_first(&sem->waiters))
+		++sem->count;
+	coro_spinlock_unlock(&sem->lock);
+}
+
+void
+coro_waitgroup_create(struct coro_waitgroup *wg)
+{
+	wg->lock.is_locked = false;
+	wg->count = 0;
+	rlist_create(&wg->waiters);
+}
+
+void
+coro_waitgroup_destroy(struct coro_waitgroup *wg)
+{
+	assert(rlist_empty(&wg->waiters));
+	(void)wg;
+}
+
+void
+coro_waitgroup_add(struct coro_waitgroup *wg, long count)
+{
+	coro_spinlock_lock(&wg->lock);
+	wg->count += count;
+	assert(wg->count >= 0);
+	if (wg->count == 0) {
+		while (!rlist_empty(&wg->waiters))
+			coro_sync_wakeup_first(&wg->waiters);
+	}
+	coro_spinlock_unlock(&wg->lock);
+}
+
+void
+coro_waitgroup_done(struct coro_waitgroup *wg)
+{
+	coro_waitgroup_add(wg, -1);
+}
+
+void
+coro_waitgroup_wait(struct coro_waitgroup *wg)
+{
+	coro_spinlock_lock(&wg->lock);
+	if (wg->count > 0)
+		coro_sync_wait(&wg->waiters, &wg->lock);
+	coro_spinlock_unlock(&wg->lock);
+}
+
+//////////////////////////////////////////////////////////////////
+// Groups.
+
+void
+coro_group_create(struct coro_group *group)
+{
+	group->lock.is_locked = false;
+	rlist_create(&group->children);
+	group->active_count = 0;
+	group->joiner = NULL;
+	group->is_cancelled = false;
+}
+
+void
+coro_group_destroy(struct coro_group *group)
+{
+	assert(rlist_empty(&group->children));
+	assert(group->joiner == NULL);
+	(void)group;
+}
+
+struct coro *
+coro_group_new(struct coro_group *group, coro_f func, void *func_arg)
+{
+	struct coro_engine *engine = this_engine;
+	return coro_engine_spawn(engine, func, func_arg, engine->stack_size,
+		engine->shared_stack != NULL, group);
+}
+
+void
+coro_group_join(struct coro_group *group)
+{
+	struct coro *c = coro_engine_for_wait()->this_coro;
+	coro_spinlock_lock(&group->lock);
+	assert(group->joiner == NULL);
+	/* Only the last child wakes the joiner up. */
+	while (group->active_count > 0) {
+		group->joiner = c;
+		coro_suspend_locked(&group->lock, false);
+		coro_spinlock_lock(&group->lock);
+	}
+	group->joiner = NULL;
+	/* Under the lock, so a concurrent cancel is over. */
+	struct rlist children;
+	rlist_create(&children);
+	rlist_splice(&children, &group->children);
+	coro_spinlock_unlock(&group->lock);
+	while (!rlist_empty(&children)) {
+		struct coro *child = rlist_shift_entry(&children, struct coro,
+			group_link);
+		child->group = NULL;
+		/* Finished already, so doesn't suspend. */
+		coro_engine_join(child);
+	}
+}
+
+void
+coro_group_cancel(struct coro_group *group)
+{
+	coro_spinlock_lock(&group->lock);
+	group->is_cancelled = true;
+	struct coro *c;
+	rlist_foreach_entry(c, &group->children, group_link)
+		coro_cancel(c);
+	coro_spinlock_unlock(&group->lock);
+}
+
+//////////////////////////////////////////////////////////////////
+// Stats.
+
+void
+coro_stats_get(const struct coro *coro, struct coro_stats *stats)
+{
+#ifdef CORO_STATS
+	*stats = coro->stats;
+#else
+	(void)coro;
+	memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+void
+coro_sched_stats_get(struct coro_sched_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->worker_count = glob_sched.engine_count;
+#ifdef CORO_STATS
+	for (int i = 0; i < glob_sched.engine_count; ++i) {
+		const struct coro_sched_stats *s = &glob_sched.engines[i].stats;
+		stats->switch_count += s->switch_count;
+		stats->cpu_ns += s->cpu_ns;
+		stats->idle_ns += s->idle_ns;
+		stats->runq_sample_count += s->runq_sample_count;
+		stats->runq_len_sum += s->runq_len_sum;
+		if (s->runq_len_max > stats->runq_len_max)
+			stats->runq_len_max = s->runq_len_max;
+	}
+#endif
+}
+
+void
+coro_sched_stats_dump(void)
+{
+#ifdef CORO_STATS
+	struct coro_sched_stats stats;
+	coro_sched_stats_get(&stats);
+	double runq_avg = stats.runq_sample_count == 0 ? 0 :
+		(double)stats.runq_len_sum / stats.runq_sample_count;
+	printf("workers: %d, switches: %llu, cpu: %.3f ms, idle: %.3f ms, "
+		"runq avg: %.2f, runq max: %llu\n", stats.worker_count,
+		(unsigned long long)stats.switch_count, stats.cpu_ns / 1e6,
+		stats.idle_ns / 1e6, runq_avg,
+		(unsigned long long)stats.runq_len_max);
+	pthread_mutex_lock(&glob_sched.stats_lock);
+	std::vector<const struct coro *> coros;
+	const struct coro *c;
+	rlist_foreach_entry(c, &glob_sched.stats_coros, stats_link)
+		coros.push_back(c);
+	std::sort(coros.begin(), coros.end(),
+		[](const struct coro *a, const struct coro *b) {
+			return a->stats.cpu_ns > b->stats.cpu_ns;
+		});
+	for (const struct coro *c : coros) {
+		printf("coro %p: func %p, switches: %llu, yields: %llu, "
+			"suspends: %llu, cpu: %.3f ms, wait: %.3f ms\n",
+			(const void *)c, (void *)c->func,
+			(unsigned long long)c->stats.switch_count,
+			(unsigned long long)c->stats.yield_count,
+			(unsigned long long)c->stats.suspend_count,
+			c->stats.cpu_ns / 1e6, c->stats.wait_ns / 1e6);
+	}
+	pthread_mutex_unlock(&glob_sched.stats_lock);
+#else
+	printf("coroutine stats are disabled, build with CORO_STATS\n");
+#endif
 }
@@ -1,17 +1,107 @@
 #pragma once
 
+#include "rlist.h"
+
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
 struct coro;
 typedef void *(*coro_f)(void *);
 
-/** Initialize the coroutines engine. */
+/** Settings of the coroutines engine. */
+struct coro_sched_opts {
+	/**
+	 * Stack size of the coroutines created by coro_new(). The
+	 * memory is committed lazily, so the real cost is the
+	 * depth the coroutine actually uses.
+	 */
+	size_t stack_size;
+	/**
+	 * How many joined coroutines to keep ready for reuse
+	 * together with their stacks. Beyond that the joined
+	 * coroutines are freed and their stacks are given to the
+	 * stack pool.
+	 */
+	size_t coro_cache_size;
+	/**
+	 * How many free stacks the pool keeps mapped for reuse.
+	 * Beyond that the stacks are unmapped.
+	 */
+	size_t stack_cache_size;
+	/**
+	 * Protect the lowest page of each stack to catch the
+	 * overflows. Note, that each guard page costs a memory
+	 * mapping, and their number is limited by the system
+	 * (vm.max_map_count on Linux).
+	 */
+	bool stack_guard;
+	/** Return the pages of the cached stacks to the kernel. */
+	bool stack_madvise;
+	/**
+	 * Number of threads running the coroutines. Each thread
+	 * has its own engine with a local run queue, and steals
+	 * work from the others when idle. A coroutine can be
+	 * resumed in any of the threads. 1 means the coroutines are
+	 * run by the thread calling coro_sched_run() in a strict
+	 * round-robin.
+	 */
+	int worker_count;
+	/**
+	 * Run the coroutines created by coro_new() on one shared
+	 * stack of stack_size bytes. When a coroutine is switched
+	 * out, its frames stay on the stack until another coroutine
+	 * needs it. Then the used part is copied into a buffer of
+	 * the same size. So a parked coroutine costs as much memory
+	 * as deep its stack is, while a switch between the
+	 * coroutines costs a copy of their frames.
+	 *
+	 * A coroutine must not give pointers to its stack variables
+	 * to the others, they are valid only while it runs. The
+	 * coroutines created with coro_new_sized() and
+	 * coro_new_inline() have their own stacks as usual. Works
+	 * only with a single worker.
+	 */
+	bool stack_shared;
+};
+
+/**
+ * Priority classes of the coroutines. A runnable coroutine of a
+ * higher class is picked before the ones of the lower classes.
+ * A class passed over too many times in a row gets a pick anyway,
+ * so the lower classes slow down under the load of the higher
+ * ones, but never starve.
+ */
+enum coro_priority {
+	/** Latency-critical, interactive coroutines. */
+	CORO_PRIO_HIGH,
+	/** The default. */
+	CORO_PRIO_NORMAL,
+	/** Background work. */
+	CORO_PRIO_LOW,
+	CORO_PRIO_COUNT,
+};
+
+/** Fill the options with the default values. */
+void
+coro_sched_opts_create(struct coro_sched_opts *opts);
+
+/** Initialize the coroutines engine with the default options. */
 void
 coro_sched_init(void);
 
+/** Initialize the coroutines engine with the given options. */
+void
+coro_sched_init_opts(const struct coro_sched_opts *opts);
+
 /**
  * Run the coroutines processing while there are any runnable
- * ones.
+ * ones, or waiting for I/O or timers. With multiple workers the
+ * calling thread is one of them, the others are started and
+ * stopped inside.
  */
 void
 coro_sched_run(void);
@@ -38,6 +128,27 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but the coroutine gets a stack of at least
+ * the given size instead of the default one.
+ */
+struct coro *
+coro_new_sized(coro_f func, void *func_arg, size_t stack_size);
+
+/**
+ * Create a new coroutine and run it right away, until it finishes
+ * or switches out for the first time. Then the caller continues.
+ * The coroutine starts on a stack shared by such coroutines of
+ * the thread, which is kept by the coroutine only if it yields
+ * or suspends. So a short function which never does costs about
+ * a couple of context switches, without a trip through the
+ * scheduler and without a stack allocation.
+ *
+ * The coroutine must be joined as any other.
+ */
+struct coro *
+coro_new_inline(coro_f func, void *func_arg);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -49,7 +160,8 @@ coro_join(struct coro *coro);
 /**
  * Pause the current coroutine until its explicitly woken up with
  * coro_wakeup(). Can be used to wait for some event, which will
- * wakeup this coro when happens.
+ * wakeup this coro when happens. A cancelled coroutine doesn't
+ * suspend, and a cancellation wakes it up.
  */
 void
 coro_suspend(void);
@@ -62,10 +174,436 @@ coro_suspend(void);
 void
 coro_yield(void);
 
+/**
+ * Set the priority class of a coroutine. New coroutines have
+ * CORO_PRIO_NORMAL. It takes effect the next time the coroutine
+ * becomes runnable, for example on its next yield.
+ *
+ * With multiple workers the normal coroutines go through the
+ * local run queues of the workers, while the high and low ones
+ * go through the shared queue.
+ */
+void
+coro_set_priority(struct coro *coro, enum coro_priority prio);
+
+/** Get the priority class of a coroutine. */
+enum coro_priority
+coro_get_priority(const struct coro *coro);
+
 /**
  * Wakeup a coroutine. If it was suspended, then it is going to be
  * continued on the next iteration of the scheduler. Otherwise
  * this function is a nop.
+ *
+ * With multiple workers it can be called from any thread. The
+ * coroutine is sent to the inbox of the worker which ran it last
+ * time.
  */
 void
 coro_wakeup(struct coro *coro);
+
+/**
+ * Request a cooperative cancellation of a coroutine. Nothing is
+ * interrupted by force. Instead the cancellable suspension points
+ * of the coroutine return early from now on: coro_suspend(),
+ * coro_sleep(), coro_suspend_timeout(), the waits on the
+ * descriptors, and the blocking calls of the bus. The coroutine
+ * is expected to check coro_is_cancelled() and to finish soon.
+ * It still has to be joined.
+ *
+ * The joins and the synchronization primitives are not
+ * cancellable, so the cleanup can still use them.
+ *
+ * With multiple workers it can be called from any thread.
+ */
+void
+coro_cancel(struct coro *coro);
+
+/** Whether the current coroutine is cancelled. */
+bool
+coro_is_cancelled(void);
+
+/**
+ * Coroutine-local storage. A key gives each coroutine its own
+ * value, NULL at the start. The first few keys are stored right
+ * in the coroutine, so their access is a couple of loads. The
+ * others go to an array allocated on the first set. Works in any
+ * worker, the values move with the coroutine.
+ *
+ * When a coroutine function returns, the destructors of the keys
+ * are called for the non-NULL values, in the coroutine itself.
+ * They can set the values again, then they are called again, a
+ * few times at most.
+ */
+typedef void (*coro_local_destructor_f)(void *value);
+
+/**
+ * Create a key for all the coroutines. The keys are never
+ * deleted. Can be called from any thread.
+ * @param destructor Destructor of the values, can be NULL.
+ *
+ * @retval >=0 The key.
+ * @retval -1 Too many keys.
+ */
+int
+coro_key_create(coro_local_destructor_f destructor);
+
+/** Get the value of the key in the current coroutine. */
+void *
+coro_local_get(int key);
+
+/** Set the value of the key in the current coroutine. */
+void
+coro_local_set(int key, void *value);
+
+/**
+ * Pause the current coroutine for the given number of seconds.
+ * The wakeups don't interrupt the sleep, only a cancellation.
+ * The timers have a millisecond resolution and never expire
+ * earlier than asked. When no coroutines are runnable, the worker
+ * sleeps until the nearest timer instead of stopping the
+ * scheduler.
+ */
+void
+coro_sleep(double timeout);
+
+/**
+ * Same as coro_suspend(), but gives up after the timeout in
+ * seconds.
+ *
+ * @retval true Woken up with coro_wakeup(), or cancelled.
+ * @retval false Timeout.
+ */
+bool
+coro_suspend_timeout(double timeout);
+
+/** Events a coroutine can wait for on a file descriptor. */
+enum coro_event {
+	/** The descriptor is readable, or a connection can be accepted. */
+	CORO_EVENT_READ = 1 << 0,
+	/** The descriptor is writable, or a connect is complete. */
+	CORO_EVENT_WRITE = 1 << 1,
+	/**
+	 * Error or hangup on the descriptor. Always reported, even
+	 * when not asked for.
+	 */
+	CORO_EVENT_ERROR = 1 << 2,
+};
+
+/**
+ * Suspend the current coroutine until the descriptor is ready for
+ * any of the given events, or the timeout expires. The descriptor
+ * is watched by the epoll of the current worker. When no
+ * coroutines are runnable, the worker sleeps in epoll_wait()
+ * instead of stopping the scheduler.
+ *
+ * Only one coroutine can wait on a descriptor at a time.
+ *
+ * @param fd Descriptor to wait on.
+ * @param events Mask of enum coro_event.
+ * @param timeout Timeout in seconds. Negative means infinity.
+ *
+ * @retval >0 Mask of the ready events.
+ * @retval 0 Timeout.
+ * @retval -1 Error, errno is set. For example, the descriptor
+ *         can't be used with epoll, or is waited on already.
+ *         ECANCELED when the coroutine is cancelled.
+ */
+int
+coro_wait_fd(int fd, int events, double timeout);
+
+/**
+ * Same as read(), but a non-blocking descriptor which is not
+ * readable yet suspends the coroutine instead of failing with
+ * EAGAIN. The descriptor must be in the non-blocking mode,
+ * otherwise the whole worker thread blocks.
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/**
+ * Same as write(), but a full non-blocking descriptor suspends
+ * the coroutine instead of failing with EAGAIN. Like write() it
+ * can write less than asked.
+ */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/**
+ * Same as accept(), but suspends the coroutine until a new
+ * connection arrives to the non-blocking listening socket. The
+ * accepted socket is non-blocking, ready for coro_read() and
+ * coro_write().
+ */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * The simplest spinlock for the short critical sections. Guards
+ * the synchronization primitives below, and can guard the custom
+ * wait queues together with coro_suspend_unlock().
+ */
+struct coro_spinlock {
+	bool is_locked;
+};
+
+static inline void
+coro_spinlock_create(struct coro_spinlock *lock)
+{
+	lock->is_locked = false;
+}
+
+static inline void
+coro_spinlock_lock(struct coro_spinlock *lock)
+{
+	while (__atomic_exchange_n(&lock->is_locked, true, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&lock->is_locked, __ATOMIC_RELAXED))
+			sched_yield();
+	}
+}
+
+static inline void
+coro_spinlock_unlock(struct coro_spinlock *lock)
+{
+	__atomic_store_n(&lock->is_locked, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * Same as coro_suspend(), but the lock is unlocked only when the
+ * coroutine is switched out. So a waker which takes the same lock
+ * always finds the coroutine suspended, and its coro_wakeup() is
+ * never lost. The lock is not locked again on return.
+ */
+void
+coro_suspend_unlock(struct coro_spinlock *lock);
+
+/**
+ * Suspending primitives to synchronize the coroutines. The waiters
+ * are queued in the FIFO order, and the wait entries are stored in
+ * the waiting coroutines themselves, so waiting never allocates.
+ * They work with any number of workers, and can be waited on from
+ * the coroutines only. The spurious coro_wakeup() calls don't
+ * interrupt the waits.
+ */
+
+/**
+ * Mutex. On unlock the ownership is handed directly to the first
+ * waiter, so nobody can barge in between, and the waiters are
+ * served strictly in turn.
+ */
+struct coro_mutex {
+	struct coro_spinlock lock;
+	bool is_locked;
+	struct rlist waiters;
+};
+
+void
+coro_mutex_create(struct coro_mutex *mutex);
+
+/** The mutex must be unlocked and have no waiters. */
+void
+coro_mutex_destroy(struct coro_mutex *mutex);
+
+void
+coro_mutex_lock(struct coro_mutex *mutex);
+
+/** Lock the mutex if it is free. Returns whether it was locked. */
+bool
+coro_mutex_trylock(struct coro_mutex *mutex);
+
+void
+coro_mutex_unlock(struct coro_mutex *mutex);
+
+/** Condition variable. */
+struct coro_cond {
+	struct coro_spinlock lock;
+	struct rlist waiters;
+};
+
+void
+coro_cond_create(struct coro_cond *cond);
+
+/** The condition must have no waiters. */
+void
+coro_cond_destroy(struct coro_cond *cond);
+
+/**
+ * Unlock the mutex and wait for a signal. The mutex is locked
+ * again before return. A signal sent after the unlock is never
+ * lost.
+ */
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex);
+
+/** Wakeup the first waiter, if any. The mutex is not required. */
+void
+coro_cond_signal(struct coro_cond *cond);
+
+/** Wakeup all the waiters. The mutex is not required. */
+void
+coro_cond_broadcast(struct coro_cond *cond);
+
+/**
+ * Counting semaphore. A post while there are waiters hands the
+ * unit directly to the first of them.
+ */
+struct coro_sem {
+	struct coro_spinlock lock;
+	size_t count;
+	struct rlist waiters;
+};
+
+void
+coro_sem_create(struct coro_sem *sem, size_t count);
+
+/** The semaphore must have no waiters. */
+void
+coro_sem_destroy(struct coro_sem *sem);
+
+/** Take a unit, waiting until there is one. */
+void
+coro_sem_wait(struct coro_sem *sem);
+
+/** Take a unit if there is one. Returns whether it was taken. */
+bool
+coro_sem_trywait(struct coro_sem *sem);
+
+/** Give a unit back. */
+void
+coro_sem_post(struct coro_sem *sem);
+
+/**
+ * Wait group. Counts the pending jobs, and lets wait until all of
+ * them are done.
+ */
+struct coro_waitgroup {
+	struct coro_spinlock lock;
+	long count;
+	struct rlist waiters;
+};
+
+void
+coro_waitgroup_create(struct coro_waitgroup *wg);
+
+/** The group must have no waiters. */
+void
+coro_waitgroup_destroy(struct coro_waitgroup *wg);
+
+/**
+ * Add the given number of jobs, can be negative. When the counter
+ * drops to zero, all the waiters are woken up. It must not go
+ * below zero.
+ */
+void
+coro_waitgroup_add(struct coro_waitgroup *wg, long count);
+
+/** Same as coro_waitgroup_add(wg, -1). */
+void
+coro_waitgroup_done(struct coro_waitgroup *wg);
+
+/** Wait until the counter is zero. */
+void
+coro_waitgroup_wait(struct coro_waitgroup *wg);
+
+/**
+ * Group of coroutines for a fan-out and fan-in. The children are
+ * spawned into the group, and are joined all at once. The joiner
+ * is suspended only once, and is woken up by the last child to
+ * finish, not by each of them. A cancellation of the group
+ * cancels all its children, including the ones spawned later, so
+ * the first failed child can stop its siblings early.
+ */
+struct coro_group {
+	struct coro_spinlock lock;
+	/** Children not joined yet. */
+	struct rlist children;
+	/** Children not finished yet. */
+	size_t active_count;
+	/** The coroutine in coro_group_join(), if any. */
+	struct coro *joiner;
+	bool is_cancelled;
+};
+
+void
+coro_group_create(struct coro_group *group);
+
+/** The group must have no children, all of them joined. */
+void
+coro_group_destroy(struct coro_group *group);
+
+/**
+ * Same as coro_new(), but the coroutine belongs to the group. It
+ * is joined by coro_group_join(), not by coro_join(). If the
+ * group is cancelled already, the coroutine starts cancelled.
+ */
+struct coro *
+coro_group_new(struct coro_group *group, coro_f func, void *func_arg);
+
+/**
+ * Wait until all the children of the group finish, and join
+ * them. Their results are dropped. The wait is not cancellable.
+ * The group can be used again afterwards, but stays cancelled if
+ * it was.
+ */
+void
+coro_group_join(struct coro_group *group);
+
+/** Cancel all the children of the group, see coro_cancel(). */
+void
+coro_group_cancel(struct coro_group *group);
+
+/**
+ * Counters of a coroutine. They are collected only when the
+ * library is built with CORO_STATS defined, and are zeros
+ * otherwise. Without it the instrumentation is compiled out
+ * completely.
+ */
+struct coro_stats {
+	/** How many times the coroutine was switched in. */
+	uint64_t switch_count;
+	/** How many of the switches out were yields. */
+	uint64_t yield_count;
+	/** How many of the switches out were suspensions. */
+	uint64_t suspend_count;
+	/** Time spent running, in nanoseconds. */
+	uint64_t cpu_ns;
+	/** Time spent runnable, but waiting for a worker. */
+	uint64_t wait_ns;
+};
+
+/** Counters of the scheduler, summed over all the workers. */
+struct coro_sched_stats {
+	/** Number of the workers. */
+	int worker_count;
+	/** Switches into the coroutines. */
+	uint64_t switch_count;
+	/** Time spent in the coroutines, in nanoseconds. */
+	uint64_t cpu_ns;
+	/** Time spent sleeping without work, in nanoseconds. */
+	uint64_t idle_ns;
+	/**
+	 * Number of the run queue samples. With one worker it is
+	 * taken once per iteration of the loop, with many - on
+	 * each pick of a coroutine.
+	 */
+	uint64_t runq_sample_count;
+	/** Sum of the run queue lengths of all the samples. */
+	uint64_t runq_len_sum;
+	/** Max run queue length among all the samples. */
+	uint64_t runq_len_max;
+};
+
+/** Get the counters of a coroutine. */
+void
+coro_stats_get(const struct coro *coro, struct coro_stats *stats);
+
+/** Get the counters of the scheduler. */
+void
+coro_sched_stats_get(struct coro_sched_stats *stats);
+
+/**
+ * Print the scheduler counters, and the ones of each not joined
+ * coroutine, the busiest first.
+ */
+void
+coro_sched_stats_dump(void);
@@ -1,7 +1,20 @@
 #include "libcoro.h"
+#include "coro_stack.h"
+#include "coro_timer.h"
 
 #include "unit.h"
 
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,26 +175,1496 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static int
+test_stack_depth_recursive(int depth)
+{
+	/* Touch the whole frame so it is really used. */
+	volatile char frame[1024];
+	frame[0] = (char)depth;
+	frame[sizeof(frame) - 1] = (char)depth;
+	if (depth == 0)
+		return frame[0];
+	return test_stack_depth_recursive(depth - 1) + frame[sizeof(frame) - 1];
+}
+
 static void *
-coro_main_f(void *arg)
+test_stack_depth_f(void *arg)
+{
+	int depth = *(int *)arg;
+	coro_yield();
+	return (void *)(intptr_t)test_stack_depth_recursive(depth);
+}
+
+static void
+test_stack_sizes(void)
+{
+	unit_test_start();
+
+	const int coro_count = 10;
+	struct coro *coros[coro_count];
+	int depths[coro_count];
+	/*
+	 * Mix the default and custom stacks, all used deeper than
+	 * the smallest size class.
+	 */
+	for (int round = 0; round < 3; ++round) {
+		for (int i = 0; i < coro_count; ++i) {
+			depths[i] = 20 + i * 10;
+			if (i % 2 == 0)
+				coros[i] = coro_new(test_stack_depth_f, &depths[i]);
+			else
+				coros[i] = coro_new_sized(test_stack_depth_f,
+					&depths[i], (i + 1) * 64 * 1024);
+		}
+		for (int i = 0; i < coro_count; ++i) {
+			intptr_t expected = depths[i] * (depths[i] + 1) / 2;
+			unit_assert(coro_join(coros[i]) == (void *)expected);
+		}
+	}
+	unit_msg("custom stack sizes");
+
+	struct coro_stack_pool pool;
+	coro_stack_pool_create(&pool, 1, true, true);
+	size_t size = 1024 * 1024;
+	struct coro_stack *stack = coro_stack_pool_get(&pool, size);
+	unit_assert(stack->size >= size);
+	/* The descriptor doesn't push the stack into the next class. */
+	unit_assert(stack->map_size < size + 4 * pool.page_size);
+	coro_stack_pool_put(&pool, stack);
+	unit_assert(coro_stack_pool_get(&pool, size) == stack);
+	coro_stack_pool_put(&pool, stack);
+	coro_stack_pool_destroy(&pool);
+	unit_msg("a power of 2 size keeps its class");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_pipe_create(int fds[2])
+{
+	unit_fail_if(pipe(fds) != 0);
+	for (int i = 0; i < 2; ++i)
+		unit_fail_if(fcntl(fds[i], F_SETFL, O_NONBLOCK) != 0);
+}
+
+static double
+test_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void *
+test_io_writer_f(void *arg)
+{
+	int fd = *(int *)arg;
+	for (int i = 0; i < 3; ++i)
+		coro_yield();
+	unit_assert(coro_write(fd, "hello", 5) == 5);
+	return NULL;
+}
+
+static void *
+test_io_thread_writer_f(void *arg)
+{
+	int fd = *(int *)arg;
+	usleep(30000);
+	unit_assert(write(fd, "x", 1) == 1);
+	return NULL;
+}
+
+static void *
+test_io_client_f(void *arg)
+{
+	struct sockaddr_in *addr = (struct sockaddr_in *)arg;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	unit_fail_if(fd < 0);
+	int rc = connect(fd, (struct sockaddr *)addr, sizeof(*addr));
+	unit_assert(rc == 0 || errno == EINPROGRESS);
+	unit_assert((coro_wait_fd(fd, CORO_EVENT_WRITE, -1) &
+		CORO_EVENT_WRITE) != 0);
+	unit_assert(coro_write(fd, "ping", 4) == 4);
+	char buf[4];
+	unit_assert(coro_read(fd, buf, sizeof(buf)) == 4);
+	unit_assert(memcmp(buf, "pong", 4) == 0);
+	close(fd);
+	return NULL;
+}
+
+static void
+test_io(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	test_pipe_create(fds);
+	struct coro *c = coro_new(test_io_writer_f, &fds[1]);
+	char buf[16];
+	unit_assert(coro_read(fds[0], buf, sizeof(buf)) == 5);
+	unit_assert(memcmp(buf, "hello", 5) == 0);
+	unit_assert(coro_join(c) == NULL);
+	unit_msg("read from a pipe written by a coroutine");
+
+	double start = test_now();
+	unit_assert(coro_wait_fd(fds[0], CORO_EVENT_READ, 0.02) == 0);
+	unit_assert(test_now() - start >= 0.02);
+	unit_msg("wait timeout");
+
+	/* Nothing is runnable, the scheduler has to block. */
+	pthread_t thread;
+	unit_fail_if(pthread_create(&thread, NULL, test_io_thread_writer_f,
+		&fds[1]) != 0);
+	unit_assert(coro_read(fds[0], buf, sizeof(buf)) == 1);
+	pthread_join(thread, NULL);
+	unit_msg("read from a pipe written by a thread");
+
+	unit_assert(coro_wait_fd(-1, CORO_EVENT_READ, -1) == -1);
+	unit_assert(errno == EBADF);
+	close(fds[0]);
+	close(fds[1]);
+
+	int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	unit_fail_if(lfd < 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	unit_fail_if(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0);
+	unit_fail_if(listen(lfd, 16) != 0);
+	unit_fail_if(getsockname(lfd, (struct sockaddr *)&addr, &len) != 0);
+	c = coro_new(test_io_client_f, &addr);
+	int fd = coro_accept(lfd, NULL, NULL);
+	unit_assert(fd >= 0);
+	unit_assert(coro_read(fd, buf, 4) == 4);
+	unit_assert(memcmp(buf, "ping", 4) == 0);
+	unit_assert(coro_write(fd, "pong", 4) == 4);
+	unit_assert(coro_join(c) == NULL);
+	close(fd);
+	close(lfd);
+	unit_msg("accept, read and write a socket");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_timer_wheel(void)
+{
+	unit_test_start();
+
+	const int timer_count = 5000;
+	struct coro_timer *timers = new struct coro_timer[timer_count];
+	uint64_t *fired = new uint64_t[timer_count];
+	struct coro_timer_wheel wheel;
+	uint64_t start = 123456789;
+	coro_timer_wheel_create(&wheel, start);
+	unsigned rand = 1;
+	for (int i = 0; i < timer_count; ++i) {
+		rand = rand * 1103515245 + 12345;
+		/* From the same tick to the far levels. */
+		int bits = rand % 40;
+		rand = rand * 1103515245 + 12345;
+		timers[i].expire_tick = start + (((uint64_t)rand << 8) &
+			((1ull << bits) - 1));
+		coro_timer_wheel_add(&wheel, &timers[i]);
+		fired[i] = 0;
+	}
+	/* Every third is cancelled. */
+	for (int i = 0; i < timer_count; i += 3)
+		coro_timer_wheel_del(&wheel, &timers[i]);
+	uint64_t tick = start;
+	struct rlist expired;
+	rlist_create(&expired);
+	while (wheel.count > 0) {
+		uint64_t next = coro_timer_wheel_next_tick(&wheel);
+		unit_assert(next > tick);
+		uint64_t prev = tick;
+		rand = rand * 1103515245 + 12345;
+		/* Random steps, sometimes right onto the next tick. */
+		if (rand % 2 == 0)
+			tick = next;
+		else
+			tick += 1 + (rand >> 4) % (2 * (next - tick));
+		coro_timer_wheel_advance(&wheel, tick, &expired);
+		while (!rlist_empty(&expired)) {
+			struct coro_timer *t = rlist_shift_entry(&expired,
+				struct coro_timer, link);
+			fired[t - timers] = tick;
+			/* Not late - was not due on the previous step. */
+			unit_assert(t->expire_tick > prev || prev == start);
+		}
+	}
+	for (int i = 0; i < timer_count; ++i) {
+		if (i % 3 == 0) {
+			unit_assert(fired[i] == 0);
+			continue;
+		}
+		uint64_t expire = timers[i].expire_tick;
+		if (expire <= start)
+			expire = start + 1;
+		unit_assert(fired[i] >= expire);
+	}
+	coro_timer_wheel_destroy(&wheel);
+	delete[] timers;
+	delete[] fired;
+	unit_msg("timers expire in time");
+
+	unit_test_finish();
+}
+
+struct test_sleep_ctx {
+	double timeout;
+	int *next_id;
+	int id;
+};
+
+static void *
+test_sleep_f(void *arg)
+{
+	struct test_sleep_ctx *ctx = (decltype(ctx))arg;
+	coro_sleep(ctx->timeout);
+	unit_assert(*ctx->next_id == ctx->id);
+	++*ctx->next_id;
+	return NULL;
+}
+
+static void *
+test_wakeup_late_f(void *arg)
+{
+	struct coro *c = (struct coro *)arg;
+	coro_sleep(0.05);
+	coro_wakeup(c);
+	return NULL;
+}
+
+static void *
+test_suspend_timeout_f(void *arg)
 {
 	(void)arg;
-	test_suspend();
-	test_loop_of_yields();
-	test_wakup_self();
-	test_join_of_join();
-	test_wakeup_of_finished();
+	/* The old timer must not wakeup the next suspension. */
+	unit_assert(coro_suspend_timeout(1));
+	double start = test_now();
+	coro_suspend();
+	return (void *)(intptr_t)(test_now() - start >= 0.04);
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	double start = test_now();
+	coro_sleep(0.03);
+	double duration = test_now() - start;
+	unit_assert(duration >= 0.03 && duration < 1);
+	unit_msg("sleep");
+
+	const int coro_count = 5;
+	struct test_sleep_ctx ctxs[coro_count];
+	struct coro *coros[coro_count];
+	int next_id = 0;
+	for (int i = 0; i < coro_count; ++i) {
+		/* Created in the reverse order of the wakeups. */
+		ctxs[i].id = coro_count - 1 - i;
+		ctxs[i].timeout = 0.01 * (ctxs[i].id + 1);
+		ctxs[i].next_id = &next_id;
+		coros[i] = coro_new(test_sleep_f, &ctxs[i]);
+	}
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_msg("sleepers wake up in the order of their timeouts");
+
+	start = test_now();
+	unit_assert(!coro_suspend_timeout(0.02));
+	unit_assert(test_now() - start >= 0.02);
+	unit_msg("suspend timeout");
+
+	struct coro *c = coro_new(test_suspend_timeout_f, NULL);
+	coro_yield();
+	coro_wakeup(c);
+	struct coro *waker = coro_new(test_wakeup_late_f, c);
+	unit_assert(coro_join(c) == (void *)1);
+	unit_assert(coro_join(waker) == NULL);
+	unit_msg("suspend woken up before the timeout");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_stats_busy_f(void *arg)
+{
+	struct coro_stats *stats = (struct coro_stats *)arg;
+	for (int i = 0; i < 3; ++i) {
+		double start = test_now();
+		while (test_now() - start < 0.01)
+			;
+		coro_yield();
+	}
+	coro_stats_get(coro_this(), stats);
 	return NULL;
 }
 
-int
-main(void)
+static void *
+test_stats_suspend_f(void *arg)
 {
-	coro_sched_init();
-	struct coro *main_coro = coro_new(coro_main_f, NULL);
-	coro_sched_run();
-	void *rc = coro_join(main_coro);
-	unit_check(rc == NULL, "main coro rc");
-	coro_sched_destroy();
+	struct coro_stats *stats = (struct coro_stats *)arg;
+	coro_suspend();
+	coro_stats_get(coro_this(), stats);
+	return NULL;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct coro_sched_stats before;
+	coro_sched_stats_get(&before);
+	struct coro_stats busy_stats, suspend_stats;
+	struct coro *busy = coro_new(test_stats_busy_f, &busy_stats);
+	struct coro *suspended = coro_new(test_stats_suspend_f,
+		&suspend_stats);
+	coro_yield();
+	coro_wakeup(suspended);
+	coro_join(busy);
+	coro_join(suspended);
+	struct coro_sched_stats after;
+	coro_sched_stats_get(&after);
+	unit_assert(after.worker_count == 1);
+#ifdef CORO_STATS
+	/* The last switch in is not over yet. */
+	unit_assert(busy_stats.switch_count == 4);
+	unit_assert(busy_stats.yield_count == 3);
+	unit_assert(busy_stats.cpu_ns >= 30000000);
+	unit_assert(suspend_stats.switch_count == 2);
+	unit_assert(suspend_stats.suspend_count == 1);
+	/* It was runnable while the busy one was spinning. */
+	unit_assert(suspend_stats.wait_ns >= 10000000);
+	unit_assert(after.switch_count >= before.switch_count + 6);
+	unit_assert(after.cpu_ns >= before.cpu_ns + 30000000);
+	unit_assert(after.runq_len_max >= 3);
+	coro_sched_stats_dump();
+	unit_msg("counters");
+#else
+	unit_assert(busy_stats.switch_count == 0 && busy_stats.cpu_ns == 0);
+	unit_assert(after.switch_count == 0);
+	unit_msg("counters are disabled");
+#endif
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_prio_ctx {
+	enum coro_priority prio;
+	int yield_count;
+	/** Runs of the coroutines of each class. */
+	int *runs;
+	/** Runs of the others when this one finished. */
+	int runs_of_others;
+};
+
+static void *
+test_prio_f(void *arg)
+{
+	struct test_prio_ctx *ctx = (decltype(ctx))arg;
+	coro_set_priority(coro_this(), ctx->prio);
+	unit_assert(coro_get_priority(coro_this()) == ctx->prio);
+	coro_yield();
+	for (int i = 0; i < ctx->yield_count; ++i) {
+		++ctx->runs[ctx->prio];
+		coro_yield();
+	}
+	ctx->runs_of_others = 0;
+	for (int p = 0; p < CORO_PRIO_COUNT; ++p) {
+		if (p != ctx->prio)
+			ctx->runs_of_others += ctx->runs[p];
+	}
+	return NULL;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	int runs[CORO_PRIO_COUNT] = {0, 0, 0};
+	struct test_prio_ctx ctxs[CORO_PRIO_COUNT];
+	struct coro *coros[CORO_PRIO_COUNT];
+	/* Created in the reverse order of the priorities. */
+	for (int p = CORO_PRIO_COUNT - 1; p >= 0; --p) {
+		ctxs[p].prio = (enum coro_priority)p;
+		ctxs[p].yield_count = 900;
+		ctxs[p].runs = runs;
+		coros[p] = coro_new(test_prio_f, &ctxs[p]);
+	}
+	coro_set_priority(coro_this(), CORO_PRIO_LOW);
+	for (int p = 0; p < CORO_PRIO_COUNT; ++p)
+		coro_join(coros[p]);
+	coro_set_priority(coro_this(), CORO_PRIO_NORMAL);
+	/*
+	 * The high one goes first, but the others are not starved.
+	 * Each is served at least once per CORO_PRIO_MAX_SKIPS picks.
+	 */
+	unit_assert(ctxs[CORO_PRIO_HIGH].runs_of_others > 900 / 9);
+	unit_assert(ctxs[CORO_PRIO_HIGH].runs_of_others < 900);
+	unit_assert(ctxs[CORO_PRIO_NORMAL].runs_of_others <
+		ctxs[CORO_PRIO_LOW].runs_of_others);
+	unit_msg("priorities without starvation");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_inline_ctx {
+	/** The caller of coro_new_inline(). */
+	struct coro *caller;
+	/** How far the coroutine went. */
+	int step;
+	/** A variable on the coroutine's stack. */
+	int *local;
+};
+
+static void *
+test_inline_return_f(void *arg)
+{
+	struct test_inline_ctx *ctx = (decltype(ctx))arg;
+	unit_assert(coro_this() != ctx->caller);
+	++ctx->step;
+	return arg;
+}
+
+static void *
+test_inline_yield_f(void *arg)
+{
+	struct test_inline_ctx *ctx = (decltype(ctx))arg;
+	ctx->step = 1;
+	coro_yield();
+	ctx->step = 2;
+	return NULL;
+}
+
+static void *
+test_inline_suspend_f(void *arg)
+{
+	struct test_inline_ctx *ctx = (decltype(ctx))arg;
+	int local = 0;
+	ctx->local = &local;
+	coro_suspend();
+	return (void *)(intptr_t)local;
+}
+
+static void *
+test_inline_nested_f(void *arg)
+{
+	struct test_inline_ctx *ctx = (decltype(ctx))arg;
+	struct test_inline_ctx sub;
+	sub.caller = coro_this();
+	sub.step = 0;
+	struct coro *c = coro_new_inline(test_inline_yield_f, &sub);
+	unit_assert(sub.step == 1);
+	coro_join(c);
+	unit_assert(sub.step == 2);
+	++ctx->step;
+	return NULL;
+}
+
+static void
+test_inline(void)
+{
+	unit_test_start();
+
+	struct test_inline_ctx ctx;
+	ctx.caller = coro_this();
+	ctx.step = 0;
+	for (int i = 0; i < 100; ++i) {
+		struct coro *c = coro_new_inline(test_inline_return_f, &ctx);
+		/* Done before the caller continues. */
+		unit_assert(ctx.step == i + 1);
+		unit_assert(coro_join(c) == &ctx);
+	}
+	unit_msg("inline coroutines finishing right away");
+
+	ctx.step = 0;
+	struct coro *c = coro_new_inline(test_inline_yield_f, &ctx);
+	unit_assert(ctx.step == 1);
+	coro_join(c);
+	unit_assert(ctx.step == 2);
+	unit_msg("inline coroutine yields");
+
+	ctx.local = NULL;
+	c = coro_new_inline(test_inline_suspend_f, &ctx);
+	unit_assert(ctx.local != NULL);
+	ctx.step = 0;
+	struct coro *c2 = coro_new_inline(test_inline_return_f, &ctx);
+	unit_assert(ctx.step == 1);
+	unit_assert(coro_join(c2) == &ctx);
+	*ctx.local = 42;
+	coro_wakeup(c);
+	unit_assert(coro_join(c) == (void *)42);
+	unit_msg("inline coroutine suspends and keeps its stack");
+
+	ctx.step = 0;
+	c = coro_new_inline(test_inline_nested_f, &ctx);
+	coro_join(c);
+	unit_assert(ctx.step == 1);
+	unit_msg("nested inline coroutines");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_sync_ctx {
+	struct coro_mutex mutex;
+	struct coro_cond cond;
+	struct coro_sem sem;
+	struct coro_waitgroup wg;
+	/** Whether someone is in the critical section. */
+	bool is_busy;
+	/** How many are in the semaphore section. */
+	int sem_users;
+	int sem_users_max;
+	/** Protected by the mutex. */
+	long counter;
+	/** Protected by the mutex, signaled via the condition. */
+	long items;
+	/** How many items the producer makes. */
+	int item_count;
+	int iter_count;
+	/** Order of the mutex acquisitions. */
+	struct coro *order[3];
+	int order_size;
+};
+
+static void *
+test_sync_mutex_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < ctx->iter_count; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		unit_assert(!ctx->is_busy);
+		ctx->is_busy = true;
+		long value = ctx->counter;
+		coro_yield();
+		ctx->counter = value + 1;
+		ctx->is_busy = false;
+		coro_mutex_unlock(&ctx->mutex);
+	}
+	coro_waitgroup_done(&ctx->wg);
+	return NULL;
+}
+
+static void *
+test_sync_order_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	coro_mutex_lock(&ctx->mutex);
+	ctx->order[ctx->order_size++] = coro_this();
+	coro_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static void *
+test_sync_cond_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	coro_mutex_lock(&ctx->mutex);
+	while (ctx->items == 0)
+		coro_cond_wait(&ctx->cond, &ctx->mutex);
+	--ctx->items;
+	coro_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static void *
+test_sync_producer_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < ctx->item_count; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		++ctx->items;
+		coro_cond_signal(&ctx->cond);
+		coro_mutex_unlock(&ctx->mutex);
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_sync_sem_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	coro_sem_wait(&ctx->sem);
+	int users = __atomic_add_fetch(&ctx->sem_users, 1, __ATOMIC_RELAXED);
+	int max = __atomic_load_n(&ctx->sem_users_max, __ATOMIC_RELAXED);
+	while (users > max &&
+	       !__atomic_compare_exchange_n(&ctx->sem_users_max, &max, users,
+					    false, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED)) {
+	}
+	coro_yield();
+	coro_yield();
+	__atomic_sub_fetch(&ctx->sem_users, 1, __ATOMIC_RELAXED);
+	coro_sem_post(&ctx->sem);
+	return NULL;
+}
+
+static void
+test_sync(void)
+{
+	unit_test_start();
+
+	struct test_sync_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	coro_mutex_create(&ctx.mutex);
+	coro_cond_create(&ctx.cond);
+	coro_sem_create(&ctx.sem, 2);
+	coro_waitgroup_create(&ctx.wg);
+
+	const int coro_count = 10;
+	ctx.iter_count = 100;
+	struct coro *coros[coro_count];
+	coro_waitgroup_add(&ctx.wg, coro_count);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_sync_mutex_f, &ctx);
+	coro_waitgroup_wait(&ctx.wg);
+	unit_assert(ctx.counter == coro_count * ctx.iter_count);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	/* Waiting on a zero group doesn't suspend. */
+	coro_waitgroup_wait(&ctx.wg);
+	unit_msg("mutex and wait group");
+
+	coro_mutex_lock(&ctx.mutex);
+	for (int i = 0; i < 3; ++i)
+		coros[i] = coro_new(test_sync_order_f, &ctx);
+	coro_yield();
+	coro_mutex_unlock(&ctx.mutex);
+	/* Handed over to the first waiter, no barging. */
+	unit_assert(!coro_mutex_trylock(&ctx.mutex));
+	for (int i = 0; i < 3; ++i)
+		coro_join(coros[i]);
+	unit_assert(ctx.order_size == 3);
+	for (int i = 0; i < 3; ++i)
+		unit_assert(ctx.order[i] == coros[i]);
+	unit_assert(coro_mutex_trylock(&ctx.mutex));
+	coro_mutex_unlock(&ctx.mutex);
+	unit_msg("mutex hands off in the FIFO order");
+
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_sync_cond_f, &ctx);
+	coro_yield();
+	coro_mutex_lock(&ctx.mutex);
+	ctx.items = 1;
+	coro_cond_signal(&ctx.cond);
+	coro_mutex_unlock(&ctx.mutex);
+	coro_yield();
+	coro_yield();
+	unit_assert(ctx.items == 0);
+	/* A spurious wakeup doesn't end the wait. */
+	for (int i = 0; i < coro_count; ++i)
+		coro_wakeup(coros[i]);
+	coro_yield();
+	coro_yield();
+	coro_mutex_lock(&ctx.mutex);
+	ctx.items = coro_count - 1;
+	coro_cond_broadcast(&ctx.cond);
+	coro_mutex_unlock(&ctx.mutex);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_assert(ctx.items == 0);
+	unit_msg("condition signal and broadcast");
+
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_sync_sem_f, &ctx);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_assert(ctx.sem_users_max == 2);
+	unit_assert(coro_sem_trywait(&ctx.sem));
+	unit_assert(coro_sem_trywait(&ctx.sem));
+	unit_assert(!coro_sem_trywait(&ctx.sem));
+	coro_sem_post(&ctx.sem);
+	coro_sem_post(&ctx.sem);
+	unit_msg("semaphore");
+
+	coro_waitgroup_destroy(&ctx.wg);
+	coro_sem_destroy(&ctx.sem);
+	coro_cond_destroy(&ctx.cond);
+	coro_mutex_destroy(&ctx.mutex);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_group_ctx {
+	struct coro_group group;
+	struct coro_mutex mutex;
+	int iter_count;
+	long counter;
+	int fd;
+	/** How many children saw the cancellation. */
+	long cancel_count;
+	bool is_unlocked;
+};
+
+static void
+test_group_count_cancel(struct test_group_ctx *ctx)
+{
+	if (coro_is_cancelled())
+		__atomic_add_fetch(&ctx->cancel_count, 1, __ATOMIC_RELAXED);
+}
+
+static void *
+test_group_work_f(void *arg)
+{
+	struct test_group_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < ctx->iter_count; ++i)
+		coro_yield();
+	__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *
+test_group_sleep_f(void *arg)
+{
+	coro_sleep(60);
+	test_group_count_cancel((struct test_group_ctx *)arg);
+	return NULL;
+}
+
+static void *
+test_group_suspend_f(void *arg)
+{
+	coro_suspend();
+	test_group_count_cancel((struct test_group_ctx *)arg);
+	return NULL;
+}
+
+static void *
+test_group_timeout_f(void *arg)
+{
+	unit_assert(coro_suspend_timeout(60));
+	test_group_count_cancel((struct test_group_ctx *)arg);
+	return NULL;
+}
+
+static void *
+test_group_read_f(void *arg)
+{
+	struct test_group_ctx *ctx = (decltype(ctx))arg;
+	char c;
+	unit_assert(coro_read(ctx->fd, &c, 1) == -1 && errno == ECANCELED);
+	test_group_count_cancel(ctx);
+	return NULL;
+}
+
+/** The mutex is not cancellable, the wait goes on. */
+static void *
+test_group_mutex_f(void *arg)
+{
+	struct test_group_ctx *ctx = (decltype(ctx))arg;
+	coro_mutex_lock(&ctx->mutex);
+	unit_assert(ctx->is_unlocked);
+	test_group_count_cancel(ctx);
+	coro_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+/** The first child to fail cancels its siblings. */
+static void *
+test_group_fail_f(void *arg)
+{
+	struct test_group_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < ctx->iter_count; ++i)
+		coro_yield();
+	coro_group_cancel(&ctx->group);
+	return NULL;
+}
+
+static void
+test_group(void)
+{
+	unit_test_start();
+
+	struct test_group_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	coro_group_create(&ctx.group);
+	coro_mutex_create(&ctx.mutex);
+	ctx.iter_count = 10;
+	const int coro_count = 10;
+	for (int i = 0; i < coro_count; ++i)
+		coro_group_new(&ctx.group, test_group_work_f, &ctx);
+	struct coro_stats stats;
+	coro_stats_get(coro_this(), &stats);
+	uint64_t suspend_count = stats.suspend_count;
+	coro_group_join(&ctx.group);
+	unit_assert(ctx.counter == coro_count);
+	coro_stats_get(coro_this(), &stats);
+#ifdef CORO_STATS
+	unit_assert(stats.suspend_count == suspend_count + 1);
+#else
+	(void)suspend_count;
+#endif
+	/* Nothing to wait for. */
+	coro_group_join(&ctx.group);
+	unit_msg("join all the children");
+
+	int fds[2];
+	test_pipe_create(fds);
+	ctx.fd = fds[0];
+	coro_mutex_lock(&ctx.mutex);
+	coro_group_new(&ctx.group, test_group_sleep_f, &ctx);
+	coro_group_new(&ctx.group, test_group_suspend_f, &ctx);
+	coro_group_new(&ctx.group, test_group_timeout_f, &ctx);
+	coro_group_new(&ctx.group, test_group_read_f, &ctx);
+	coro_group_new(&ctx.group, test_group_mutex_f, &ctx);
+	coro_yield();
+	double start = test_now();
+	coro_group_cancel(&ctx.group);
+	coro_yield();
+	coro_yield();
+	ctx.is_unlocked = true;
+	coro_mutex_unlock(&ctx.mutex);
+	coro_group_join(&ctx.group);
+	unit_assert(test_now() - start < 1);
+	unit_assert(ctx.cancel_count == 5);
+	unit_msg("cancel the waits");
+
+	/* The group stays cancelled, the new children see it. */
+	ctx.cancel_count = 0;
+	coro_group_new(&ctx.group, test_group_sleep_f, &ctx);
+	coro_group_new(&ctx.group, test_group_read_f, &ctx);
+	coro_group_join(&ctx.group);
+	unit_assert(ctx.cancel_count == 2);
+	unit_msg("spawn into a cancelled group");
+	coro_group_destroy(&ctx.group);
+
+	coro_group_create(&ctx.group);
+	ctx.cancel_count = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coro_group_new(&ctx.group, test_group_suspend_f, &ctx);
+	coro_group_new(&ctx.group, test_group_fail_f, &ctx);
+	coro_group_join(&ctx.group);
+	unit_assert(ctx.cancel_count == coro_count);
+	unit_msg("a child cancels the siblings");
+	coro_group_destroy(&ctx.group);
+
+	/* A single coroutine, cancelled before it suspends. */
+	ctx.cancel_count = 0;
+	struct coro *c = coro_new(test_group_suspend_f, &ctx);
+	coro_cancel(c);
+	coro_join(c);
+	unit_assert(ctx.cancel_count == 1);
+	unit_assert(!coro_is_cancelled());
+	unit_msg("cancel a coroutine");
+
+	coro_mutex_destroy(&ctx.mutex);
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_LOCAL_KEY_COUNT = 10,
+};
+
+static int test_local_keys[TEST_LOCAL_KEY_COUNT];
+static int test_local_again_key;
+static long test_local_destroyed = 0;
+
+static void
+test_local_destructor_f(void *value)
+{
+	__atomic_add_fetch(&test_local_destroyed, (long)(intptr_t)value,
+		__ATOMIC_RELAXED);
+}
+
+/** Sets its value once more, so it is destroyed twice. */
+static void
+test_local_again_f(void *value)
+{
+	test_local_destructor_f(value);
+	if ((intptr_t)value == 1000)
+		coro_local_set(test_local_again_key, (void *)(intptr_t)2000);
+}
+
+static void
+test_local_keys_create(void)
+{
+	static bool is_created = false;
+	if (is_created)
+		return;
+	is_created = true;
+	for (int i = 0; i < TEST_LOCAL_KEY_COUNT; ++i) {
+		test_local_keys[i] = coro_key_create(test_local_destructor_f);
+		unit_fail_if(test_local_keys[i] < 0);
+	}
+	test_local_again_key = coro_key_create(test_local_again_f);
+	unit_fail_if(test_local_again_key < 0);
+}
+
+/** Each key gets id * 100 + key number, and keeps it over yields. */
+static void *
+test_local_f(void *arg)
+{
+	intptr_t id = (intptr_t)arg;
+	for (int i = 0; i < TEST_LOCAL_KEY_COUNT; ++i)
+		unit_assert(coro_local_get(test_local_keys[i]) == NULL);
+	for (int i = 0; i < TEST_LOCAL_KEY_COUNT; ++i) {
+		coro_local_set(test_local_keys[i], (void *)(id * 100 + i));
+		coro_yield();
+	}
+	for (int i = 0; i < TEST_LOCAL_KEY_COUNT; ++i) {
+		unit_assert(coro_local_get(test_local_keys[i]) ==
+			(void *)(id * 100 + i));
+		coro_yield();
+	}
+	/* Reset to NULL is not destroyed. */
+	coro_local_set(test_local_keys[0], NULL);
+	return NULL;
+}
+
+/** Sum of all the values of test_local_f(), except the reset one. */
+static long
+test_local_expected(int coro_count)
+{
+	long sum = 0;
+	for (int id = 1; id <= coro_count; ++id) {
+		for (int i = 1; i < TEST_LOCAL_KEY_COUNT; ++i)
+			sum += id * 100 + i;
+	}
+	return sum;
+}
+
+static void *
+test_local_again_coro_f(void *arg)
+{
+	(void)arg;
+	coro_local_set(test_local_again_key, (void *)(intptr_t)1000);
+	return NULL;
+}
+
+static void
+test_local(void)
+{
+	unit_test_start();
+
+	test_local_keys_create();
+	test_local_destroyed = 0;
+	const int coro_count = 10;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_local_f, (void *)(intptr_t)(i + 1));
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_assert(test_local_destroyed == test_local_expected(coro_count));
+	unit_msg("each coroutine has own values, destroyed at the end");
+
+	/* The pooled coroutines start with no values. */
+	test_local_destroyed = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_local_f, (void *)(intptr_t)(i + 1));
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_assert(test_local_destroyed == test_local_expected(coro_count));
+	test_local_destroyed = 0;
+	coro_join(coro_new_inline(test_local_f, (void *)(intptr_t)1));
+	unit_assert(test_local_destroyed == test_local_expected(1));
+	unit_msg("reused coroutines start clean");
+
+	test_local_destroyed = 0;
+	coro_join(coro_new(test_local_again_coro_f, NULL));
+	unit_assert(test_local_destroyed == 3000);
+	unit_msg("a value set by a destructor is destroyed too");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_mt_ctx {
+	int yield_count;
+	int spawn_count;
+	long counter;
+};
+
+static void *
+test_mt_worker_f(void *arg)
+{
+	struct test_mt_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < ctx->yield_count; ++i) {
+		__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return arg;
+}
+
+static void *
+test_mt_spawner_f(void *arg)
+{
+	struct test_mt_ctx *ctx = (decltype(ctx))arg;
+	struct coro **coros = new struct coro *[ctx->spawn_count];
+	for (int i = 0; i < ctx->spawn_count; ++i) {
+		/* Inline ones start here, but migrate after a yield. */
+		if (i % 4 == 3)
+			coros[i] = coro_new_inline(test_mt_worker_f, ctx);
+		else
+			coros[i] = coro_new(test_mt_worker_f, ctx);
+		/* The high and low ones go via the shared queue. */
+		coro_set_priority(coros[i], (enum coro_priority)(i % 3));
+	}
+	for (int i = 0; i < ctx->spawn_count; ++i)
+		unit_assert(coro_join(coros[i]) == ctx);
+	delete[] coros;
+	return NULL;
+}
+
+static void *
+test_mt_main_f(void *arg)
+{
+	struct test_mt_ctx *ctx = (decltype(ctx))arg;
+	const int spawner_count = 10;
+	struct coro *spawners[spawner_count];
+	for (int i = 0; i < spawner_count; ++i)
+		spawners[i] = coro_new(test_mt_spawner_f, ctx);
+	/* The joiners and the joined ones are in different threads. */
+	for (int i = 0; i < spawner_count; ++i) {
+		struct coro *c = coro_new(test_join_f, spawners[i]);
+		unit_assert(coro_join(c) == NULL);
+	}
+	unit_assert(ctx->counter ==
+		(long)spawner_count * ctx->spawn_count * ctx->yield_count);
+	return NULL;
+}
+
+static void
+test_multiple_workers(void)
+{
+	unit_test_start();
+
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = 4;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+
+	struct test_mt_ctx ctx;
+	ctx.yield_count = 100;
+	ctx.spawn_count = 300;
+	ctx.counter = 0;
+	for (int round = 0; round < 3; ++round) {
+		struct coro *c = coro_new(test_mt_main_f, &ctx);
+		coro_sched_run();
+		unit_assert(coro_join(c) == NULL);
+		ctx.counter = 0;
+	}
+	unit_msg("spawn, yield and join in 4 threads");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+
+enum {
+	TEST_MT_IO_PAIR_COUNT = 20,
+	TEST_MT_IO_MSG_COUNT = 100,
+};
+
+static void *
+test_mt_io_producer_f(void *arg)
+{
+	int fd = *(int *)arg;
+	for (int i = 0; i < TEST_MT_IO_MSG_COUNT; ++i) {
+		char byte = (char)i;
+		unit_assert(coro_write(fd, &byte, 1) == 1);
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_mt_io_consumer_f(void *arg)
+{
+	int fd = *(int *)arg;
+	for (int i = 0; i < TEST_MT_IO_MSG_COUNT;) {
+		char buf[TEST_MT_IO_MSG_COUNT];
+		ssize_t rc = coro_read(fd, buf, sizeof(buf));
+		unit_assert(rc > 0);
+		for (ssize_t j = 0; j < rc; ++j, ++i)
+			unit_assert(buf[j] == (char)i);
+	}
+	return NULL;
+}
+
+static void
+test_multiple_workers_io(void)
+{
+	unit_test_start();
+
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = 4;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+
+	int fds[TEST_MT_IO_PAIR_COUNT][2];
+	struct coro *coros[TEST_MT_IO_PAIR_COUNT][2];
+	for (int i = 0; i < TEST_MT_IO_PAIR_COUNT; ++i) {
+		test_pipe_create(fds[i]);
+		coros[i][0] = coro_new(test_mt_io_consumer_f, &fds[i][0]);
+		coros[i][1] = coro_new(test_mt_io_producer_f, &fds[i][1]);
+	}
+	coro_sched_run();
+	for (int i = 0; i < TEST_MT_IO_PAIR_COUNT; ++i) {
+		unit_assert(coro_join(coros[i][0]) == NULL);
+		unit_assert(coro_join(coros[i][1]) == NULL);
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	unit_msg("pipes between coroutines in 4 threads");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static void *
+test_mt_sleep_f(void *arg)
+{
+	int id = *(int *)arg;
+	coro_sleep(0.001 * (id % 10));
+	return arg;
+}
+
+static void *
+test_mt_suspend_timeout_f(void *arg)
+{
+	(void)arg;
+	while (coro_suspend_timeout(0.5))
+		;
+	return NULL;
+}
+
+static void *
+test_mt_wakeup_many_f(void *arg)
+{
+	struct coro **coros = (struct coro **)arg;
+	for (int i = 0; i < 100; ++i) {
+		coro_wakeup(coros[i % 10]);
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void
+test_multiple_workers_timers(void)
+{
+	unit_test_start();
+
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = 4;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+
+	const int coro_count = 200;
+	struct coro *coros[coro_count];
+	int ids[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		ids[i] = i;
+		coros[i] = coro_new(test_mt_sleep_f, &ids[i]);
+	}
+	struct coro *suspended[10];
+	for (int i = 0; i < 10; ++i)
+		suspended[i] = coro_new(test_mt_suspend_timeout_f, NULL);
+	struct coro *waker = coro_new(test_mt_wakeup_many_f, suspended);
+	coro_sched_run();
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == &ids[i]);
+	for (int i = 0; i < 10; ++i)
+		unit_assert(coro_join(suspended[i]) == NULL);
+	unit_assert(coro_join(waker) == NULL);
+	unit_msg("sleeps and timeouts in 4 threads");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static void
+test_multiple_workers_sync(void)
+{
+	unit_test_start();
+
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = 4;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+
+	struct test_sync_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	coro_mutex_create(&ctx.mutex);
+	coro_cond_create(&ctx.cond);
+	coro_sem_create(&ctx.sem, 3);
+	coro_waitgroup_create(&ctx.wg);
+	ctx.iter_count = 300;
+
+	const int coro_count = 40;
+	struct coro *coros[coro_count * 3 + 1];
+	int count = 0;
+	coro_waitgroup_add(&ctx.wg, coro_count);
+	for (int i = 0; i < coro_count; ++i) {
+		coros[count++] = coro_new(test_sync_mutex_f, &ctx);
+		coros[count++] = coro_new(test_sync_sem_f, &ctx);
+	}
+	/* Each consumer takes one item. */
+	for (int i = 0; i < coro_count; ++i)
+		coros[count++] = coro_new(test_sync_cond_f, &ctx);
+	ctx.item_count = coro_count;
+	coros[count++] = coro_new(test_sync_producer_f, &ctx);
+	coro_sched_run();
+	for (int i = 0; i < count; ++i)
+		coro_join(coros[i]);
+	unit_assert(ctx.counter == coro_count * ctx.iter_count);
+	unit_assert(ctx.items == 0);
+	unit_assert(ctx.sem_users_max <= 3);
+	unit_msg("mutex, condition, semaphore and wait group in 4 threads");
+	coro_waitgroup_destroy(&ctx.wg);
+	coro_sem_destroy(&ctx.sem);
+	coro_cond_destroy(&ctx.cond);
+	coro_mutex_destroy(&ctx.mutex);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static void *
+test_mt_group_main_f(void *arg)
+{
+	struct test_group_ctx *ctx = (decltype(ctx))arg;
+	const int coro_count = 100;
+	for (int i = 0; i < coro_count; ++i)
+		coro_group_new(&ctx->group, test_group_work_f, ctx);
+	coro_group_join(&ctx->group);
+	unit_assert(ctx->counter == coro_count);
+
+	for (int i = 0; i < coro_count; ++i) {
+		coro_group_new(&ctx->group, i % 2 == 0 ? test_group_suspend_f :
+			test_group_sleep_f, ctx);
+	}
+	coro_group_new(&ctx->group, test_group_fail_f, ctx);
+	double start = test_now();
+	coro_group_join(&ctx->group);
+	unit_assert(test_now() - start < 10);
+	unit_assert(ctx->cancel_count == coro_count);
+	return NULL;
+}
+
+static void
+test_multiple_workers_group(void)
+{
+	unit_test_start();
+
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = 4;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+
+	struct test_group_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	coro_group_create(&ctx.group);
+	ctx.iter_count = 100;
+	struct coro *c = coro_new(test_mt_group_main_f, &ctx);
+	coro_sched_run();
+	coro_join(c);
+	unit_msg("join and cancel the groups in 4 threads");
+	coro_group_destroy(&ctx.group);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static void
+test_multiple_workers_local(void)
+{
+	unit_test_start();
+
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = 4;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+
+	test_local_keys_create();
+	test_local_destroyed = 0;
+	const int coro_count = 100;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_local_f, (void *)(intptr_t)(i + 1));
+	coro_sched_run();
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_assert(test_local_destroyed == test_local_expected(coro_count));
+	unit_msg("locals move with the coroutines between 4 threads");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_SHARED_COUNT = 500,
+	TEST_SHARED_FRAME_SIZE = 64,
+};
+
+/**
+ * Fill a frame, switch out, go deeper, and check the frame is
+ * intact. Returns the sum of all the frames.
+ */
+static long
+test_shared_stack_recursive(int id, int depth)
+{
+	int frame[TEST_SHARED_FRAME_SIZE];
+	for (int i = 0; i < TEST_SHARED_FRAME_SIZE; ++i)
+		frame[i] = id * 100 + depth + i;
+	coro_yield();
+	long sum = 0;
+	if (depth > 0)
+		sum = test_shared_stack_recursive(id, depth - 1);
+	else
+		coro_sleep(0.001);
+	for (int i = 0; i < TEST_SHARED_FRAME_SIZE; ++i) {
+		if (frame[i] != id * 100 + depth + i)
+			return -1;
+		sum += frame[i];
+	}
+	return sum;
+}
+
+static long
+test_shared_stack_expected(int id, int depth)
+{
+	long sum = 0;
+	for (int d = 0; d <= depth; ++d) {
+		for (int i = 0; i < TEST_SHARED_FRAME_SIZE; ++i)
+			sum += id * 100 + d + i;
+	}
+	return sum;
+}
+
+static void *
+test_shared_stack_f(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	return (void *)(intptr_t)test_shared_stack_recursive(id, id % 8);
+}
+
+static void *
+test_shared_stack_main_f(void *arg)
+{
+	(void)arg;
+	struct coro **coros = new struct coro *[TEST_SHARED_COUNT];
+	for (int i = 0; i < TEST_SHARED_COUNT; ++i) {
+		void *id = (void *)(intptr_t)i;
+		/* Own stacks work next to the shared one. */
+		if (i % 50 == 1)
+			coros[i] = coro_new_sized(test_shared_stack_f, id, 32768);
+		else if (i % 50 == 2)
+			coros[i] = coro_new_inline(test_shared_stack_f, id);
+		else
+			coros[i] = coro_new(test_shared_stack_f, id);
+	}
+	for (int i = 0; i < TEST_SHARED_COUNT; ++i) {
+		unit_assert((long)(intptr_t)coro_join(coros[i]) ==
+			test_shared_stack_expected(i, i % 8));
+	}
+	delete[] coros;
+	return NULL;
+}
+
+static void
+test_shared_stack(void)
+{
+	unit_test_start();
+
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.stack_shared = true;
+	opts.stack_size = 64 * 1024;
+	opts.coro_cache_size = 100;
+	coro_sched_init_opts(&opts);
+	for (int round = 0; round < 3; ++round) {
+		struct coro *c = coro_new(test_shared_stack_main_f, NULL);
+		coro_sched_run();
+		unit_assert(coro_join(c) == NULL);
+	}
+	unit_msg("coroutines on a shared stack keep their frames");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+coro_main_f(void *arg)
+{
+	(void)arg;
+	test_suspend();
+	test_loop_of_yields();
+	test_wakup_self();
+	test_join_of_join();
+	test_wakeup_of_finished();
+	test_stack_sizes();
+	test_io();
+	test_timers();
+	test_stats();
+	test_priority();
+	test_inline();
+	test_sync();
+	test_group();
+	test_local();
+	return NULL;
+}
+
+int
+main(void)
+{
+	test_timer_wheel();
+
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	/* Small caches to make the tests free and reuse the stacks. */
+	opts.coro_cache_size = 2;
+	opts.stack_cache_size = 3;
+	coro_sched_init_opts(&opts);
+	struct coro *main_coro = coro_new(coro_main_f, NULL);
+	coro_sched_run();
+	void *rc = coro_join(main_coro);
+	unit_check(rc == NULL, "main coro rc");
+	coro_sched_destroy();
+
+	test_multiple_workers();
+	test_multiple_workers_io();
+	test_multiple_workers_timers();
+	test_multiple_workers_sync();
+	test_multiple_workers_group();
+	test_multiple_workers_local();
+	test_shared_stack();
 	return 0;
 }
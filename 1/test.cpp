@@ -2,8 +2,15 @@
 
 #include "unit.h"
 #include "corobus.h"
+#include "coro_ring.h"
 
+#include <fcntl.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -101,6 +108,52 @@ recv_join(struct ctx_recv *ctx)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/** The ring doesn't look into the messages, the size is an id. */
+static void
+test_ring(void)
+{
+	unit_test_start();
+	struct coro_ring ring;
+	coro_ring_create(&ring, 5);
+	unit_assert(coro_ring_capacity(&ring) == 8);
+	unit_assert(coro_ring_is_empty(&ring));
+
+	unit_msg("single messages wrap around");
+	size_t next_in = 0;
+	size_t next_out = 0;
+	for (int i = 0; i < 5; ++i) {
+		for (int j = 0; j < 6; ++j)
+			coro_ring_push(&ring)->len = next_in++;
+		unit_assert(coro_ring_size(&ring) == 6);
+		unit_assert(coro_ring_at(&ring, 5)->len == next_in - 1);
+		while (!coro_ring_is_empty(&ring))
+			unit_assert(coro_ring_pop(&ring)->len == next_out++);
+	}
+	for (int j = 0; j < 8; ++j)
+		coro_ring_push(&ring)->len = next_in++;
+	unit_assert(coro_ring_size(&ring) == coro_ring_capacity(&ring));
+	while (!coro_ring_is_empty(&ring))
+		unit_assert(coro_ring_pop(&ring)->len == next_out++);
+
+	unit_msg("batches split on the edge");
+	struct coro_bus_msg in[8];
+	struct coro_bus_msg out[8];
+	for (int i = 0; i < 20; ++i) {
+		size_t count = 1 + i % 8;
+		for (size_t j = 0; j < count; ++j)
+			in[j].len = next_in++;
+		coro_ring_push_n(&ring, in, count);
+		unit_assert(coro_ring_size(&ring) == count);
+		coro_ring_pop_n(&ring, out, count);
+		for (size_t j = 0; j < count; ++j)
+			unit_assert(out[j].len == next_out++);
+	}
+	coro_ring_destroy(&ring);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_basic(void)
 {
@@ -191,6 +244,50 @@ test_channel_reopen(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_many_channels(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	const int count = 1000;
+	int channels[count];
+
+	unit_msg("open many, close every other one");
+	for (int i = 0; i < count; ++i) {
+		channels[i] = coro_bus_channel_open(bus, 2);
+		unit_assert(channels[i] == i);
+	}
+	for (int i = 0; i < count; i += 2)
+		coro_bus_channel_close(bus, channels[i]);
+#if NEED_BROADCAST
+	unit_assert(coro_bus_broadcast(bus, 7) == 0);
+#else
+	for (int i = 1; i < count; i += 2)
+		unit_assert(coro_bus_send(bus, channels[i], 7) == 0);
+#endif
+	unsigned data;
+	for (int i = 0; i < count; ++i) {
+		unit_assert(coro_bus_try_recv(bus, channels[i], &data) == -1 ||
+			(i % 2 == 1 && data == 7));
+	}
+
+	unit_msg("the closed descriptors are reused");
+	for (int i = 0; i < count; i += 2) {
+		channels[i] = coro_bus_channel_open(bus, 2);
+		unit_assert(channels[i] >= 0 && channels[i] < count);
+		unit_assert(channels[i] % 2 == 0);
+	}
+	unit_assert(coro_bus_channel_open(bus, 2) == count);
+	for (int i = 0; i < count; ++i)
+		unit_assert(coro_bus_try_send(bus, channels[i], i) == 0);
+	for (int i = 0; i < count; ++i) {
+		unit_assert(coro_bus_try_recv(bus, channels[i], &data) == 0);
+		unit_assert(data == (unsigned)i);
+	}
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
 static void
 test_multiple_channels(void)
 {
@@ -737,30 +834,825 @@ test_wakeup_on_close(void)
 	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
 	unit_assert(data2 == 654);
 
-	coro_bus_delete(bus);
-	unit_test_finish();
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_cancel_waiting(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+
+	unit_msg("cancel a receiver");
+	unsigned data1 = 987;
+	struct ctx_recv recv_ctx1;
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	coro_yield();
+	unit_assert(recv_ctx1.is_started && !recv_ctx1.is_done);
+	coro_cancel(recv_ctx1.worker);
+	unit_assert(recv_join(&recv_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+	unit_assert(data1 == 987);
+
+	unit_msg("cancelled receiver passes the wakeup on");
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	unsigned data2 = 654;
+	struct ctx_recv recv_ctx2;
+	recv_start(&recv_ctx2, bus, c1, &data2);
+	coro_yield();
+	unit_assert(!recv_ctx1.is_done && !recv_ctx2.is_done);
+	unit_assert(coro_bus_send(bus, c1, 123) == 0);
+	coro_cancel(recv_ctx1.worker);
+	unit_assert(recv_join(&recv_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+	unit_assert(recv_join(&recv_ctx2) == 0 && data2 == 123);
+
+	unit_msg("cancel a sender");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 2);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+	coro_cancel(send_ctx.worker);
+	unit_assert(send_join(&send_ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+	unit_assert(coro_bus_recv(bus, c1, &data1) == 0 && data1 == 1);
+	unit_assert(coro_bus_try_recv(bus, c1, &data1) != 0);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_close_non_empty_bus(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 10);
+	unit_assert(c2 >= 0);
+
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	unit_assert(coro_bus_send(bus, c2, 1) == 0);
+	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int msg_free_count = 0;
+
+static void
+msg_free(void *ptr, size_t len)
+{
+	(void)len;
+	free(ptr);
+	++msg_free_count;
+}
+
+struct ctx_recv_msg {
+	struct coro_bus *bus;
+	int channel;
+	struct coro_bus_msg msg;
+	int rc;
+};
+
+static void *
+recv_msg_f(void *arg)
+{
+	struct ctx_recv_msg *ctx = (decltype(ctx))arg;
+	ctx->rc = coro_bus_recv_msg(ctx->bus, ctx->channel, &ctx->msg);
+	return NULL;
+}
+
+static void
+test_msg_basic(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	coro_bus_set_msg_free(bus, msg_free);
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+	struct coro_bus_msg msg;
+
+	unit_msg("small payload is copied");
+	char small[] = "small";
+	unit_assert(coro_bus_send_msg(bus, c1, small, sizeof(small)) == 0);
+	small[0] = 'x';
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0);
+	unit_assert(msg.len == sizeof(small));
+	unit_assert(strcmp((char *)coro_bus_msg_data(&msg), "small") == 0);
+
+	unit_msg("big payload is passed by the pointer");
+	char *big = (char *)malloc(100);
+	memset(big, 'b', 100);
+	unit_assert(coro_bus_send_msg(bus, c1, big, 100) == 0);
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0);
+	unit_assert(msg.len == 100);
+	unit_assert(coro_bus_msg_data(&msg) == big);
+	free(big);
+
+	unit_msg("unsigned values are messages too");
+	unit_assert(coro_bus_send(bus, c1, 123) == 0);
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0);
+	unit_assert(msg.len == sizeof(unsigned));
+	unit_assert(*(unsigned *)coro_bus_msg_data(&msg) == 123);
+	unsigned value = 456;
+	unit_assert(coro_bus_send_msg(bus, c1, &value, sizeof(value)) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &value) == 0);
+	unit_assert(value == 456);
+
+	unit_msg("try send to a full channel keeps the pointer");
+	for (int i = 0; i < 3; ++i)
+		unit_assert(coro_bus_try_send_msg(bus, c1, &i, sizeof(i)) == 0);
+	big = (char *)malloc(100);
+	unit_assert(coro_bus_try_send_msg(bus, c1, big, 100) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (int i = 0; i < 3; ++i) {
+		unit_assert(coro_bus_try_recv_msg(bus, c1, &msg) == 0);
+		unit_assert(*(int *)coro_bus_msg_data(&msg) == i);
+	}
+	unit_assert(coro_bus_try_recv_msg(bus, c1, &msg) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("blocking receive");
+	struct ctx_recv_msg ctx;
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.rc = -1;
+	struct coro *worker = coro_new(recv_msg_f, &ctx);
+	coro_yield();
+	unit_assert(coro_bus_send_msg(bus, c1, big, 100) == 0);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.rc == 0);
+	unit_assert(coro_bus_msg_data(&ctx.msg) == big);
+	free(big);
+
+	unit_msg("pending payloads are freed with the channel and the bus");
+	msg_free_count = 0;
+	unit_assert(coro_bus_send_msg(bus, c1, malloc(100), 100) == 0);
+	unit_assert(coro_bus_send_msg(bus, c1, small, sizeof(small)) == 0);
+	unit_assert(coro_bus_send_msg(bus, c1, malloc(100), 100) == 0);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(msg_free_count == 2);
+	c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(coro_bus_send_msg(bus, c1, malloc(100), 100) == 0);
+	coro_bus_delete(bus);
+	unit_assert(msg_free_count == 3);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+select_op_create(struct coro_bus_op *op, int channel,
+	enum coro_bus_op_type type, unsigned data)
+{
+	op->channel = channel;
+	op->type = type;
+	coro_bus_msg_create(&op->msg, &data, sizeof(data));
+}
+
+static unsigned
+select_op_data(struct coro_bus_op *op)
+{
+	unit_assert(op->msg.len == sizeof(unsigned));
+	return *(unsigned *)coro_bus_msg_data(&op->msg);
+}
+
+struct ctx_select {
+	struct coro_bus *bus;
+	struct coro_bus_op *ops;
+	unsigned count;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+select_f(void *arg)
+{
+	struct ctx_select *ctx = (decltype(ctx))arg;
+	ctx->rc = coro_bus_select(ctx->bus, ctx->ops, ctx->count);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+select_start(struct ctx_select *ctx, struct coro_bus *bus,
+	struct coro_bus_op *ops, unsigned count)
+{
+	ctx->bus = bus;
+	ctx->ops = ops;
+	ctx->count = count;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(select_f, ctx);
+}
+
+static int
+select_join(struct ctx_select *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void
+test_select(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_op ops[3];
+
+	unit_msg("no operations or no channel");
+	unit_assert(coro_bus_try_select(bus, ops, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	select_op_create(&ops[0], 0, CORO_BUS_OP_RECV, 0);
+	unit_assert(coro_bus_select(bus, ops, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	int c3 = coro_bus_channel_open(bus, 1);
+	unit_assert(c3 >= 0);
+	unit_assert(coro_bus_send(bus, c3, 3) == 0);
+
+	unit_msg("nothing is ready");
+	select_op_create(&ops[0], c1, CORO_BUS_OP_RECV, 0);
+	select_op_create(&ops[1], c2, CORO_BUS_OP_RECV, 0);
+	select_op_create(&ops[2], c3, CORO_BUS_OP_SEND, 30);
+	unit_assert(coro_bus_try_select(bus, ops, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("the first ready one is taken");
+	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_try_select(bus, ops, 3) == 0);
+	unit_assert(select_op_data(&ops[0]) == 1);
+	unit_assert(coro_bus_select(bus, ops, 3) == 1);
+	unit_assert(select_op_data(&ops[1]) == 2);
+
+	unit_msg("wait for a message");
+	struct ctx_select ctx;
+	select_start(&ctx, bus, ops, 3);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_send(bus, c2, 20) == 0);
+	unit_assert(select_join(&ctx) == 1);
+	unit_assert(select_op_data(&ops[1]) == 20);
+
+	unit_msg("wait for room");
+	select_start(&ctx, bus, ops, 3);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 3);
+	unit_assert(select_join(&ctx) == 2);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 30);
+
+	unit_msg("the other waiters get their wakeups too");
+	unit_assert(coro_bus_send(bus, c3, 3) == 0);
+	select_start(&ctx, bus, ops, 3);
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(!ctx.is_done && !recv_ctx.is_done);
+	unit_assert(coro_bus_send(bus, c1, 10) == 0);
+	unit_assert(coro_bus_send(bus, c1, 11) == 0);
+	unit_assert(select_join(&ctx) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0);
+	unit_assert(data + select_op_data(&ops[0]) == 21);
+
+	unit_msg("close a channel during the wait");
+	select_start(&ctx, bus, ops, 3);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_channel_close(bus, c2);
+	unit_assert(select_join(&ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("cancel the wait");
+	select_start(&ctx, bus, ops, 1);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_cancel(ctx.worker);
+	unit_assert(select_join(&ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+
+	unit_msg("a wait left all the queues");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 3);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c3);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Send into the durable channel file, and quit without closing the
+ * channel, like on a crash.
+ */
+static void
+durable_crash(const char *path)
+{
+	pid_t pid = fork();
+	unit_assert(pid >= 0);
+	if (pid == 0) {
+		struct coro_bus *bus = coro_bus_new();
+		int c1 = coro_bus_channel_open_durable(bus, 10, path, NULL);
+		bool ok = c1 >= 0 && coro_bus_try_send(bus, c1, 7) == 0 &&
+			coro_bus_try_send(bus, c1, 8) == 0 &&
+			coro_bus_channel_commit(bus, c1) == 0 &&
+			coro_bus_try_send(bus, c1, 9) == 0;
+		unsigned data = 0;
+		ok = ok && coro_bus_try_recv(bus, c1, &data) == 0 && data == 7;
+		_exit(ok ? 0 : 1);
+	}
+	int status;
+	unit_assert(waitpid(pid, &status, 0) == pid);
+	unit_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void
+test_durable(void)
+{
+	unit_test_start();
+	char path[] = "/tmp/corobus_test_XXXXXX";
+	int fd = mkstemp(path);
+	unit_assert(fd >= 0);
+	close(fd);
+	struct coro_bus *bus = coro_bus_new();
+	coro_bus_set_msg_free(bus, msg_free);
+	msg_free_count = 0;
+	struct coro_bus_durable_opts opts;
+	coro_bus_durable_opts_create(&opts);
+	/* Too small, so it has to grow. */
+	opts.segment_size = 64;
+	opts.commit_batch = 0;
+
+	unit_msg("new file");
+	int c1 = coro_bus_channel_open_durable(bus, 4, path, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	char *payload = (char *)malloc(100);
+	for (int i = 0; i < 100; ++i)
+		payload[i] = (char)i;
+	unit_assert(coro_bus_send_msg(bus, c1, payload, 100) == 0);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_channel_commit(bus, c1) == 0);
+
+	unit_msg("close keeps the unread ones in the file");
+	coro_bus_channel_close(bus, c1);
+	unit_assert(msg_free_count == 1);
+
+	unit_msg("reopen resumes from the last commit");
+	c1 = coro_bus_channel_open_durable(bus, 2, path, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_try_send(bus, c1, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+	struct coro_bus_msg msg;
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0 && msg.len == 100);
+	payload = (char *)coro_bus_msg_data(&msg);
+	for (int i = 0; i < 100; ++i)
+		unit_assert(payload[i] == (char)i);
+	free(payload);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("a crash loses what is not committed");
+	durable_crash(path);
+	c1 = coro_bus_channel_open_durable(bus, 10, path, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 7);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 8);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("the read messages make room, the commits go in batches");
+	opts.commit_batch = 16;
+	c1 = coro_bus_channel_open_durable(bus, 16, path, &opts);
+	unit_assert(c1 >= 0);
+	for (int r = 0; r < 100; ++r) {
+		for (unsigned i = 0; i < 16; ++i)
+			unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+		for (unsigned i = 0; i < 16; ++i)
+			unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == i);
+	}
+	coro_bus_channel_close(bus, c1);
+	struct stat st;
+	unit_assert(stat(path, &st) == 0);
+	unit_assert(st.st_size <= 4096 + 1024);
+	c1 = coro_bus_channel_open_durable(bus, 16, path, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("commit of the other channels");
+	c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(coro_bus_channel_commit(bus, c1) == 0);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_channel_commit(bus, c1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("not a channel file");
+	fd = open(path, O_WRONLY | O_TRUNC);
+	unit_assert(fd >= 0);
+	unit_assert(write(fd, "garbage", 7) == 7);
+	close(fd);
+	unit_assert(coro_bus_channel_open_durable(bus, 1, path, &opts) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_SYSTEM);
+
+	unlink(path);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_spill(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	coro_bus_set_msg_free(bus, msg_free);
+	msg_free_count = 0;
+	struct coro_bus_spill_opts opts;
+	coro_bus_spill_opts_create(&opts);
+	/* A bit more than a chunk, so the file wraps around. */
+	opts.spill_limit = 300;
+
+	unit_msg("a burst goes to the file, and comes back in order");
+	int c1 = coro_bus_channel_open_spill(bus, 4, &opts);
+	unit_assert(c1 >= 0);
+	unsigned next_sent = 0;
+	while (coro_bus_try_send(bus, c1, next_sent) == 0)
+		++next_sent;
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(next_sent == 4 + 300);
+	unsigned next_recv = 0;
+	unsigned data;
+	for (int r = 0; r < 20; ++r) {
+		for (int i = 0; i < 100; ++i) {
+			unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+			unit_assert(data == next_recv++);
+		}
+		for (int i = 0; i < 100; ++i)
+			unit_assert(coro_bus_try_send(bus, c1, next_sent++) == 0);
+		unit_assert(coro_bus_try_send(bus, c1, next_sent) != 0);
+	}
+	while (coro_bus_try_recv(bus, c1, &data) == 0)
+		unit_assert(data == next_recv++);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(next_recv == next_sent);
+
+	unit_msg("the payloads stay in memory");
+	char *payload = (char *)malloc(100);
+	memset(payload, 'x', 100);
+	for (int i = 0; i < 4; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_send_msg(bus, c1, payload, 100) == 0);
+	for (int i = 0; i < 4; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == (unsigned)i);
+	struct coro_bus_msg msg;
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0);
+	unit_assert(msg.len == 100 && coro_bus_msg_data(&msg) == payload);
+
+	unit_msg("close frees the spilled payloads");
+	for (int i = 0; i < 300; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_send_msg(bus, c1, payload, 100) == 0);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(msg_free_count == 1);
+
+#if NEED_BATCH
+	unit_msg("a batch is split between the memory and the file");
+	c1 = coro_bus_channel_open_spill(bus, 4, &opts);
+	unit_assert(c1 >= 0);
+	unsigned batch[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+	unit_assert(coro_bus_send_v(bus, c1, batch, 3) == 3);
+	unit_assert(coro_bus_send_v(bus, c1, batch + 3, 7) == 7);
+	unsigned out[10];
+	unit_assert(coro_bus_recv_v(bus, c1, out, 10) == 4);
+	unit_assert(coro_bus_recv_v(bus, c1, out + 4, 10) == 4);
+	unit_assert(coro_bus_recv_v(bus, c1, out + 8, 10) == 2);
+	for (unsigned i = 0; i < 10; ++i)
+		unit_assert(out[i] == i);
+	coro_bus_channel_close(bus, c1);
+#endif
+
+	unit_msg("no directory");
+	opts.dir = "/non/existent";
+	unit_assert(coro_bus_channel_open_spill(bus, 4, &opts) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_SYSTEM);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_stats stats;
+
+	unit_msg("no channel");
+	unit_assert(coro_bus_stats(bus, 0, &stats) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("the messages are counted");
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == 0 && stats.recv_count == 0);
+	unit_assert(stats.size == 0 && stats.max_size == 0);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unsigned data;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == 3 && stats.recv_count == 1);
+	unit_assert(stats.size == 2 && stats.max_size == 3);
+	unit_assert(stats.send_wait_count == 0 && stats.recv_wait_count == 0);
+
+	unit_msg("a sender waits for room");
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 4);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_wait_count == 1 && stats.send_wait_ns > 0);
+	unit_assert(stats.recv_wait_count == 0 && stats.recv_wait_ns == 0);
+
+	unit_msg("a receiver waits for a message");
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(recv_ctx.is_started && !recv_ctx.is_done);
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0 && data == 5);
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == 6 && stats.recv_count == 6);
+	unit_assert(stats.size == 0 && stats.max_size == 3);
+	unit_assert(stats.recv_wait_count == 1 && stats.recv_wait_ns > 0);
+
+	unit_msg("a select waits in each channel");
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	struct coro_bus_op ops[2];
+	select_op_create(&ops[0], c1, CORO_BUS_OP_RECV, 0);
+	select_op_create(&ops[1], c2, CORO_BUS_OP_RECV, 0);
+	struct ctx_select select_ctx;
+	select_start(&select_ctx, bus, ops, 2);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c2, 6) == 0);
+	unit_assert(select_join(&select_ctx) == 1);
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.recv_wait_count == 2 && stats.recv_count == 6);
+	unit_assert(coro_bus_stats(bus, c2, &stats) == 0);
+	unit_assert(stats.recv_wait_count == 1 && stats.recv_count == 1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("the spilled messages count in the size");
+	struct coro_bus_spill_opts opts;
+	coro_bus_spill_opts_create(&opts);
+	opts.spill_limit = 10;
+	c1 = coro_bus_channel_open_spill(bus, 2, &opts);
+	unit_assert(c1 >= 0);
+	for (unsigned i = 0; i < 5; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.size == 4 && stats.max_size == 5);
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** A coroutine publishing into a topic, or receiving from it. */
+struct ctx_topic {
+	struct coro_bus *bus;
+	int topic;
+	int sub;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_started;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+topic_f(void *arg)
+{
+	struct ctx_topic *ctx = (decltype(ctx))arg;
+	ctx->is_started = true;
+	if (ctx->sub < 0)
+		ctx->rc = coro_bus_publish(ctx->bus, ctx->topic, ctx->data);
+	else
+		ctx->rc = coro_bus_topic_recv(ctx->bus, ctx->topic, ctx->sub,
+			&ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+/** Publish the data if the subscription is negative, else receive. */
+static void
+topic_start(struct ctx_topic *ctx, struct coro_bus *bus, int topic, int sub,
+	unsigned data)
+{
+	ctx->bus = bus;
+	ctx->topic = topic;
+	ctx->sub = sub;
+	ctx->data = data;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_started = false;
+	ctx->is_done = false;
+	ctx->worker = coro_new(topic_f, ctx);
+	coro_yield();
 }
 
-////////////////////////////////////////////////////////////////////////////////
+static int
+topic_join(struct ctx_topic *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
 
 static void
-test_close_non_empty_bus(void)
+test_topic(void)
 {
 	unit_test_start();
 	struct coro_bus *bus = coro_bus_new();
+	coro_bus_set_msg_free(bus, msg_free);
+	msg_free_count = 0;
+	unsigned data;
 
-	int c1 = coro_bus_channel_open(bus, 3);
-	unit_assert(c1 >= 0);
-	int c2 = coro_bus_channel_open(bus, 10);
-	unit_assert(c2 >= 0);
+	unit_msg("no topic");
+	unit_assert(coro_bus_subscribe(bus, 0) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_publish(bus, 0, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	int t1 = coro_bus_topic_open(bus, 3);
+	unit_assert(t1 >= 0);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, 0, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
 
-	unit_assert(coro_bus_send(bus, c1, 1) == 0);
-	unit_assert(coro_bus_send(bus, c1, 2) == 0);
-	unit_assert(coro_bus_send(bus, c1, 3) == 0);
-	unit_assert(coro_bus_send(bus, c2, 1) == 0);
-	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+	unit_msg("nobody gets a message without subscribers");
+	unit_assert(coro_bus_try_publish(bus, t1, 1) == 0);
+	unit_assert(coro_bus_try_publish_msg(bus, t1, malloc(100), 100) == 0);
+	unit_assert(msg_free_count == 1);
+
+	unit_msg("each subscriber gets all the messages");
+	int s1 = coro_bus_subscribe(bus, t1);
+	int s2 = coro_bus_subscribe(bus, t1);
+	unit_assert(s1 >= 0 && s2 >= 0 && s1 != s2);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_try_publish(bus, t1, i) == 0);
+	for (unsigned i = 0; i < 3; ++i) {
+		unit_assert(coro_bus_try_topic_recv(bus, t1, s1, &data) == 0);
+		unit_assert(data == i);
+	}
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("the slowest subscriber holds the publishers");
+	unit_assert(coro_bus_try_publish(bus, t1, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s2, &data) == 0 && data == 0);
+	unit_assert(coro_bus_try_publish(bus, t1, 3) == 0);
+	for (unsigned i = 1; i < 4; ++i) {
+		unit_assert(coro_bus_try_topic_recv(bus, t1, s2, &data) == 0);
+		unit_assert(data == i);
+	}
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s1, &data) == 0 && data == 3);
+
+	unit_msg("a payload is shared until all are done with it");
+	char *payload = (char *)malloc(100);
+	unit_assert(coro_bus_publish_msg(bus, t1, payload, 100) == 0);
+	struct coro_bus_msg msg;
+	unit_assert(coro_bus_topic_recv_msg(bus, t1, s1, &msg) == 0);
+	unit_assert(msg.len == 100 && coro_bus_msg_data(&msg) == payload);
+	unit_assert(coro_bus_topic_recv_msg(bus, t1, s2, &msg) == 0);
+	unit_assert(msg.len == 100 && coro_bus_msg_data(&msg) == payload);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s1, &data) != 0);
+	unit_assert(msg_free_count == 1);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s2, &data) != 0);
+	unit_assert(msg_free_count == 2);
+
+	unit_msg("a subscriber waits for a message");
+	struct ctx_topic recv_ctx;
+	topic_start(&recv_ctx, bus, t1, s1, 0);
+	unit_assert(recv_ctx.is_started && !recv_ctx.is_done);
+	unit_assert(coro_bus_publish(bus, t1, 10) == 0);
+	unit_assert(topic_join(&recv_ctx) == 0 && recv_ctx.data == 10);
+	unit_assert(coro_bus_topic_recv(bus, t1, s2, &data) == 0 && data == 10);
+
+	unit_msg("a publisher waits for the slowest subscriber");
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_publish(bus, t1, i) == 0);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_topic_recv(bus, t1, s1, &data) == 0);
+	struct ctx_topic publish_ctx;
+	topic_start(&publish_ctx, bus, t1, -1, 3);
+	unit_assert(publish_ctx.is_started && !publish_ctx.is_done);
+	unit_assert(coro_bus_topic_recv(bus, t1, s2, &data) == 0 && data == 0);
+	unit_assert(topic_join(&publish_ctx) == 0);
+
+	unit_msg("unsubscribe releases the unread messages");
+	coro_bus_unsubscribe(bus, t1, s2);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s2, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s1, &data) == 0 && data == 3);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_try_publish(bus, t1, i) == 0);
+
+	unit_msg("a new subscriber gets only the new messages");
+	s2 = coro_bus_subscribe(bus, t1);
+	unit_assert(s2 >= 0);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s2, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_try_topic_recv(bus, t1, s1, &data) == 0);
+	unit_assert(coro_bus_try_publish(bus, t1, 20) == 0);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s2, &data) == 0 && data == 20);
+
+	unit_msg("a waiter of a cancelled subscription doesn't get a new one");
+	topic_start(&recv_ctx, bus, t1, s2, 0);
+	unit_assert(recv_ctx.is_started && !recv_ctx.is_done);
+	coro_bus_unsubscribe(bus, t1, s2);
+	int s3 = coro_bus_subscribe(bus, t1);
+	unit_assert(s3 == s2);
+	unit_assert(coro_bus_try_publish(bus, t1, 30) == 0);
+	unit_assert(topic_join(&recv_ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s3, &data) == 0 && data == 30);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s1, &data) == 0 && data == 20);
+	unit_assert(coro_bus_try_topic_recv(bus, t1, s1, &data) == 0 && data == 30);
+
+	unit_msg("close wakes up the subscribers and frees the payloads");
+	topic_start(&recv_ctx, bus, t1, s1, 0);
+	unit_assert(recv_ctx.is_started && !recv_ctx.is_done);
+	coro_bus_topic_close(bus, t1);
+	unit_assert(topic_join(&recv_ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
 
+	unit_msg("the closed descriptor is reused");
+	int t2 = coro_bus_topic_open(bus, 3);
+	unit_assert(t2 == t1);
+	t1 = coro_bus_topic_open(bus, 3);
+	unit_assert(t1 >= 0 && t1 != t2);
+	coro_bus_topic_close(bus, t2);
+	unit_assert(coro_bus_topic_open(bus, 3) == t2);
+	coro_bus_topic_close(bus, t2);
+	s1 = coro_bus_subscribe(bus, t1);
+	unit_assert(coro_bus_publish_msg(bus, t1, malloc(100), 100) == 0);
+	msg_free_count = 0;
 	coro_bus_delete(bus);
+	unit_assert(msg_free_count == 1);
 	unit_test_finish();
 }
 
@@ -1014,6 +1906,72 @@ test_broadcast_blocking_drop_channel_during_wait(void)
 #endif
 }
 
+static void
+test_broadcast_blocking_all_full(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("create some channels full with data");
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	int c3 = coro_bus_channel_open(bus, 1);
+	unit_assert(c3 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+	unit_assert(coro_bus_send(bus, c3, 3) == 0);
+
+	unit_msg("a broadcast and a send wait on the same channel");
+	struct ctx_broadcast ctx;
+	broadcast_start(&ctx, bus, 999);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 4);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+
+	unit_msg("the waiting broadcast doesn't hold the room back");
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(!ctx.is_done);
+
+	unit_msg("nothing happens until all the channels have room");
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 2);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 3);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 4);
+	unit_assert(broadcast_join(&ctx) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 999);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 999);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 999);
+
+	unit_msg("cancel a broadcast waiting on many channels");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+	broadcast_start(&ctx, bus, 999);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	coro_cancel(ctx.worker);
+	unit_assert(broadcast_join(&ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+
+	unit_msg("the cancelled one has left all the queues");
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 2);
+	unit_assert(coro_bus_try_recv(bus, c3, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void
@@ -1604,15 +2562,505 @@ test_recv_vector_blocking_recv_many(void)
 #endif
 }
 
+static void
+test_recv_vector_wakeup_batch(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 10);
+	unit_assert(c1 >= 0);
+	unsigned data[5] = {1, 2, 3, 4, 5};
+
+	unit_msg("a batch goes to the first waiter if it fits");
+	unsigned data_a[4] = {0};
+	struct ctx_recv_v ctx_a;
+	recv_v_start(&ctx_a, bus, c1, data_a, 4);
+	unsigned data_b[4] = {0};
+	struct ctx_recv_v ctx_b;
+	recv_v_start(&ctx_b, bus, c1, data_b, 4);
+	coro_yield();
+	unit_assert(!ctx_a.is_done && !ctx_b.is_done);
+	unit_assert(coro_bus_send_v(bus, c1, data, 3) == 3);
+	unit_assert(recv_v_join(&ctx_a) == 3);
+	unit_assert(data_a[0] == 1 && data_a[1] == 2 && data_a[2] == 3);
+	coro_yield();
+	unit_assert(!ctx_b.is_done);
+#ifdef CORO_STATS
+	struct coro_stats stats;
+	coro_stats_get(ctx_b.worker, &stats);
+	unit_assert(stats.suspend_count == 1);
+#endif
+
+	unit_msg("a bigger one goes to as many as needed");
+	recv_v_start(&ctx_a, bus, c1, data_a, 2);
+	unsigned data_c[4] = {0};
+	struct ctx_recv_v ctx_c;
+	recv_v_start(&ctx_c, bus, c1, data_c, 4);
+	coro_yield();
+	unit_assert(coro_bus_send_v(bus, c1, data, 5) == 5);
+	unit_assert(recv_v_join(&ctx_b) == 4);
+	unit_assert(recv_v_join(&ctx_a) == 1);
+	unit_assert(coro_bus_try_recv(bus, c1, &data_a[0]) != 0);
+	coro_yield();
+	unit_assert(!ctx_c.is_done);
+
+	unit_msg("a cancelled waiter passes all its wakeups on");
+	recv_v_start(&ctx_a, bus, c1, data_a, 1);
+	recv_v_start(&ctx_b, bus, c1, data_b, 1);
+	coro_yield();
+	unit_assert(coro_bus_send_v(bus, c1, data, 3) == 3);
+	coro_cancel(ctx_c.worker);
+	unit_assert(recv_v_join(&ctx_c) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+	unit_assert(recv_v_join(&ctx_a) == 1 && data_a[0] == 1);
+	unit_assert(recv_v_join(&ctx_b) == 1 && data_b[0] == 2);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+static void
+test_msg_vector(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+
+	unit_msg("send as many as fit, the payloads are not copied");
+	char *payloads[5];
+	struct coro_bus_msg msgs[5];
+	for (int i = 0; i < 5; ++i) {
+		payloads[i] = (char *)malloc(64);
+		coro_bus_msg_create(&msgs[i], payloads[i], 64);
+	}
+	unit_assert(coro_bus_send_msg_v(bus, c1, msgs, 5) == 3);
+	unit_assert(coro_bus_try_send_msg_v(bus, c1, msgs + 3, 2) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	struct coro_bus_msg out[5];
+	unit_assert(coro_bus_recv_msg_v(bus, c1, out, 5) == 3);
+	for (int i = 0; i < 3; ++i) {
+		unit_assert(out[i].len == 64);
+		unit_assert(coro_bus_msg_data(&out[i]) == payloads[i]);
+	}
+	unit_assert(coro_bus_try_send_msg_v(bus, c1, msgs + 3, 2) == 2);
+	unit_assert(coro_bus_try_recv_msg_v(bus, c1, out, 1) == 1);
+	unit_assert(coro_bus_msg_data(&out[0]) == payloads[3]);
+	unit_assert(coro_bus_try_recv_msg_v(bus, c1, out, 5) == 1);
+	unit_assert(coro_bus_msg_data(&out[0]) == payloads[4]);
+	unit_assert(coro_bus_try_recv_msg_v(bus, c1, out, 5) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (int i = 0; i < 5; ++i)
+		free(payloads[i]);
+
+	unit_msg("values and messages share the order");
+	unsigned values[2] = {1, 2};
+	unit_assert(coro_bus_send_v(bus, c1, values, 2) == 2);
+	unit_assert(coro_bus_recv_msg_v(bus, c1, out, 5) == 2);
+	unit_assert(*(unsigned *)coro_bus_msg_data(&out[0]) == 1);
+	unit_assert(*(unsigned *)coro_bus_msg_data(&out[1]) == 2);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_MT_CHANNEL_COUNT = 3,
+	TEST_MT_PEER_COUNT = 3,
+	TEST_MT_SEND_COUNT = 300,
+	TEST_MT_BROADCAST_COUNT = 30,
+	TEST_MT_RECV_COUNT = TEST_MT_SEND_COUNT + TEST_MT_BROADCAST_COUNT /
+		TEST_MT_PEER_COUNT,
+	TEST_MT_BROADCAST_BASE = TEST_MT_CHANNEL_COUNT * TEST_MT_PEER_COUNT *
+		TEST_MT_SEND_COUNT,
+	TEST_MT_VALUE_COUNT = TEST_MT_BROADCAST_BASE + TEST_MT_BROADCAST_COUNT,
+	/** How many values each relay and sink takes in test_mt_select(). */
+	TEST_MT_RELAY_COUNT = TEST_MT_BROADCAST_BASE / TEST_MT_PEER_COUNT,
+};
+
+struct ctx_mt {
+	struct coro_bus *bus;
+	int channels[TEST_MT_CHANNEL_COUNT];
+	/** How many times each value was received. */
+	int seen[TEST_MT_VALUE_COUNT];
+};
+
+struct ctx_mt_peer {
+	struct ctx_mt *ctx;
+	int channel;
+	unsigned first;
+};
+
+/** Send own range of values, one by one and in batches. */
+static void *
+mt_send_f(void *arg)
+{
+	struct ctx_mt_peer *peer = (decltype(peer))arg;
+	unsigned data[5];
+	unsigned next = peer->first;
+	unsigned end = peer->first + TEST_MT_SEND_COUNT;
+	while (next < end) {
+		if (next % 2 == 0) {
+			unit_assert(coro_bus_send(peer->ctx->bus, peer->channel,
+				next) == 0);
+			unit_assert(coro_bus_errno() == CORO_BUS_ERR_NONE);
+			++next;
+			continue;
+		}
+		unsigned count = 0;
+		for (; count < 5 && next + count < end; ++count)
+			data[count] = next + count;
+		int rc = coro_bus_send_v(peer->ctx->bus, peer->channel, data,
+			count);
+		unit_assert(rc > 0);
+		next += rc;
+	}
+	return NULL;
+}
+
+static void *
+mt_recv_f(void *arg)
+{
+	struct ctx_mt_peer *peer = (decltype(peer))arg;
+	unsigned data[4];
+	for (int received = 0; received < TEST_MT_RECV_COUNT;) {
+		unsigned capacity = 4;
+		if (TEST_MT_RECV_COUNT - received < 4)
+			capacity = TEST_MT_RECV_COUNT - received;
+		int rc = coro_bus_recv_v(peer->ctx->bus, peer->channel, data,
+			capacity);
+		unit_assert(rc > 0);
+		unit_assert(coro_bus_errno() == CORO_BUS_ERR_NONE);
+		for (int i = 0; i < rc; ++i) {
+			__atomic_fetch_add(&peer->ctx->seen[data[i]], 1,
+				__ATOMIC_RELAXED);
+		}
+		received += rc;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+mt_broadcast_f(void *arg)
+{
+	struct ctx_mt *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < TEST_MT_BROADCAST_COUNT; ++i) {
+		unit_assert(coro_bus_broadcast(ctx->bus,
+			TEST_MT_BROADCAST_BASE + i) == 0);
+		coro_yield();
+	}
+	return NULL;
+}
+
+/**
+ * Move the messages from all the inputs to the output, and keep
+ * receiving while waiting for room in the output.
+ */
+static void *
+mt_relay_f(void *arg)
+{
+	struct ctx_mt_peer *peer = (decltype(peer))arg;
+	struct ctx_mt *ctx = peer->ctx;
+	struct coro_bus_op ops[TEST_MT_CHANNEL_COUNT + 1];
+	unsigned pending[TEST_MT_RELAY_COUNT];
+	int pending_count = 0;
+	int received = 0;
+	while (received < TEST_MT_RELAY_COUNT || pending_count > 0) {
+		unsigned count = 0;
+		if (pending_count > 0) {
+			select_op_create(&ops[count++], peer->channel,
+				CORO_BUS_OP_SEND, pending[0]);
+		}
+		for (int i = 0; i < TEST_MT_CHANNEL_COUNT &&
+		     received < TEST_MT_RELAY_COUNT; ++i) {
+			select_op_create(&ops[count++], ctx->channels[i],
+				CORO_BUS_OP_RECV, 0);
+		}
+		int rc = coro_bus_select(ctx->bus, ops, count);
+		unit_assert(rc >= 0);
+		if (ops[rc].type == CORO_BUS_OP_RECV) {
+			pending[pending_count++] = select_op_data(&ops[rc]);
+			++received;
+		} else {
+			memmove(pending, pending + 1,
+				--pending_count * sizeof(pending[0]));
+		}
+	}
+	return NULL;
+}
+
+static void *
+mt_sink_f(void *arg)
+{
+	struct ctx_mt_peer *peer = (decltype(peer))arg;
+	for (int i = 0; i < TEST_MT_RELAY_COUNT; ++i) {
+		unsigned data;
+		unit_assert(coro_bus_recv(peer->ctx->bus, peer->channel,
+			&data) == 0);
+		__atomic_fetch_add(&peer->ctx->seen[data], 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/**
+ * The relays wait on all the inputs and the output at once. Each
+ * value goes through exactly one of them.
+ */
+static void
+test_mt_select(void)
+{
+	unit_test_start();
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = 4;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+
+	struct ctx_mt *ctx = new ctx_mt;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->bus = coro_bus_new_mt();
+	for (int i = 0; i < TEST_MT_CHANNEL_COUNT; ++i) {
+		ctx->channels[i] = coro_bus_channel_open(ctx->bus, 7);
+		unit_assert(ctx->channels[i] >= 0);
+	}
+	int output = coro_bus_channel_open(ctx->bus, 2);
+	unit_assert(output >= 0);
+	const int peer_count = TEST_MT_CHANNEL_COUNT * TEST_MT_PEER_COUNT;
+	struct ctx_mt_peer senders[peer_count];
+	struct ctx_mt_peer relay = {ctx, output, 0};
+	struct coro *coros[peer_count + TEST_MT_PEER_COUNT * 2];
+	int coro_count = 0;
+	for (int i = 0; i < peer_count; ++i) {
+		senders[i].ctx = ctx;
+		senders[i].channel = ctx->channels[i % TEST_MT_CHANNEL_COUNT];
+		senders[i].first = i * TEST_MT_SEND_COUNT;
+		coros[coro_count++] = coro_new(mt_send_f, &senders[i]);
+	}
+	for (int i = 0; i < TEST_MT_PEER_COUNT; ++i) {
+		coros[coro_count++] = coro_new(mt_relay_f, &relay);
+		coros[coro_count++] = coro_new(mt_sink_f, &relay);
+	}
+	coro_sched_run();
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+
+	unit_msg("every message is relayed once");
+	for (int i = 0; i < TEST_MT_BROADCAST_BASE; ++i)
+		unit_assert(ctx->seen[i] == 1);
+	for (int i = 0; i < TEST_MT_CHANNEL_COUNT; ++i)
+		coro_bus_channel_close(ctx->bus, ctx->channels[i]);
+	coro_bus_channel_close(ctx->bus, output);
+	coro_bus_delete(ctx->bus);
+	delete ctx;
+	coro_sched_destroy();
+	unit_test_finish();
+}
+
+static void
+test_mt_send_recv(void)
+{
+	unit_test_start();
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = 4;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+
+	struct ctx_mt *ctx = new ctx_mt;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->bus = coro_bus_new_mt();
+	for (int i = 0; i < TEST_MT_CHANNEL_COUNT; ++i) {
+		/* Small, so the peers wait for each other a lot. */
+		ctx->channels[i] = coro_bus_channel_open(ctx->bus, 7);
+		unit_assert(ctx->channels[i] >= 0);
+	}
+	const int peer_count = TEST_MT_CHANNEL_COUNT * TEST_MT_PEER_COUNT;
+	struct ctx_mt_peer senders[peer_count];
+	struct ctx_mt_peer receivers[peer_count];
+	struct coro *coros[peer_count * 2 + 1];
+	int coro_count = 0;
+	for (int i = 0; i < peer_count; ++i) {
+		senders[i].ctx = ctx;
+		senders[i].channel = ctx->channels[i % TEST_MT_CHANNEL_COUNT];
+		senders[i].first = i * TEST_MT_SEND_COUNT;
+		receivers[i] = senders[i];
+		coros[coro_count++] = coro_new(mt_send_f, &senders[i]);
+		coros[coro_count++] = coro_new(mt_recv_f, &receivers[i]);
+	}
+	coros[coro_count++] = coro_new(mt_broadcast_f, ctx);
+	coro_sched_run();
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+
+	unit_msg("every message is received once, broadcasts once per "
+		"channel");
+	for (int i = 0; i < TEST_MT_BROADCAST_BASE; ++i)
+		unit_assert(ctx->seen[i] == 1);
+	for (int i = TEST_MT_BROADCAST_BASE; i < TEST_MT_VALUE_COUNT; ++i)
+		unit_assert(ctx->seen[i] == TEST_MT_CHANNEL_COUNT);
+	for (int i = 0; i < TEST_MT_CHANNEL_COUNT; ++i)
+		coro_bus_channel_close(ctx->bus, ctx->channels[i]);
+	coro_bus_delete(ctx->bus);
+	delete ctx;
+	coro_sched_destroy();
+	unit_test_finish();
+}
+
+enum {
+	TEST_MT_APART_COUNT = 3,
+	TEST_MT_APART_SEND_COUNT = 1000,
+};
+
+struct ctx_mt_apart {
+	struct coro_bus *bus;
+	int topic;
+	int channels[TEST_MT_APART_COUNT];
+	/** The topic is locked in the free callback. */
+	bool is_holding;
+	/** Someone is about to wait for the topic. */
+	bool is_contended;
+	/** How many peers are done with their channels. */
+	int done_count;
+	/** The done count when the topic was unlocked. */
+	int held_done_count;
+};
+
+/** The free callback has no argument. */
+static struct ctx_mt_apart *mt_apart_ctx = NULL;
+
+/**
+ * Called with the topic locked. Keeps it locked until the peers
+ * are done with their own channels, or for a few seconds.
+ */
+static void
+mt_apart_free(void *ptr, size_t len)
+{
+	(void)len;
+	free(ptr);
+	struct ctx_mt_apart *ctx = mt_apart_ctx;
+	__atomic_store_n(&ctx->is_holding, true, __ATOMIC_RELEASE);
+	time_t deadline = time(NULL) + 5;
+	while (__atomic_load_n(&ctx->done_count, __ATOMIC_ACQUIRE) <
+	       TEST_MT_APART_COUNT && time(NULL) < deadline)
+		sched_yield();
+	ctx->held_done_count = __atomic_load_n(&ctx->done_count,
+		__ATOMIC_ACQUIRE);
+}
+
+/** Drop an unread message, the topic stays locked in its free. */
+static void *
+mt_apart_hold_f(void *arg)
+{
+	struct ctx_mt_apart *ctx = (decltype(ctx))arg;
+	int sub = coro_bus_subscribe(ctx->bus, ctx->topic);
+	unit_assert(sub >= 0);
+	unit_assert(coro_bus_publish_msg(ctx->bus, ctx->topic, malloc(100),
+		100) == 0);
+	coro_bus_unsubscribe(ctx->bus, ctx->topic, sub);
+	return NULL;
+}
+
+/** Wait for the locked topic, blocking a worker meanwhile. */
+static void *
+mt_apart_contend_f(void *arg)
+{
+	struct ctx_mt_apart *ctx = (decltype(ctx))arg;
+	while (!__atomic_load_n(&ctx->is_holding, __ATOMIC_ACQUIRE))
+		coro_yield();
+	__atomic_store_n(&ctx->is_contended, true, __ATOMIC_RELEASE);
+	unit_assert(coro_bus_try_publish(ctx->bus, ctx->topic, 1) == 0);
+	return NULL;
+}
+
+static void *
+mt_apart_peer_f(void *arg)
+{
+	struct ctx_mt_peer *peer = (decltype(peer))arg;
+	struct ctx_mt_apart *ctx = mt_apart_ctx;
+	while (!__atomic_load_n(&ctx->is_contended, __ATOMIC_ACQUIRE))
+		coro_yield();
+	for (unsigned i = 0; i < TEST_MT_APART_SEND_COUNT; ++i) {
+		unsigned data;
+		unit_assert(coro_bus_try_send(ctx->bus, peer->channel, i) == 0);
+		unit_assert(coro_bus_try_recv(ctx->bus, peer->channel,
+			&data) == 0);
+		unit_assert(data == i);
+	}
+	__atomic_add_fetch(&ctx->done_count, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * The calls on the different channels don't go through a common
+ * lock. The peers finish with their channels while another
+ * descriptor is locked, and someone waits for it.
+ */
+static void
+test_mt_channels_apart(void)
+{
+	unit_test_start();
+	struct coro_sched_opts opts;
+	coro_sched_opts_create(&opts);
+	opts.worker_count = 4;
+	opts.stack_size = 64 * 1024;
+	coro_sched_init_opts(&opts);
+
+	struct ctx_mt_apart *ctx = new ctx_mt_apart;
+	memset(ctx, 0, sizeof(*ctx));
+	mt_apart_ctx = ctx;
+	ctx->bus = coro_bus_new_mt();
+	coro_bus_set_msg_free(ctx->bus, mt_apart_free);
+	ctx->topic = coro_bus_topic_open(ctx->bus, 4);
+	unit_assert(ctx->topic >= 0);
+	struct ctx_mt_peer peers[TEST_MT_APART_COUNT];
+	struct coro *coros[TEST_MT_APART_COUNT + 2];
+	int coro_count = 0;
+	for (int i = 0; i < TEST_MT_APART_COUNT; ++i) {
+		ctx->channels[i] = coro_bus_channel_open(ctx->bus, 1);
+		unit_assert(ctx->channels[i] >= 0);
+		peers[i].ctx = NULL;
+		peers[i].channel = ctx->channels[i];
+		peers[i].first = 0;
+		coros[coro_count++] = coro_new(mt_apart_peer_f, &peers[i]);
+	}
+	coros[coro_count++] = coro_new(mt_apart_hold_f, ctx);
+	coros[coro_count++] = coro_new(mt_apart_contend_f, ctx);
+	coro_sched_run();
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+
+	unit_msg("the channels are used while another one is locked");
+	unit_assert(ctx->held_done_count == TEST_MT_APART_COUNT);
+	for (int i = 0; i < TEST_MT_APART_COUNT; ++i)
+		coro_bus_channel_close(ctx->bus, ctx->channels[i]);
+	coro_bus_topic_close(ctx->bus, ctx->topic);
+	coro_bus_delete(ctx->bus);
+	mt_apart_ctx = NULL;
+	delete ctx;
+	coro_sched_destroy();
+	unit_test_finish();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
 coro_main_f(void *arg)
 {
 	(void)arg;
+	test_ring();
 	test_basic();
 	test_channel_reopen();
 	test_multiple_channels();
+	test_many_channels();
 
 	test_send_basic();
 	test_send_blocking();
@@ -1625,11 +3073,19 @@ coro_main_f(void *arg)
 	test_stress_send_recv_concurrent();
 	test_send_recv_very_many();
 	test_wakeup_on_close();
+	test_cancel_waiting();
 	test_close_non_empty_bus();
+	test_msg_basic();
+	test_select();
+	test_durable();
+	test_spill();
+	test_stats();
+	test_topic();
 
 	test_broadcast_basic();
 	test_broadcast_blocking_basic();
 	test_broadcast_blocking_drop_channel_during_wait();
+	test_broadcast_blocking_all_full();
 
 	test_send_vector_basic();
 	test_send_vector_blocking();
@@ -1638,6 +3094,8 @@ coro_main_f(void *arg)
 	test_recv_vector_basic();
 	test_recv_vector_blocking();
 	test_recv_vector_blocking_recv_many();
+	test_recv_vector_wakeup_batch();
+	test_msg_vector();
 	return NULL;
 }
 
@@ -1661,5 +3119,9 @@ main(int argc, char **argv)
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
 	coro_sched_destroy();
+
+	test_mt_send_recv();
+	test_mt_select();
+	test_mt_channels_apart();
 	return 0;
 }
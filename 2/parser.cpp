@@ -4,10 +4,7 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
-
-struct parser {
-	std::string buffer;
-};
+#include <string_view>
 
 enum token_type {
 	TOKEN_TYPE_NONE,
@@ -21,17 +18,63 @@ enum token_type {
 	TOKEN_TYPE_BACKGROUND,
 };
 
+/**
+ * A token of the current line. The text of a string is unescaped
+ * right in the parser buffer, in place of the raw one, so the
+ * token is only its position there.
+ */
 struct token {
 	enum token_type type = TOKEN_TYPE_NONE;
-	std::string data;
+	size_t begin = 0;
+	size_t len = 0;
 };
 
-static void
-token_reset(struct token *t)
-{
-	t->data.clear();
-	t->type = TOKEN_TYPE_NONE;
-}
+enum lexer_state {
+	/** Skipping the spaces before a token. */
+	LEXER_STATE_SPACE,
+	/** Inside a string, maybe in quotes. */
+	LEXER_STATE_WORD,
+	/** After a backslash in a string. */
+	LEXER_STATE_ESCAPE,
+	/** After an operator char, which can be doubled. */
+	LEXER_STATE_OPERATOR,
+	/** Inside a comment, until the end of the line. */
+	LEXER_STATE_COMMENT,
+};
+
+/**
+ * The lexer keeps its state between the feeds, and each char is
+ * looked at once, however small the pieces of a line are. The
+ * tokens are collected until the line is complete, and only then
+ * the command line is built from them.
+ */
+struct parser {
+	/**
+	 * The fed text. The popped lines are dropped from the front
+	 * only when they take at least half of it, so on average
+	 * each char is moved a constant number of times.
+	 */
+	std::string buffer;
+	/** Beginning of the first line not popped yet. */
+	size_t line_begin = 0;
+	/** The next char to lex. */
+	size_t pos = 0;
+	/**
+	 * Where the next char of the current string is written. It
+	 * never gets ahead of the lexed chars, an unescaped string is
+	 * not longer than the raw one.
+	 */
+	size_t out = 0;
+	/** Beginning of the current string. */
+	size_t word_begin = 0;
+	enum lexer_state state = LEXER_STATE_SPACE;
+	/** The quote the current string is in, or 0. */
+	char quote = 0;
+	/** The char of the current operator. */
+	char op = 0;
+	/** Tokens of the current line. Keeps its memory between lines. */
+	std::vector<token> tokens;
+};
 
 struct parser *
 parser_new(void)
@@ -42,306 +85,287 @@ parser_new(void)
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
+	size_t used = p->line_begin;
+	if (used > 0 && used >= p->buffer.size() - used) {
+		p->buffer.erase(0, used);
+		p->line_begin = 0;
+		p->pos -= used;
+		p->out -= used;
+		p->word_begin -= used;
+		for (struct token &t : p->tokens)
+			t.begin -= used;
+	}
 	p->buffer.append(str, len);
 }
 
+static std::string_view
+parser_token_str(struct parser *p, const struct token *t)
+{
+	return std::string_view(p->buffer.data() + t->begin, t->len);
+}
+
+/** End the current token, and get to the spaces before the next one. */
 static void
-parser_consume(struct parser *p, uint32_t size)
+parser_emit(struct parser *p, enum token_type type)
 {
-	assert(p->buffer.size() >= size);
-	p->buffer.erase(0, size);
+	struct token t;
+	t.type = type;
+	t.begin = p->word_begin;
+	t.len = p->out - p->word_begin;
+	p->tokens.push_back(t);
+	p->word_begin = p->out;
+	p->state = LEXER_STATE_SPACE;
 }
 
-static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+static enum token_type
+token_type_operator(char op, bool is_double)
 {
-	token_reset(out);
-	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
-		}
-		++pos;
+	switch(op) {
+	case '&':
+		return is_double ? TOKEN_TYPE_AND : TOKEN_TYPE_BACKGROUND;
+	case '|':
+		return is_double ? TOKEN_TYPE_OR : TOKEN_TYPE_PIPE;
+	case '>':
+		return is_double ? TOKEN_TYPE_OUT_APPEND : TOKEN_TYPE_OUT_NEW;
+	default:
+		assert(false);
+		return TOKEN_TYPE_NONE;
 	}
-	char quote = 0;
-	while (pos < end) {
-		char c = *pos;
-		switch(c) {
-		case '\'':
-		case '"':
-			if (quote == 0) {
-				quote = c;
-				++pos;
-				if (pos == end)
-					return 0;
+}
+
+/**
+ * Lex the fed text until the end of a line. Returns true when the
+ * tokens of the whole line are collected, the last one is a new
+ * line. Otherwise all the text is lexed, and the line continues
+ * in the next feed.
+ */
+static bool
+parser_lex_line(struct parser *p)
+{
+	char *buf = p->buffer.data();
+	size_t end = p->buffer.size();
+	while (p->pos < end) {
+		char c = buf[p->pos];
+		switch(p->state) {
+		case LEXER_STATE_SPACE:
+			if (c == '\n') {
+				++p->pos;
+				parser_emit(p, TOKEN_TYPE_NEW_LINE);
+				return true;
+			}
+			if (isspace((unsigned char)c)) {
+				++p->pos;
 				continue;
 			}
-			if (quote != c)
-				goto append_and_next;
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\\':
-			if (quote == '\'')
-				goto append_and_next;
-			if (quote == '"') {
-				++pos;
-				if (pos == end)
-					return 0;
-				c = *pos;
-				switch (c)
-				{
-				case '\\':
+			p->state = LEXER_STATE_WORD;
+			p->quote = 0;
+			p->word_begin = p->pos;
+			p->out = p->pos;
+			continue;
+		case LEXER_STATE_WORD:
+			switch(c) {
+			case '\'':
+			case '"':
+				if (p->quote == 0) {
+					p->quote = c;
+					++p->pos;
+					continue;
+				}
+				if (p->quote != c)
+					goto append_and_next;
+				++p->pos;
+				parser_emit(p, TOKEN_TYPE_STR);
+				continue;
+			case '\\':
+				if (p->quote == '\'')
+					goto append_and_next;
+				++p->pos;
+				p->state = LEXER_STATE_ESCAPE;
+				continue;
+			case '&':
+			case '|':
+			case '>':
+				if (p->quote != 0)
 					goto append_and_next;
-				case '\n':
-					++pos;
+				if (p->out != p->word_begin) {
+					parser_emit(p, TOKEN_TYPE_STR);
 					continue;
-				case '"':
+				}
+				p->op = c;
+				++p->pos;
+				p->state = LEXER_STATE_OPERATOR;
+				continue;
+			case ' ':
+			case '\t':
+			case '\r':
+			case '\n':
+				if (p->quote != 0)
 					goto append_and_next;
-				default:
-					break;
+				if (c != '\n')
+					++p->pos;
+				/* Nothing but an escaped new line is not a string. */
+				if (p->out == p->word_begin)
+					p->state = LEXER_STATE_SPACE;
+				else
+					parser_emit(p, TOKEN_TYPE_STR);
+				continue;
+			case '#':
+				if (p->quote != 0)
+					goto append_and_next;
+				if (p->out != p->word_begin) {
+					parser_emit(p, TOKEN_TYPE_STR);
+					continue;
 				}
-				out->data += '\\';
+				++p->pos;
+				p->state = LEXER_STATE_COMMENT;
+				continue;
+			default:
 				goto append_and_next;
 			}
-			assert(quote == 0);
-			++pos;
-			if (pos == end)
-				return 0;
-			c = *pos;
+		case LEXER_STATE_ESCAPE:
+			p->state = LEXER_STATE_WORD;
 			if (c == '\n') {
-				++pos;
+				++p->pos;
 				continue;
 			}
+			/* In double quotes only a few chars are escaped. */
+			if (p->quote == '"' && c != '\\' && c != '"')
+				buf[p->out++] = '\\';
 			goto append_and_next;
-		case '&':
-		case '|':
-		case '>':
-			if (quote != 0)
-				goto append_and_next;
-			if (!out->data.empty()) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
-			}
-			++pos;
-			if (pos == end)
-				return 0;
-			if (*pos == c) {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_AND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_OR;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_APPEND;
-					break;
-				default:
-					assert(false);
-					break;
-				}
-				++pos;
+		case LEXER_STATE_OPERATOR:
+			if (c == p->op) {
+				++p->pos;
+				parser_emit(p, token_type_operator(p->op, true));
 			} else {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_BACKGROUND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_PIPE;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_NEW;
-					break;
-				default:
-					assert(false);
-					break;
-				}
-			}
-			return pos - begin;
-		case ' ':
-		case '\t':
-		case '\r':
-			if (quote != 0)
-				goto append_and_next;
-			assert(!out->data.empty());
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\n':
-			if (quote != 0)
-				goto append_and_next;
-			assert(!out->data.empty());
-			out->type = TOKEN_TYPE_STR;
-			return pos - begin;
-		case '#':
-			if (quote != 0)
-				goto append_and_next;
-			if (!out->data.empty()) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
+				parser_emit(p, token_type_operator(p->op, false));
 			}
-			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
+			continue;
+		case LEXER_STATE_COMMENT: {
+			const char *new_line = (const char *)memchr(buf + p->pos, '\n',
+				end - p->pos);
+			if (new_line == NULL) {
+				p->pos = end;
+				return false;
 			}
-			return 0;
+			p->pos = new_line + 1 - buf;
+			parser_emit(p, TOKEN_TYPE_NEW_LINE);
+			return true;
+		}
 		default:
-			goto append_and_next;
+			assert(false);
 		}
 	append_and_next:
-		out->data += c;
-		++pos;
+		buf[p->out++] = c;
+		++p->pos;
 	}
-	return 0;
+	return false;
 }
 
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
+/** Build the command line from the tokens of a whole line. */
+static enum parser_error
+parser_build_line(struct parser *p, struct command_line *line)
 {
-	struct command_line *line = new command_line();
-	char *pos = p->buffer.data();
-	const char *begin = pos;
-	char *end = pos + p->buffer.size();
-	struct token token;
-	enum parser_error res = PARSER_ERR_NONE;
-
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+	size_t i = 0;
+	const struct token *t;
+	for (;;) {
+		t = &p->tokens[i++];
 		expr e;
-		switch(token.type) {
+		switch(t->type) {
 		case TOKEN_TYPE_STR:
 			if (!line->exprs.empty() && line->exprs.back().type == EXPR_TYPE_COMMAND) {
-				line->exprs.back().cmd->args.emplace_back(std::move(token.data));
+				line->exprs.back().cmd->args.emplace_back(parser_token_str(p, t));
 				continue;
 			}
 			e.type = EXPR_TYPE_COMMAND;
 			e.cmd.emplace();
-			e.cmd->exe = std::move(token.data);
+			e.cmd->exe = parser_token_str(p, t);
 			line->exprs.emplace_back(std::move(e));
 			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->exprs.empty())
-				continue;
-			goto close_and_return;
 		case TOKEN_TYPE_PIPE:
-			if (line->exprs.empty()) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
+			if (line->exprs.empty())
+				return PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
+			if (line->exprs.back().type != EXPR_TYPE_COMMAND)
+				return PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
 			e.type = EXPR_TYPE_PIPE;
 			line->exprs.emplace_back(std::move(e));
 			continue;
 		case TOKEN_TYPE_AND:
-			if (line->exprs.empty()) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
+			if (line->exprs.empty())
+				return PARSER_ERR_AND_WITH_NO_LEFT_ARG;
+			if (line->exprs.back().type != EXPR_TYPE_COMMAND)
+				return PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
 			e.type = EXPR_TYPE_AND;
 			line->exprs.emplace_back(std::move(e));
 			continue;
 		case TOKEN_TYPE_OR:
-			if (line->exprs.empty()) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
+			if (line->exprs.empty())
+				return PARSER_ERR_OR_WITH_NO_LEFT_ARG;
+			if (line->exprs.back().type != EXPR_TYPE_COMMAND)
+				return PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
 			e.type = EXPR_TYPE_OR;
 			line->exprs.emplace_back(std::move(e));
 			continue;
+		case TOKEN_TYPE_NEW_LINE:
 		case TOKEN_TYPE_OUT_NEW:
 		case TOKEN_TYPE_OUT_APPEND:
 		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
+			break;
 		default:
 			assert(false);
 		}
+		break;
 	}
-	goto return_no_line;
-
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
+	/* The last token is a new line, so the ones before it are safe to look at. */
+	if (t->type == TOKEN_TYPE_OUT_NEW || t->type == TOKEN_TYPE_OUT_APPEND) {
+		if (t->type == TOKEN_TYPE_OUT_NEW)
 			line->out_type = OUTPUT_TYPE_FILE_NEW;
 		else
 			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
-		}
-		line->out_file = std::move(token.data);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+		t = &p->tokens[i++];
+		if (t->type != TOKEN_TYPE_STR)
+			return PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+		line->out_file = parser_token_str(p, t);
+		t = &p->tokens[i++];
 	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
+	if (t->type == TOKEN_TYPE_BACKGROUND) {
 		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+		t = &p->tokens[i++];
 	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(!line->exprs.empty());
-		parser_consume(p, pos - begin);
-		if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
-		}
-		*out = line;
-		return PARSER_ERR_NONE;
-	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
+	if (t->type != TOKEN_TYPE_NEW_LINE)
+		return PARSER_ERR_TOO_LATE_ARGUMENTS;
+	if (line->exprs.empty() || line->exprs.back().type != EXPR_TYPE_COMMAND)
+		return PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+	return PARSER_ERR_NONE;
+}
 
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
+	*out = NULL;
+	while (parser_lex_line(p)) {
+		struct command_line *line = NULL;
+		enum parser_error res = PARSER_ERR_NONE;
+		/* Skip empty lines. */
+		if (p->tokens.size() > 1) {
+			line = new command_line();
+			res = parser_build_line(p, line);
+			if (res != PARSER_ERR_NONE) {
+				/*
+				 * The whole line is skipped. It can't be executed but can't
+				 * just crash here because of that.
+				 */
+				delete line;
+				line = NULL;
+			}
+		}
+		p->line_begin = p->pos;
+		p->tokens.clear();
+		if (line != NULL || res != PARSER_ERR_NONE) {
+			*out = line;
+			return res;
 		}
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
-
-return_no_line:
-	delete line;
-	*out = NULL;
-	return res;
+	return PARSER_ERR_NONE;
 }
 
 void
@@ -833,6 +833,66 @@ test_background(void)
 	unit_test_finish();
 }
 
+static void
+test_many_lines_in_pieces(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	/*
+	 * The pieces cut the escapes, the quotes, and the operators,
+	 * and the lines are popped while the next ones are not full.
+	 */
+	const char *str = "echo \"a \\\" b\" c\\ d 'e f' \\\n g >> out.txt\n";
+	uint32_t len = strlen(str);
+	const int line_count = 1000;
+	int popped = 0;
+	uint32_t piece = 1;
+	for (int i = 0; i < line_count; ++i) {
+		for (uint32_t pos = 0; pos < len; pos += piece) {
+			piece = piece % 7 + 1;
+			parser_feed(p, &str[pos], pos + piece > len ? len - pos : piece);
+			while (parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+			       line != NULL) {
+				unit_fail_if(line->out_type != OUTPUT_TYPE_FILE_APPEND);
+				unit_fail_if(line->out_file != "out.txt");
+				unit_fail_if(line->exprs.size() != 1);
+				const command &cmd = *line->exprs.front().cmd;
+				unit_fail_if(cmd.exe != "echo");
+				unit_fail_if(cmd.args.size() != 4);
+				unit_fail_if(cmd.args[0] != "a \" b");
+				unit_fail_if(cmd.args[1] != "c d");
+				unit_fail_if(cmd.args[2] != "e f");
+				unit_fail_if(cmd.args[3] != "g");
+				delete line;
+				++popped;
+			}
+		}
+	}
+	unit_check(popped == line_count, "all the lines");
+
+	unit_msg("Several lines in one feed");
+	parser_feed(p, "a\nb\nc", 5);
+	const char *exes[] = {"a", "b"};
+	for (const char *exe : exes) {
+		unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+		unit_assert(line != NULL);
+		unit_check(line->exprs.front().cmd->exe == exe, "exe");
+		delete line;
+	}
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no more lines yet");
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	unit_check(line->exprs.front().cmd->exe == "c", "exe");
+	delete line;
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_error_one(struct parser *p, const char *expr, enum parser_error err)
 {
@@ -864,6 +924,7 @@ test_errors(void)
 	test_error_one(p, " exe && ||", PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND);
 	test_error_one(p, "exe > &&", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
 	test_error_one(p, "exe >> &&", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe >", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
 	test_error_one(p, "exe > test.txt & arg", PARSER_ERR_TOO_LATE_ARGUMENTS);
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
@@ -896,6 +957,7 @@ main(void)
 	test_multiline_string();
 	test_logical_operators();
 	test_background();
+	test_many_lines_in_pieces();
 	test_errors();
 	return 0;
 }